@@ -31,6 +31,41 @@
  *					which keeps popen(cmd,"r") from
  *					hanging.
  * Revised: 20-APR-2014			Fix bug in dm_fgetc.
+ * Revised: 16-OCT-2026			Add dm_readv(), dm_writev().
+ * Revised: 16-OCT-2026			Add record mode (DM_O_RECORD) and
+ *					dm_read_record().
+ * Revised: 16-OCT-2026			Add dm_tee_open(), dm_tee_attach()
+ *					broadcast streams.
+ * Revised: 16-OCT-2026			Add DM_F_SETPIPE_SZ, DM_F_GETPIPE_SZ
+ *					fcntl commands.
+ * Revised: 16-OCT-2026			Return stream statistics from
+ *					dm_get_statistics().
+ * Revised: 16-OCT-2026			Add DM_O_DUPLEX and dm_call() for
+ *					request/response exchanges.
+ * Revised: 16-OCT-2026			Add DM_O_BUSY_POLL and
+ *					DM_F_SETBUSY_POLL for busy-poll reads.
+ * Revised: 16-OCT-2026			Buffer FILE writes to bypassed streams
+ *					(outbuf), add dm_setvbuf, dm_setbuf.
+ * Revised: 16-OCT-2026			Bind FILEs to dm_fastio_cursor slots
+ *					for header-inlined getc/putc.
+ * Revised: 16-OCT-2026			Format printf output in place in the
+ *					outbuf, per-fd printbuf otherwise.
+ * Revised: 16-OCT-2026			Add dm_epoll persistent poll sets,
+ *					run down poll track on close.
+ * Revised: 16-OCT-2026			Add dm_get_wait_fd for foreign event
+ *					loops.
+ * Revised: 16-OCT-2026			Add dm_aio_submit, dm_aio_reap and
+ *					dm_aio_cancel.
+ * Revised: 16-OCT-2026			Thread-safe build (DMPIPE_THREADS),
+ *					per-fd biased locks, lock-free
+ *					extension row install.
+ * Revised: 17-OCT-2026			Hash FILE lookups, flush from written
+ *					list, arena allocate inbufs.
+ * Revised: 17-OCT-2026			Move stream statistics to
+ *					dm_get_stream_statistics().
+ * Revised: 17-OCT-2026			Flush outbufs only before reads of
+ *					their device, keep data a failed
+ *					flush couldn't write.
  */
 #include <math.h>
 #include <stdlib.h>
@@ -60,6 +95,11 @@
 #include "dmpipe_bypass.h"	/* memory functions */
 #include "dmpipe_poll.h"	/* Caches poll hack */
 #include "doscan.h"
+#ifdef DMPIPE_THREADS
+#include <pthread.h>
+#include <sched.h>		/* sched_yield() */
+#include <builtins.h>		/* DEC C builtin functions */
+#endif
 /*
  * Inbuf is used as working buffer for fgetc/ungetc, fgets, scanf
  */
@@ -73,6 +113,33 @@ struct dm_inbuf {
     char buffer[DM_INBUF_BUFSIZE];
     char eob[4];		/* allows writing null to buffer[length] */
 };
+/*
+ * Outbuf collects FILE writes (fputc, fputs, puts, perror, fwrite, printf)
+ * for a bypassed stream, see write_outbuf.
+ */
+#define DM_OUTBUF_SIZE 4096
+
+struct dm_outbuf {
+    int length;			/* bytes buffered */
+    char buffer[DM_OUTBUF_SIZE];
+};
+#define DM_OUTBUF_PRINTF_MIN 1024	/* flush first if less room for printf */
+#define DM_PRINTBUF_SIZE 16385		/* printf chunk when not using outbuf */
+#ifdef DMPIPE_THREADS
+/*
+ * Per-fd lock for the thread-safe build, see lock_fd.
+ */
+struct dm_fd_lock {
+    pthread_mutex_t mutex;	/* taken once fd is shared */
+    pthread_t owner;		/* thread fd is biased to */
+    int biased;			/* owner is set */
+    volatile int shared;	/* bias revoked, every caller takes mutex */
+    volatile int busy;		/* owner in a call without the mutex */
+    pthread_t holder;		/* thread in a call on the fd */
+    int depth;			/* holder's nesting of locked calls */
+    int unlocked;		/* holder entered by bias, not mutex */
+};
+#endif
 /*
  * Global variables.  Track auxillary information about open file
  * descriptors (fds).  We have to potentially map 65K of fds, but
@@ -88,8 +155,19 @@ struct dm_fd_extension {
     dm_bypass bp;
     unsigned long write_ops;	/* write operations invoked */
     unsigned long read_ops;     /* read operations invoked */
-    struct dm_inbuf *inbuf;
+    struct dm_outbuf *outbuf;
+    int outbuf_mode;		/* _IOFBF, _IOLBF, _IONBF or 0 for default */
+    struct dm_fastio *fastio;	/* cursor slot bound to, see bind_fastio */
+    char *printbuf;		/* DM_PRINTBUF_SIZE, printf without outbuf */
     int fcntl_flags;		/* for fcntl() support */
+    int aio_pass[2];		/* last aio_wait that polled read/write */
+    /* Members below survive init_extension, inbuf must be first of them */
+    struct dm_inbuf *inbuf;	/* from inbuf arena, kept for fd's life */
+    struct dm_fd_extension *written_next;	/* see note_written */
+    int written;		/* on written list */
+#ifdef DMPIPE_THREADS
+    struct dm_fd_lock lock;
+#endif
 };
 #define FD_EXTENSION_MAP_ROWS 256*4
 #define FD_EXTENSION_MAP_COLS 64
@@ -108,16 +186,39 @@ static struct dm_fd_extension *dm_fd_extrow[FD_EXTENSION_MAP_ROWS] = {
     dm_fd_ext_row0, 0, 0, 0, 0, 0 ,0, 0, 0 
 };
 static int inbuf_min_delay_control = 0;
+static int outbuf_dirty = 0;		/* extensions with buffered output */
+static struct dm_fd_extension *written_list = 0;	/* see note_written */
+struct dm_fastio dm_fastio_cursor[DM_FASTIO_SLOTS];	/* inline getc/putc */
+static struct dm_fd_extension *fastio_owner[DM_FASTIO_SLOTS];
 static FILE *tty = 0;
 /*
- * For functions that use a *FILE argument, keep a small cache of their
- * corresponding filenos;
+ * For functions that use a *FILE argument, map FILE pointers to their
+ * extensions with an open addressing hash table (linear probing), see
+ * lookup_fp.  Table size is a power of 2 and doubles when half full, live
+ * and deleted entries both counting.
  */
-#define FP_TO_FD_TLB_SIZE 3
-static struct {
-    FILE *fp;
+#define FP_HASH_MIN_SIZE 64
+#define FP_HASH_DELETED ((FILE *) 1)
+struct fp_hash_entry {
+    FILE *fp;			/* 0 if never used, FP_HASH_DELETED */
     struct dm_fd_extension *fdx;
-} dm_fp_map[FP_TO_FD_TLB_SIZE] = { {0,0}, {0,0}, {0,0} };
+};
+struct fp_hash_table {
+    int size;			/* number of entries, power of 2 */
+    int used;			/* entries not empty, includes deleted */
+    int live;			/* entries mapping a FILE */
+    struct fp_hash_entry entry[1];	/* variable length */
+};
+static struct fp_hash_table *dm_fp_hash = 0;
+#define FP_HASH(fp,size) \
+	((((unsigned long) (fp) >> 4) * 2654435761U) & ((size)-1))
+/*
+ * Inbufs are carved from arena chunks, an extension keeps its inbuf when
+ * the fd is closed and reuses it when the fd number is opened again.
+ */
+#define DM_INBUF_ARENA_COUNT 16		/* inbufs per arena chunk */
+static struct dm_inbuf *inbuf_arena = 0;
+static int inbuf_arena_left = 0;
 
 /* TRACE */
 FILE *fp_trace=NULL;
@@ -196,6 +297,9 @@ fp_trace = open_dmpipe_trace_file();
 }
 /* END TRACE */
 
+static int flush_outbuf ( struct dm_fd_extension *fdx );
+static void free_outbuf ( struct dm_fd_extension *fdx );
+static void aio_rundown_fd ( int fd );
 void CloseAllDMPipeBypasses(void)
 {
 int fdrow;
@@ -213,6 +317,7 @@ for (fdrow=0; (fdrow < (dm_fd_ext_high_row + 1)); fdrow++)
 	    dm_fd_extrow[fdrow][fdcol].initialized = 0;
 	    if ( dm_fd_extrow[fdrow][fdcol].bypass_flags && dm_fd_extrow[fdrow][fdcol].bp )
 	       {
+	       flush_outbuf ( &dm_fd_extrow[fdrow][fdcol] );
 	       dm_bypass_shutdown ( dm_fd_extrow[fdrow][fdcol].bp );
 	       dm_fd_extrow[fdrow][fdcol].bp = 0;
 	       }
@@ -223,6 +328,324 @@ for (fdrow=0; (fdrow < (dm_fd_ext_high_row + 1)); fdrow++)
 CleanupDone = 1; 
 }
 
+/*************************************************************************/
+/*
+ * Thread-safe build (DMPIPE_THREADS).  The public functions that use an
+ * extension are compiled under a _locked name (FD_ENTRY) and the public
+ * name, defined at the end of this module, holds the fd's lock around
+ * the call.  An fd used by one thread only is biased to that thread, which
+ * enters and leaves with a flag store and a barrier.  The first other 
+ * thread to use the fd revokes the bias, waiting for the owner's current
+ * call to finish, and from then on every caller takes the fd's mutex.
+ * Locks nest, so a locked function may call another (dm_call calls 
+ * dm_write).
+ */
+#ifdef DMPIPE_THREADS
+#define FD_ENTRY(type,name) static type name##_locked
+#define OUTBUF_DIRTY_INC() __ATOMIC_INCREMENT_LONG ( &outbuf_dirty )
+#define OUTBUF_DIRTY_DEC() __ATOMIC_DECREMENT_LONG ( &outbuf_dirty )
+#if defined(__INITIAL_POINTER_SIZE) && (__INITIAL_POINTER_SIZE == 64)
+#define CMP_STORE_POINTER(slot,old,ptr) \
+	__CMP_STORE_QUAD ( (slot), (__int64) (old), (__int64) (ptr), (slot) )
+#else
+#define CMP_STORE_POINTER(slot,old,ptr) \
+	__CMP_STORE_LONG ( (slot), (int) (old), (int) (ptr), (slot) )
+#endif
+#define INSTALL_POINTER(slot,ptr) CMP_STORE_POINTER(slot,0,ptr)
+/*
+ * Changes to the FILE hash and the inbuf arena are serialized by 
+ * ext_init_lock, lookups take no lock.
+ */
+#define TABLE_LOCK() pthread_once ( &threads_once, init_threads ); \
+	pthread_mutex_lock ( &ext_init_lock )
+#define TABLE_UNLOCK() pthread_mutex_unlock ( &ext_init_lock )
+
+static pthread_once_t threads_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ext_init_lock;	/* recursive, stderr init nests */
+
+static void init_threads ( void )
+{
+    pthread_mutexattr_t attr;
+    int col;
+    /*
+     * Row 0 is static, other rows get their mutexes when allocated.
+     */
+    pthread_mutexattr_init ( &attr );
+    pthread_mutexattr_settype ( &attr, PTHREAD_MUTEX_RECURSIVE );
+    pthread_mutex_init ( &ext_init_lock, &attr );
+    pthread_mutexattr_destroy ( &attr );
+    for ( col = 0; col < FD_EXTENSION_MAP_COLS; col++ )
+	pthread_mutex_init ( &dm_fd_ext_row0[col].lock.mutex, 0 );
+}
+
+static void lock_fd ( struct dm_fd_extension *fdx )
+{
+    struct dm_fd_lock *lk;
+    pthread_t self;
+
+    if ( !fdx ) return;
+    lk = &fdx->lock;
+    self = pthread_self();
+    if ( pthread_equal ( lk->holder, self ) ) {
+	lk->depth++;			/* nested call */
+	return;
+    }
+    if ( !lk->shared ) {
+	if ( !lk->biased && __CMP_STORE_LONG ( &lk->biased, 0, 1, 
+		&lk->biased ) ) {
+	    lk->owner = self;		/* first thread to use fd */
+	    __MB();
+	}
+	if ( pthread_equal ( lk->owner, self ) ) {
+	    lk->busy = 1;
+	    __MB();
+	    if ( !lk->shared ) {
+		lk->holder = self;
+		lk->depth = 1;
+		lk->unlocked = 1;
+		return;
+	    }
+	    lk->busy = 0;		/* revoked, use mutex */
+	} else {
+	    lk->shared = 1;
+	    __MB();
+	    while ( lk->busy ) sched_yield();
+	}
+    }
+    pthread_once ( &threads_once, init_threads );
+    pthread_mutex_lock ( &lk->mutex );
+    lk->holder = self;
+    lk->depth = 1;
+    lk->unlocked = 0;
+}
+/*
+ * Lock without waiting and without revoking another thread's bias, return
+ * 1 if locked.
+ */
+static int trylock_fd ( struct dm_fd_extension *fdx )
+{
+    struct dm_fd_lock *lk;
+    pthread_t self;
+
+    lk = &fdx->lock;
+    self = pthread_self();
+    if ( pthread_equal ( lk->holder, self ) ) {
+	lk->depth++;
+	return 1;
+    }
+    if ( !lk->shared ) {
+	if ( !lk->biased || !pthread_equal ( lk->owner, self ) ) return 0;
+	lk->busy = 1;
+	__MB();
+	if ( !lk->shared ) {
+	    lk->holder = self;
+	    lk->depth = 1;
+	    lk->unlocked = 1;
+	    return 1;
+	}
+	lk->busy = 0;
+    }
+    pthread_once ( &threads_once, init_threads );
+    if ( pthread_mutex_trylock ( &lk->mutex ) != 0 ) return 0;
+    lk->holder = self;
+    lk->depth = 1;
+    lk->unlocked = 0;
+    return 1;
+}
+
+static void unlock_fd ( struct dm_fd_extension *fdx )
+{
+    struct dm_fd_lock *lk;
+
+    if ( !fdx ) return;
+    lk = &fdx->lock;
+    if ( --lk->depth > 0 ) return;
+    lk->holder = 0;
+    if ( lk->unlocked ) {
+	__MB();
+	lk->busy = 0;
+    } else pthread_mutex_unlock ( &lk->mutex );
+}
+#else
+#define FD_ENTRY(type,name) type name
+#define OUTBUF_DIRTY_INC() outbuf_dirty++
+#define OUTBUF_DIRTY_DEC() --outbuf_dirty
+#define TABLE_LOCK()
+#define TABLE_UNLOCK()
+#define lock_fd(fdx)
+#define unlock_fd(fdx)
+#endif
+/*************************************************************************/
+/*
+ * FILE hash table.  A lookup probes from the FILE's hash slot until it 
+ * finds the FILE or an entry never used, removal leaves a deleted marker so
+ * later entries of the probe sequence are still found.  Entries are filled 
+ * in extension first, and a table outgrown is replaced by a complete copy,
+ * so in the thread-safe build lookups may run while the table is changed.
+ * The old table can't be freed then, a thread may still be probing it.
+ */
+static struct dm_fd_extension *lookup_fp ( FILE *fp )
+{
+    struct fp_hash_table *table;
+    struct fp_hash_entry *entry;
+    int i;
+
+    table = dm_fp_hash;
+    if ( !table || !fp ) return 0;
+    for ( i = FP_HASH(fp,table->size); ; i = (i+1) & (table->size-1) ) {
+	entry = &table->entry[i];
+	if ( entry->fp == fp ) return entry->fdx;
+	if ( !entry->fp ) return 0;
+    }
+}
+/*
+ * Return new table sized for live entries plus one, copying live entries
+ * from old table.  Return 0 if no memory.
+ */
+static struct fp_hash_table *resize_fp_hash ( struct fp_hash_table *old )
+{
+    struct fp_hash_table *table;
+    struct fp_hash_entry *entry;
+    int size, i, j;
+
+    size = FP_HASH_MIN_SIZE;
+    while ( old && ((old->live+1)*4 > size) ) size = size * 2;
+    table = calloc ( 1, sizeof(struct fp_hash_table) +
+	(size-1)*sizeof(struct fp_hash_entry) );
+    if ( !table ) return 0;
+    table->size = size;
+    for ( i = 0; old && (i < old->size); i++ ) {
+	entry = &old->entry[i];
+	if ( !entry->fp || (entry->fp == FP_HASH_DELETED) ) continue;
+	for ( j = FP_HASH(entry->fp,size); table->entry[j].fp; 
+		j = (j+1) & (size-1) );
+	table->entry[j] = *entry;
+	table->used++;
+	table->live++;
+    }
+    return table;
+}
+
+static void insert_fp ( FILE *fp, struct dm_fd_extension *fdx )
+{
+    struct fp_hash_table *table;
+    struct fp_hash_entry *entry, *slot;
+    int i;
+
+    TABLE_LOCK();
+    table = dm_fp_hash;
+    if ( !table || ((table->used+1)*2 > table->size) ) {
+	table = resize_fp_hash ( dm_fp_hash );
+	if ( !table ) {
+	    TABLE_UNLOCK();
+	    return;			/* lookups fall back to fileno() */
+	}
+#ifdef DMPIPE_THREADS
+	__MB();
+#else
+	if ( dm_fp_hash ) free ( dm_fp_hash );
+#endif
+	dm_fp_hash = table;
+    }
+    /*
+     * Update existing entry or fill first deleted or unused entry.
+     */
+    slot = 0;
+    for ( i = FP_HASH(fp,table->size); ; i = (i+1) & (table->size-1) ) {
+	entry = &table->entry[i];
+	if ( entry->fp == fp ) {
+	    entry->fdx = fdx;
+	    TABLE_UNLOCK();
+	    return;
+	}
+	if ( !slot && (entry->fp == FP_HASH_DELETED) ) slot = entry;
+	if ( !entry->fp ) break;
+    }
+    if ( !slot ) {
+	slot = entry;
+	table->used++;
+    }
+    table->live++;
+    slot->fdx = fdx;
+#ifdef DMPIPE_THREADS
+    __MB();
+#endif
+    slot->fp = fp;
+    TABLE_UNLOCK();
+}
+
+static void remove_fp ( FILE *fp )
+{
+    struct fp_hash_table *table;
+    struct fp_hash_entry *entry;
+    int i;
+
+    if ( !fp || !dm_fp_hash ) return;
+    TABLE_LOCK();
+    table = dm_fp_hash;
+    for ( i = FP_HASH(fp,table->size); table->entry[i].fp; 
+		i = (i+1) & (table->size-1) ) {
+	entry = &table->entry[i];
+	if ( entry->fp == fp ) {
+	    entry->fp = FP_HASH_DELETED;
+	    table->live--;
+	    break;
+	}
+    }
+    TABLE_UNLOCK();
+}
+/*
+ * Allocate inbuf from arena, return 0 if no memory.  Arena chunks are
+ * never freed, inbufs stay with their extension.
+ */
+static struct dm_inbuf *alloc_inbuf ( void )
+{
+    struct dm_inbuf *inbuf;
+
+    TABLE_LOCK();
+    if ( inbuf_arena_left == 0 ) {
+	inbuf_arena = calloc ( DM_INBUF_ARENA_COUNT, sizeof(struct dm_inbuf) );
+	if ( inbuf_arena ) inbuf_arena_left = DM_INBUF_ARENA_COUNT;
+    }
+    inbuf = 0;
+    if ( inbuf_arena_left > 0 ) {
+	inbuf = inbuf_arena++;
+	inbuf_arena_left--;
+    }
+    TABLE_UNLOCK();
+    return inbuf;
+}
+/*
+ * Put extension on the written list on its first write since init, 
+ * flush_before_read and dm_fflush(NULL) visit only extensions on the list
+ * rather than scanning the extension table.  An extension is pushed once 
+ * and never removed (extensions are never freed), so the list is as long
+ * as the number of distinct fds ever written and may be walked without a
+ * lock.
+ */
+static void note_written ( struct dm_fd_extension *fdx )
+{
+#ifdef DMPIPE_THREADS
+    struct dm_fd_extension *head;
+#endif
+    if ( fdx->written ) return;
+    fdx->written = 1;
+#ifdef DMPIPE_THREADS
+    do {
+	head = written_list;
+	fdx->written_next = head;
+	__MB();
+    } while ( !CMP_STORE_POINTER ( &written_list, head, fdx ) );
+#else
+    fdx->written_next = written_list;
+    written_list = fdx;
+#endif
+}
+
+static void count_write ( struct dm_fd_extension *fdx )
+{
+    if ( fdx->write_ops++ == 0 ) note_written ( fdx );
+}
 /*************************************************************************/
 /*
  * Main functions for managing extension blocks:
@@ -232,14 +655,17 @@ CleanupDone = 1;
  *     rundown_extension
  */
 static struct dm_fd_extension *find_fp_extension(FILE *fp, int ini_if);
+static void unbind_fastio ( struct dm_fd_extension *fdx );
 static void init_extension ( struct dm_fd_extension *fdx, int fd, FILE *fp )
 {
     char nambuf[512];
     /*
-     * Zero-out and fill in caller's arguments.
+     * Zero-out and fill in caller's arguments.  Initialized is set last,
+     * another thread may test it without the lock.  An inbuf left from
+     * the fd's last use is emptied.
      */
-    memset ( fdx, 0, sizeof(struct dm_fd_extension) );
-    fdx->initialized = 1;
+    memset ( fdx, 0, offsetof(struct dm_fd_extension,inbuf) );
+    if ( fdx->inbuf ) fdx->inbuf->rpos = fdx->inbuf->length = 0;
     fdx->fd = fd;
     fdx->fp = fp;
     /*
@@ -267,6 +693,10 @@ static void init_extension ( struct dm_fd_extension *fdx, int fd, FILE *fp )
      */
      
     fdx->bp = dm_bypass_init ( fd, &fdx->bypass_flags );
+#ifdef DMPIPE_THREADS
+    __MB();
+#endif
+    fdx->initialized = 1;
     
 #ifdef DEBUG
 if ( !tty ) tty = fopen ( "DBG$OUTPUT:", "a", "shr=put" );
@@ -283,14 +713,76 @@ static void rundown_extension ( struct dm_fd_extension *fdx )
     if ( fdx->bypass_flags ) {
 	fdx->bypass_flags = 0;
     }
-    if ( fdx->bp ) dm_bypass_shutdown ( fdx->bp );
+    if ( fdx->bp ) {
+	flush_outbuf ( fdx );
+	dm_bypass_shutdown ( fdx->bp );
+    }
     fdx->bp = 0;
+    unbind_fastio ( fdx );
+    aio_rundown_fd ( fdx->fd );
+    if ( fdx->poll_ext ) dm_poll_rundownn_track ( &fdx->poll_ext );
+    free_outbuf ( fdx );
+    if ( fdx->printbuf ) free ( fdx->printbuf );
+    fdx->printbuf = 0;
+    remove_fp ( fdx->fp );
     fdx->initialized = 0;
 }
 
+/*
+ * Initialize extension on first use, once even if threads race for it.
+ */
+static void first_use ( struct dm_fd_extension *fdx, int fd )
+{
+#ifdef DMPIPE_THREADS
+    pthread_once ( &threads_once, init_threads );
+    pthread_mutex_lock ( &ext_init_lock );
+    if ( !fdx->initialized ) init_extension ( fdx, fd, 0 );
+    pthread_mutex_unlock ( &ext_init_lock );
+#else
+    init_extension ( fdx, fd, 0 );
+#endif
+}
+/*
+ * Allocate row of extensions and return the installed row.  Rows are
+ * never freed, so in the thread-safe build readers need no lock, the row 
+ * is installed with a compare and swap and the loser of a race frees its
+ * copy.
+ */
+static struct dm_fd_extension *new_row ( int fd_row )
+{
+    struct dm_fd_extension *row;
+#ifdef DMPIPE_THREADS
+    int col, high;
+#endif
+
+    row = calloc ( FD_EXTENSION_MAP_COLS, sizeof(struct dm_fd_extension) );
+    if ( !row ) {
+	errno = ENOMEM;
+	return 0;
+    }
+#ifdef DMPIPE_THREADS
+    for ( col = 0; col < FD_EXTENSION_MAP_COLS; col++ )
+	pthread_mutex_init ( &row[col].lock.mutex, 0 );
+    __MB();
+    if ( !INSTALL_POINTER ( &dm_fd_extrow[fd_row], row ) ) {
+	for ( col = 0; col < FD_EXTENSION_MAP_COLS; col++ )
+	    pthread_mutex_destroy ( &row[col].lock.mutex );
+	free ( row );
+    }
+    do {
+	high = dm_fd_ext_high_row;
+    } while ( (fd_row > high) && !__CMP_STORE_LONG ( &dm_fd_ext_high_row,
+	high, fd_row, &dm_fd_ext_high_row ) );
+#else
+    dm_fd_extrow[fd_row] = row;
+    if ( fd_row > dm_fd_ext_high_row ) dm_fd_ext_high_row = fd_row;
+#endif
+    return dm_fd_extrow[fd_row];
+}
+
 static struct dm_fd_extension *find_extension ( int fd, int init_if )
 {
-    int fd_row, fd_col, row_ndx;
+    int fd_row, fd_col;
 
     if ( fd < 0 ) {
 	errno = EINVAL;
@@ -303,7 +795,7 @@ static struct dm_fd_extension *find_extension ( int fd, int init_if )
 	    /*
 	     * Initialize extension.
 	     */
-	    init_extension ( &dm_fd_ext_row0[fd], fd, 0 );
+	    first_use ( &dm_fd_ext_row0[fd], fd );
 	}
 	return &dm_fd_ext_row0[fd];
     }
@@ -317,31 +809,17 @@ static struct dm_fd_extension *find_extension ( int fd, int init_if )
 	return 0;
     }
     /*
-     * Extend high row if needed, zeroing pointers in intervening rows.
-     */
-    if ( fd_row > dm_fd_ext_high_row ) {
-	for (row_ndx=dm_fd_ext_high_row+1; row_ndx <= fd_row; row_ndx++) {
-	    dm_fd_extrow[row_ndx] = 0;
-	}
-	dm_fd_ext_high_row = fd_row;
-    }
-    /*
-     * Allocate row if first time accessing and fd in this row.
+     * Allocate row if first time accessing and fd in this row, rows past
+     * the high row are still null from static initialization.
      */
     if ( !dm_fd_extrow[fd_row] ) {
-	/*  Allocate row */
-	dm_fd_extrow[fd_row] = calloc ( FD_EXTENSION_MAP_COLS,
-		sizeof(struct dm_fd_extension) );
-	if ( !dm_fd_extrow[fd_row] ) {
-	    errno = ENOMEM;
-	    return 0;
-	}
+	if ( !new_row ( fd_row ) ) return 0;
     }
     /*
      * Check for initialization, then return extension block to caller.
      */
     if ( init_if && !dm_fd_extrow[fd_row][fd_col].initialized ) {
-	init_extension ( &dm_fd_extrow[fd_row][fd_col], fd, 0 );
+	first_use ( &dm_fd_extrow[fd_row][fd_col], fd );
     }
 
     return (dm_fd_extrow[fd_row])+fd_col;
@@ -349,20 +827,21 @@ static struct dm_fd_extension *find_extension ( int fd, int init_if )
 
 static struct dm_fd_extension *find_fp_extension ( FILE *fp, int init_if )
 {
-    int fd, i;
+    int fd;
     struct dm_fd_extension *fdx;
     /*
-     * Search cache.
+     * Search hash table.
      */
-    for ( i = 0; i < FP_TO_FD_TLB_SIZE; i++ ) {
-	if ( fp == dm_fp_map[i].fp ) {
-	    fdx = dm_fp_map[i].fdx;
-	    if ( !fdx || !fdx->initialized ) break;
-	    return fdx;		/* found in cache */
-	}
+    fdx = lookup_fp ( fp );
+    if ( fdx && fdx->initialized ) {
+#ifdef DMPIPE_THREADS
+	if ( fdx->fp == fp ) return fdx;  /* else entry stale, fd reused */
+#else
+	return fdx;		/* found in table */
+#endif
     }
     /*
-     * Not in cache, lookup by file descriptor, then associate file pointer
+     * Not in table, lookup by file descriptor, then associate file pointer
      * with this extension.
      */     
     fd = fileno ( fp );
@@ -371,15 +850,10 @@ static struct dm_fd_extension *find_fp_extension ( FILE *fp, int init_if )
     if ( !fdx ) return fdx;
     if ( !fdx->fp ) fdx->fp = fp;
     /*
-     * Replace oldest entry in cache current fp.
+     * Add to table, replacing any stale entry for fp.
      */
     if ( !fdx->initialized ) return fdx;
-    for ( i = FP_TO_FD_TLB_SIZE-1; i > 0; --i ) {
-	dm_fp_map[i] = dm_fp_map[i-1];
-    }
-    dm_fp_map[0].fp = fp;
-    dm_fp_map[0].fdx = fdx;
-
+    insert_fp ( fp, fdx );
 
     return fdx;
 }
@@ -389,6 +863,189 @@ static void broken_pipe ( int fd )
     exit ( EPIPE );
 }
 /*************************************************************************/
+/*
+ * Output buffering for FILE writes to a bypassed stream, so a program
+ * writing a character at a time doesn't make a memstream write of each.
+ * Data reaches the write stream when the outbuf fills, at a newline when
+ * line buffered, on fflush or fclose, before a read (see
+ * flush_before_read), and at exit.  Mode is set by setvbuf, default is
+ * line buffered except stderr.  Record mode and non-blocking streams
+ * aren't buffered, each write must stay a single write.  A failed flush
+ * leaves the data buffered.
+ */
+static int output_mode ( struct dm_fd_extension *fdx )
+{
+    if ( fdx->fcntl_flags & (O_NONBLOCK|DM_O_RECORD) ) return _IONBF;
+    if ( fdx->outbuf_mode ) return fdx->outbuf_mode;
+    return (fdx->fd == 2) ? _IONBF : _IOLBF;
+}
+
+static int flush_outbuf ( struct dm_fd_extension *fdx )
+{
+    struct dm_outbuf *outbuf;
+    int status;
+
+    unbind_fastio ( fdx );
+    outbuf = fdx->outbuf;
+    if ( !outbuf || (outbuf->length == 0) ) return 0;
+    status = dm_bypass_write ( fdx->bp, outbuf->buffer, outbuf->length );
+    if ( status < 0 ) return -1;	/* data stays buffered */
+    outbuf->length = 0;
+    OUTBUF_DIRTY_DEC();
+    return 0;
+}
+/*
+ * Free outbuf, dropping any data a failed flush left in it.
+ */
+static void free_outbuf ( struct dm_fd_extension *fdx )
+{
+    if ( !fdx->outbuf ) return;
+    if ( fdx->outbuf->length > 0 ) OUTBUF_DIRTY_DEC();
+    free ( fdx->outbuf );
+    fdx->outbuf = 0;
+}
+
+/*
+ * Flush outbufs before a read that may wait, as stdio does: the outbuf of
+ * the fd read and of any other fd writing the same bypassed device (dup),
+ * so a request goes out before its reply is awaited, and every line 
+ * buffered or unbuffered outbuf, so a prompt without a newline goes out
+ * before its answer is awaited.  Only fully buffered output to other
+ * streams stays buffered.  In the thread-safe build another fd is only
+ * flushed if this thread can lock it without waiting, one held or owned 
+ * by another thread is left for that thread to flush.
+ */
+static void flush_before_read ( struct dm_fd_extension *fdx )
+{
+    struct dm_fd_extension *peer;
+    memstream rstream, wstream, peer_rstream, peer_wstream;
+
+    wstream = 0;
+    if ( fdx ) {
+	if ( fdx->outbuf ) flush_outbuf ( fdx );
+	if ( fdx->bp && (dm_bypass_current_streams ( fdx->bp, &rstream, 
+		&wstream ) < 0) ) wstream = 0;
+    }
+    for ( peer = written_list; peer && outbuf_dirty; 
+		peer = peer->written_next ) {
+	if ( (peer == fdx) || !peer->outbuf || !peer->bp ||
+		(peer->outbuf->length == 0) ) continue;
+	if ( output_mode ( peer ) == _IOFBF ) {
+	    if ( !wstream || (dm_bypass_current_streams ( peer->bp, 
+		&peer_rstream, &peer_wstream ) < 0) || 
+		(peer_wstream != wstream) ) continue;
+	}
+#ifdef DMPIPE_THREADS
+	if ( !trylock_fd ( peer ) ) continue;
+	flush_outbuf ( peer );
+	unlock_fd ( peer );
+#else
+	flush_outbuf ( peer );
+#endif
+    }
+}
+/*
+ * Write iovec array through outbuf, return bytes written or -1.  Writes
+ * too big to be worth copying go straight to the stream after what is
+ * buffered.
+ */
+static int write_outbuf ( struct dm_fd_extension *fdx, 
+	const struct iovec *iov, int iovcnt )
+{
+    struct dm_outbuf *outbuf;
+    int mode, total, i, newline;
+
+    unbind_fastio ( fdx );
+    for ( total = 0, i = 0; i < iovcnt; i++ ) total += iov[i].iov_len;
+    mode = output_mode ( fdx );
+    if ( (mode != _IONBF) && !fdx->outbuf )
+	fdx->outbuf = calloc ( sizeof(struct dm_outbuf), 1 );
+    outbuf = fdx->outbuf;
+    if ( (mode == _IONBF) || !outbuf || (total >= DM_OUTBUF_SIZE) ) {
+	if ( flush_outbuf ( fdx ) < 0 ) return -1;
+	return dm_bypass_writev ( fdx->bp, iov, iovcnt );
+    }
+    if ( total == 0 ) return 0;
+
+    if ( (outbuf->length + total) > DM_OUTBUF_SIZE ) {
+	if ( flush_outbuf ( fdx ) < 0 ) return -1;
+    }
+    if ( outbuf->length == 0 ) OUTBUF_DIRTY_INC();
+    for ( newline = 0, i = 0; i < iovcnt; i++ ) {
+	memcpy ( &outbuf->buffer[outbuf->length], iov[i].iov_base, 
+		iov[i].iov_len );
+	outbuf->length += iov[i].iov_len;
+	if ( (mode == _IOLBF) && memchr ( iov[i].iov_base, '\n', 
+		iov[i].iov_len ) ) newline = 1;
+    }
+    if ( newline && (flush_outbuf ( fdx ) < 0) ) return -1;
+    return total;
+}
+
+static int write_buffered ( struct dm_fd_extension *fdx, const void *data,
+	int length )
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) data;
+    iov.iov_len = length;
+    return write_outbuf ( fdx, &iov, 1 );
+}
+/*
+ * Cursors for the in line getc/putc in dmpipe.h.  While an extension is
+ * bound to a slot the slot's pointers, not inbuf->rpos and outbuf->length,
+ * say how far its buffers have been consumed and filled, so every function
+ * touching the buffers unbinds first (load_inbuf, write_outbuf, 
+ * flush_outbuf, scan_input).  The write cursor is only given out while the
+ * outbuf already holds data, keeping outbuf_dirty right without the inline
+ * code knowing of it.
+ */
+static void unbind_fastio ( struct dm_fd_extension *fdx )
+{
+    struct dm_fastio *fio;
+
+    fio = fdx->fastio;
+    if ( !fio ) return;
+    if ( fio->rptr ) fdx->inbuf->rpos = 
+	fio->rptr - (unsigned char *) fdx->inbuf->buffer;
+    if ( fio->wptr ) fdx->outbuf->length = 
+	fio->wptr - (unsigned char *) fdx->outbuf->buffer;
+    memset ( fio, 0, sizeof(struct dm_fastio) );
+    fastio_owner[fio-dm_fastio_cursor] = 0;
+    fdx->fastio = 0;
+}
+
+static void bind_fastio ( struct dm_fd_extension *fdx, FILE *fptr )
+{
+    struct dm_fastio *fio;
+    int slot;
+#ifdef DMPIPE_THREADS
+    /*
+     * Slots are shared by all threads and inline getc/putc can't take the
+     * fd's lock, leave them empty so every call comes here.
+     */
+    return;
+#endif
+    slot = DM_FASTIO_HASH(fptr);
+    unbind_fastio ( fdx );
+    if ( fastio_owner[slot] ) unbind_fastio ( fastio_owner[slot] );
+    fio = &dm_fastio_cursor[slot];
+
+    if ( (fdx->bypass_flags & DM_BYPASS_HINT_READS) && fdx->inbuf ) {
+	fio->rptr = (unsigned char *) &fdx->inbuf->buffer[fdx->inbuf->rpos];
+	fio->rend = (unsigned char *) &fdx->inbuf->buffer[fdx->inbuf->length];
+    }
+    if ( (fdx->bypass_flags & DM_BYPASS_HINT_WRITES) && fdx->outbuf &&
+	(fdx->outbuf->length > 0) && (output_mode ( fdx ) != _IONBF) ) {
+	fio->wptr = (unsigned char *) &fdx->outbuf->buffer[fdx->outbuf->length];
+	fio->wend = (unsigned char *) &fdx->outbuf->buffer[DM_OUTBUF_SIZE];
+    }
+    if ( !fio->rptr && !fio->wptr ) return;
+    fio->fp = fptr;
+    fastio_owner[slot] = fdx;
+    fdx->fastio = fio;
+}
+/*************************************************************************/
 /*
  * Define functional replacements for CRTL I/O routines that bypass
  * pipe device and use shared memory instead.  The dual mode pipe retain
@@ -411,7 +1068,7 @@ dmpipe_trace_output("dm_pipe()\r\n");
     return status;
 }
 
-ssize_t dm_read ( int fd, void *buffer_vp, size_t nbytes )
+FD_ENTRY(ssize_t,dm_read) ( int fd, void *buffer_vp, size_t nbytes )
 {
     int status, expedite_flag;
     struct dm_fd_extension *fdx;
@@ -420,6 +1077,7 @@ ssize_t dm_read ( int fd, void *buffer_vp, size_t nbytes )
 dmpipe_trace_output("dm_read()\r\n");
 /* END TRACE */
     fdx = find_extension ( fd, 1 );
+    if ( outbuf_dirty ) flush_before_read ( fdx );
     if ( fdx->bypass_flags ) {
 	if ( fdx->read_ops == 0 ) {
 	    /* First time reading, stall for writer to give peer a chance
@@ -446,7 +1104,7 @@ dmpipe_trace_output("dm_read()\r\n");
     return read ( fd, buffer_vp, nbytes );
 }
 
-ssize_t dm_write ( int fd, const void *buffer_vp, size_t nbytes )
+FD_ENTRY(ssize_t,dm_write) ( int fd, const void *buffer_vp, size_t nbytes )
 {
     int status;
     struct dm_fd_extension *fdx;
@@ -462,13 +1120,15 @@ dmpipe_trace_output("dm_write()\r\n");
 	    fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
 		fdx->bp, "w", fdx->fcntl_flags );
 	}
-	fdx->write_ops++;
+	count_write ( fdx );
 	/*
 	 * Switch to bypass if stream established, otherwise fall through
 	 * to regular write.
 	 */
 	if ( fdx->bypass_flags & DM_BYPASS_HINT_WRITES ) {
-	    status = dm_bypass_write ( fdx->bp, buffer_vp, nbytes );
+	    status = flush_outbuf ( fdx );
+	    if ( status == 0 ) 
+		status = dm_bypass_write ( fdx->bp, buffer_vp, nbytes );
 	    BROKEN_PIPE_CHECK ( status, fdx->fd );
 	    return status;
 	}
@@ -477,9 +1137,205 @@ dmpipe_trace_output("dm_write()\r\n");
     return write ( fd, buffer_vp, nbytes );
 }
 
-int dm_close ( int file_desc )
+/*
+ * Write request and read the reply.  Once the bypass has both streams the
+ * peer is woken and the reply awaited in one step, until then (or without
+ * a bypass) it is a write followed by a read.
+ */
+FD_ENTRY(ssize_t,dm_call) ( int fd, const void *request, size_t reqlen, 
+	void *reply, size_t replysize )
+{
+    struct dm_fd_extension *fdx;
+
+/* TRACE */
+dmpipe_trace_output("dm_call()\r\n");
+/* END TRACE */
+    fdx = find_extension ( fd, 1 );
+    if ( fdx->bypass_flags && (fdx->write_ops > 0) && (fdx->read_ops > 0) &&
+	((fdx->bypass_flags & (DM_BYPASS_HINT_READS|DM_BYPASS_HINT_WRITES|
+	DM_BYPASS_HINT_POPEN_R)) == (DM_BYPASS_HINT_READS|
+	DM_BYPASS_HINT_WRITES)) ) {
+	count_write ( fdx );
+	fdx->read_ops++;
+	if ( outbuf_dirty ) flush_before_read ( fdx );
+	return dm_bypass_call ( fdx->bp, request, reqlen, reply, replysize );
+    }
+    /*
+     * First exchange starts the bypass, request goes out before read
+     * stream is negotiated.
+     */
+    if ( dm_write ( fd, request, reqlen ) < 0 ) return -1;
+    if ( outbuf_dirty ) flush_before_read ( fdx );
+    if ( fdx->bypass_flags ) {
+	if ( fdx->read_ops == 0 ) 
+	    fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
+		fdx->bp, "r", fdx->fcntl_flags );
+	fdx->read_ops++;
+	if ( fdx->bypass_flags & DM_BYPASS_HINT_READS ) 
+	    return dm_bypass_read ( fdx->bp, reply, replysize, 1, 0 );
+    }
+    return read ( fd, reply, replysize );
+}
+
+/*
+ * Read one record.  In record mode (DM_O_RECORD set by writer) this is the
+ * data of one write call, which *record points to either in the shared
+ * memory (valid until next read on fd) or in buffer.  Without a bypass,
+ * a read of the mailbox also returns a record.
+ */
+FD_ENTRY(ssize_t,dm_read_record) ( int fd, void *buffer, size_t bufsize, 
+	const void **record )
+{
+    int count;
+    struct dm_fd_extension *fdx;
+
+/* TRACE */
+dmpipe_trace_output("dm_read_record()\r\n");
+/* END TRACE */
+    *record = 0;
+    fdx = find_extension ( fd, 1 );
+    if ( outbuf_dirty ) flush_before_read ( fdx );
+    if ( fdx->bypass_flags ) {
+	if ( fdx->read_ops == 0 ) {
+	    /* First time reading, stall for writer to give peer a chance
+	     * to negotiate bypass */
+	    fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
+		fdx->bp, "r", fdx->fcntl_flags );
+	}
+	fdx->read_ops++;
+	if ( fdx->bypass_flags & DM_BYPASS_HINT_READS ) {
+	    count = dm_bypass_read_record ( fdx->bp, buffer, bufsize, record );
+	    if ( count < 0 ) return -1;
+	    if ((count == 0) && !*record && 
+		(fdx->bypass_flags&DM_BYPASS_HINT_POPEN_R)) {
+	        /*
+	         * See dm_fread for explanation of freopen().
+	         */
+	        if ( fdx->fp ) fdx->fp = freopen ( "_NL:", "r", fdx->fp );
+	        fdx->bypass_flags ^= DM_BYPASS_HINT_POPEN_R;
+	    }
+	    return count;
+	}
+    }
+
+    count = read ( fd, buffer, bufsize );
+    if ( count > 0 ) *record = buffer;
+    return count;
+}
+
+FD_ENTRY(ssize_t,dm_readv) ( int fd, const struct iovec *iov, int iovcnt )
 {
-    int status, i;
+    int i;
+    size_t nbytes;
+    struct dm_fd_extension *fdx;
+
+/* TRACE */
+dmpipe_trace_output("dm_readv()\r\n");
+/* END TRACE */
+    fdx = find_extension ( fd, 1 );
+    if ( outbuf_dirty ) flush_before_read ( fdx );
+    if ( fdx->bypass_flags ) {
+	if ( fdx->read_ops == 0 ) {
+	    /* First time reading, stall for writer to give peer a chance
+	     * to negotiate bypass */
+	    fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
+		fdx->bp, "r", fdx->fcntl_flags );
+	}
+	fdx->read_ops++;
+	if ( fdx->bypass_flags & DM_BYPASS_HINT_READS ) {
+	    int count;
+	    for ( nbytes = 0, i = 0; i < iovcnt; i++ ) nbytes += iov[i].iov_len;
+	    count = dm_bypass_readv ( fdx->bp, iov, iovcnt, nbytes, 0 );
+	    if ( count < 0 ) return -1;
+	    if ((count == 0) && (fdx->bypass_flags&DM_BYPASS_HINT_POPEN_R)) {
+	        /*
+	         * See dm_fread for explanation of freopen().
+	         */
+	        if ( fdx->fp ) fdx->fp = freopen ( "_NL:", "r", fdx->fp );
+	        fdx->bypass_flags ^= DM_BYPASS_HINT_POPEN_R;
+	    }
+	    return count;
+	}
+    }
+
+    return readv ( fd, iov, iovcnt );
+}
+
+FD_ENTRY(ssize_t,dm_writev) ( int fd, const struct iovec *iov, int iovcnt )
+{
+    int status;
+    struct dm_fd_extension *fdx;
+    fdx = find_extension ( fd, 1 );
+
+/* TRACE */
+dmpipe_trace_output("dm_writev()\r\n");
+/* END TRACE */
+    if ( fdx->bypass_flags ) {
+	if ( fdx->write_ops == 0 ) {
+	    /* First time writing, stall for writer to give peer a chance
+	     * to negotiate bypass */
+	    fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
+		fdx->bp, "w", fdx->fcntl_flags );
+	}
+	count_write ( fdx );
+	/*
+	 * Whole vector is one memstream operation, so reader sees at most 
+	 * one wake for it.  Fall through to CRTL if not bypassed.
+	 */
+	if ( fdx->bypass_flags & DM_BYPASS_HINT_WRITES ) {
+	    status = flush_outbuf ( fdx );
+	    if ( status == 0 ) status = dm_bypass_writev ( fdx->bp, iov, iovcnt );
+	    BROKEN_PIPE_CHECK ( status, fdx->fd );
+	    return status;
+	}
+    }
+
+    return writev ( fd, iov, iovcnt );
+}
+
+/*
+ * Broadcast streams aren't tied to a file descriptor, pass through to
+ * bypass layer.
+ */
+dm_tee dm_tee_open ( const char *name, int flags )
+{
+/* TRACE */
+dmpipe_trace_output("dm_tee_open()\r\n");
+/* END TRACE */
+    return dm_bypass_tee_open ( name, 
+	(flags&DM_TEE_DROP_LAGGING) ? DM_BYPASS_TEE_DROP : 0 );
+}
+
+dm_tee dm_tee_attach ( const char *name )
+{
+/* TRACE */
+dmpipe_trace_output("dm_tee_attach()\r\n");
+/* END TRACE */
+    return dm_bypass_tee_attach ( name );
+}
+
+ssize_t dm_tee_write ( dm_tee tee, const void *buffer, size_t nbytes )
+{
+    int status;
+
+    status = dm_bypass_tee_write ( tee, buffer, nbytes );
+    BROKEN_PIPE_CHECK ( status, 0 );
+    return status;
+}
+
+ssize_t dm_tee_read ( dm_tee tee, void *buffer, size_t nbytes )
+{
+    return dm_bypass_tee_read ( tee, buffer, nbytes );
+}
+
+int dm_tee_close ( dm_tee tee )
+{
+    return dm_bypass_tee_close ( tee );
+}
+
+FD_ENTRY(int,dm_close) ( int file_desc )
+{
+    int status;
     struct dm_fd_extension *fdx;
     
 /* TRACE */
@@ -488,25 +1344,29 @@ dmpipe_trace_output("dm_close()\r\n");
     if (!CleanupDone)
        {
        fdx = find_extension ( file_desc, 0 );
-       if ( fdx->fp ) {
-	 /* Invalidate cache entry */
-	 for ( i = 0; i < FP_TO_FD_TLB_SIZE; i++ ) {
-	     if ( fdx->fp == dm_fp_map[i].fp ) dm_fp_map[i].fp = 0;
-	     }
+       if ( fdx && fdx->fp ) {
+	 remove_fp ( fdx->fp );	/* Invalidate hash table entry */
           }
        if ( fdx && fdx->initialized ) {	/* Rundown bypass */
 	 fdx->initialized = 0;
 	 if ( fdx->bypass_flags && fdx->bp ) {
+	    flush_outbuf ( fdx );
 	    dm_bypass_shutdown ( fdx->bp );
 	    fdx->bp = 0;
 	    }
+	 unbind_fastio ( fdx );
+	 aio_rundown_fd ( file_desc );
+	 if ( fdx->poll_ext ) dm_poll_rundownn_track ( &fdx->poll_ext );
+	 free_outbuf ( fdx );
+	 if ( fdx->printbuf ) free ( fdx->printbuf );
+	 fdx->printbuf = 0;
           }
        }
     
     return close ( file_desc );
 }
 
-ssize_t dm_feof (FILE *fptr)
+FD_ENTRY(ssize_t,dm_feof) (FILE *fptr)
 {
     int status;
     size_t result=0;
@@ -724,7 +1584,7 @@ dmpipe_trace_output("dm_fopen()\r\n");
     return fp;
 }
 
-int dm_fputc(int ichar, FILE *fptr)
+FD_ENTRY(int,dm_fputc) (int ichar, FILE *fptr)
 {
     int status;
     size_t result;
@@ -743,15 +1603,17 @@ dmpipe_trace_output("dm_fputc()\r\n");
 	    fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
 		fdx->bp, "w", fdx->fcntl_flags );
 	}
-	fdx->write_ops++;
+	count_write ( fdx );
 	/*
 	 * Switch for bypass if stream established, otherwise fall through
 	 * to regular fputs.
 	 */
 	if ( fdx->bypass_flags & DM_BYPASS_HINT_WRITES ) {
-	    status = dm_bypass_write ( fdx->bp, (void *)&ichar, 1);
+	    unsigned char c = ichar;
+	    status = write_buffered ( fdx, &c, 1 );
 	    
 	    BROKEN_PIPE_CHECK ( status, fdx->fd );
+	    if ( status != -1 ) bind_fastio ( fdx, fptr );
 	    
 	    return (((status != -1) ? ichar : EOF));
 	}
@@ -770,7 +1632,7 @@ dmpipe_trace_output("dm_fputc()\r\n");
     return result;
 }
 
-int dm_puts(const char *str)
+FD_ENTRY(int,dm_puts) (const char *str)
 {
     int status, status2;
     unsigned long slen=strlen(str);
@@ -791,14 +1653,18 @@ dmpipe_trace_output("dm_puts()\r\n");
 	    fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
 		fdx->bp, "w", fdx->fcntl_flags );
 	}
-	fdx->write_ops++;
+	count_write ( fdx );
 	/*
 	 * Switch for bypass if stream established, otherwise fall through
 	 * to regular fputs.
 	 */
 	if ( fdx->bypass_flags & DM_BYPASS_HINT_WRITES ) {
-	    status = dm_bypass_write ( fdx->bp, (void *)str, slen );
-	    if (dm_bypass_write ( fdx->bp, (void *)&new_line, 1 ) == -1) status = -1;
+	    struct iovec line[2];	/* one write, so one record */
+	    line[0].iov_base = (void *) str;
+	    line[0].iov_len = slen;
+	    line[1].iov_base = (void *) &new_line;
+	    line[1].iov_len = 1;
+	    status = write_outbuf ( fdx, line, 2 );
 	    
 	    BROKEN_PIPE_CHECK ( status, fdx->fd );
 	    
@@ -820,7 +1686,7 @@ dmpipe_trace_output("dm_puts()\r\n");
 }
 
 
-int dm_fputs(const char *str, FILE *fptr)
+FD_ENTRY(int,dm_fputs) (const char *str, FILE *fptr)
 {
     int status;
     unsigned long slen=strlen(str);
@@ -840,13 +1706,13 @@ dmpipe_trace_output("dm_fputs()\r\n");
 	    fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
 		fdx->bp, "w", fdx->fcntl_flags );
 	}
-	fdx->write_ops++;
+	count_write ( fdx );
 	/*
 	 * Switch for bypass if stream established, otherwise fall through
 	 * to regular fputs.
 	 */
 	if ( fdx->bypass_flags & DM_BYPASS_HINT_WRITES ) {
-	    status = dm_bypass_write ( fdx->bp, (void *)str, slen );
+	    status = write_buffered ( fdx, str, slen );
 	    
 	    BROKEN_PIPE_CHECK ( status, fdx->fd );
 	    
@@ -867,7 +1733,8 @@ dmpipe_trace_output("dm_fputs()\r\n");
     return result;
 }
 
-size_t dm_fread ( void *ptr, size_t itmsize, size_t nitems, FILE *fptr )
+FD_ENTRY(size_t,dm_fread) ( void *ptr, size_t itmsize, size_t nitems, 
+	FILE *fptr )
 {
     int status;
     struct dm_fd_extension *fdx;
@@ -876,6 +1743,7 @@ size_t dm_fread ( void *ptr, size_t itmsize, size_t nitems, FILE *fptr )
 dmpipe_trace_output("dm_fread()\r\n");
 /* END TRACE */
     fdx = find_fp_extension ( fptr, 1 );
+    if ( outbuf_dirty ) flush_before_read ( fdx );
     if ( fdx && fdx->initialized ) {
 	if ( fdx->read_ops == 0 ) {
 	    /* First time reading, stall for writer to give peer a chance
@@ -928,7 +1796,7 @@ fdx->fd, fdx->bypass_flags, status);
 }
 
 
-size_t dm_fwrite ( const void *ptr, size_t itmsize, size_t nitems,
+FD_ENTRY(size_t,dm_fwrite) ( const void *ptr, size_t itmsize, size_t nitems,
 	FILE *fptr )
 {
     int status;
@@ -948,13 +1816,13 @@ dmpipe_trace_output("dm_fwrite()\r\n");
 	    fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
 		fdx->bp, "w", fdx->fcntl_flags );
 	}
-	fdx->write_ops++;
+	count_write ( fdx );
 	/*
 	 * Switch fo bypass if stream established, otherwise fall through
 	 * to regular write.
 	 */
 	if ( fdx->bypass_flags & DM_BYPASS_HINT_WRITES ) {
-	    status = dm_bypass_write ( fdx->bp, ptr, itmsize*nitems );
+	    status = write_buffered ( fdx, ptr, itmsize*nitems );
 	    
 	    BROKEN_PIPE_CHECK ( status, fdx->fd );
 	    
@@ -983,7 +1851,7 @@ static int load_inbuf ( struct dm_fd_extension *fdx, int needed )
      * Create inbuf if first call.  Also set min_delay_control flag
      * to 1 (yes) or 2 (no) by checking environment variable.
      */
-    if ( !fdx->inbuf ) fdx->inbuf = calloc ( sizeof(struct dm_inbuf), 1 );
+    if ( !fdx->inbuf ) fdx->inbuf = alloc_inbuf();
     if ( !fdx->inbuf ) return -1;
     if ( inbuf_min_delay_control == 0 ) {
 	char *envvar = getenv ( "DMPIPE_INBUF_MIN_DELAY" );
@@ -1000,6 +1868,7 @@ static int load_inbuf ( struct dm_fd_extension *fdx, int needed )
 	}
     }
 
+    unbind_fastio ( fdx );
     inbuf = fdx->inbuf;
     available = inbuf->length - inbuf->rpos;
     while ( available < needed ) {
@@ -1011,6 +1880,7 @@ static int load_inbuf ( struct dm_fd_extension *fdx, int needed )
 		inbuf->length );
 	    inbuf->rpos = DM_INBUF_LOOKBACK;
 	}
+	if ( outbuf_dirty ) flush_before_read ( fdx );
 	count = dm_bypass_read ( fdx->bp, &inbuf->buffer[inbuf->length],
 		DM_INBUF_BUFSIZE-inbuf->length, (inbuf_min_delay_control==1) ?
 		needed : (DM_INBUF_BUFSIZE-inbuf->length), &expedite_flag );
@@ -1034,7 +1904,7 @@ static int load_inbuf ( struct dm_fd_extension *fdx, int needed )
 }
 
 
-char *dm_fgets ( char *str, int maxchar, FILE *fptr )
+FD_ENTRY(char *,dm_fgets) ( char *str, int maxchar, FILE *fptr )
 {
     int status, count, remaining, segsize, i, found_newline;
     struct dm_fd_extension *fdx;
@@ -1043,6 +1913,7 @@ char *dm_fgets ( char *str, int maxchar, FILE *fptr )
 dmpipe_trace_output("dm_fgets()\r\n");
 /* END TRACE */
     fdx = find_fp_extension ( fptr, 1 );
+    if ( outbuf_dirty ) flush_before_read ( fdx );
     if ( fdx && fdx->initialized ) {
 	if ( fdx->read_ops == 0 ) {
 	    /* First time reading, stall for writer to give peer a chance
@@ -1092,7 +1963,7 @@ fdx->fd, fdx->bypass_flags, i );
     return fgets ( str, maxchar, fptr );
 }
 
-int dm_ungetc ( int c, FILE *fptr )
+FD_ENTRY(int,dm_ungetc) ( int c, FILE *fptr )
 {
     int status, count;
     struct dm_fd_extension *fdx;
@@ -1123,7 +1994,7 @@ dmpipe_trace_output("dm_ungetc()\r\n");
     return ungetc ( c, fptr );
 }
 
-int dm_fgetc ( FILE *fptr )
+FD_ENTRY(int,dm_fgetc) ( FILE *fptr )
 {
     int status, count;
     struct dm_fd_extension *fdx;
@@ -1133,6 +2004,7 @@ int dm_fgetc ( FILE *fptr )
 dmpipe_trace_output("dm_fgetc()\r\n");
 /* END TRACE */
     fdx = find_fp_extension ( fptr, 1 );
+    if ( outbuf_dirty ) flush_before_read ( fdx );
     if ( fdx && fdx->initialized ) {
 	if ( fdx->read_ops == 0 ) {
 	    /* First time reading, stall for writer to give peer a chance
@@ -1146,6 +2018,7 @@ dmpipe_trace_output("dm_fgetc()\r\n");
 	    if ( 0 == load_inbuf ( fdx, 1 ) ) {
 	        ucp = (unsigned char) fdx->inbuf->buffer[fdx->inbuf->rpos];
 		fdx->inbuf->rpos++;	    
+		bind_fastio ( fdx, fptr );
 		return ucp;
 	    } else return -1;   /* callers set errno? */
 	}
@@ -1154,7 +2027,7 @@ dmpipe_trace_output("dm_fgetc()\r\n");
     return fgetc ( fptr );
 }
 
-int dm_fclose ( FILE *fptr )
+FD_ENTRY(int,dm_fclose) ( FILE *fptr )
 {
     int status;
     struct dm_fd_extension *fdx;
@@ -1171,7 +2044,7 @@ dmpipe_trace_output("dm_fclose()\r\n");
        }
     return fclose ( fptr );
 }
-int dm_pclose ( FILE *fptr )
+FD_ENTRY(int,dm_pclose) ( FILE *fptr )
 {
     int status;
     struct dm_fd_extension *fdx;
@@ -1239,6 +2112,25 @@ int dm_get_statistics ( int fd, struct dm_bypass_statistics *blk )
 
     return blk->valid_flags;
 }
+/*
+ * Return memstream statistics of the fd's bypassed streams.  Separate from
+ * dm_get_statistics so images linked to its shorter block keep working.
+ */
+int dm_get_stream_statistics ( int fd, 
+	struct dm_bypass_stream_statistics *blk )
+{
+    struct dm_fd_extension *fdx;
+
+    fdx = find_extension ( fd, 0 );
+
+    memset ( blk, 0, sizeof (struct dm_bypass_stream_statistics) );
+    if ( !fdx || !fdx->initialized ) return -1;
+
+    if ( fdx->bp ) dm_bypass_get_statistics ( fdx->bp, &blk->read_stream,
+	&blk->write_stream );
+
+    return fdx->bypass_flags/2;
+}
 
 static int unistd_partial_cb ( void *fdx_vp, char *buffer, int length )
 {
@@ -1258,13 +2150,13 @@ fprintf (tty, "/dmpipe/ FD[%d] partial(,,%d) startup set bypass_flags: %d\n",
 		 fdx->fd, length, fdx->bypass_flags );
 #endif
 	}
-	fdx->write_ops++;
+	count_write ( fdx );
 	/*
 	 * Switch fo bypass if stream established, otherwise fall through
 	 * to regular write.
 	 */
 	if ( fdx->bypass_flags & DM_BYPASS_HINT_WRITES ) {
-	    count = dm_bypass_write ( fdx->bp, buffer, length );
+	    count = write_buffered ( fdx, buffer, length );
 	    BROKEN_PIPE_CHECK ( count, fdx->fd );
 	    return count;
 	}
@@ -1273,6 +2165,51 @@ fprintf (tty, "/dmpipe/ FD[%d] partial(,,%d) startup set bypass_flags: %d\n",
 
     return count;
 }
+/*
+ * Flush callback for doprint_engine formatting in place in an outbuf.  The
+ * engine is given the outbuf's free space, so buffer normally lies at
+ * outbuf->length already and only the length moves.  When the engine has
+ * filled its region the outbuf is flushed and the engine reuses the same
+ * region, now past the (empty) outbuf's end, so its last chunk is moved
+ * down.  Only the engine's final chunk can be short, so the move never
+ * overlaps data the engine will write again.
+ */
+struct printf_sink {
+    struct dm_fd_extension *fdx;
+    int count;			/* bytes accepted, -1 after error */
+};
+
+static int outbuf_partial_cb ( void *sink_vp, char *buffer, int length,
+	int *bytes_left )
+{
+    struct printf_sink *sink;
+    struct dm_fd_extension *fdx;
+    struct dm_outbuf *outbuf;
+    char *tail;
+    int full;
+
+    sink = sink_vp;
+    fdx = sink->fdx;
+    outbuf = fdx->outbuf;
+    *bytes_left = 0;
+    if ( sink->count < 0 ) return -1;
+
+    full = (&buffer[length] == &outbuf->buffer[DM_OUTBUF_SIZE]);
+    tail = &outbuf->buffer[outbuf->length];
+    if ( buffer != tail ) memmove ( tail, buffer, length );
+    if ( (outbuf->length == 0) && (length > 0) ) OUTBUF_DIRTY_INC();
+    outbuf->length += length;
+    sink->count += length;
+
+    if ( full || ((output_mode ( fdx ) == _IOLBF) && 
+	memchr ( tail, '\n', length )) ) {
+	if ( flush_outbuf ( fdx ) < 0 ) {
+	    sink->count = -1;
+	    return -1;
+	}
+    }
+    return length;
+}
 /*
  * generic function for processing printf.  Different engines are used
  * for the different floating point formats the compiler can use.
@@ -1311,7 +2248,7 @@ static int vxfprintf ( FILE *fptr, const char *format, va_list ap,
 {
     struct dm_fd_extension *fdx;
     int status, status2, bytes_left;
-    char *buffer=(char *)malloc(16385);
+    char *buffer;
 /* TRACE */
 dmpipe_trace_output("vxfprintf()\r\n");
 /* END TRACE */
@@ -1319,13 +2256,51 @@ dmpipe_trace_output("vxfprintf()\r\n");
      * See if file pointer has extended attributes.
      */
     fdx = find_fp_extension ( fptr, 1 );
+    if ( !fdx ) return -1;
+    lock_fd ( fdx );
+#ifdef DOPRINT_H
+    if ( fdx->initialized && (fdx->write_ops > 0) &&
+	(fdx->bypass_flags & DM_BYPASS_HINT_WRITES) &&
+	(output_mode ( fdx ) != _IONBF) ) {
+	/*
+	 * Established bypass with an outbuf, let engine format into the
+	 * outbuf's free space.
+	 */
+	struct printf_sink sink;
+
+	unbind_fastio ( fdx );
+	if ( !fdx->outbuf ) fdx->outbuf = calloc ( sizeof(struct dm_outbuf), 1 );
+	if ( fdx->outbuf ) {
+	    status = 0;
+	    if ( (DM_OUTBUF_SIZE-fdx->outbuf->length) < DM_OUTBUF_PRINTF_MIN )
+		status = flush_outbuf ( fdx );
+	    count_write ( fdx );
+	    sink.fdx = fdx;
+	    sink.count = 0;
+	    if ( status == 0 ) status = doprint_engine ( 
+		&fdx->outbuf->buffer[fdx->outbuf->length], format, ap,
+		DM_OUTBUF_SIZE-fdx->outbuf->length, &sink, outbuf_partial_cb,
+		&bytes_left FLT_VEC_ARG );
+	    if ( (status >= 0) && (sink.count >= 0) ) status = sink.count;
+	    else status = -1;
+	    BROKEN_PIPE_CHECK ( status, fdx->fd );
+	    unlock_fd ( fdx );
+	    return status;
+	}
+    }
+#endif
+    /*
+     * Format into the fd's printbuf, passing each chunk to partial_cb.
+     */
+    if ( !fdx->printbuf ) fdx->printbuf = malloc ( DM_PRINTBUF_SIZE );
+    buffer = fdx->printbuf;
     if (buffer != NULL) {
-      if ( fdx && fdx->initialized && 
+      if ( fdx->initialized && 
 	  (fdx->bypass_flags&(DM_BYPASS_HINT_WRITES|DM_BYPASS_HINT_STARTING)) ) {
 	  /*
 	   * Give engine special output routine than can handle bypass.
            */
-	  status = doprint_engine ( buffer, format, ap, 16385,
+	  status = doprint_engine ( buffer, format, ap, DM_PRINTBUF_SIZE,
 		  fdx, unistd_partial_cb, &bytes_left FLT_VEC_ARG );
 
           if ( (status >= 0) && bytes_left > 0 ) {
@@ -1339,7 +2314,7 @@ dmpipe_trace_output("vxfprintf()\r\n");
 	  /*
 	   * Not bypassing, use routine that goes directly to CRTL.
            */
-	  status = doprint_engine ( buffer, format, ap, 16385,
+	  status = doprint_engine ( buffer, format, ap, DM_PRINTBUF_SIZE,
 		  fdx, unistd_partial_cb, &bytes_left FLT_VEC_ARG );
 
           if ( (status >= 0) && bytes_left > 0 ) {
@@ -1348,11 +2323,11 @@ dmpipe_trace_output("vxfprintf()\r\n");
 	      if ( status2 > 0 ) status += status2;
 	  }
       }
-    free(buffer);
     } else {
       status = -1;
       errno = ENOMEM;
     }
+    unlock_fd ( fdx );
     return status;
 }
 /*
@@ -1506,6 +2481,9 @@ static int fcntl_hack ( int fd, int cmd, va_list ap )
      * Special hacks for magic files:
      *   F_SETLKW+100:  Open new file on NL: that associates X11 event flags
      *                  named by fd argument.
+     *   F_SETLKW+101:  (DM_F_SETPIPE_SZ) Set shared memory size of pipe.
+     *   F_SETLKW+102:  (DM_F_GETPIPE_SZ) Get shared memory size of pipe.
+     *   F_SETLKW+103:  (DM_F_SETBUSY_POLL) Set busy poll time of reads.
      */
     if ( (cmd == (F_SETLKW+100)) && (fd >= 0) && (fd < 128) ) {
 	x11_fd = open ( "NL:", O_RDONLY, 0660 );
@@ -1516,6 +2494,21 @@ static int fcntl_hack ( int fd, int cmd, va_list ap )
 	fdx->fcntl_flags = (fd << 24);
 
 	return x11_fd;
+    } else if ( (cmd == DM_F_SETPIPE_SZ) || (cmd == DM_F_GETPIPE_SZ) ) {
+	fdx = find_extension ( fd, 1 );
+	if ( !fdx || !fdx->initialized || !fdx->bp ) {
+	    errno = EINVAL;		/* not a bypassed pipe */
+	    return -1;
+	}
+	if ( cmd == DM_F_GETPIPE_SZ ) return dm_bypass_get_pipe_size (fdx->bp);
+	return dm_bypass_set_pipe_size ( fdx->bp, va_arg(ap,int) );
+    } else if ( cmd == DM_F_SETBUSY_POLL ) {
+	fdx = find_extension ( fd, 1 );
+	if ( !fdx || !fdx->initialized || !fdx->bp ) {
+	    errno = EINVAL;		/* not a bypassed pipe */
+	    return -1;
+	}
+	return dm_bypass_set_busy_poll ( fdx->bp, va_arg(ap,int) );
     } else {
        errno = EINVAL;
        return -1;
@@ -1569,12 +2562,15 @@ dmpipe_trace_output("dm_fcntl()\r\n");
 	  case F_SETFL:
 	    i_arg = va_arg(ap,int); va_end(ap);
 	    prev_flags = fdx->fcntl_flags;
+	    unbind_fastio ( fdx );		/* output mode may change */
 	    fdx->fcntl_flags = i_arg;
 	    /*
 	     * map fcntl flags to memstream attributes.
 	     */
 	    new_attr = old_rattr = old_wattr = 0;
 	    if ( i_arg & O_NONBLOCK ) new_attr = MEMSTREAM_ATTR_NONBLOCK;
+	    if ( i_arg & DM_O_RECORD ) new_attr |= MEMSTREAM_ATTR_RECORD;
+	    if ( i_arg & DM_O_BUSY_POLL ) new_attr |= MEMSTREAM_ATTR_BUSY_POLL;
 	    if ( rstream ) {
 		status = memstream_control (rstream, &new_attr, &old_rattr );
 	    }
@@ -1602,6 +2598,8 @@ new_attr, rstream, old_rattr, wstream, old_wattr, status );
 	case F_SETFD:
 	case F_SETFL:
 	    i_arg = va_arg ( ap, int ); va_end ( ap );
+	    if ( cmd == F_SETFL )		/* mbx keeps records */
+		i_arg &= ~(DM_O_RECORD|DM_O_DUPLEX|DM_O_BUSY_POLL);
 	    i_arg =  fcntl ( fd, cmd, i_arg );
 	    return i_arg;
 
@@ -1623,6 +2621,38 @@ new_attr, rstream, old_rattr, wstream, old_wattr, status );
     return -1;
 }
 
+/*
+ * Ensure bypass initialized since we may never have done I/O yet.  There
+ * are 2 streams, only initialize the ones asked about.
+ */
+static void start_bypass ( struct dm_fd_extension *fdx,
+	int want_read, int want_write )
+{
+    if ( fdx->bypass_flags && want_read && (fdx->read_ops==0) ) {
+	fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
+		fdx->bp, "r", fdx->fcntl_flags );
+	fdx->read_ops++;	/* only count once! */
+    }
+    if ( fdx->bypass_flags && want_write && (fdx->write_ops==0) ) {
+	fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
+		fdx->bp, "w", fdx->fcntl_flags );
+	count_write ( fdx );	/* only count once! */
+    }
+}
+/*
+ * Get fd's poll track for polling the directions wanted, creating it on
+ * first use.
+ */
+static dm_poll_track prepare_poll_track ( struct dm_fd_extension *fdx,
+	int want_read, int want_write )
+{
+    start_bypass ( fdx, want_read, want_write );
+    if ( !fdx->poll_ext ) 
+	fdx->poll_ext = dm_poll_create_track
+		( fdx->fd, fdx->bp, fdx->fcntl_flags );
+    return fdx->poll_ext;
+}
+
 int dm_poll ( struct pollfd filedes[], nfds_t nfds, int timeout )
 {
     int i, status;
@@ -1643,32 +2673,12 @@ dmpipe_trace_output("dm_poll()\r\n");
 	filedes[i].revents = 0;
         fdx = find_extension ( filedes[i].fd, 1 );
 	if ( fdx ) {
-	    /*
-	     * Ensure bypass initialized since we may never have done I/O yet.
-	     * There are 2 streams, only initialize if events requests
-	     * the appropriate status.
-	     */
-	     if ( fdx->bypass_flags &&
-			(filedes[i].events & POLLIN) && (fdx->read_ops==0) ) {
-		fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
-			fdx->bp, "r", fdx->fcntl_flags );
-		fdx->read_ops++;	/* only count once! */
-	     }
-	     if ( fdx->bypass_flags &&
-			(filedes[i].events & POLLOUT) && (fdx->write_ops==0) ) {
-		fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
-			fdx->bp, "w", fdx->fcntl_flags );
-		fdx->write_ops++;	/* only count once! */
-	     }
 	    /*
 	     * Add poll extension structure, creating on first call.  If
 	     * successful, add link to the caller's filedes entry.
 	     */
-	    if ( !fdx->poll_ext ) 
-		fdx->poll_ext = dm_poll_create_track
-			( filedes[i].fd, fdx->bp, fdx->fcntl_flags );
-
-	    if ( fdx->poll_ext ) {
+	    if ( prepare_poll_track ( fdx, filedes[i].events & POLLIN,
+			filedes[i].events & POLLOUT ) ) {
 		dm_poll_group_add_pollfd (&group, &filedes[i], fdx->poll_ext);
 	    } else {
 		/* failed to create track */
@@ -1734,58 +2744,405 @@ dmpipe_trace_output("dm_select()\r\n");
 	 */
         fdx = find_extension ( fd, 1 );
 	if ( fdx ) {
-	    /* Ensure initialized since we may never have done I/O yet */
-	     if ( fdx->bypass_flags &&
-			(summary_mask&DM_POLL_SELECT_READ) && (fdx->read_ops==0) ) {
-		fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
-			fdx->bp, "r", fdx->fcntl_flags );
-		fdx->read_ops++;	/* only count once! */
-	     }
-	     if ( fdx->bypass_flags &&
-			(summary_mask&DM_POLL_SELECT_WRITE) && (fdx->write_ops==0) ) {
-		fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
-			fdx->bp, "w", fdx->fcntl_flags );
-		fdx->write_ops++;	/* only count once! */
-	     }
 	    /* Add poll structure, creating on first call. */
-	    if ( !fdx->poll_ext ) 
-		fdx->poll_ext = dm_poll_create_track
-			( fd, fdx->bp, fdx->fcntl_flags );
+	    if ( prepare_poll_track ( fdx, summary_mask&DM_POLL_SELECT_READ,
+			summary_mask&DM_POLL_SELECT_WRITE ) ) {
+		dm_poll_group_add_selectfd (&group, fd, summary_mask,
+			fdx->poll_ext);
+	    } else {
+		/* failed to create track */
+		status = -1;
+		break;
+	    }
+	} else {
+	    break;
+	}
+    }
+    /*
+     * Wait and when done, step through group members and convert the
+     * event summaries back to fd_set bits.
+     */
+    status = dm_poll_scan_group ( &group );
+    count = 0;
+    for ( member = group.first_member; member; member=member->next_member ) {
+	summary_mask = (member->select_event & member->select_mask);
+	if (summary_mask == 0 ) continue;	/* nothing to report */
+	fd = member->fd;
+	count++;
+	if ( summary_mask & DM_POLL_SELECT_READ ) FD_SET(fd,readfds);
+	if ( summary_mask & DM_POLL_SELECT_WRITE ) FD_SET(fd,writefds);
+	if ( summary_mask & DM_POLL_SELECT_EXCEPT ) FD_SET(fd,exceptfds);
+    }
+    /*
+     * Cleanup.
+     */
+    dm_poll_group_end ( &group );
+    
+    return count;
+}
+/*
+ * Persistent poll sets.  Registration does the work dm_poll repeats on
+ * every call (extension lookup, bypass startup, classification), the set
+ * itself lives in dmpipe_poll.c.
+ */
+dm_epoll dm_epoll_create ( int size )
+{
+    dm_epoll ep;
+/* TRACE */
+dmpipe_trace_output("dm_epoll_create()\r\n");
+/* END TRACE */
+    ep = dm_poll_set_create ( );
+    if ( !ep ) errno = ENOMEM;
+    return ep;
+}
+
+int dm_epoll_ctl ( dm_epoll ep, int op, int fd, struct dm_epoll_event *event )
+{
+    struct dm_fd_extension *fdx;
+    struct dm_poll_set_member *member;
+    dm_poll_track pt;
+
+    if ( !ep ) {
+	errno = EINVAL;
+	return -1;
+    }
+    member = dm_poll_set_find ( ep, fd );
+    switch ( op ) {
+      case DM_EPOLL_CTL_ADD:
+      case DM_EPOLL_CTL_MOD:
+	if ( !event ) break;
+	if ( (op == DM_EPOLL_CTL_ADD) && member ) {
+	    errno = EEXIST;
+	    return -1;
+	} else if ( (op == DM_EPOLL_CTL_MOD) && !member ) {
+	    errno = ENOENT;
+	    return -1;
+	}
+        fdx = find_extension ( fd, 1 );
+	if ( !fdx ) {
+	    errno = EBADF;
+	    return -1;
+	}
+	pt = prepare_poll_track ( fdx, event->events & POLLIN,
+		event->events & POLLOUT );
+	if ( !pt ) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	/*
+	 * Like epoll with regular files, refuse what we can't wait on.
+	 * Sockets are left to the CRTL poll().
+	 */
+	if ( (pt->dev_type == DMPIPE_POLL_DEV_UNKNOWN) ||
+		(pt->dev_type == DMPIPE_POLL_DEV_SOCKET) ) {
+	    errno = EPERM;
+	    return -1;
+	}
+	if ( member ) return dm_poll_set_modify ( ep, member, event->events,
+		event->data.u64 );
+	return dm_poll_set_add ( ep, pt, event->events, event->data.u64 );
+
+      case DM_EPOLL_CTL_DEL:
+	if ( !member ) {
+	    errno = ENOENT;
+	    return -1;
+	}
+	return dm_poll_set_remove ( ep, member );
+
+      default:
+	break;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+int dm_epoll_wait ( dm_epoll ep, struct dm_epoll_event *events, 
+	int maxevents, int timeout )
+{
+    struct dm_poll_set_member *member;
+    int count, i;
+
+    if ( !ep || (maxevents <= 0) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    count = dm_poll_set_wait ( ep, timeout, maxevents, &member );
+    for ( i = 0; member && (i < count); member = member->next_report ) {
+	events[i].events = member->pfd.revents;
+	events[i].data.u64 = member->data;
+	i++;
+    }
+    return count;
+}
+
+int dm_epoll_close ( dm_epoll ep )
+{
+    return dm_poll_set_destroy ( ep );
+}
+/*
+ * Return descriptor a foreign event loop can wait on for fd.  A bypassed
+ * pipe's stream gets a wait handle that is readable while a non-blocking
+ * read (write for a write-only fd) may make progress, other fds are already
+ * visible to the system's polling so fd itself is returned.
+ */
+FD_ENTRY(int,dm_get_wait_fd) ( int fd )
+{
+    int mode, want_read;
+    struct dm_fd_extension *fdx;
+    memstream rstream, wstream, stream;
+
+    fdx = find_extension ( fd, 1 );
+    if ( !fdx ) return -1;
+    if ( !fdx->initialized || !fdx->bp ) return fd;
+
+    mode = fcntl ( fd, F_GETFL, 0 );	/* fcntl_flags lacks access mode */
+    want_read = (mode < 0) || ((mode&(O_WRONLY|O_RDWR)) != O_WRONLY);
+    start_bypass ( fdx, want_read, !want_read );
+    dm_bypass_current_streams ( fdx->bp, &rstream, &wstream );
+    stream = want_read ? rstream : wstream;
+    if ( !stream ) return fd;		/* fell back to mailbox */
+
+    return memstream_wait_fd ( stream );
+}
+/*
+ * Asynchronous I/O.  Submitted control blocks sit on one queue in
+ * submission order until reaped, pending ones are polled together with
+ * dm_poll and moved along only as far as they can go without blocking.
+ */
+#define AIO_PENDING 1
+#define AIO_COMPLETE 2
+
+static struct {
+    struct dm_aiocb *first, *last;	/* submitted and not yet reaped */
+    int pending;			/* not yet complete */
+    int pass;				/* wait counter, see aio_wait() */
+    int alloc;				/* size of pfd and op arrays */
+    struct pollfd *pfd;
+    struct dm_aiocb **op;		/* operation each pfd entry is for */
+} aio;
+
+static void aio_complete ( struct dm_aiocb *cb, ssize_t result, int error )
+{
+    cb->result = result;
+    cb->error = error;
+    cb->state = AIO_COMPLETE;
+    aio.pending--;
+}
+/*
+ * Complete fd's pending operations, fd is being closed.
+ */
+static void aio_rundown_fd ( int fd )
+{
+    struct dm_aiocb *cb;
+
+    if ( !aio.pending ) return;
+    for ( cb = aio.first; cb; cb = cb->next ) {
+	if ( (cb->fd == fd) && (cb->state == AIO_PENDING) ) 
+	    aio_complete ( cb, -1, EBADF );
+    }
+}
+/*
+ * Transfer what we can for an operation whose fd polled ready.  A read
+ * asks for only 1 byte so it doesn't block, a write to a bypassed stream
+ * is cut to the space available unless it is a record.
+ */
+static void aio_progress ( struct dm_aiocb *cb )
+{
+    struct dm_fd_extension *fdx;
+    memstream rstream, wstream;
+    int state, pending, space, count;
+    char *buffer;
+
+    fdx = find_extension ( cb->fd, 0 );
+    if ( !fdx || !fdx->initialized ) {
+	aio_complete ( cb, -1, EBADF );
+	return;
+    }
+    buffer = (char *) cb->buffer + cb->transferred;
+    count = cb->nbytes - cb->transferred;
+    if ( cb->opcode == DM_AIO_READ ) {
+	fdx->read_ops++;
+	if ( fdx->bypass_flags & DM_BYPASS_HINT_READS )
+	    count = dm_bypass_read ( fdx->bp, buffer, count, 1, 0 );
+	else count = read ( cb->fd, buffer, count );
+
+    } else if ( fdx->bypass_flags & DM_BYPASS_HINT_WRITES ) {
+	count_write ( fdx );
+	dm_bypass_current_streams ( fdx->bp, &rstream, &wstream );
+	if ( wstream && !(fdx->fcntl_flags&DM_O_RECORD) &&
+		(memstream_query ( wstream, &state, &pending, &space, 0 ) == 0)
+		&& (space > 0) && (space < count) ) count = space;
+	if ( flush_outbuf ( fdx ) == 0 ) 
+	    count = dm_bypass_write ( fdx->bp, buffer, count );
+	else count = -1;
+	BROKEN_PIPE_CHECK ( count, fdx->fd );
+
+    } else {
+	count_write ( fdx );
+	count = write ( cb->fd, buffer, count );
+    }
+    if ( count < 0 ) {
+	if ( (errno != EWOULDBLOCK) && (errno != EAGAIN) ) 
+	    aio_complete ( cb, -1, errno );
+	return;
+    }
+    cb->transferred += count;
+    if ( (cb->opcode == DM_AIO_READ) || (cb->transferred >= cb->nbytes) )
+	aio_complete ( cb, cb->transferred, 0 );
+}
+/*
+ * Poll fds of pending operations and progress the ready ones.  Only the
+ * oldest operation in each direction of an fd is polled, so a second read
+ * can't block on data the first one took.
+ */
+static int aio_wait ( int timeout )
+{
+    struct dm_aiocb *cb;
+    struct dm_fd_extension *fdx;
+    int count, i, active, dir;
+
+    if ( aio.pending > aio.alloc ) {
+	free ( aio.pfd );
+	free ( aio.op );
+	aio.alloc = aio.pending + 32;
+	aio.pfd = malloc ( aio.alloc * sizeof(struct pollfd) );
+	aio.op = malloc ( aio.alloc * sizeof(struct dm_aiocb *) );
+	if ( !aio.pfd || !aio.op ) {
+	    aio.alloc = 0;
+	    errno = ENOMEM;
+	    return -1;
+	}
+    }
+    aio.pass++;
+    count = 0;
+    for ( cb = aio.first; cb; cb = cb->next ) {
+	if ( cb->state != AIO_PENDING ) continue;
+	fdx = find_extension ( cb->fd, 1 );
+	if ( !fdx ) {
+	    aio_complete ( cb, -1, EBADF );
+	    continue;
+	}
+	dir = (cb->opcode == DM_AIO_WRITE);
+	if ( fdx->aio_pass[dir] == aio.pass ) continue;
+	fdx->aio_pass[dir] = aio.pass;
+	if ( !dir && outbuf_dirty ) flush_before_read ( fdx );
+	aio.pfd[count].fd = cb->fd;
+	aio.pfd[count].events = dir ? POLLOUT : POLLIN;
+	aio.pfd[count].revents = 0;
+	aio.op[count] = cb;
+	count++;
+    }
+    if ( count == 0 ) return 1;		/* all completed with errors */
+
+    active = dm_poll ( aio.pfd, count, timeout );
+    for ( i = 0; (active > 0) && (i < count); i++ ) {
+	if ( aio.pfd[i].revents ) aio_progress ( aio.op[i] );
+    }
+    return active;
+}
+
+int dm_aio_submit ( struct dm_aiocb *cbs[], int count )
+{
+    int i;
+    struct dm_aiocb *cb;
+
+    for ( i = 0; i < count; i++ ) {
+	cb = cbs[i];
+	if ( cb->state || ((cb->opcode != DM_AIO_READ) && 
+		(cb->opcode != DM_AIO_WRITE)) ) {
+	    errno = EINVAL;		/* already queued or bad opcode */
+	    break;
+	}
+	if ( !find_extension ( cb->fd, 1 ) ) break;
+	cb->result = -1;
+	cb->error = EINPROGRESS;
+	cb->transferred = 0;
+	cb->state = AIO_PENDING;
+	cb->next = 0;
+	if ( aio.last ) aio.last->next = cb;
+	else aio.first = cb;
+	aio.last = cb;
+	aio.pending++;
+    }
+    return (i > 0) ? i : -1;
+}
 
-	    if ( fdx->poll_ext ) {
-		dm_poll_group_add_selectfd (&group, fd, summary_mask,
-			fdx->poll_ext);
-	    } else {
-		/* failed to create track */
-		status = -1;
-		break;
+int dm_aio_reap ( struct dm_aiocb *done[], int min_count, int max_count,
+	int timeout )
+{
+    int count, i, waited, active;
+    struct dm_aiocb *cb, *prev, *next;
+
+    if ( (max_count < 1) || (min_count > max_count) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    count = 0;
+    waited = 0;
+    for ( ; ; ) {
+	/*
+	 * Take completed operations off queue, in submission order.
+	 */
+	prev = 0;
+	for ( cb = aio.first; cb && (count < max_count); cb = next ) {
+	    next = cb->next;
+	    if ( cb->state != AIO_COMPLETE ) {
+		prev = cb;
+		continue;
 	    }
-	} else {
+	    if ( prev ) prev->next = next;
+	    else aio.first = next;
+	    if ( aio.last == cb ) aio.last = prev;
+	    cb->state = 0;
+	    cb->next = 0;
+	    done[count++] = cb;
+	}
+	if ( (count >= max_count) || (aio.pending == 0) ) break;
+	if ( waited && (count >= min_count) ) break;
+	/*
+	 * Wait only while we are short of min_count, otherwise just look.
+	 */
+	active = aio_wait ( (count >= min_count) ? 0 : timeout );
+	if ( active < 0 ) {
+	    if ( count == 0 ) return -1;
 	    break;
 	}
+	if ( active == 0 ) break;	/* timed out or nothing ready */
+	waited = 1;
     }
     /*
-     * Wait and when done, step through group members and convert the
-     * event summaries back to fd_set bits.
+     * Deliver completions.
      */
-    status = dm_poll_scan_group ( &group );
-    count = 0;
-    for ( member = group.first_member; member; member=member->next_member ) {
-	summary_mask = (member->select_event & member->select_mask);
-	if (summary_mask == 0 ) continue;	/* nothing to report */
-	fd = member->fd;
-	count++;
-	if ( summary_mask & DM_POLL_SELECT_READ ) FD_SET(fd,readfds);
-	if ( summary_mask & DM_POLL_SELECT_WRITE ) FD_SET(fd,writefds);
-	if ( summary_mask & DM_POLL_SELECT_EXCEPT ) FD_SET(fd,exceptfds);
+    for ( i = 0; i < count; i++ ) {
+	if ( done[i]->callback ) done[i]->callback ( done[i] );
     }
-    /*
-     * Cleanup.
-     */
-    dm_poll_group_end ( &group );
-    
     return count;
 }
+/*
+ * Withdraw an operation not yet reaped.  A write may already have sent
+ * some of its data (transferred).
+ */
+int dm_aio_cancel ( struct dm_aiocb *cb )
+{
+    struct dm_aiocb *cur, *prev;
+
+    prev = 0;
+    for ( cur = aio.first; cur; cur = cur->next ) {
+	if ( cur == cb ) break;
+	prev = cur;
+    }
+    if ( !cur ) {
+	errno = EINVAL;
+	return -1;
+    }
+    if ( prev ) prev->next = cb->next;
+    else aio.first = cb->next;
+    if ( aio.last == cb ) aio.last = prev;
+    if ( cb->state == AIO_PENDING ) aio.pending--;
+    cb->state = 0;
+    cb->next = 0;
+    return 0;
+}
 /*
  * Scan functions.  Scan_input() support routine does basic read of input
  * stream, stopping at various break conditions (mitigating need for
@@ -1806,8 +3163,9 @@ static int scan_input ( void *fdx_vp,
      * Create inbuf if first call.
      */
     fdx = fdx_vp;
-    if ( !fdx->inbuf ) fdx->inbuf = calloc ( sizeof(struct dm_inbuf), 1 );
+    if ( !fdx->inbuf ) fdx->inbuf = alloc_inbuf();
     if ( !fdx->inbuf ) return -1;
+    unbind_fastio ( fdx );
     inbuf = fdx->inbuf;
     /*
      * If bit 0 of code set, skip whitespace in stream.
@@ -1918,7 +3276,7 @@ static int scan_input ( void *fdx_vp,
  * Generalized vfscanf function that lets use call scanf with the
  * argument list pointing to various floating point formats.
  */
-int dm_vfscanf_vec ( FILE *fptr, const char *format_spec, va_list ap,
+FD_ENTRY(int,dm_vfscanf_vec) ( FILE *fptr, const char *format_spec, va_list ap,
 	struct doscan_float_format_functions *flt_vec )
 {
     int status, count, remaining, segsize, i, found_newline;
@@ -2075,9 +3433,9 @@ int dm_scanf_t ( const char *format_spec, ... )
     return status;
 }
 /*
- * Perror.  Contstruct output line as 4 separate writes.
+ * Perror.  Contstruct output line as one write of 4 pieces.
  */
-void dm_perror ( const char *str )
+FD_ENTRY(void,dm_perror) ( const char *str )
 {
     int status, fd, ecode, vmscode;
     char *errmsg;
@@ -2103,18 +3461,22 @@ dmpipe_trace_output("dm_perror()\r\n");
 	    fdx->bypass_flags = dm_bypass_startup_stall (fdx->bypass_flags,
 		fdx->bp, "w", fdx->fcntl_flags );
 	}
-	fdx->write_ops++;
+	count_write ( fdx );
 	/*
 	 * Switch to bypass if stream established, otherwise fall through
 	 * to regular perror().
 	 */
 	if ( fdx->bypass_flags & DM_BYPASS_HINT_WRITES ) {
-
-	    status = dm_bypass_write ( fdx->bp, str, strlen(str) );
-	    if ( status >= 0 ) status = dm_bypass_write ( fdx->bp, ": ", 2 );
-	    if ( status >= 0 ) status = dm_bypass_write ( fdx->bp, errmsg,
-			strlen(errmsg) );
-	    if ( status >= 0 ) status = dm_bypass_write ( fdx->bp, "\n", 1 );
+	    struct iovec msg[4];	/* one write, so one record */
+	    msg[0].iov_base = (void *) str;
+	    msg[0].iov_len = strlen(str);
+	    msg[1].iov_base = ": ";
+	    msg[1].iov_len = 2;
+	    msg[2].iov_base = errmsg;
+	    msg[2].iov_len = strlen(errmsg);
+	    msg[3].iov_base = "\n";
+	    msg[3].iov_len = 1;
+	    status = write_outbuf ( fdx, msg, 4 );
 	    BROKEN_PIPE_CHECK ( status, fdx->fd );
 	    return;
 	}
@@ -2134,13 +3496,14 @@ static int flush_extension ( struct dm_fd_extension *fdx )
 
     dm_bypass_current_streams ( fdx->bp, &rstream, &wstream );
     if ( wstream ) {
-	status = memstream_flush ( wstream );
+	status = flush_outbuf ( fdx );
+	if ( status == 0 ) status = memstream_flush ( wstream );
 	BROKEN_PIPE_CHECK ( status, fdx->fd );
     } else status = EOF;	/* stream not open for write */
     return status;
 }
 
-int dm_fsync ( int fd )
+FD_ENTRY(int,dm_fsync) ( int fd )
 {
     struct dm_fd_extension *fdx;
 
@@ -2159,7 +3522,7 @@ dmpipe_trace_output("dm_fsync()\r\n");
     return fsync ( fd );
 }
 
-int dm_fflush ( FILE *fptr )
+FD_ENTRY(int,dm_fflush) ( FILE *fptr )
 {
     struct dm_fd_extension *fdx;
 /* TRACE */
@@ -2169,26 +3532,13 @@ dmpipe_trace_output("dm_fflush()\r\n");
      * Check for flush-all case of fptr null
      */
     if ( !fptr ) {
-	int row, col;
-	struct dm_fd_extension *extrow;
 	/*
-	 * Scan fdx table for initialized extensions and recursivelflush.
+	 * Scan written list for active (initialized) extensions with fp 
+	 * that we have written to at least once and recursively flush.
 	 */
-	for ( row = 0; row < FD_EXTENSION_MAP_ROWS; row++ ) {
-	    /*
-	     * Rows are dynamically allocated, skip if never created.
-	     */
-	    extrow = dm_fd_extrow[row];
-	    if ( !extrow ) continue;
-	    /*
-	     * Scan row looking for active (initialized) extensions with fp 
-	     * that we have written to at least once and flush.
-	     */
-	    for ( col = 0; col < FD_EXTENSION_MAP_COLS; col++ ) {
-		fdx = &extrow[col];
-		if ( fdx->initialized && fdx->fp && (fdx->write_ops>0) ) {
-		    dm_fflush ( fdx->fp );
-		}
+	for ( fdx = written_list; fdx; fdx = fdx->written_next ) {
+	    if ( fdx->initialized && fdx->fp && (fdx->write_ops>0) ) {
+		dm_fflush ( fdx->fp );
 	    }
 	}
     }
@@ -2206,3 +3556,325 @@ dmpipe_trace_output("dm_fflush()\r\n");
      */
     return fflush ( fptr );
 }
+/*
+ * Buffering mode applies to our outbuf as well as the CRTL's buffer.
+ */
+FD_ENTRY(int,dm_setvbuf) ( FILE *fptr, char *buffer, int mode, size_t size )
+{
+    struct dm_fd_extension *fdx;
+/* TRACE */
+dmpipe_trace_output("dm_setvbuf()\r\n");
+/* END TRACE */
+    fdx = find_fp_extension ( fptr, 1 );
+    if ( fdx && fdx->initialized && 
+	((mode == _IOFBF) || (mode == _IOLBF) || (mode == _IONBF)) ) {
+	if ( fdx->bp ) flush_outbuf ( fdx );
+	fdx->outbuf_mode = mode;
+    }
+    return setvbuf ( fptr, buffer, mode, size );
+}
+
+void dm_setbuf ( FILE *fptr, char *buffer )
+{
+    dm_setvbuf ( fptr, buffer, buffer ? _IOFBF : _IONBF, BUFSIZ );
+}
+#ifdef DMPIPE_THREADS
+/*************************************************************************/
+/*
+ * Public entry points for the thread-safe build, each holds the lock of
+ * the fd (or FILE's fd) it is given around the _locked function above.
+ * Extension is looked up without initializing it so that happens under
+ * the lock.
+ */
+ssize_t dm_read ( int fd, void *buffer_vp, size_t nbytes )
+{
+    struct dm_fd_extension *fdx;
+    ssize_t count;
+
+    fdx = find_extension ( fd, 0 );
+    lock_fd ( fdx );
+    count = dm_read_locked ( fd, buffer_vp, nbytes );
+    unlock_fd ( fdx );
+    return count;
+}
+
+ssize_t dm_write ( int fd, const void *buffer_vp, size_t nbytes )
+{
+    struct dm_fd_extension *fdx;
+    ssize_t count;
+
+    fdx = find_extension ( fd, 0 );
+    lock_fd ( fdx );
+    count = dm_write_locked ( fd, buffer_vp, nbytes );
+    unlock_fd ( fdx );
+    return count;
+}
+
+ssize_t dm_call ( int fd, const void *request, size_t reqlen, void *reply,
+	size_t replysize )
+{
+    struct dm_fd_extension *fdx;
+    ssize_t count;
+
+    fdx = find_extension ( fd, 0 );
+    lock_fd ( fdx );
+    count = dm_call_locked ( fd, request, reqlen, reply, replysize );
+    unlock_fd ( fdx );
+    return count;
+}
+
+ssize_t dm_read_record ( int fd, void *buffer, size_t bufsize, 
+	const void **record )
+{
+    struct dm_fd_extension *fdx;
+    ssize_t count;
+
+    fdx = find_extension ( fd, 0 );
+    lock_fd ( fdx );
+    count = dm_read_record_locked ( fd, buffer, bufsize, record );
+    unlock_fd ( fdx );
+    return count;
+}
+
+ssize_t dm_readv ( int fd, const struct iovec *iov, int iovcnt )
+{
+    struct dm_fd_extension *fdx;
+    ssize_t count;
+
+    fdx = find_extension ( fd, 0 );
+    lock_fd ( fdx );
+    count = dm_readv_locked ( fd, iov, iovcnt );
+    unlock_fd ( fdx );
+    return count;
+}
+
+ssize_t dm_writev ( int fd, const struct iovec *iov, int iovcnt )
+{
+    struct dm_fd_extension *fdx;
+    ssize_t count;
+
+    fdx = find_extension ( fd, 0 );
+    lock_fd ( fdx );
+    count = dm_writev_locked ( fd, iov, iovcnt );
+    unlock_fd ( fdx );
+    return count;
+}
+
+int dm_close ( int file_desc )
+{
+    struct dm_fd_extension *fdx;
+    int status;
+
+    fdx = find_extension ( file_desc, 0 );
+    lock_fd ( fdx );
+    status = dm_close_locked ( file_desc );
+    unlock_fd ( fdx );
+    return status;
+}
+
+int dm_get_wait_fd ( int fd )
+{
+    struct dm_fd_extension *fdx;
+    int status;
+
+    fdx = find_extension ( fd, 0 );
+    lock_fd ( fdx );
+    status = dm_get_wait_fd_locked ( fd );
+    unlock_fd ( fdx );
+    return status;
+}
+
+int dm_fsync ( int fd )
+{
+    struct dm_fd_extension *fdx;
+    int status;
+
+    fdx = find_extension ( fd, 0 );
+    lock_fd ( fdx );
+    status = dm_fsync_locked ( fd );
+    unlock_fd ( fdx );
+    return status;
+}
+
+void dm_perror ( const char *str )
+{
+    struct dm_fd_extension *fdx;
+
+    fdx = find_extension ( 2, 0 );
+    lock_fd ( fdx );
+    dm_perror_locked ( str );
+    unlock_fd ( fdx );
+}
+
+ssize_t dm_feof ( FILE *fptr )
+{
+    struct dm_fd_extension *fdx;
+    ssize_t result;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    result = dm_feof_locked ( fptr );
+    unlock_fd ( fdx );
+    return result;
+}
+
+int dm_fputc ( int ichar, FILE *fptr )
+{
+    struct dm_fd_extension *fdx;
+    int result;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    result = dm_fputc_locked ( ichar, fptr );
+    unlock_fd ( fdx );
+    return result;
+}
+
+int dm_puts ( const char *str )
+{
+    struct dm_fd_extension *fdx;
+    int result;
+
+    fdx = find_fp_extension ( stdout, 0 );
+    lock_fd ( fdx );
+    result = dm_puts_locked ( str );
+    unlock_fd ( fdx );
+    return result;
+}
+
+int dm_fputs ( const char *str, FILE *fptr )
+{
+    struct dm_fd_extension *fdx;
+    int result;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    result = dm_fputs_locked ( str, fptr );
+    unlock_fd ( fdx );
+    return result;
+}
+
+size_t dm_fread ( void *ptr, size_t itmsize, size_t nitems, FILE *fptr )
+{
+    struct dm_fd_extension *fdx;
+    size_t count;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    count = dm_fread_locked ( ptr, itmsize, nitems, fptr );
+    unlock_fd ( fdx );
+    return count;
+}
+
+size_t dm_fwrite ( const void *ptr, size_t itmsize, size_t nitems,
+	FILE *fptr )
+{
+    struct dm_fd_extension *fdx;
+    size_t count;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    count = dm_fwrite_locked ( ptr, itmsize, nitems, fptr );
+    unlock_fd ( fdx );
+    return count;
+}
+
+char *dm_fgets ( char *str, int maxchar, FILE *fptr )
+{
+    struct dm_fd_extension *fdx;
+    char *result;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    result = dm_fgets_locked ( str, maxchar, fptr );
+    unlock_fd ( fdx );
+    return result;
+}
+
+int dm_ungetc ( int c, FILE *fptr )
+{
+    struct dm_fd_extension *fdx;
+    int result;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    result = dm_ungetc_locked ( c, fptr );
+    unlock_fd ( fdx );
+    return result;
+}
+
+int dm_fgetc ( FILE *fptr )
+{
+    struct dm_fd_extension *fdx;
+    int result;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    result = dm_fgetc_locked ( fptr );
+    unlock_fd ( fdx );
+    return result;
+}
+
+int dm_fclose ( FILE *fptr )
+{
+    struct dm_fd_extension *fdx;
+    int status;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    status = dm_fclose_locked ( fptr );
+    unlock_fd ( fdx );
+    return status;
+}
+
+int dm_pclose ( FILE *fptr )
+{
+    struct dm_fd_extension *fdx;
+    int status;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    status = dm_pclose_locked ( fptr );
+    unlock_fd ( fdx );
+    return status;
+}
+
+int dm_vfscanf_vec ( FILE *fptr, const char *format_spec, va_list ap,
+	struct doscan_float_format_functions *flt_vec )
+{
+    struct dm_fd_extension *fdx;
+    int status;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    status = dm_vfscanf_vec_locked ( fptr, format_spec, ap, flt_vec );
+    unlock_fd ( fdx );
+    return status;
+}
+
+int dm_fflush ( FILE *fptr )
+{
+    struct dm_fd_extension *fdx;
+    int status;
+    /*
+     * Flush-all (null fptr) locks each stream as it flushes it.
+     */
+    fdx = fptr ? find_fp_extension ( fptr, 0 ) : 0;
+    lock_fd ( fdx );
+    status = dm_fflush_locked ( fptr );
+    unlock_fd ( fdx );
+    return status;
+}
+
+int dm_setvbuf ( FILE *fptr, char *buffer, int mode, size_t size )
+{
+    struct dm_fd_extension *fdx;
+    int status;
+
+    fdx = find_fp_extension ( fptr, 0 );
+    lock_fd ( fdx );
+    status = dm_setvbuf_locked ( fptr, buffer, mode, size );
+    unlock_fd ( fdx );
+    return status;
+}
+#endif
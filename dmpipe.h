@@ -15,13 +15,141 @@
 #include <unistd.h>		/* pipe definitions, pipe(), close() */
 #include <unixio.h>		/* isapipe() */
 #include <fcntl.h>		/* open() */
+#include <sys/uio.h>		/* readv(), writev() */
 #include <poll.h>		/* poll() and friends */
 /*#include <socket.h>*/		/* select() was implemented by TCP/IP dev. */
 #include <time.h>		/* Select() */
+#include "memstream.h"		/* struct memstream_stats */
 
 int dm_pipe ( int fds[2] );
 ssize_t dm_read ( int fd, void *buffer_vp, size_t nbytes );
 ssize_t dm_write ( int fd, const void *buffer_vp, size_t nbytes );
+ssize_t dm_readv ( int fd, const struct iovec *iov, int iovcnt );
+ssize_t dm_writev ( int fd, const struct iovec *iov, int iovcnt );
+ssize_t dm_read_record ( int fd, void *buffer, size_t bufsize,
+	const void **record );
+/*
+ * dm_fcntl(fd,F_SETFL,flags|DM_O_RECORD) on the writing side, before its
+ * first write, makes each write a record for dm_read_record().
+ */
+#define DM_O_RECORD 0x00800000
+/*
+ * dm_fcntl(fd,F_SETFL,flags|DM_O_DUPLEX) before the first read or write on
+ * a pipe used in both directions puts both streams in one shared memory
+ * section, set up in a single negotiation with the peer.  Only the side
+ * starting the bypass needs it.  Dm_call writes a request and waits for
+ * the reply in one step, returning the reply length (as soon as any of
+ * it has arrived), 0 or -1.
+ */
+#define DM_O_DUPLEX 0x00400000
+ssize_t dm_call ( int fd, const void *request, size_t reqlen, void *reply,
+	size_t replysize );
+/*
+ * Shared memory section size of a bypassed pipe, like Linux F_SETPIPE_SZ.
+ * dm_fcntl(fd,DM_F_SETPIPE_SZ,size) rounds size up to a power of 2 pages
+ * (up to 1GB) and returns it.  It sets the size for streams the fd starts
+ * and moves an established write stream to a section of the new size,
+ * data already written is still delivered first.  Default size is taken
+ * from DMPIPE_MEMSTREAM_SIZE (64K if not defined).  If
+ * DMPIPE_MEMSTREAM_MAX_SIZE is defined, a writer that keeps blocking on a
+ * full section doubles it, up to that size.
+ */
+#define DM_F_SETPIPE_SZ (F_SETLKW+101)
+#define DM_F_GETPIPE_SZ (F_SETLKW+102)
+/*
+ * dm_fcntl(fd,F_SETFL,flags|DM_O_BUSY_POLL) makes a read finding the pipe
+ * empty spin watching for data before it waits, like Linux SO_BUSY_POLL.
+ * dm_fcntl(fd,DM_F_SETBUSY_POLL,usec) sets how long (default 50).
+ */
+#define DM_O_BUSY_POLL 0x00200000
+#define DM_F_SETBUSY_POLL (F_SETLKW+103)
+/*
+ * Broadcast (tee) streams.  One process opens a named tee for writing and
+ * up to 16 others attach to read it, each receiving everything written
+ * after it attached.  The writer is held back by the slowest reader 
+ * unless opened with DM_TEE_DROP_LAGGING, in which case a reader still
+ * half a buffer behind after the writer has waited briefly is dropped
+ * and its reads fail with EIO.  Dm_tee_read returns 0 once the writer
+ * has closed and all its data is read.
+ */
+typedef struct dm_bypass_tee_ctx *dm_tee;
+#define DM_TEE_DROP_LAGGING 1
+dm_tee dm_tee_open ( const char *name, int flags );
+dm_tee dm_tee_attach ( const char *name );
+ssize_t dm_tee_write ( dm_tee tee, const void *buffer, size_t nbytes );
+ssize_t dm_tee_read ( dm_tee tee, void *buffer, size_t nbytes );
+int dm_tee_close ( dm_tee tee );
+/*
+ * Persistent poll sets, like Linux epoll.  Fds registered with
+ * dm_epoll_ctl stay in the set (until removed or closed) and dm_epoll_wait
+ * returns up to maxevents ready ones, with the poll() revents bits and
+ * the caller's data.  Bypassed pipes are only queried again once their
+ * peer has read or written them, so a wait costs in proportion to the
+ * active pipes, not the registered ones.  Level triggered only; sockets
+ * and files are refused with EPERM.
+ */
+typedef struct dm_poll_set *dm_epoll;
+typedef union dm_epoll_data {
+    void *ptr;
+    int fd;
+    unsigned int u32;
+    unsigned long long u64;
+} dm_epoll_data_t;
+struct dm_epoll_event {
+    unsigned int events;		/* POLLIN, POLLOUT, ... */
+    dm_epoll_data_t data;
+};
+#define DM_EPOLL_CTL_ADD 1
+#define DM_EPOLL_CTL_DEL 2
+#define DM_EPOLL_CTL_MOD 3
+dm_epoll dm_epoll_create ( int size );
+int dm_epoll_ctl ( dm_epoll ep, int op, int fd, struct dm_epoll_event *event );
+int dm_epoll_wait ( dm_epoll ep, struct dm_epoll_event *events, 
+	int maxevents, int timeout );
+int dm_epoll_close ( dm_epoll ep );
+/*
+ * Descriptor to put in a foreign event loop (poll, select, epoll) in place
+ * of fd.  For a bypassed pipe it is a wait handle (an abstract socket on
+ * Linux, a mailbox on VMS) that becomes readable when the peer writes or
+ * reads the pipe, and stays readable until a non-blocking dm_read (dm_write
+ * if fd is write-only) fails with EWOULDBLOCK, so set O_NONBLOCK with
+ * dm_fcntl first.  Don't read or close it, it goes away with fd.  Other
+ * fds are returned unchanged.
+ */
+int dm_get_wait_fd ( int fd );
+/*
+ * Asynchronous reads and writes.  Dm_aio_submit queues control blocks
+ * without waiting and dm_aio_reap moves the queued transfers along,
+ * returning those that completed, so one thread can keep I/O going on
+ * many pipes.  A read completes once it has any data (result 0 at end of
+ * file), a write once all nbytes are written, which on a bypassed pipe
+ * may take several pieces.  The control block and buffer belong to
+ * dmpipe until reaped or cancelled.  Reap waits until min_count have
+ * completed (timeout in milliseconds bounds each wait that sees no
+ * progress, -1 for none) and calls each one's callback, if any, before
+ * returning, the way a QIO's AST routine reports its completion.  A
+ * callback may submit its control block again.  Closing an fd completes
+ * its operations with EBADF.
+ */
+struct dm_aiocb {
+    int fd;
+    int opcode;				/* DM_AIO_READ or DM_AIO_WRITE */
+    void *buffer;
+    size_t nbytes;
+    void (*callback) ( struct dm_aiocb *cb );	/* optional */
+    void *user_arg;
+    ssize_t result;			/* bytes moved or -1, when reaped */
+    int error;				/* errno value if result is -1 */
+    size_t transferred;			/* private to dmpipe */
+    int state;
+    struct dm_aiocb *next;
+};
+#define DM_AIO_READ 1
+#define DM_AIO_WRITE 2
+int dm_aio_submit ( struct dm_aiocb *cbs[], int count );
+int dm_aio_reap ( struct dm_aiocb *done[], int min_count, int max_count,
+	int timeout );
+int dm_aio_cancel ( struct dm_aiocb *cb );
 int dm_close ( int file_desc );
 int dm_open ( const char *file_spec, int flats, ... );
 int dm_dup ( int file_desc );
@@ -50,7 +178,53 @@ int dm_select(int nfds, fd_set *readfds, fd_set *writefds,
 int dm_poll ( struct pollfd filedes[], nfds_t nfds, int timeout );
 void dm_perror ( const char *str );
 int dm_fflush ( FILE *fptr );
+int dm_setvbuf ( FILE *fptr, char *buffer, int mode, size_t size );
+void dm_setbuf ( FILE *fptr, char *buffer );
 int dm_fsync ( int fd );
+/*
+ * In line getc/putc.  After dm_fgetc or dm_fputc moves a character through
+ * a bypassed stream, the FILE is bound to a dm_fastio_cursor slot exposing
+ * the unread part of its input buffer and the free part of its output
+ * buffer.  Dm_getc_unlocked and dm_putc_unlocked work on the slot while
+ * they can and call the library when it is exhausted, when another FILE
+ * holds the slot, or to write a newline (which may flush).  Any other
+ * library call on the stream folds the cursors back first.  Characters
+ * moved in line are not counted in dm_get_statistics' read/write ops.
+ * Getc, putc and their _unlocked forms all map to these.  When dmpipe is
+ * built with DMPIPE_THREADS no stream is ever bound to a slot, so every
+ * call falls through to dm_fgetc or dm_fputc, which take the fd's lock;
+ * the in line path is then safe from any thread but saves nothing.
+ */
+#define DM_FASTIO_SLOTS 16
+#define DM_FASTIO_HASH(fptr) \
+	((((unsigned long) (fptr)) >> 3) & (DM_FASTIO_SLOTS-1))
+struct dm_fastio {
+    FILE *fp;				/* stream bound to slot, 0 if none */
+    unsigned char *rptr, *rend;		/* unread input */
+    unsigned char *wptr, *wend;		/* free output space */
+};
+extern struct dm_fastio dm_fastio_cursor[DM_FASTIO_SLOTS];
+
+static inline int dm_getc_unlocked ( FILE *fptr )
+{
+    struct dm_fastio *fio;
+
+    fio = &dm_fastio_cursor[DM_FASTIO_HASH(fptr)];
+    if ( (fio->fp == fptr) && (fio->rptr < fio->rend) ) return *fio->rptr++;
+    return dm_fgetc ( fptr );
+}
+
+static inline int dm_putc_unlocked ( int ichar, FILE *fptr )
+{
+    struct dm_fastio *fio;
+    unsigned char c;
+
+    c = ichar;
+    fio = &dm_fastio_cursor[DM_FASTIO_HASH(fptr)];
+    if ( (fio->fp == fptr) && (fio->wptr < fio->wend) && (c != '\n') )
+	return *fio->wptr++ = c;
+    return dm_fputc ( ichar, fptr );
+}
 int dm_isapipe ( int fd, int *bypass_status );  /* note additional argument */
 /*
  * Statistics retreival.
@@ -60,6 +234,17 @@ struct dm_bypass_statistics {
     long write_ops, read_ops;
 };
 int dm_get_statistics ( int fd, struct dm_bypass_statistics *blk );
+/*
+ * Statistics of the shared memory streams, valid for the directions
+ * flagged as bypassed (return value, as for dm_get_statistics).  Setting
+ * DMPIPE_MEMSTREAM_STATS to a file name ("-" for stderr) appends each
+ * stream's statistics to it when the stream closes.
+ */
+struct dm_bypass_stream_statistics {
+    struct memstream_stats read_stream;
+    struct memstream_stats write_stream;
+};
+int dm_get_stream_statistics ( int fd, struct dm_bypass_stream_statistics *blk );
 /*
  * Printf functions interpet floats multiple ways.  Define fprintf and printf
  * macros to select the proper variant.
@@ -141,6 +326,8 @@ int dm_scanf_t ( const char *fmt, ... );
 #define pipe(a) dm_pipe(a)
 #define read(a,b,c) dm_read(a,b,c)
 #define write(a,b,c) dm_write(a,b,c)
+#define readv(a,b,c) dm_readv(a,b,c)
+#define writev(a,b,c) dm_writev(a,b,c)
 #define close(a) dm_close(a)
 #define open dm_open
 
@@ -164,16 +351,33 @@ int dm_scanf_t ( const char *fmt, ... );
 #define __feof_(a) dm_feof(a)
 #define feof_unlocked(a) dm_feof(a)
 #pragma message restore
-#define getc(a) dm_fgetc(a)
-#define getchar(a) dm_fgetc(stdin)
-#define putc(a,b) dm_fputc(a,b)
-#define putchar(a) dm_fputc(a, stdout)
+#define getc(a) dm_getc_unlocked(a)
+#define getchar() dm_getc_unlocked(stdin)
+#define putc(a,b) dm_putc_unlocked(a,b)
+#define putchar(a) dm_putc_unlocked(a,stdout)
+#pragma message save
+#pragma message disable (MACROREDEF)
+#undef getc_unlocked
+#undef getchar_unlocked
+#undef putc_unlocked
+#undef putchar_unlocked
+#undef fgetc_unlocked
+#undef fputc_unlocked
+#define getc_unlocked(a) dm_getc_unlocked(a)
+#define getchar_unlocked() dm_getc_unlocked(stdin)
+#define putc_unlocked(a,b) dm_putc_unlocked(a,b)
+#define putchar_unlocked(a) dm_putc_unlocked(a,stdout)
+#define fgetc_unlocked(a) dm_getc_unlocked(a)
+#define fputc_unlocked(a,b) dm_putc_unlocked(a,b)
+#pragma message restore
 #define puts(a) dm_puts(a)
 #define ungetc(a,b) dm_ungetc(a,b)
 #define fcntl dm_fcntl
 #define poll(a,b,c) dm_poll(a,b,c)
 #define select(a,b,c,d,e) dm_select(a,b,c,d,e)
 #define fflush(a) dm_fflush(a)
+#define setvbuf(a,b,c,d) dm_setvbuf(a,b,c,d)
+#define setbuf(a,b) dm_setbuf(a,b)
 #define fsync(a) dm_fsync(a)
 #define isapipe(fd) dm_isapipe((fd),0)
 #endif /* DM_NO_CRTL_WRAP */
@@ -33,6 +33,28 @@
  * Revised:  21-APR-2014	Fix implied_lf processing in alternate_bypass.
  * Revised:  23-APR-2014	Fix pipe detection for MPA devices, previous
  *				change to using ALLDEVNAM DVI code broke it.
+ * Revised:  16-OCT-2026	Select memstream commbuf format with
+ *				DMPIPE_MEMSTREAM_FORMAT environment variable.
+ * Revised:  16-OCT-2026	Add dm_bypass_readv and dm_bypass_writev.
+ * Revised:  16-OCT-2026	Add dm_bypass_read_record, record mode set
+ *				from fcntl flags when stream begins.
+ * Revised:  16-OCT-2026	Accept MPSC in DMPIPE_MEMSTREAM_FORMAT.
+ * Revised:  16-OCT-2026	Add broadcast (tee) sections, one writer and
+ *				several readers, for dm_tee_open/dm_tee_attach.
+ * Revised:  16-OCT-2026	Per-stream section size (dm_fcntl and
+ *				DMPIPE_MEMSTREAM_SIZE), writer moves stream to
+ *				a larger section when it keeps blocking, up to
+ *				DMPIPE_MEMSTREAM_MAX_SIZE.
+ * Revised:  16-OCT-2026	Batch reader wakes per DMPIPE_MEMSTREAM_WAKE.
+ * Revised:  16-OCT-2026	Add dm_bypass_get_statistics.
+ * Revised:  16-OCT-2026	Publish stream statistics in the telemetry
+ *				page (dmpipe_telemetry.h) for dmpipe_top.
+ * Revised:  16-OCT-2026	Duplex sections (DM_BYPASS_FCNTL_DUPLEX), both
+ *				streams of a read/write pipe in one section
+ *				from one negotiation, and dm_bypass_call.
+ * Revised:  16-OCT-2026	Guard free stream data and nexus lists with
+ *				mutexes in the thread-safe (DMPIPE_THREADS)
+ *				build.
  */
 #include <stdlib.h>
 #include <stdio.h>
@@ -46,6 +68,7 @@
 
 #include "dmpipe_bypass.h"
 #include "memstream.h"
+#include "dmpipe_telemetry.h"
 
 #include <descrip.h>		/* VMS string descriptors */
 #include <starlet.h>
@@ -64,11 +87,17 @@
 #include <vadef.h>		/* VMS virtual address space definitions */
 #include <agndef.h>
 #include <cmbdef.h>
+#include <builtins.h>		/* DEC C builtin functions */
+#ifdef DMPIPE_THREADS
+#include <pthread.h>
+#endif
 
 #define DMPIPE_ACE_ID 31814     /* ID code for application ACEs */
 #define DM_SECVER_MAJOR 1
 #define DM_SECVER_MINOR 1
 #define DMPIPE_MEMSTREAM_BLK_SIZE 0x10000	/* 64K */
+#define DMPIPE_MEMSTREAM_MIN_SIZE 0x2000	/* 8K, one page */
+#define DMPIPE_MEMSTREAM_MAX_SIZE 0x40000000	/* 1G, P0 space limit */
 #define DM_NEXUS_NAME_SIZE 32
 /*
  * Lock value block is 2 quadword structures.  The 2 comminucating
@@ -92,7 +121,9 @@ struct dm_lksb_valblk_unit {
 		wake_request:    1,   /* Peer should wake process */
 		peer_ack:        1,   /* Peer acknoleges request */
                 peer_nak:        1,   /* peer refused request */
-		reserved:       10,
+		size_shift:      5,   /* log2 of requested section size */
+		duplex:          1,   /* section carries both directions */
+		reserved:        4,
 		stream_id:      16;   /* sub-id for stream */
 	} bit;
     } flags;
@@ -142,9 +173,19 @@ struct dm_devinfo {
  */
 struct dm_stream_data {
     struct dm_stream_data *next;/* for free list */
-    int size;			/* size of block, integral number of pages */
+    unsigned long long size;	/* size of block, integral number of pages */
     void *blk;			/* Address of shared memory */
-    struct memstream_stats stats;
+    int stream_id;		/* section name is resnam.stream_id */
+    int generation;		/* number of times stream migrated */
+    struct {
+	unsigned long long size;
+	void *blk;		/* section stream is migrating from */
+    } retired;
+    int alias;			/* second half of duplex section, blk is
+				   mapped by the first half's sdata */
+    int offset;			/* offset of stream's commbuf in blk */
+    struct dm_telemetry_slot *telemetry;   /* published statistics */
+    struct memstream_stats stats;	/* used if no telemetry slot */
 };
 struct dm_nexus {
     struct dm_nexus *next;	/* global list for finding */
@@ -164,6 +205,8 @@ struct dm_nexus {
     } mbx_watch;
 
     struct dm_stream_data *rstream_mem, *wstream_mem;
+    int pipe_size;		/* section size for new streams */
+    int poll_usec;		/* busy poll budget, 0 for default */
 
     memstream rstream;		/* stream for reading */
     memstream wstream;		/* stream for writing */
@@ -200,6 +243,20 @@ struct dm_bypass_ctx {
 extern char dmpipe_trace;
 void dmpipe_trace_output(const char *cp_format, ...);
 /* END TRACE */
+/*
+ * Thread-safe build (DMPIPE_THREADS) guards the free list and nexus list
+ * with mutexes, the streams themselves are serialized by dmpipe.c's per-fd
+ * locks.
+ */
+#ifdef DMPIPE_THREADS
+static pthread_mutex_t sdata_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t nexus_list_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LIST_LOCK(mutex) pthread_mutex_lock ( &mutex )
+#define LIST_UNLOCK(mutex) pthread_mutex_unlock ( &mutex )
+#else
+#define LIST_LOCK(mutex)
+#define LIST_UNLOCK(mutex)
+#endif
 /*
  * Allocate and free stream data handles.
  */
@@ -209,44 +266,227 @@ static struct dm_stream_data *alloc_stream_data ( int blk_size )
 {
     struct dm_stream_data *sdata;
 
+    LIST_LOCK ( sdata_list_lock );
     if ( free_sdata && (free_sdata->size >= blk_size) ) {
 	sdata = free_sdata;
 	free_sdata = sdata->next;
 	sdata->next = 0;
+	sdata->stream_id = 0;
+	sdata->generation = 0;
+	sdata->alias = 0;
+	sdata->offset = 0;
+	LIST_UNLOCK ( sdata_list_lock );
     } else {
+	LIST_UNLOCK ( sdata_list_lock );
 	sdata = calloc ( sizeof(struct dm_stream_data), 1 );
 	if ( sdata ) sdata->size = blk_size;
     }
     return sdata;
 }
+static int unmap_section ( void *blk, unsigned long long size )
+{
+    unsigned long long region_id, start_va, va_size, del_va, del_cnt;
+
+    region_id = VA$C_P0;
+    start_va = (unsigned long long) blk;
+    va_size = size;
+
+    return SYS$DELTVA_64 ( &region_id, start_va, va_size, 0,
+	&del_va, &del_cnt );
+}
 static int free_stream_data ( struct dm_stream_data *sdata, int unmap )
 {
     int status;
     /*
      * Delete virtual memory addresses mapping global section used by stream.
      */
+    if ( sdata->retired.blk ) {
+	unmap_section ( sdata->retired.blk, sdata->retired.size );
+	sdata->retired.blk = 0;
+    }
     if ( unmap ) {
-	unsigned long long region_id, start_va, va_size, del_va, del_cnt;
-
-	region_id = VA$C_P0;
-	start_va = (unsigned long long) sdata->blk;
-	va_size = sdata->size;
-
-	status = SYS$DELTVA_64 ( &region_id, start_va, va_size, 0,
-		&del_va, &del_cnt );
+	status = unmap_section ( sdata->blk, sdata->size );
     } else {
 	sdata->blk = 0;
 	status = 1;
     }
+    if ( sdata->telemetry ) {
+	sdata->telemetry->pid = 0;	/* release slot */
+	sdata->telemetry = 0;
+    }
     /*
      * Place sdata block on free list so it, along with address range
      * can be reused.
      */
+    LIST_LOCK ( sdata_list_lock );
     sdata->next = free_sdata;
     free_sdata = sdata;
+    LIST_UNLOCK ( sdata_list_lock );
 
     return status;
 }
+/*
+ * Round section size up to a power of 2 pages in supported range, return
+ * its log2.
+ */
+static int section_size_shift ( long long size )
+{
+    int shift;
+
+    for ( shift = 13; (1LL<<shift) < size; shift++ );
+    if ( shift > 30 ) shift = 30;	/* DMPIPE_MEMSTREAM_MAX_SIZE */
+    return shift;
+}
+/*
+ * Section sizes for new streams, DMPIPE_MEMSTREAM_SIZE environment variable
+ * sets the initial size (default 64K) and DMPIPE_MEMSTREAM_MAX_SIZE lets
+ * a writer that keeps finding the section full move to larger ones.
+ * DMPIPE_MEMSTREAM_WAKE ("low_water,high_water,msec") sets the writer's
+ * wake batching.
+ */
+static struct {
+    int selected;
+    int initial;
+    int limit;
+    int wake[3];		/* low water, high water, max latency */
+} section_sizing = { 0, DMPIPE_MEMSTREAM_BLK_SIZE, 0, { 0, 0, 0 } };
+
+static void select_section_sizes ( void )
+{
+    char *envvar;
+
+    if ( section_sizing.selected ) return;
+    section_sizing.selected = 1;
+    envvar = getenv ( "DMPIPE_MEMSTREAM_SIZE" );
+    if ( envvar && (atoi ( envvar ) > 0) ) section_sizing.initial = 
+	1 << section_size_shift ( atoi ( envvar ) );
+    envvar = getenv ( "DMPIPE_MEMSTREAM_MAX_SIZE" );
+    if ( envvar && (atoi ( envvar ) > 0) ) section_sizing.limit = 
+	1 << section_size_shift ( atoi ( envvar ) );
+    envvar = getenv ( "DMPIPE_MEMSTREAM_WAKE" );
+    if ( envvar ) {
+	section_sizing.wake[2] = 10;
+	sscanf ( envvar, "%d,%d,%d", &section_sizing.wake[0],
+		&section_sizing.wake[1], &section_sizing.wake[2] );
+    }
+}
+/*
+ * Name of stream's global section: resnam.stream_id, plus .generation for
+ * sections a stream migrated to.  Name must have room for 44 characters.
+ */
+static void format_section_name ( char *name, struct dm_lock *lock,
+	struct dm_stream_data *sdata )
+{
+    if ( sdata->generation ) sprintf ( name, "%s.%d.%d", lock->resnam,
+	sdata->stream_id, sdata->generation );
+    else sprintf ( name, "%s.%d", lock->resnam, sdata->stream_id );
+}
+/**************************************************************************/
+/* Telemetry page.  Map the DMPIPE_TELEMETRY section the first time a
+ * stream starts, then claim a slot for each stream so dmpipe_top can
+ * watch it.  Defining DMPIPE_TELEMETRY as 0 turns publishing off.
+ */
+static struct {
+    int mapped;				/* 1 mapped, -1 unavailable */
+    struct dm_telemetry_page *page;
+} telemetry;
+
+static struct dm_telemetry_page *map_telemetry ( void )
+{
+    static $DESCRIPTOR(sect_name_dx,DM_TELEMETRY_SECTION);
+    struct {
+        int match;
+        struct {
+            unsigned int minor:24, major:8;
+        } ver;
+    } sect_id;
+    unsigned long long region_id, sect_va, sect_length;
+    char *envvar;
+    int status, flags;
+
+    if ( telemetry.mapped ) return telemetry.page;
+    telemetry.mapped = -1;
+    envvar = getenv ( "DMPIPE_TELEMETRY" );
+    if ( envvar && (strcmp ( envvar, "0" ) == 0) ) return 0;
+
+    sect_id.match = SEC$K_MATALL;
+    sect_id.ver.minor = 0;
+    sect_id.ver.major = DM_TELEMETRY_VERSION;
+    region_id = VA$C_P0;
+    flags = SEC$M_DZRO|SEC$M_EXPREG|SEC$M_GBL|SEC$M_PAGFIL|SEC$M_WRT;
+    status = SYS$CRMPSC_GPFILE_64 ( &sect_name_dx, &sect_id, 0xff00, 
+	sizeof(struct dm_telemetry_page), &region_id, 0, 0, flags, 
+	&sect_va, &sect_length, 0, 0 );
+    if ( ((status&1) == 0) || ((sect_va & 0x7fffffff) != sect_va) ) return 0;
+
+    telemetry.page = (struct dm_telemetry_page *) sect_va;
+    if ( telemetry.page->version == 0 ) {
+	/* First to map it, every process stores the same values */
+	telemetry.page->slot_count = DM_TELEMETRY_SLOTS;
+	telemetry.page->version = DM_TELEMETRY_VERSION;
+    }
+    if ( telemetry.page->version != DM_TELEMETRY_VERSION ) return 0;
+    telemetry.mapped = 1;
+    return telemetry.page;
+}
+
+static int process_exists ( unsigned int pid )
+{
+    int code, value;
+
+    code = JPI$_PID;
+    return LIB$GETJPI ( &code, &pid, 0, &value, 0, 0 ) != SS$_NONEXPR;
+}
+/*
+ * Take a free slot, or failing that one whose owner no longer exists.
+ */
+static struct dm_telemetry_slot *claim_telemetry_slot ( void )
+{
+    struct dm_telemetry_page *page;
+    struct dm_telemetry_slot *slot;
+    unsigned int owner;
+    int pass, i;
+
+    page = map_telemetry();
+    if ( !page ) return 0;
+    for ( pass = 0; pass < 2; pass++ ) {
+	for ( i = 0; i < DM_TELEMETRY_SLOTS; i++ ) {
+	    slot = &page->slot[i];
+	    owner = slot->pid;
+	    if ( owner && ((pass == 0) || process_exists ( owner )) ) continue;
+	    if ( __CMP_STORE_LONG ( &slot->pid, owner, getpid(), 
+		&slot->pid ) ) return slot;
+	}
+    }
+    return 0;
+}
+/*
+ * Point stream's statistics at its telemetry slot, or at sdata if the
+ * page is full or unavailable.  Called again when a stream migrates, to
+ * update the section name.
+ */
+static void publish_stream ( struct dm_stream_data *sdata, 
+	struct dm_lock *lock, memstream stream, int is_writer, int is_tee )
+{
+    struct dm_telemetry_slot *slot;
+
+    if ( stream ) sdata->telemetry = claim_telemetry_slot();
+    slot = sdata->telemetry;
+    if ( slot ) {
+	slot->is_writer = is_writer;
+	slot->is_tee = is_tee;
+	slot->blk_size = sdata->size;
+	slot->offset = sdata->offset;
+	format_section_name ( slot->section, lock, sdata );
+	if ( stream ) memstream_assign_statistics ( stream, &slot->stats );
+    } else if ( stream ) memstream_assign_statistics ( stream, &sdata->stats );
+}
+
+static struct memstream_stats *stream_statistics ( 
+	struct dm_stream_data *sdata )
+{
+    return sdata->telemetry ? &sdata->telemetry->stats : &sdata->stats;
+}
 /**************************************************************************/
 /* Wrapper for $CRMPSC call to create a page file section.
  */
@@ -268,10 +508,11 @@ static int sys_crmpsc_gpfile ( struct dm_lock *lock,
     unsigned long long sect_va_in;
     int i, status, prot;
     /*
-     * Create global section from lock and and sub_id in lock->lksb.
+     * Create global section from lock and and stream's sub_id, sections
+     * a stream migrates to add the generation.
      */
-    if ( strlen ( lock->resnam ) > (sizeof(sect_name)-8) ) return SS$_BADPARAM;
-    sprintf ( sect_name, "%s.%d", lock->resnam, lock->stream_id );
+    if ( strlen ( lock->resnam ) > (sizeof(sect_name)-12) ) return SS$_BADPARAM;
+    format_section_name ( sect_name, lock, sdata );
     sect_name_dx.dsc$w_length = strlen ( sect_name );
     /*
      * Setup the various parameters for this page file section:
@@ -643,6 +884,8 @@ static struct dm_nexus *find_nexus ( char *device_name,
     }
     if ( !nexus ) return 0;
     strcpy ( nexus->name, device_name );
+    select_section_sizes();
+    nexus->pipe_size = section_sizing.initial;
     nexus->dvi = *info_if;
     nexus->dtype = info_if->devtype;
     nexus->chan = chan;
@@ -691,15 +934,20 @@ static int delete_nexus ( struct dm_nexus *nexus )
 	nexus->lock.state = LCK$K_NLMODE;
 	nexus->lock.lksb.id = 0;
     }
+    /*
+     * Close both streams before unmapping, a duplex section holds both.
+     */
+    if ( nexus->rstream ) memstream_close ( nexus->rstream );
+    if ( nexus->wstream ) memstream_close ( nexus->wstream );
     if ( nexus->rstream ) {
-	memstream_close ( nexus->rstream );
-	status = free_stream_data ( nexus->rstream_mem, 1 );
+	status = free_stream_data ( nexus->rstream_mem, 
+		!nexus->rstream_mem->alias );
 	if ( (status&1) == 0 ) fprintf(stderr, 
 		"deltva error on rstream: %d\n", status );
     }
     if ( nexus->wstream ) {
-	memstream_close ( nexus->wstream );
-	status = free_stream_data ( nexus->wstream_mem, 1 );
+	status = free_stream_data ( nexus->wstream_mem,
+		!nexus->wstream_mem->alias );
 	if ( (status&1) == 0 ) fprintf(stderr, 
 		"deltva error on wstream: %d\n", status );
     }
@@ -889,14 +1137,16 @@ dm_bypass dm_bypass_init ( int fd, int *flags )
     /*
      * Retrieve existing nexus or create new one.  Remove redundant channel.
      */
+    LIST_LOCK ( nexus_list_lock );
     bp->nexus = find_nexus ( device_name, &info, chan );
+    if ( bp->nexus ) bp->nexus->ref_count++;
+    LIST_UNLOCK ( nexus_list_lock );
     if ( !bp->nexus ) {
 	if ( chan ) SYS$DASSGN ( chan );
 	*flags = 0;
 	free ( bp );
 	return 0;
     }
-    bp->nexus->ref_count++;
     if ( chan != bp->nexus->chan ) SYS$DASSGN ( chan );
     *flags = DM_BYPASS_HINT_STARTING;		/* allow negotiation */
     /*
@@ -916,19 +1166,99 @@ dm_bypass dm_bypass_init ( int fd, int *flags )
     }
     return bp;
 }
+/*
+ * Choose commbuf format for memstreams we initialize, based upon the
+ * DMPIPE_MEMSTREAM_FORMAT environment variable: LINEAR (default), RING,
+ * SPSC, MPSC, or the numeric format version.  Peer attaches using whatever
+ * format the section was initialized with.
+ */
+static void select_memstream_format ( void )
+{
+    static int selected = 0;
+    char *envvar;
+
+    if ( selected ) return;
+    selected = 1;
+    envvar = getenv ( "DMPIPE_MEMSTREAM_FORMAT" );
+    if ( !envvar ) return;
+    if ( isdigit ( *envvar ) ) {
+	memstream_set_format ( atoi ( envvar ) );
+    } else if ( strncasecmp ( envvar, "R", 1 ) == 0 ) {
+	memstream_set_format ( MEMSTREAM_FORMAT_RING );
+    } else if ( strncasecmp ( envvar, "L", 1 ) == 0 ) {
+	memstream_set_format ( MEMSTREAM_FORMAT_LINEAR );
+    } else if ( strncasecmp ( envvar, "S", 1 ) == 0 ) {
+	memstream_set_format ( MEMSTREAM_FORMAT_SPSC );
+    } else if ( strncasecmp ( envvar, "M", 1 ) == 0 ) {
+	memstream_set_format ( MEMSTREAM_FORMAT_MPSC );
+    }
+}
+
+/*
+ * Memstream callback to map the section a stream migrates to, the next
+ * generation of the stream's section, or unmap the one it left.
+ */
+static void *remap_stream ( void *nexus_vp, void *old_blk, int *blk_size, 
+	int is_writer )
+{
+    struct dm_nexus *nexus;
+    struct dm_stream_data *sdata, next;
+    int status;
+
+    nexus = nexus_vp;
+    sdata = is_writer ? nexus->wstream_mem : nexus->rstream_mem;
+    if ( !blk_size ) {
+	if ( sdata->retired.blk == old_blk ) {
+	    unmap_section ( sdata->retired.blk, sdata->retired.size );
+	    sdata->retired.blk = 0;
+	} else if ( sdata->blk == old_blk ) {
+	    /* New section was unusable, back out */
+	    unmap_section ( sdata->blk, sdata->size );
+	    sdata->blk = sdata->retired.blk;
+	    sdata->size = sdata->retired.size;
+	    sdata->generation--;
+	    sdata->retired.blk = 0;
+	}
+	return 0;
+    }
+    if ( sdata->retired.blk || (*blk_size > DMPIPE_MEMSTREAM_MAX_SIZE) ) 
+	return 0;
+    /*
+     * Map at new address since section may be bigger.
+     */
+    next = *sdata;
+    next.blk = 0;
+    next.size = *blk_size;
+    next.generation = sdata->generation + 1;
+    status = sys_crmpsc_gpfile ( &nexus->lock, 0, &next );
+    if ( (status&1) == 0 ) return 0;
+
+    sdata->retired.blk = sdata->blk;
+    sdata->retired.size = sdata->size;
+    sdata->blk = next.blk;
+    sdata->size = next.size;
+    sdata->generation = next.generation;
+    publish_stream ( sdata, &nexus->lock, 0, is_writer, 0 );
+    *blk_size = sdata->size;
+    return sdata->blk;
+}
+
 static int begin_stream ( int flags, int is_writer, struct dm_nexus *nexus,
-	int fcntl_flags )
+	int fcntl_flags, int blk_size )
 {
-    int status, blk_size, stream_flags;
+    int status, stream_flags;
     void *blk;
     memstream stream;
     struct dm_stream_data *sdata;
     /*
      * Create memory section.
      */
-    sdata = alloc_stream_data ( DMPIPE_MEMSTREAM_BLK_SIZE );
-    if ( sdata ) status = sys_crmpsc_gpfile ( &nexus->lock, 0, sdata );
-    else return (flags&0xfffe);		/* allocation failure */
+    select_memstream_format();
+    sdata = alloc_stream_data ( blk_size );
+    if ( sdata ) {
+	sdata->stream_id = nexus->lock.stream_id;
+	status = sys_crmpsc_gpfile ( &nexus->lock, 0, sdata );
+    } else return (flags&0xfffe);		/* allocation failure */
 
     if ( status & 1 ) {
 	/*
@@ -936,19 +1266,29 @@ static int begin_stream ( int flags, int is_writer, struct dm_nexus *nexus,
          */
 	stream = memstream_create ( sdata->blk, sdata->size, is_writer );
 	if ( !stream ) return (flags&0xfffe);   /* disable negotiations */
-	if ( fcntl_flags & O_NONBLOCK ) {
-	    stream_flags = MEMSTREAM_ATTR_NONBLOCK;
-	    memstream_control ( stream, &stream_flags, 0 );
-	}
+	stream_flags = 0;
+	if ( fcntl_flags & O_NONBLOCK ) stream_flags = MEMSTREAM_ATTR_NONBLOCK;
+	if ( fcntl_flags & DM_BYPASS_FCNTL_RECORD ) 
+	    stream_flags |= MEMSTREAM_ATTR_RECORD;
+	if ( fcntl_flags & DM_BYPASS_FCNTL_BUSY_POLL ) 
+	    stream_flags |= MEMSTREAM_ATTR_BUSY_POLL;
+	if ( stream_flags ) memstream_control ( stream, &stream_flags, 0 );
+	if ( nexus->poll_usec && !is_writer ) 
+	    memstream_set_busy_poll ( stream, nexus->poll_usec );
+	memstream_set_growth ( stream, remap_stream, nexus, 
+		is_writer ? section_sizing.limit : 0 );
 
 	if ( is_writer ) {
-	    memstream_assign_statistics ( stream, &sdata->stats );
+	    if ( section_sizing.wake[0] || section_sizing.wake[1] )
+		memstream_set_wake_marks ( stream, section_sizing.wake[0],
+		    section_sizing.wake[1], section_sizing.wake[2] );
+	    publish_stream ( sdata, &nexus->lock, stream, 1, 0 );
 	    nexus->wstream_mem = sdata;
 	    nexus->wstream = stream;
 	    flags |= 4;			/* start bypassing device */
 
 	} else {
-	    memstream_assign_statistics ( stream, &sdata->stats );
+	    publish_stream ( sdata, &nexus->lock, stream, 0, 0 );
 	    nexus->rstream_mem = sdata;
 	    nexus->rstream = stream;
 	    flags |= 2;			/* start bypassing */
@@ -957,6 +1297,67 @@ static int begin_stream ( int flags, int is_writer, struct dm_nexus *nexus,
 
     return flags;
 }
+/*
+ * Start both streams in a single section (DM_O_DUPLEX), each direction
+ * using half of it.  Requester writes the first half and reads the second.
+ * Second half gets its own sdata (alias) so each stream has its own
+ * statistics, only the first half's sdata maps and unmaps the section.
+ */
+static int begin_duplex ( int flags, int is_requester, struct dm_nexus *nexus,
+	int fcntl_flags, int blk_size )
+{
+    int status, stream_flags;
+    memstream pair[2];
+    struct dm_stream_data *sdata, *alias;
+
+    select_memstream_format();
+    sdata = alloc_stream_data ( blk_size );
+    if ( !sdata ) return (flags&0xfffe);	/* allocation failure */
+    alias = alloc_stream_data ( blk_size );
+    if ( !alias ) {
+	free_stream_data ( sdata, 0 );
+	return (flags&0xfffe);
+    }
+    sdata->stream_id = nexus->lock.stream_id;
+    status = sys_crmpsc_gpfile ( &nexus->lock, 0, sdata );
+    if ( ((status&1) == 0) || (memstream_create_duplex ( sdata->blk, 
+		sdata->size, is_requester, pair ) < 0) ) {
+	free_stream_data ( alias, 0 );
+	if ( status&1 ) free_stream_data ( sdata, 1 );
+	else free_stream_data ( sdata, 0 );
+	return (flags&0xfffe);			/* disable negotiations */
+    }
+    alias->stream_id = sdata->stream_id;
+    alias->blk = sdata->blk;
+    alias->size = sdata->size;
+    alias->alias = 1;
+    alias->offset = sdata->size / 2;
+
+    stream_flags = 0;
+    if ( fcntl_flags & O_NONBLOCK ) stream_flags = MEMSTREAM_ATTR_NONBLOCK;
+    if ( fcntl_flags & DM_BYPASS_FCNTL_RECORD ) 
+	stream_flags |= MEMSTREAM_ATTR_RECORD;
+    if ( fcntl_flags & DM_BYPASS_FCNTL_BUSY_POLL ) 
+	stream_flags |= MEMSTREAM_ATTR_BUSY_POLL;
+    if ( stream_flags ) {
+	memstream_control ( pair[0], &stream_flags, 0 );
+	memstream_control ( pair[1], &stream_flags, 0 );
+    }
+    if ( nexus->poll_usec ) 
+	memstream_set_busy_poll ( pair[0], nexus->poll_usec );
+    if ( section_sizing.wake[0] || section_sizing.wake[1] )
+	memstream_set_wake_marks ( pair[1], section_sizing.wake[0],
+	    section_sizing.wake[1], section_sizing.wake[2] );
+
+    nexus->wstream_mem = is_requester ? sdata : alias;
+    nexus->rstream_mem = is_requester ? alias : sdata;
+    nexus->wstream = pair[1];
+    nexus->rstream = pair[0];
+    publish_stream ( nexus->wstream_mem, &nexus->lock, pair[1], 1, 0 );
+    publish_stream ( nexus->rstream_mem, &nexus->lock, pair[0], 0, 0 );
+
+    return flags | 6;			/* bypass both directions */
+}
 /*
  * The negotiate_bypass function is called while lock is held in PW mode, 
  * any changes to the lock value block will be written back and thus 
@@ -980,7 +1381,7 @@ static int negotiate_bypass ( int flags, dm_bypass bp, const char *op,
     struct dm_lksb *lksb;
     struct dm_nexus *nexus;
     struct dm_lksb_valblk_unit *my_val, *peer_val;
-    int status, action, will_write;
+    int status, action, will_write, duplex;
 
     nexus = bp->nexus;
     lock = &nexus->lock;
@@ -1030,6 +1431,18 @@ static int negotiate_bypass ( int flags, dm_bypass bp, const char *op,
 	    /* already have the stream */
 	    peer_val->flags.bit.peer_ack = 1;
 
+	} else if ( peer_val->flags.bit.duplex && !nexus->rstream && 
+		!nexus->wstream ) {
+	    /*
+	     * Peer's section holds both directions, take the other half.
+	     */
+	    lock->stream_id = peer_val->flags.bit.stream_id;
+	    flags = begin_duplex ( flags, 0, nexus, fcntl_flags,
+		peer_val->flags.bit.size_shift ?
+		(1 << peer_val->flags.bit.size_shift) : 
+		DMPIPE_MEMSTREAM_BLK_SIZE );
+
+	    peer_val->flags.bit.peer_ack = 1;
 	} else {
 	    /*
 	     * Create stream to complement peer's request
@@ -1037,11 +1450,16 @@ static int negotiate_bypass ( int flags, dm_bypass bp, const char *op,
 	    lock->stream_id = peer_val->flags.bit.stream_id;
 	    flags = begin_stream ( flags, 
 		1^peer_val->flags.bit.will_write, /* flip 1->0, 0->1 */
-		nexus, fcntl_flags );
+		nexus, fcntl_flags, peer_val->flags.bit.size_shift ?
+		(1 << peer_val->flags.bit.size_shift) : 
+		DMPIPE_MEMSTREAM_BLK_SIZE );
 
 	    peer_val->flags.bit.peer_ack = 1;
 	}
     }
+    if ( (action & 2) && nexus->rstream && nexus->wstream ) {
+	action &= ~1;		/* peer's duplex section gave us our stream */
+    }
     if ( action & 1 ) {
 	/*
 	 * Prospectively create a stream and solicit a peer.
@@ -1051,9 +1469,16 @@ static int negotiate_bypass ( int flags, dm_bypass bp, const char *op,
 	else my_val->flags.bit.stream_id++;
 	lock->stream_id = my_val->flags.bit.stream_id;
 
-	flags = begin_stream ( flags, will_write, nexus, fcntl_flags );
+	duplex = (fcntl_flags & DM_BYPASS_FCNTL_DUPLEX) && 
+		!nexus->rstream && !nexus->wstream;
+	if ( duplex ) flags = begin_duplex ( flags, 1, nexus, fcntl_flags,
+		nexus->pipe_size );
+	else flags = begin_stream ( flags, will_write, nexus, fcntl_flags,
+		nexus->pipe_size );
+	my_val->flags.bit.size_shift = section_size_shift ( nexus->pipe_size );
 	my_val->flags.bit.connect_request = 1;
 	my_val->flags.bit.will_write = will_write;
+	my_val->flags.bit.duplex = duplex;
 	/*
 	 * Stall to let peer show up and/or answer request.
 	 */
@@ -1602,7 +2027,9 @@ dmpipe_trace = 0;
  */
 int dm_bypass_shutdown ( dm_bypass bp )
 {
+    LIST_LOCK ( nexus_list_lock );
     if ( bp->nexus ) unlink_nexus ( bp->nexus );
+    LIST_UNLOCK ( nexus_list_lock );
     bp->nexus = 0;
 
     free ( bp );
@@ -1641,6 +2068,64 @@ int dm_bypass_write ( dm_bypass bp, const void *buffer, size_t nbytes )
 {
     return memstream_write ( bp->nexus->wstream, buffer, nbytes );
 }
+int dm_bypass_call ( dm_bypass bp, const void *request, size_t reqlen,
+	void *reply, size_t replysize )
+{
+    int doesnt_care;
+    if ( !bp->nexus->rstream || !bp->nexus->wstream ) {
+	errno = EINVAL;
+	return -1;
+    }
+    return memstream_call ( bp->nexus->wstream, request, reqlen,
+	bp->nexus->rstream, reply, replysize, 1, &doesnt_care );
+}
+/*
+ * Vector versions.  The alternate (mailbox) read path has no scatter
+ * support, so fill the first non-empty buffer, a short read is legal.
+ */
+int dm_bypass_readv ( dm_bypass bp, const struct iovec *iov, int iovcnt,
+	size_t min_bytes, int *expedite_flag )
+{
+    int doesnt_care, i;
+    if ( bp->nexus->rstream ) {
+	return memstream_readv ( bp->nexus->rstream, iov, iovcnt, min_bytes,
+		expedite_flag ? expedite_flag : &doesnt_care );
+    }
+    if ( bp->nexus->alt.buffer ) {
+	for ( i = 0; (i < iovcnt) && (iov[i].iov_len == 0); i++ );
+	if ( i >= iovcnt ) return 0;
+	return alternate_bypass_read ( bp->nexus, iov[i].iov_base, 
+		iov[i].iov_len, iov[i].iov_len < min_bytes ? 
+		iov[i].iov_len : min_bytes,
+		expedite_flag ? expedite_flag : &doesnt_care );
+    }
+    return -1;
+}
+int dm_bypass_writev ( dm_bypass bp, const struct iovec *iov, int iovcnt )
+{
+    return memstream_writev ( bp->nexus->wstream, iov, iovcnt );
+}
+/*
+ * Record read.  The alternate path returns whatever the next mailbox read
+ * delivers.
+ */
+int dm_bypass_read_record ( dm_bypass bp, void *buffer, size_t bufsize,
+	const void **record )
+{
+    int doesnt_care, count;
+    if ( bp->nexus->rstream ) {
+	return memstream_read_record ( bp->nexus->rstream, buffer, bufsize,
+		record, &doesnt_care );
+    }
+    *record = 0;
+    if ( bp->nexus->alt.buffer ) {
+	count = alternate_bypass_read ( bp->nexus, buffer, bufsize, 1,
+		&doesnt_care );
+	if ( count > 0 ) *record = buffer;
+	return count;
+    }
+    return -1;
+}
 /*
  * Give direct access to memstream for polling.
  */
@@ -1655,9 +2140,85 @@ int dm_bypass_current_streams ( dm_bypass bp,
     return -1;   /* invalid */
 }
 
+/*
+ * Set size of shared memory section for bypassed pipe (rounded up to a
+ * power of 2 pages).  Applies to streams started later and moves an
+ * existing write stream to a section of the new size.  The reading side 
+ * of an established stream can't change it.  Return new size or -1.
+ */
+long long dm_bypass_set_pipe_size ( dm_bypass bp, long long size )
+{
+    struct dm_nexus *nexus;
+    int status;
+
+    nexus = bp->nexus;
+    if ( (size <= 0) || (size > DMPIPE_MEMSTREAM_MAX_SIZE) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    size = 1LL << section_size_shift ( size );
+    if ( nexus->wstream ) {
+	status = memstream_resize ( nexus->wstream, size );
+	if ( status < 0 ) return -1;
+    } else if ( nexus->rstream ) {
+	errno = EBUSY;		/* only writer can move stream */
+	return -1;
+    }
+    nexus->pipe_size = size;
+    return size;
+}
+
+long long dm_bypass_get_pipe_size ( dm_bypass bp )
+{
+    struct dm_nexus *nexus;
+
+    nexus = bp->nexus;
+    if ( nexus->wstream_mem ) return nexus->wstream_mem->size;
+    if ( nexus->rstream_mem ) return nexus->rstream_mem->size;
+    return nexus->pipe_size;
+}
+/*
+ * Set busy poll budget of read stream, now or when it starts.  Polling
+ * itself is turned on by DM_O_BUSY_POLL (memstream attribute).
+ */
+int dm_bypass_set_busy_poll ( dm_bypass bp, int usec )
+{
+    struct dm_nexus *nexus;
+
+    nexus = bp->nexus;
+    if ( usec < 0 ) {
+	errno = EINVAL;
+	return -1;
+    }
+    nexus->poll_usec = usec;
+    if ( nexus->rstream ) 
+	return memstream_set_busy_poll ( nexus->rstream, usec );
+    return 0;
+}
+/*
+ * Copy stream statistics out, caller's blocks are left alone for streams
+ * that aren't started.
+ */
+int dm_bypass_get_statistics ( dm_bypass bp, struct memstream_stats *rstats,
+	struct memstream_stats *wstats )
+{
+    struct dm_nexus *nexus;
+    int valid;
+
+    nexus = bp->nexus;
+    valid = 0;
+    if ( nexus->rstream_mem ) {
+	*rstats = *stream_statistics ( nexus->rstream_mem );
+	valid |= 1;
+    }
+    if ( nexus->wstream_mem ) {
+	*wstats = *stream_statistics ( nexus->wstream_mem );
+	valid |= 2;
+    }
+    return valid;
+}
 /*
 * Check to see if peer closed its stream.
-*/
 int is_dm_bypass_peer_done(dm_bypass bp)
 {
 int ret_val = 0;
@@ -1678,3 +2239,153 @@ else
    }
 return ret_val;
 }
+/**************************************************************************/
+/* Broadcast (tee) sections.  A named section not tied to a pipe device
+ * that one writer opens and up to 16 readers attach to, each reader
+ * getting its own copy of the data written after it attached.  The
+ * lock on DMPIPE_TEE_<name> is held in PW mode while the section is
+ * mapped and the memstream created, so the first process to arrive
+ * initializes the commbuf.  The writer records its PID in the lock value
+ * block to keep out a second writer.
+ */
+#define DM_TEE_LOCK_PREFIX "DMPIPE_TEE_"
+struct dm_bypass_tee_ctx {
+    struct dm_lock lock;
+    struct dm_stream_data *sdata;
+    memstream stream;
+    int is_writer;
+};
+
+static dm_bypass_tee begin_tee ( const char *name, int is_writer, 
+	int stream_flags )
+{
+    struct dm_bypass_tee_ctx *tee;
+    int status, prev_format;
+
+    if ( strlen ( name ) >= 
+	(DM_NEXUS_NAME_SIZE - sizeof(DM_TEE_LOCK_PREFIX)) ) {
+	errno = EINVAL;
+	return 0;
+    }
+    tee = calloc ( sizeof(struct dm_bypass_tee_ctx), 1 );
+    if ( !tee ) return tee;
+    tee->is_writer = is_writer;
+    strcpy ( tee->lock.resnam, DM_TEE_LOCK_PREFIX );
+    strcat ( tee->lock.resnam, name );
+    tee->lock.ef = EFN$C_ENF;
+    /*
+     * Lock out other openers while we map and possibly initialize.  A 
+     * writer that died holding the lock leaves the value block invalid.
+     */
+    status = sys_enq ( LCK$K_PWMODE, &tee->lock, 0, 0, 0 );
+    if ( status == SS$_VALNOTVALID ) {
+	/* Granted with warning, sys_enq didn't record it */
+	tee->lock.lock_id = tee->lock.lksb.id;
+	tee->lock.state = LCK$K_PWMODE;
+	memset ( tee->lock.lksb.val, 0, sizeof(tee->lock.lksb.val) );
+	status = SS$_NORMAL;
+    }
+    if ( (status&1) == 0 ) {
+	free ( tee );
+	errno = EVMSERR;
+	vaxc$errno = status;
+	return 0;
+    }
+    tee->lock.my_val = &tee->lock.lksb.val[0];
+    if ( is_writer && tee->lock.my_val->pid ) {
+	status = SS$_DUPLNAM;		/* already has a writer */
+	errno = EBUSY;
+    } else {
+	tee->sdata = alloc_stream_data ( DMPIPE_MEMSTREAM_BLK_SIZE );
+	if ( tee->sdata ) status = sys_crmpsc_gpfile ( &tee->lock, 0, 
+		tee->sdata );
+	else status = SS$_INSFMEM;
+	if ( status&1 ) {
+	    prev_format = memstream_set_format ( MEMSTREAM_FORMAT_TEE );
+	    tee->stream = memstream_create ( tee->sdata->blk, 
+		tee->sdata->size, is_writer );
+	    memstream_set_format ( prev_format );
+	    if ( !tee->stream ) {
+		free_stream_data ( tee->sdata, 1 );
+		status = SS$_INSFMEM;		/* no reader slot free */
+		errno = EMFILE;
+	    } 
+	} else if ( tee->sdata ) {
+	    free_stream_data ( tee->sdata, 0 );
+	    errno = EVMSERR;
+	    vaxc$errno = status;
+	} else errno = ENOMEM;
+    }
+    if ( (status&1) == 0 ) {
+	SYS$DEQ ( tee->lock.lksb.id, 0, 0, 0 );
+	free ( tee );
+	return 0;
+    }
+    if ( stream_flags ) memstream_control ( tee->stream, &stream_flags, 0 );
+    publish_stream ( tee->sdata, &tee->lock, tee->stream, is_writer, 1 );
+    if ( is_writer ) tee->lock.my_val->pid = getpid();
+    /*
+     * Lower lock to write back value block and let others in.
+     */
+    sys_enq ( LCK$K_CRMODE, &tee->lock, 0, 0, 0 );
+    return tee;
+}
+
+dm_bypass_tee dm_bypass_tee_open ( const char *name, int flags )
+{
+    return begin_tee ( name, 1, 
+	(flags&DM_BYPASS_TEE_DROP) ? MEMSTREAM_ATTR_DROP : 0 );
+}
+
+dm_bypass_tee dm_bypass_tee_attach ( const char *name )
+{
+    return begin_tee ( name, 0, 0 );
+}
+
+int dm_bypass_tee_write ( dm_bypass_tee tee, const void *buffer, 
+	size_t nbytes )
+{
+    if ( !tee->is_writer ) {
+	errno = EBADF;
+	return -1;
+    }
+    return memstream_write ( tee->stream, buffer, nbytes );
+}
+/*
+ * Read returns 0 once the writer has closed and we have read everything,
+ * -1 with errno EIO if the writer dropped us for lagging.
+ */
+int dm_bypass_tee_read ( dm_bypass_tee tee, void *buffer, size_t nbytes )
+{
+    int count, doesnt_care;
+
+    if ( tee->is_writer ) {
+	errno = EBADF;
+	return -1;
+    }
+    do {
+	count = memstream_read ( tee->stream, buffer, nbytes, 1, 
+		&doesnt_care );
+    } while ( (count == 0) && doesnt_care );	/* writer flushed */
+    if ( (count < 0) && (errno == EPIPE) ) count = 0;
+    return count;
+}
+
+int dm_bypass_tee_close ( dm_bypass_tee tee )
+{
+    int status;
+
+    if ( tee->is_writer ) memstream_flush ( tee->stream );
+    memstream_close ( tee->stream );
+    memstream_destroy ( tee->stream );
+    status = free_stream_data ( tee->sdata, 1 );
+    /*
+     * Let another writer open the tee.
+     */
+    if ( sys_enq ( LCK$K_PWMODE, &tee->lock, 0, 0, 0 ) & 1 ) {
+	if ( tee->is_writer ) tee->lock.my_val->pid = 0;
+	SYS$DEQ ( tee->lock.lksb.id, &tee->lock.lksb.val, 0, 0 );
+    } else SYS$DEQ ( tee->lock.lksb.id, 0, 0, 0 );
+    free ( tee );
+    return (status&1) ? 0 : -1;
+}
@@ -32,6 +32,35 @@ int dm_bypass_negotiate (int initial_flags, dm_bypass bp, char *op, int bytes);
 int dm_bypass_read(dm_bypass bp, void *buffer, size_t nbytes, 
 	size_t min_bytes, int *expedite_flag );
 int dm_bypass_write ( dm_bypass bp, const void *buffer, size_t nbytes );
+int dm_bypass_readv ( dm_bypass bp, const struct iovec *iov, int iovcnt,
+	size_t min_bytes, int *expedite_flag );
+int dm_bypass_writev ( dm_bypass bp, const struct iovec *iov, int iovcnt );
+int dm_bypass_read_record ( dm_bypass bp, void *buffer, size_t bufsize,
+	const void **record );
+#define DM_BYPASS_FCNTL_RECORD 0x00800000	/* DM_O_RECORD in dmpipe.h */
+#define DM_BYPASS_FCNTL_DUPLEX 0x00400000	/* DM_O_DUPLEX in dmpipe.h */
+#define DM_BYPASS_FCNTL_BUSY_POLL 0x00200000	/* DM_O_BUSY_POLL */
+/*
+ * Write request and wait for reply, both streams must be established.
+ */
+int dm_bypass_call ( dm_bypass bp, const void *request, size_t reqlen,
+	void *reply, size_t replysize );
+/*
+ * Size of shared memory section used by pipe's streams, see DM_F_SETPIPE_SZ
+ * in dmpipe.h.
+ */
+long long dm_bypass_set_pipe_size ( dm_bypass bp, long long size );
+long long dm_bypass_get_pipe_size ( dm_bypass bp );
+/*
+ * Busy poll budget for read stream, see DM_F_SETBUSY_POLL in dmpipe.h.
+ */
+int dm_bypass_set_busy_poll ( dm_bypass bp, int usec );
+/*
+ * Copy statistics of bypass's streams, return mask of those copied: <0>
+ * read stream, <1> write stream.
+ */
+int dm_bypass_get_statistics ( dm_bypass bp, struct memstream_stats *rstats,
+	struct memstream_stats *wstats );
 int is_dm_bypass_peer_done(dm_bypass bp);
 /*
  * dm_bypass_stderr_propagate() is called by parent to convey its stderr
@@ -47,6 +76,20 @@ int dm_bypass_stderr_recover(pid_t parent, dm_bypass stdout_bp);
  */
 int dm_bypass_current_streams ( dm_bypass bp, 
 	memstream *rstream, memstream *wstream  );
+/*
+ * Broadcast (tee) sections, named shared memory one writer opens and 
+ * several readers attach to, each reading everything written after it
+ * attached.  Writer waits for slowest reader unless DM_BYPASS_TEE_DROP
+ * is set, then readers too far behind are dropped and fail with EIO.
+ */
+typedef struct dm_bypass_tee_ctx *dm_bypass_tee;   /* opaque type */
+#define DM_BYPASS_TEE_DROP 1		/* DM_TEE_DROP_LAGGING in dmpipe.h */
+dm_bypass_tee dm_bypass_tee_open ( const char *name, int flags );
+dm_bypass_tee dm_bypass_tee_attach ( const char *name );
+int dm_bypass_tee_write ( dm_bypass_tee tee, const void *buffer, 
+	size_t nbytes );
+int dm_bypass_tee_read ( dm_bypass_tee tee, void *buffer, size_t nbytes );
+int dm_bypass_tee_close ( dm_bypass_tee tee );
 /*
  * Callback function for C$DOPRINT family of routines.
  */
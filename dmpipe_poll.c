@@ -60,6 +60,11 @@ static struct {
  * in the fildes array passed to us.
  */
 static unsigned int dm_last_incarnation = 0;
+/*
+ * All persistent poll sets, so a track being run down can be taken out of
+ * any set still holding it.
+ */
+static struct dm_poll_set *known_sets = 0;
 /*
  * Cleanup and dispose of poll_track block allocated by create_track.
  */
@@ -366,12 +371,15 @@ static int tty_cancel ( dm_poll_track pt )
     return 0;
 }
 /*
- * DMPIPE bypass streams.
+ * DMPIPE bypass streams.  The query arms notification on each stream it
+ * found nothing on (always for the read stream, for the write stream only
+ * if POLLOUT wanted) so the peer's next read or write wakes us, and notes
+ * which ones in pt->armed for bypass_signalled().
  */
 static int bypass_query ( dm_poll_track pt )
 {
     memstream rstream, wstream;
-    int status, count, state, pending_bytes, available_space;
+    int status, count, state, pending_bytes, available_space, want_out;
     struct pollfd *pblk;
     /*
      * drill past bypass layer to get directly to memstream objects for
@@ -384,6 +392,7 @@ TTYPRINT "/poll/ bypass query for fd[%d]\n", pt->fd );
 
     pblk = pt->filedes;
     count = 0;
+    pt->armed = 0;
     if ( rstream ) {
 	memstream_query(rstream, &state, &pending_bytes, &available_space,1);
 #ifdef DEBUG
@@ -397,7 +406,7 @@ available_space );
 	else if ( (state == MEMSTREAM_STATE_WRITER_DONE) ||
 		(state == MEMSTREAM_STATE_CLOSED) ) {
 	    nonmaskable_event ( pt, POLLHUP, DM_POLL_SELECT_EXCEPT, &count );
-	}
+	} else if ( memstream_armed ( rstream ) ) pt->armed |= 1;
     } else {
 	/* report error/hup if polling for readablity */
 /*
@@ -409,7 +418,10 @@ available_space );
     }
 
     if ( wstream ) {
-	memstream_query(wstream, &state, &pending_bytes, &available_space,0);
+	want_out = pblk ? (pblk->events & POLLOUT) : 
+		(pt->select_mask & DM_POLL_SELECT_WRITE);
+	memstream_query(wstream, &state, &pending_bytes, &available_space,
+		want_out ? 1 : 0);
 
 	if ( (state == MEMSTREAM_STATE_READER_DONE) ||
 		(state == MEMSTREAM_STATE_CLOSED) ) 
@@ -417,6 +429,7 @@ available_space );
 
 	if ( available_space > 0 ) 
 	    maskable_event ( pt, POLLOUT, DM_POLL_SELECT_WRITE, &count );
+	else if ( want_out && memstream_armed ( wstream ) ) pt->armed |= 2;
     } else {
 	/* report error/hup if polling for writeablity */
 /*
@@ -426,6 +439,22 @@ available_space );
 
     return count;
 }
+/*
+ * Return true if a peer has acted on a stream bypass_query armed, meaning
+ * the member must be queried again.  Members with nothing armed can't be
+ * signalled and are left to the periodic rescan.
+ */
+static int bypass_signalled ( dm_poll_track pt )
+{
+    memstream rstream, wstream;
+
+    if ( 0 > dm_bypass_current_streams (pt->bp, &rstream, &wstream)) return 1;
+    if ( (pt->armed & 1) && (!rstream || !memstream_armed ( rstream )) )
+	return 1;
+    if ( (pt->armed & 2) && (!wstream || !memstream_armed ( wstream )) )
+	return 1;
+    return 0;
+}
 static int bypass_cancel ( dm_poll_track pt )
 {
 
@@ -574,6 +603,19 @@ int dm_poll_rundownn_track (dm_poll_track *pt_ptr )
     }
     if ( !cur ) return -1;
     *pt_ptr = 0;		/* Zero for caller */
+    /*
+     * Drop from poll sets, fd is going away.
+     */
+    if ( pt->sets > 0 ) {
+	struct dm_poll_set *set;
+	struct dm_poll_set_member *member, *next;
+	for ( set = known_sets; set; set = set->next_set ) {
+	    for ( member = set->first; member; member = next ) {
+		next = member->next;
+		if ( member->pt == pt ) dm_poll_set_remove ( set, member );
+	    }
+	}
+    }
     /*
      * Dispose of block using common routine called by exit handler.
      */
@@ -674,6 +716,27 @@ int dm_poll_group_add_selectfd ( struct dm_poll_group *group, int fd,
     return 0;;
 }
 
+/*
+ * Hibernate, waking after period (delta time) if it is set.  The period is
+ * timed with a timer request of our own, identified by the period's
+ * address, rather than $SCHDWK, whose $CANWAK would also cancel wakeups
+ * the application scheduled.
+ */
+static void period_wake ( void *period )
+{
+    SYS$WAKE ( 0, 0 );
+}
+static void hiber_period ( long long *period )
+{
+    int status;
+
+    status = 0;
+    if ( period ) status = SYS$SETIMR ( EFN$C_ENF, period, period_wake, 
+	period, 0 );
+    SYS$HIBER();
+    if ( status&1 ) SYS$CANTIM ( period, 0 );
+}
+
 static void scan_timeout ( void *group_vp )
 {
     struct dm_poll_group *group;
@@ -684,11 +747,18 @@ static void scan_timeout ( void *group_vp )
 /*
  * Do the guts of the poll() function.  Return value is number of events
  * or -1.
+ *
+ * Bypassed streams are armed by their query, so the peer wakes us when
+ * there is something to see and we hibernate without a poll period;
+ * after a wake only the members whose armed streams were touched are
+ * queried again.  Devices with no wake mechanism (mailboxes, terminals,
+ * sockets, X11) and bypass members that couldn't be armed still need the
+ * poll_period rescan, which covers every such member.
  */
 int dm_poll_scan_group ( struct dm_poll_group *group )
 {
     dm_poll_track pt;
-    int status, count, timer_armed;
+    int status, count, timer_armed, periodic, rescan;
     long long timeout_time, start_time, now;
     /*
      * Outer loop, repeat until timout
@@ -712,18 +782,26 @@ TTYPRINT "/poll/ scan_group, timer: %d (exp:%d), first_mem: %x\n",
 timer_armed, group->timeout_expired, group->first_member );
 #endif
 
+    rescan = 0;
     do {
 	/*
-	 * Do a device scan and note positive results.
+	 * Do a device scan and note positive results.  On rescans, skip
+	 * bypass members still waiting for their peer.
 	 */
+	periodic = 0;
 	for ( pt = group->first_member; pt; pt = pt->next_member ) {
 	    if ( !pt->device_query ) continue;
+	    if ( rescan && (pt->dev_type == DMPIPE_POLL_DEV_BYPASS) &&
+		pt->armed && !bypass_signalled ( pt ) ) continue;
 	    status = pt->device_query ( pt );
-	    if ( status < 0 ) break;
+	    if ( (pt->dev_type != DMPIPE_POLL_DEV_BYPASS) || !pt->armed )
+		periodic = 1;
+	    if ( status < 0 ) { periodic = 1; break; }
 	    else if ( status > 0 ) count++;
 	}
 	/*
-	 * Stall for poll_period delay if wait not over.
+	 * Stall until woken by a peer, the timeout, or the poll_period
+	 * delay if some member needs it.
 	 */
 	if ( count == 0 ) {
 	    if ( !timer_armed ) {
@@ -746,8 +824,10 @@ timer_armed, group->timeout_expired, group->first_member );
 		if ((status&1) == 0 ) group->timeout_expired = 1;
 		timer_armed = 1;
 	    }
-	    SYS$SCHDWK ( 0, 0, &group->poll_period, 0 );
-	    SYS$HIBER();
+	    if ( !group->timeout_expired ) {
+		hiber_period ( periodic ? &group->poll_period : 0 );
+	    }
+	    rescan = 1;
 	}
     } while ( (count == 0) && !group->timeout_expired );
     /*
@@ -775,3 +855,239 @@ int dm_poll_group_end ( struct dm_poll_group *group )
     }
     return -1;
 }
+/*********************************************************************/
+/*
+ * Persistent poll sets.  The check list holds members to query first on
+ * the next scan: newly added or modified ones and those last found ready.
+ * Members reported go to the end of the list, after those a full report
+ * left unqueried, and the sweep of the other members resumes where the 
+ * last one stopped, so when more are ready than a wait may report each
+ * gets its turn (round robin).
+ */
+static void check_enqueue ( struct dm_poll_set *set, 
+	struct dm_poll_set_member *member )
+{
+    if ( member->queued ) return;
+    member->queued = 1;
+    member->check_next = 0;
+    member->check_prev = set->check_last;
+    if ( set->check_last ) set->check_last->check_next = member;
+    else set->check_first = member;
+    set->check_last = member;
+}
+static void check_dequeue ( struct dm_poll_set *set, 
+	struct dm_poll_set_member *member )
+{
+    if ( !member->queued ) return;
+    member->queued = 0;
+    if ( member->check_prev ) member->check_prev->check_next = 
+	member->check_next;
+    else set->check_first = member->check_next;
+    if ( member->check_next ) member->check_next->check_prev = 
+	member->check_prev;
+    else set->check_last = member->check_prev;
+}
+
+struct dm_poll_set *dm_poll_set_create ( void )
+{
+    struct dm_poll_set *set;
+
+    set = calloc ( sizeof(struct dm_poll_set), 1 );
+    if ( !set ) return set;
+    set->poll_period = (-10000) * POLL_PERIOD_MSEC;
+    set->next_set = known_sets;
+    known_sets = set;
+    return set;
+}
+
+int dm_poll_set_destroy ( struct dm_poll_set *set )
+{
+    struct dm_poll_set **link;
+
+    for ( link = &known_sets; *link && (*link != set); 
+	link = &(*link)->next_set );
+    if ( !*link ) {
+	errno = EINVAL;		/* not a set we made */
+	return -1;
+    }
+    *link = set->next_set;
+    while ( set->first ) dm_poll_set_remove ( set, set->first );
+    free ( set );
+    return 0;
+}
+
+struct dm_poll_set_member *dm_poll_set_find 
+	( struct dm_poll_set *set, int fd )
+{
+    struct dm_poll_set_member *member;
+
+    for ( member = set->first; member; member = member->next ) {
+	if ( member->pt->fd == fd ) break;
+    }
+    return member;
+}
+
+int dm_poll_set_add ( struct dm_poll_set *set, dm_poll_track pt, 
+	int events, unsigned long long data )
+{
+    struct dm_poll_set_member *member;
+
+    member = calloc ( sizeof(struct dm_poll_set_member), 1 );
+    if ( !member ) {
+	errno = ENOMEM;
+	return -1;
+    }
+    member->pt = pt;
+    member->pfd.fd = pt->fd;
+    member->pfd.events = events;
+    member->data = data;
+    member->prev = set->last;
+    if ( set->last ) set->last->next = member;
+    else set->first = member;
+    set->last = member;
+    set->member_count++;
+    pt->sets++;
+    check_enqueue ( set, member );	/* query on next wait */
+    return 0;
+}
+
+int dm_poll_set_modify ( struct dm_poll_set *set, 
+	struct dm_poll_set_member *member, int events, unsigned long long data )
+{
+    member->pfd.events = events;
+    member->data = data;
+    check_enqueue ( set, member );
+    return 0;
+}
+
+int dm_poll_set_remove ( struct dm_poll_set *set, 
+	struct dm_poll_set_member *member )
+{
+    check_dequeue ( set, member );
+    if ( set->sweep == member ) set->sweep = member->next;
+    if ( member->prev ) member->prev->next = member->next;
+    else set->first = member->next;
+    if ( member->next ) member->next->prev = member->prev;
+    else set->last = member->prev;
+    set->member_count--;
+    member->pt->sets--;
+    if ( member->pt->filedes == &member->pfd ) member->pt->filedes = 0;
+    free ( member );
+    return 0;
+}
+
+static void set_timeout ( void *set_vp )
+{
+    struct dm_poll_set *set;
+    set = set_vp;
+    set->timeout_expired = 1;
+    SYS$WAKE ( 0, 0 );
+}
+/*
+ * Query one member, adding it to the report list if ready (the wait
+ * requeues reported members when done).  Note if it needs the periodic
+ * rescan.  Return value as for device query functions.
+ */
+static int scan_set_member ( struct dm_poll_set *set, 
+	struct dm_poll_set_member *member, int *periodic,
+	struct dm_poll_set_member ***report_tail )
+{
+    dm_poll_track pt;
+    int status;
+
+    pt = member->pt;
+    member->generation = set->generation;
+    member->pfd.revents = 0;
+    pt->filedes = &member->pfd;
+    pt->select_mask = 0;
+    status = pt->device_query ( pt );
+    if ( (pt->dev_type != DMPIPE_POLL_DEV_BYPASS) || !pt->armed ||
+	(status < 0) ) *periodic = 1;
+    if ( status > 0 ) {
+	member->next_report = 0;
+	**report_tail = member;
+	*report_tail = &member->next_report;
+    }
+    return status;
+}
+/*
+ * Wait for members of set to become ready, returning count of ready
+ * members (at most max_ready) linked through next_report.  Each scan
+ * queries the check list, then the bypass members bypass_signalled()
+ * says a peer has touched and any other devices, so with only bypass
+ * members the queries done are proportional to the number of active
+ * pipes.  Waiting is as for dm_poll_scan_group.
+ */
+int dm_poll_set_wait ( struct dm_poll_set *set, int timeout, int max_ready,
+	struct dm_poll_set_member **ready )
+{
+    struct dm_poll_set_member *member, *next, **report_tail;
+    dm_poll_track pt;
+    int status, count, periodic, timer_set, i;
+    long long start_time, now, timeout_time;
+
+    *ready = 0;
+    report_tail = ready;
+    count = 0;
+    timer_set = 0;
+    set->timeout_expired = (timeout == 0);
+    if ( timeout > 0 ) SYS$GETTIM ( &start_time );
+
+    for ( ;; ) {
+	periodic = 0;
+	set->generation++;
+	/*
+	 * Take over the check list, ones we can't report stay queued.
+	 */
+	member = set->check_first;
+	set->check_first = set->check_last = 0;
+	for ( ; member; member = next ) {
+	    next = member->check_next;
+	    member->queued = 0;
+	    if ( !member->pt->device_query ) continue;
+	    if ( count >= max_ready ) check_enqueue ( set, member );
+	    else if ( scan_set_member ( set, member, &periodic, 
+		&report_tail ) > 0 ) count++;
+	}
+	/*
+	 * Sweep rest of members once around from the saved position, armed
+	 * bypass members are skipped unless their peer has acted on them.
+	 */
+	member = set->sweep ? set->sweep : set->first;
+	for ( i = 0; member && (i < set->member_count) && 
+		(count < max_ready); i++ ) {
+	    pt = member->pt;
+	    next = member->next ? member->next : set->first;
+	    if ( !member->queued && pt->device_query &&
+		(member->generation != set->generation) &&
+		((pt->dev_type != DMPIPE_POLL_DEV_BYPASS) || !pt->armed ||
+		bypass_signalled ( pt )) && 
+		(scan_set_member ( set, member, &periodic, &report_tail ) > 0) )
+		count++;
+	    member = next;
+	}
+	set->sweep = member;
+	if ( (count > 0) || set->timeout_expired ) break;
+	/*
+	 * Nothing ready, arm timeout on first pass and wait for a wake.
+	 */
+	if ( (timeout > 0) && !timer_set ) {
+	    SYS$GETTIM ( &now );
+	    timeout_time = (now - start_time) + (-10000LL * timeout);
+	    if ( timeout_time < 0 ) status = SYS$SETIMR ( EFN$C_ENF, 
+		&timeout_time, set_timeout, set, 0 );
+	    else status = SS$_TIMEOUT;
+	    if ( (status&1) == 0 ) break;
+	    timer_set = 1;
+	}
+	hiber_period ( periodic ? &set->poll_period : 0 );
+    }
+
+    if ( timer_set && !set->timeout_expired ) SYS$CANTIM ( set, 0 );
+    /*
+     * Requeue reported members behind the ones left unqueried.
+     */
+    for ( member = *ready; member; member = member->next_report )
+	check_enqueue ( set, member );
+    return count;
+}
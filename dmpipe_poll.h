@@ -41,6 +41,9 @@ struct dm_poll_extension {
     int select_event;		/* Filled in during scan */
     struct pollfd *filedes;	/* points into poll() call arrray to allowed
 				   update of revents */
+    int armed;			/* bypass streams left armed by query,
+				   1-read, 2-write */
+    int sets;			/* number of poll sets holding track */
     char device_name[32];
     dm_device_query_function device_query;	/* device-specific poll */
     dm_device_cancel_function device_cancel;	/* device-specific poll */
@@ -99,5 +102,46 @@ int dm_poll_group_add_selectfd
 int dm_poll_scan_group ( struct dm_poll_group *group );
 
 int dm_poll_group_end ( struct dm_poll_group *group );
+/*
+ * Persistent poll sets (dm_epoll).  Members stay registered between waits,
+ * so classification and startup are done once.  Bypass members stay armed
+ * between waits and are only queried again once their peer has touched
+ * them; members found ready go on the check list, which is queried first
+ * on the next wait (level triggered).  Other devices are queried on every
+ * scan with the poll_period rescan.
+ */
+struct dm_poll_set_member {
+    struct dm_poll_set_member *next, *prev;	/* interest list */
+    struct dm_poll_set_member *check_next, *check_prev;
+    struct dm_poll_set_member *next_report;	/* wait's result list */
+    int queued;			/* on check list */
+    unsigned int generation;	/* set's scan it was last queried in */
+    dm_poll_track pt;
+    struct pollfd pfd;		/* events wanted, revents of last query */
+    unsigned long long data;	/* caller's cookie */
+};
+struct dm_poll_set {
+    struct dm_poll_set *next_set;		/* list of all sets */
+    struct dm_poll_set_member *first, *last;
+    struct dm_poll_set_member *check_first, *check_last;
+    struct dm_poll_set_member *sweep;	/* where next sweep starts */
+    int member_count;
+    unsigned int generation;	/* counts scans */
+    int timeout_expired;
+    long long poll_period;	/* VMS delta time */
+};
+
+struct dm_poll_set *dm_poll_set_create ( void );
+int dm_poll_set_destroy ( struct dm_poll_set *set );
+struct dm_poll_set_member *dm_poll_set_find 
+	( struct dm_poll_set *set, int fd );
+int dm_poll_set_add ( struct dm_poll_set *set, dm_poll_track pt, 
+	int events, unsigned long long data );
+int dm_poll_set_modify ( struct dm_poll_set *set, 
+	struct dm_poll_set_member *member, int events, unsigned long long data );
+int dm_poll_set_remove ( struct dm_poll_set *set, 
+	struct dm_poll_set_member *member );
+int dm_poll_set_wait ( struct dm_poll_set *set, int timeout, int max_ready,
+	struct dm_poll_set_member **ready );
 
 #endif
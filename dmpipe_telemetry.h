@@ -0,0 +1,35 @@
+#ifndef DMPIPE_TELEMETRY_H
+#define DMPIPE_TELEMETRY_H
+/*
+ * Telemetry page, a global section each process using dmpipe maps to
+ * publish its streams.  A process claims a slot for every memstream it
+ * starts and keeps the stream's statistics block in the slot, so the
+ * counters are live without copying.  Monitors such as dmpipe_top read
+ * the page without locking, a sample may mix old and new values.
+ *
+ * A slot is free when pid is 0.  Slots of processes that exited without
+ * releasing them are reclaimed by the next process needing one.
+ */
+#include "memstream.h"
+
+#define DM_TELEMETRY_SECTION "DMPIPE_TELEMETRY"
+#define DM_TELEMETRY_VERSION 2
+#define DM_TELEMETRY_SLOTS 256
+
+struct dm_telemetry_slot {
+    unsigned int pid;			/* owning process, 0 if free */
+    int is_writer;			/* which end of stream owner has */
+    int is_tee;				/* broadcast (tee) stream */
+    int blk_size;			/* size of stream's section */
+    int offset;				/* stream's commbuf in section (duplex) */
+    char section[44];			/* name of stream's global section */
+    struct memstream_stats stats;
+};
+
+struct dm_telemetry_page {
+    int version;			/* DM_TELEMETRY_VERSION */
+    int slot_count;
+    struct dm_telemetry_slot slot[DM_TELEMETRY_SLOTS];
+};
+
+#endif
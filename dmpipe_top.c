@@ -0,0 +1,201 @@
+/*
+ * Monitor the dmpipe streams published in the telemetry page, sampling
+ * them at a fixed interval.  Each sample lists the live streams with
+ * the most backed up first:
+ *
+ *    PID/PEER	process owning the slot and the process at the other end.
+ *    END	W for writer, R for reader, T prefix for tee streams.
+ *    STATE	commbuf state (EMPTY: reader waiting, FULL: writer waiting).
+ *    DEPTH	bytes written but not yet read, and percent of buffer.
+ *    BYTES/S	rate data moved through this end since last sample.
+ *    WAIT%	percent of the interval this end spent waiting for its peer.
+ *
+ * Stream sections are mapped read-only and examined without taking
+ * their locks, so samples never slow the pipeline down.
+ *
+ * Usage:
+ *    dmpipe_top [interval-seconds [samples]]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <descrip.h>
+#include <starlet.h>			/* VMS system services prototypes */
+#include <ssdef.h>			/* VMS system service condition codes*/
+#include <jpidef.h>			/* VMS Job/Process Information */
+#include <lib$routines.h>		/* VMS RTL functions */
+#include <secdef.h>			/* VMS global sections. */
+#include <vadef.h>			/* VMS virtual address space */
+
+#include "memstream.h"
+#include "dmpipe_telemetry.h"
+
+static char *state_name[] = {		/* see MEMSTREAM_STATE_* */
+    "IDLE", "EMPTY", "FULL", "WDONE", "RDONE", "CLOSED" };
+
+struct sample {
+    unsigned int pid;			/* slot owner when sampled */
+    long long bytes, wait_usec;		/* counters at last sample */
+};
+struct row {
+    struct dm_telemetry_slot *slot;
+    struct memstream_snapshot snap;
+    int mapped;				/* snap valid */
+    int fill;				/* percent of buffer pending */
+    double rate, wait_pct;
+};
+
+static int process_exists ( unsigned int pid )
+{
+    int code, value;
+
+    code = JPI$_PID;
+    return LIB$GETJPI ( &code, &pid, 0, &value, 0, 0 ) != SS$_NONEXPR;
+}
+/*
+ * Map an existing global section read-only, return its address or 0.
+ */
+static void *map_section ( char *name, unsigned long long length,
+	unsigned long long *mapped_length )
+{
+    struct dsc$descriptor_s name_dx;
+    struct {
+        int match;
+        struct {
+            unsigned int minor:24, major:8;
+        } ver;
+    } sect_id;
+    unsigned long long region_id, sect_va;
+    int status;
+
+    name_dx.dsc$w_length = strlen ( name );
+    name_dx.dsc$b_dtype = DSC$K_DTYPE_T;
+    name_dx.dsc$b_class = DSC$K_CLASS_S;
+    name_dx.dsc$a_pointer = name;
+    sect_id.match = SEC$K_MATALL;
+    sect_id.ver.minor = 0;
+    sect_id.ver.major = 0;
+    region_id = VA$C_P0;
+
+    status = SYS$MGBLSC_64 ( &name_dx, &sect_id, &region_id, 0, length,
+	0, SEC$M_EXPREG, &sect_va, mapped_length );
+    if ( (status&1) == 0 ) return 0;
+    return (void *) sect_va;
+}
+
+static void unmap_section ( void *blk, unsigned long long length )
+{
+    unsigned long long region_id, del_va, del_cnt;
+
+    region_id = VA$C_P0;
+    SYS$DELTVA_64 ( &region_id, (unsigned long long) blk, length, 0,
+	&del_va, &del_cnt );
+}
+/*
+ * Most backed up streams first.
+ */
+static int compare_rows ( const void *a_vp, const void *b_vp )
+{
+    const struct row *a, *b;
+
+    a = a_vp;
+    b = b_vp;
+    if ( a->fill != b->fill ) return b->fill - a->fill;
+    if ( a->wait_pct != b->wait_pct ) 
+	return (b->wait_pct > a->wait_pct) ? 1 : -1;
+    return strcmp ( a->slot->section, b->slot->section );
+}
+
+int main ( int argc, char **argv )
+{
+    static struct sample prev[DM_TELEMETRY_SLOTS];
+    static struct row rows[DM_TELEMETRY_SLOTS];
+    struct dm_telemetry_page *page;
+    struct dm_telemetry_slot *slot;
+    struct row *row;
+    unsigned long long page_length, blk_length;
+    void *blk;
+    int interval, samples, count, i, n;
+    long long bytes, wait_usec;
+    time_t now;
+
+    interval = (argc > 1) ? atoi ( argv[1] ) : 2;
+    samples = (argc > 2) ? atoi ( argv[2] ) : 0;
+    if ( interval < 1 ) {
+	printf ( "Usage: dmpipe_top [interval-seconds [samples]]\n" );
+	return 0;
+    }
+    page = map_section ( DM_TELEMETRY_SECTION,
+	sizeof(struct dm_telemetry_page), &page_length );
+    if ( !page ) {
+	printf ( "No %s section, no process has published streams\n",
+	    DM_TELEMETRY_SECTION );
+	return 1;
+    }
+    if ( page->version != DM_TELEMETRY_VERSION ) {
+	printf ( "Telemetry page version %d, expected %d\n", page->version,
+	    DM_TELEMETRY_VERSION );
+	return 1;
+    }
+
+    for ( count = 0; (samples == 0) || (count < samples); count++ ) {
+	if ( count > 0 ) sleep ( interval );
+	n = 0;
+	for ( i = 0; i < DM_TELEMETRY_SLOTS; i++ ) {
+	    slot = &page->slot[i];
+	    if ( !slot->pid || !process_exists ( slot->pid ) ) {
+		prev[i].pid = 0;
+		continue;
+	    }
+	    row = &rows[n++];
+	    memset ( row, 0, sizeof(struct row) );
+	    row->slot = slot;
+	    blk = map_section ( slot->section, 0, &blk_length );
+	    if ( blk ) {
+		row->mapped = (slot->offset < blk_length) &&
+		    (memstream_inspect ( (char *) blk + slot->offset,
+		    &row->snap ) == 0);
+		unmap_section ( blk, blk_length );
+	    }
+	    if ( row->mapped )
+		row->fill = (row->snap.pending * 100LL) / row->snap.data_limit;
+	    /*
+	     * Rates since last sample of same owner.
+	     */
+	    bytes = slot->stats.bytes;
+	    wait_usec = slot->stats.wait_usec;
+	    if ( prev[i].pid == slot->pid ) {
+		row->rate = (double) (bytes - prev[i].bytes) / interval;
+		row->wait_pct = (wait_usec - prev[i].wait_usec) /
+			(interval * 10000.0);
+	    }
+	    prev[i].pid = slot->pid;
+	    prev[i].bytes = bytes;
+	    prev[i].wait_usec = wait_usec;
+	}
+	qsort ( rows, n, sizeof(struct row), compare_rows );
+
+	time ( &now );
+	printf ( "\ndmpipe_top  %.24s  %d stream%s\n", ctime ( &now ), n,
+	    (n == 1) ? "" : "s" );
+	printf ( "%-8s %-8s %-3s %-6s %10s %4s %12s %5s  %s\n", "PID", "PEER",
+	    "END", "STATE", "DEPTH", "%", "BYTES/S", "WAIT%", "SECTION" );
+	for ( i = 0; i < n; i++ ) {
+	    row = &rows[i];
+	    slot = row->slot;
+	    printf ( "%08X %08X %s%s  %-6s %10d %4d %12.0f %5.1f  %s\n",
+		slot->pid, row->mapped ? (slot->is_writer ?
+		row->snap.reader_pid : row->snap.writer_pid) : 0,
+		slot->is_tee ? "T" : " ", slot->is_writer ? "W" : "R",
+		(row->mapped && (row->snap.state >= 0) && (row->snap.state <= 5))
+		? state_name[row->snap.state] : "?",
+		row->snap.pending, row->fill, row->rate, row->wait_pct,
+		slot->section );
+	}
+	fflush ( stdout );
+    }
+    return 0;
+}
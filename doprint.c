@@ -56,7 +56,8 @@ static int flush_stream ( user_stream stream )
 }
 /*
  * Add characters to output stream, return value is number added
- * or -1.
+ * or -1.  Segments are limited to the space left in the buffer, which
+ * the caller may have made small.
  */
 static put_stream_nchar ( user_stream stream, char c, size_t length )
 {
@@ -66,8 +67,8 @@ static put_stream_nchar ( user_stream stream, char c, size_t length )
     status = 0;
     all_same = 0;
     for ( remaining = length; remaining > 0; remaining -= segsize ) {
-	segsize = remaining;
-	if ( segsize > stream->size ) segsize = stream->size;
+	segsize = stream->size - stream->used;
+	if ( segsize > remaining ) segsize = remaining;
 	if ( !all_same ) memset ( &stream->buffer[stream->used], c, segsize );
 	stream->used += segsize;
 
@@ -86,8 +87,8 @@ static int put_stream ( user_stream stream, char *string, size_t length )
     int status;
     status = 0;
     for ( remaining = length; remaining > 0; remaining -= segsize ) {
-	segsize = remaining;
-	if ( segsize > stream->size ) segsize = stream->size;
+	segsize = stream->size - stream->used;
+	if ( segsize > remaining ) segsize = remaining;
 	memcpy ( &stream->buffer[stream->used], string, segsize );
 	string += segsize;
 	stream->used += segsize;
@@ -108,16 +109,16 @@ static int put_stream_asciiz ( user_stream stream, char *string )
     char *out_ptr;
 
     for ( out_ptr = string; *out_ptr; out_ptr += segsize ) {
+	available = stream->size - stream->used;
+	segsize = strnlen ( out_ptr, available );
+	memcpy ( &stream->buffer[stream->used], out_ptr, segsize );
+
+	stream->used += segsize;
 	if ( stream->used >= stream->size ) {
 	    status = flush_stream ( stream );
 	    stream->used = 0;
 	    if ( status <= 0 ) return -1;
 	}
-	available = stream->size - stream->used;
-	segsize = strnlen ( string, available );
-	memcpy ( &stream->buffer[stream->used], string, segsize );
-
-	stream->used += segsize;
     }
 
     return out_ptr - string;
@@ -865,6 +866,7 @@ cnv.specifier_char, cnv.flags.sizeq, arg_type_map[sc_index].qual[cnv.flags.sizeq
 	    stream.buffer[stream.used++] = c;
 	    if ( stream.used >= stream.size ) {
 		if ( flush_stream ( &stream ) < 0 ) break;
+		stream.used = 0;
 	    }
 	}
     }
@@ -15,12 +15,75 @@
  *				field as well to convey flush requests.
  *				commbuf format version bumped to 2 due to
  *				addtion of comm_flags structure.
+ *
+ * Revised: 16-OCT-2026		Add ring buffer commbuf format (version 3),
+ *				selected with memstream_set_format().  Write
+ *				position wraps to start of data area so writer
+ *				can make progress while reader is draining.
+ * Revised: 16-OCT-2026		Add lock-free single producer/single consumer
+ *				format (version 4).  Cursors live on separate
+ *				cache lines and are updated without the spin
+ *				lock, which is only taken for state changes.
+ * Revised: 16-OCT-2026		Isolate VMS specific code (process wake/hiber,
+ *				spin lock builtins, exit handler) so memstream
+ *				also builds for POSIX systems.  Linux version
+ *				waits on futexes in the commbuf.
+ * Revised: 16-OCT-2026		Adaptive spin lock acquisition, spin budget
+ *				learned per stream followed by exponential
+ *				yield backoff and finally parking.
+ * Revised: 16-OCT-2026		Add zero-copy reserve/commit and peek/consume
+ *				functions.  Put and get primitives reserve or
+ *				peek when passed a null buffer.
+ * Revised: 16-OCT-2026		Add memstream_writev and memstream_readv,
+ *				built on reserve/peek so a whole iovec array
+ *				moves with one commit and one peer wake.
+ * Revised: 16-OCT-2026		Add record mode (MEMSTREAM_ATTR_RECORD), the
+ *				writer frames each write with a length prefix
+ *				and memstream_read_record returns one record.
+ * Revised: 16-OCT-2026		Add multi-producer fan-in format (version 5),
+ *				writers claim whole records under the spin
+ *				lock and publish them without it.
+ * Revised: 16-OCT-2026		Add tee format (version 6), one writer
+ *				broadcasting to several readers that each
+ *				have their own cursor.
+ * Revised: 16-OCT-2026		Add block migration, a writer can move the
+ *				stream to a larger (or smaller) shared block
+ *				and grow automatically when it keeps blocking.
+ * Revised: 16-OCT-2026		Add wake batching, writer sets low/high water
+ *				marks and reader waits with a deadline.
+ * Revised: 16-OCT-2026		Add duplex blocks holding both directions of
+ *				a request/response pair, and memstream_call
+ *				to send a request and wait for the reply.
+ * Revised: 16-OCT-2026		Add busy-poll reads (MEMSTREAM_ATTR_BUSY_POLL),
+ *				reader watches an empty stream for a set time
+ *				before arming notification and waiting.
+ * Revised: 16-OCT-2026		Lock-free formats size segments independent of
+ *				seg_limit, copies are dispatched by size to
+ *				memcpy or non-temporal stores (calibrated).
+ * Revised: 16-OCT-2026		Add memstream_armed so pollers can tell which
+ *				armed streams a peer has since signalled.
+ * Revised: 16-OCT-2026		Add memstream_wait_fd, a descriptor the peer
+ *				posts to with each wake so foreign event
+ *				loops can wait on a stream.
+ * Revised: 16-OCT-2026		Guard open streams list and first time setup
+ *				with a mutex when built with DMPIPE_THREADS.
+ * Revised: 17-OCT-2026		Bump IPC version for the changed header, don't
+ *				attach to a commbuf of another IPC version.
+ * Revised: 17-OCT-2026		Time hibernate deadline with $SETIMR, $CANWAK
+ *				cancelled the application's wakeups.
+ * Revised: 17-OCT-2026		Time lock holds per stream, not in a shared
+ *				static.
  */
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#ifdef DMPIPE_THREADS
+#include <pthread.h>
+#endif
 
+#ifdef __VMS
 #include <jpidef.h>			/* VMS Job/Process Information */
 #include <syidef.h>			/* VMS System Information */
 #include <starlet.h>			/* VMS system services prototypes */
@@ -29,12 +92,115 @@
 #include <efndef.h>			/* VMS system service condition codes*/
 #include <lib$routines.h>		/* VMS RTL functions */
 #include <builtins.h>			/* DEC C builtin functions */
+#include <iodef.h>			/* mailbox wait handles */
+#include <dvidef.h>
+#include <descrip.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>			/* C11 atomics */
+#include <sys/syscall.h>
+#include <linux/futex.h>		/* Linux fast user-space mutex */
+#include <sys/socket.h>			/* wait handles */
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>			/* __rdtsc() */
+#endif
+#define __MEMCPY memcpy
+#define __MEMSET memset
+#endif
 
 #include "memstream.h"
 
+#define MEMSTREAM_CACHE_LINE 64		/* Separation for SPSC cursors */
+/*
+ * Ordered access to cells shared without lock.  On VMS, aligned longword
+ * loads and stores are atomic and memory barriers supply acquire/release
+ * ordering.  Elsewhere use C11 atomics.
+ */
+#ifdef __VMS
+typedef int commbuf_atomic;
+
+static int load_acquire ( volatile commbuf_atomic *cell )
+{
+    int value;
+
+    value = *cell;
+    __MB();
+    return value;
+}
+static void store_release ( volatile commbuf_atomic *cell, int value )
+{
+    __MB();
+    *cell = value;
+}
+#define full_barrier() __MB()
+/*
+ * Free running cycle counter for timing the spin lock, only differences
+ * between readings are meaningful.
+ */
+#ifdef __alpha
+#define CYCLE_DELTA(start,end) (((end)-(start))&0xffffffff) /* 32-bit */
+static unsigned long long read_cycle_counter ( void )
+{
+    return __RPCC();
+}
+#elif defined(__ia64)
+static unsigned long long read_cycle_counter ( void )
+{
+    return __getReg ( _IA64_REG_AR_ITC );
+}
+#else
+static unsigned long long read_cycle_counter ( void )
+{
+    long long now;
+
+    SYS$GETTIM ( &now );		/* 100 nanosecond ticks */
+    return now;
+}
+#endif
+#else
+typedef _Atomic int commbuf_atomic;
+
+static int load_acquire ( volatile commbuf_atomic *cell )
+{
+    return atomic_load_explicit ( cell, memory_order_acquire );
+}
+static void store_release ( volatile commbuf_atomic *cell, int value )
+{
+    atomic_store_explicit ( cell, value, memory_order_release );
+}
+#define full_barrier() atomic_thread_fence ( memory_order_seq_cst )
+
+static unsigned long long read_cycle_counter ( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+
+    clock_gettime ( CLOCK_MONOTONIC, &now );	/* nanosecond ticks */
+    return (now.tv_sec * 1000000000ULL) + now.tv_nsec;
+#endif
+}
+#endif
+#ifndef CYCLE_DELTA
+#define CYCLE_DELTA(start,end) ((end)-(start))
+#endif
+
 /* TRACE */
 extern char dmpipe_trace;
 void dmpipe_trace_output(const char *cp_format, ...);
+#ifdef __VMS
+#define TRACE_AVAILABLE 1
+#else
+#pragma weak dmpipe_trace_output	/* not in standalone test images */
+#define TRACE_AVAILABLE (dmpipe_trace_output != 0)
+#endif
 /* END TRACE */
 static FILE *tty;
 /*
@@ -45,14 +211,17 @@ static struct {
     int stall_retry;			/* Spin lock secondary retries */
     int stall_msec;			/* Secondary sleep time */
     int seg_limit;			/* Max data xfer while lock held */
+    int stream_copy;			/* copies this big use non-temporal
+					   stores, 0 until calibrated */
 
-    long long stall_delta;		/* VMS delta time */
+    long long stall_delta;		/* VMS delta time or nanoseconds */
     pid_t self;				/* Current process PID */
     int cpu_count;			/* Number of CPUs available */
     int sequence;			/* Number of memstreams initialized */
     int spinlock_fails;
+    int fmt_version;			/* format for new commbufs */
 } spn = {
-    100000, 1500, 20, 4096, 0, 0, 0, 0, 0
+    100000, 1500, 20, 4096, 0, 0, 0, 0, 0, 0, MEMSTREAM_FORMAT_LINEAR
 };
 static int memstream_rundown ( int *exit_status, memstream *open_streams );
 
@@ -60,6 +229,19 @@ static struct {
     int status;
     memstream open_streams;
 } rundown;
+/*
+ * Thread-safe build, streams are opened and closed from several threads.
+ * A stream context itself is used by one thread at a time (dmpipe.c locks
+ * the fd).
+ */
+#ifdef DMPIPE_THREADS
+static pthread_mutex_t open_streams_lock = PTHREAD_MUTEX_INITIALIZER;
+#define OPEN_STREAMS_LOCK() pthread_mutex_lock ( &open_streams_lock )
+#define OPEN_STREAMS_UNLOCK() pthread_mutex_unlock ( &open_streams_lock )
+#else
+#define OPEN_STREAMS_LOCK()
+#define OPEN_STREAMS_UNLOCK()
+#endif
 static struct {
     void *flink;			/* used by VMS */
     int (*handler) (int *exit_status, memstream *open_streams );
@@ -74,6 +256,7 @@ static struct {
  * must be synchonized using the lock member and offset 16;  The longwords
  * on either side of the lock structure are more or less static.
  */
+#ifdef __VMS
 union lock_state {
     struct {
 	long flag;				/* 1 if set */
@@ -81,10 +264,24 @@ union lock_state {
     } state;
     long long state_qw;			/* for atomic exchange */
 };
+#else
+union lock_state {
+    struct {
+	commbuf_atomic flag;		/* 1 if set */
+	pid_t owner;
+    } state;
+    long long state_qw;
+};
+#endif
 union comm_flags {
     struct {
 	unsigned int expedite:  1,	/* reader should flush */
-	             reserved: 30;	/* fill out longword */
+	             framed:    1,	/* writer sends records */
+	             migrated:  1,	/* writer moved to next block */
+	             next_shift: 5,	/* log2 size of next block */
+	             timed_wait: 1,	/* waiting reader has a deadline */
+	             wake_msec: 10,	/* writer batching, reader deadline */
+	             reserved: 12;	/* fill out longword */
     } bit;
     unsigned long mask;
 };
@@ -102,11 +299,146 @@ struct commbuf {
     union comm_flags flags;		/* additional inter-process comm */
     int write_pos;			/* Offset of next byte to write */
     int read_pos;			/* offset of next byte to read */
+    long long wake_stamp[2];		/* usec of last wake, see note_wait() */
+    int notify[2];			/* wait handle ids, see notify_blocked() */
+#ifndef __VMS
+    commbuf_atomic wake_pending[2];	/* futex words, see hibernate() */
+#endif
 
     char data[4];			/* variable size */
 };
 #define MEMSTREAM_FMT_VERSION 2		/* added flags field */
-#define MEMSTREAM_IPC_VERSION 1
+#define MEMSTREAM_FMT_RING 3		/* positions wrap at data_limit */
+#define MEMSTREAM_FMT_SPSC 4		/* ring with lock-free cursors */
+#define MEMSTREAM_FMT_MPSC 5		/* many writers, one reader */
+#define MEMSTREAM_FMT_TEE 6		/* one writer, many readers */
+#define MEMSTREAM_IPC_VERSION 2		/* wake_stamp, notify in header */
+/*
+ * In linear format (version 2), data occupies data[read_pos..write_pos-1]
+ * and both positions reset to 0 only when the reader drains the buffer.
+ * In ring format (version 3), positions wrap to 0 when they reach
+ * data_limit, so pending data may be split into 2 pieces.  One byte is
+ * always left unused so read_pos==write_pos unambiguously means empty.
+ *
+ * SPSC format (version 4) is a ring whose positions are moved out of the
+ * header into cursors on their own cache lines: head is written only
+ * by the writer and tail only by the reader.  Data transfers don't take
+ * the spin lock, it is only held to change state (EMPTY/FULL arming and
+ * close), so write_pos and read_pos in the header are unused.
+ */
+struct spsc_cursor {
+    commbuf_atomic pos;			/* offset into data area */
+    char fill[MEMSTREAM_CACHE_LINE-sizeof(int)];
+};
+struct spsc_layout {
+    union {
+	struct commbuf hdr;
+	char fill[MEMSTREAM_CACHE_LINE*((sizeof(struct commbuf)+
+		MEMSTREAM_CACHE_LINE-1)/MEMSTREAM_CACHE_LINE)];
+    } hdr;
+    struct spsc_cursor head;		/* Offset of next byte to write */
+    struct spsc_cursor tail;		/* Offset of next byte to read */
+    char data[MEMSTREAM_CACHE_LINE];	/* variable size */
+};
+#define SPSC_LAYOUT(buf) ((volatile struct spsc_layout *) (buf))
+#define SPSC_DATA_OFFSET offsetof(struct spsc_layout,data)
+/*
+ * MPSC format (version 5) lets up to MPSC_MAX_WRITERS writers feed one
+ * reader.  The data area holds records, each a header followed by the
+ * bytes of one put or commit.  A writer claims a record by moving the
+ * claim cursor under the spin lock, fills it without the lock, then
+ * publishes it by storing its length.  The reader takes records in claim
+ * order, so bytes of one record are never interleaved with another
+ * writer's, and skips the empty record left when a claim doesn't fit
+ * before the end of the data area.  Only the reader arms EMPTY state;
+ * a writer blocked for space flags its own slot instead of arming FULL,
+ * since several writers may be blocked at once.
+ */
+#define MPSC_MAX_WRITERS 16
+struct peer_slot {
+    pid_t pid;				/* 0 if slot is free */
+    int waiting;			/* blocked for space or flush */
+    commbuf_atomic wake;		/* futex word (POSIX) */
+    int fill;
+};
+struct mpsc_record {
+    commbuf_atomic length;		/* 0 until committed, then bytes+1 */
+    int size;				/* offset to next record */
+};
+struct mpsc_control {
+    commbuf_atomic waiting;		/* some writer slot is waiting */
+    int writers;			/* attached writers */
+    struct peer_slot slot[MPSC_MAX_WRITERS];
+};
+struct mpsc_layout {
+    union {
+	struct commbuf hdr;
+	char fill[MEMSTREAM_CACHE_LINE*((sizeof(struct commbuf)+
+		MEMSTREAM_CACHE_LINE-1)/MEMSTREAM_CACHE_LINE)];
+    } hdr;
+    struct spsc_cursor claim;		/* Offset of next record to claim */
+    struct spsc_cursor tail;		/* Offset of next record to read */
+    union {
+	struct mpsc_control ctl;
+	char fill[MEMSTREAM_CACHE_LINE*((sizeof(struct mpsc_control)+
+		MEMSTREAM_CACHE_LINE-1)/MEMSTREAM_CACHE_LINE)];
+    } ctl;
+    char data[MEMSTREAM_CACHE_LINE];	/* variable size */
+};
+#define MPSC_LAYOUT(buf) ((volatile struct mpsc_layout *) (buf))
+#define MPSC_DATA_OFFSET offsetof(struct mpsc_layout,data)
+#define MPSC_CONTROL(buf) (&MPSC_LAYOUT(buf)->ctl.ctl)
+#define MPSC_RECORD(buf,pos) \
+	((volatile struct mpsc_record *) &MPSC_LAYOUT(buf)->data[pos])
+#define MPSC_HDR_SIZE ((int) sizeof(struct mpsc_record))
+/*
+ * Tee format (version 6) broadcasts one writer's data to up to
+ * TEE_MAX_READERS readers.  It is an SPSC ring with a tail cursor per
+ * reader, so the slowest reader limits the writer's space.  The writer
+ * arms FULL as with SPSC, but readers wait on their own slots since
+ * several may be waiting at once.  A reader starts at the head position
+ * current when it attaches.  With MEMSTREAM_ATTR_DROP set, a writer that
+ * has waited TEE_DROP_MSEC for space drops readers still lagging more
+ * than half the buffer instead of waiting for them any longer.
+ */
+#define TEE_MAX_READERS MPSC_MAX_WRITERS	/* wake_slots() assumes equal */
+#define TEE_DROP_MSEC 250		/* wait before dropping readers */
+struct tee_reader {
+    struct peer_slot slot;
+    commbuf_atomic tail;		/* Offset of next byte to read */
+    int dropped;			/* writer stopped waiting for us */
+    char fill[MEMSTREAM_CACHE_LINE-sizeof(struct peer_slot)-2*sizeof(int)];
+};
+struct tee_control {
+    commbuf_atomic waiting;		/* some reader slot is waiting */
+    int readers;			/* attached readers */
+};
+struct tee_layout {
+    union {
+	struct commbuf hdr;
+	char fill[MEMSTREAM_CACHE_LINE*((sizeof(struct commbuf)+
+		MEMSTREAM_CACHE_LINE-1)/MEMSTREAM_CACHE_LINE)];
+    } hdr;
+    struct spsc_cursor head;		/* Offset of next byte to write */
+    union {
+	struct tee_control ctl;
+	char fill[MEMSTREAM_CACHE_LINE];
+    } ctl;
+    struct tee_reader reader[TEE_MAX_READERS];
+    char data[MEMSTREAM_CACHE_LINE];	/* variable size */
+};
+#define TEE_LAYOUT(buf) ((volatile struct tee_layout *) (buf))
+#define TEE_DATA_OFFSET offsetof(struct tee_layout,data)
+#define TEE_CONTROL(buf) (&TEE_LAYOUT(buf)->ctl.ctl)
+/*
+ * True if stream's wake_peer targets waiting slots (formats with several
+ * peers) rather than a single process.
+ */
+#define WAKES_SLOTS(stream) ( \
+	((stream)->buf->fmt_version == MEMSTREAM_FMT_MPSC && \
+		!(stream)->is_writer) || \
+	((stream)->buf->fmt_version == MEMSTREAM_FMT_TEE && \
+		(stream)->is_writer) )
 /*
  * 6 commbuf states.
  */
@@ -132,6 +464,7 @@ struct commbuf_report {
    union comm_flags flags;		/* additional notification */
    int exit_state;			/* commbuf->state at lock release */
    int transferred;			/* bytes transferred */
+   int position;			/* data offset of transfer */
 };
 /*
  * memstream_context structure is created by memstream_create function to
@@ -142,10 +475,166 @@ struct memstream_context {
     struct commbuf *buf;		/* Shared buffer */
     union comm_flags flags;		/* flags on last read */
     int is_writer;			/* Indicates which end of stream */
+    int duplex;				/* half of a request/response block */
     int attributes;			/* control flags */
+    int poll_usec;			/* busy poll budget, see busy_poll() */
     struct memstream_stats *stats;      /* Optional. */
+    unsigned long long lock_since;	/* cycle counter when lock was
+					   acquired, 0 if hold not timed */
+    struct {
+	int average;			/* recent spins needed to get lock */
+	int budget;			/* spins before backing off */
+    } spin;
+    struct {
+	int pos;			/* data offset of region */
+	int size;			/* 0 if no region outstanding */
+    } region;				/* zero-copy reserve or peek */
+    struct {
+	int mode;			/* >0 framed, <0 not, 0 undecided */
+	int remaining;			/* unread bytes of current record */
+	int view;			/* record returned in place (region) */
+	int hdr_len;			/* bytes of length prefix read */
+	union {
+	    int length;
+	    char b[4];
+	} hdr;				/* length prefix */
+    } record;				/* record mode state */
+    struct {
+	volatile struct peer_slot *slot;	/* writer's wait slot */
+	int offset;			/* bytes of tail record already read */
+    } fanin;				/* MPSC format state */
+    struct {
+	volatile struct tee_reader *reader;	/* reader's cursor and slot */
+	long long drop_at;		/* writer blocked, time to drop */
+    } tee;				/* Tee format state */
+    struct {
+	memstream_remap_callback *remap;	/* maps next block */
+	void *arg;			/* remap callback argument */
+	int blk_size;			/* size of current block */
+	int limit;			/* automatic growth limit, 0 if off */
+	int blocked;			/* writes blocked since reader caught up */
+	struct commbuf *prev;		/* block reader hasn't left yet */
+	long long poll_at;		/* waiting for reader, time to recheck */
+    } growth;				/* block migration state */
+    struct {
+	int low_water;			/* pending bytes worth waking reader */
+	int high_water;			/* wake reader during long writes */
+	int timed;			/* reader's next wait has deadline */
+	int idle;			/* timed wait brought nothing, next
+					   wait is untimed */
+	long long wake_at;		/* reader's deadline */
+    } batch;				/* writer batching of reader wakes */
+    struct {
+	int id;				/* published handle, 0 if none */
+	int fd;				/* descriptor given to caller */
+	unsigned short chan;		/* VMS: channel to handle */
+	unsigned short peer_chan;	/* VMS: channel to peer's handle */
+	int peer_id;			/* handle peer_chan is assigned to */
+    } notify;				/* wait handle, see memstream_wait_fd() */
 };
+static int wake_slots ( memstream stream );
+/*
+ * Time hibernate must return by, 0 if none.
+ */
+static long long wait_deadline ( memstream stream )
+{
+    long long deadline;
+
+    deadline = stream->tee.drop_at;
+    if ( stream->growth.poll_at && 
+	(!deadline || (stream->growth.poll_at < deadline)) )
+	deadline = stream->growth.poll_at;
+    if ( stream->batch.wake_at && 
+	(!deadline || (stream->batch.wake_at < deadline)) )
+	deadline = stream->batch.wake_at;
+    return deadline;
+}
+/***********************************************************************/
+/* Statistics helpers, used only when caller assigned a statistics block.
+ *    histogram_add()		Count value in its log2 bucket.
+ *    note_lock_acquired()	Time spent getting lock, start timing hold.
+ *    note_lock_release()	Time lock was held.
+ *    note_wait()		Time parked in hibernate and time from the
+ *				peer's wake until we resumed.
+ *    count_segment()		Data moved by one transfer.
+ */
+#define WAKE_STAMP(buf,is_writer) (&(buf)->wake_stamp[(is_writer)?0:1])
+#define NOTIFY_ID(buf,is_writer) (&(buf)->notify[(is_writer)?0:1])
+static long long clock_usec ( void );
+
+static void histogram_add ( unsigned int *histogram, 
+	unsigned long long value )
+{
+    int bucket;
+
+    for ( bucket = 0; (value > 1) && (bucket < MEMSTREAM_HIST_BUCKETS-1);
+	bucket++ ) value = value >> 1;
+    histogram[bucket]++;
+}
+
+static void note_lock_acquired ( memstream stream, unsigned long long start )
+{
+    unsigned long long now, ticks;
+
+    now = read_cycle_counter();
+    ticks = CYCLE_DELTA ( start, now );
+    stream->stats->lock_acquires++;
+    stream->stats->lock_acquire_ticks += ticks;
+    histogram_add ( stream->stats->acquire_histogram, ticks );
+    stream->lock_since = now;
+}
+
+static void note_lock_release ( memstream stream )
+{
+    unsigned long long ticks;
+
+    if ( !stream->stats || !stream->lock_since ) return;
+    ticks = CYCLE_DELTA ( stream->lock_since, read_cycle_counter() );
+    stream->stats->lock_hold_ticks += ticks;
+    histogram_add ( stream->stats->hold_histogram, ticks );
+    stream->lock_since = 0;
+}
+
+static void note_wait ( memstream stream, long long start )
+{
+    long long now, stamp;
+
+    now = clock_usec();
+    stream->stats->wait_usec += now - start;
+    histogram_add ( stream->stats->wait_histogram, now - start );
+    /*
+     * Peer stamps the commbuf when it wakes us.  MPSC writers and tee
+     * readers are woken through their slots and have no stamp.
+     */
+    stamp = *WAKE_STAMP ( stream->buf, stream->is_writer );
+    if ( stamp > start ) {
+	stream->stats->resumes++;
+	stream->stats->resume_usec += now - stamp;
+	histogram_add ( stream->stats->resume_histogram, now - stamp );
+    }
+}
+
+static void count_segment ( memstream stream, int bytes )
+{
+    if ( !stream->stats ) return;
+    stream->stats->segments++;
+    stream->stats->bytes += bytes;
+}
+#ifdef __VMS
 /****************************************************************************/
+static void set_stall_time ( int stall_msec )
+{
+    /*
+     * Compute VMS delta time for stall.
+     */
+    spn.stall_delta = stall_msec;
+    if ( spn.stall_delta > 0 ) {
+	spn.stall_delta = spn.stall_delta * -10000;
+    } else {
+	SYS$GETTIM ( &spn.stall_delta );
+    }
+}
+
 /* Get current process ID and save in global spn struct.
  */
 static int set_spn_self ( void )
@@ -165,7 +654,7 @@ static int set_spn_self ( void )
     code = SYI$_ACTIVECPU_CNT;
     status = LIB$GETSYI ( &code, &spn.cpu_count, 0, 0, 0, 0 );
 
-    if ( status&1 ) if ( spn.cpu_count == 1 ) {
+    if ( (status&1) && (spn.cpu_count == 1) ) {
 	/*
 	 * Change default parameters for spinlocks when a uni-processor.
 	 * Spin locks don't make progress when only 1 CPU, minimize the
@@ -176,7 +665,7 @@ static int set_spn_self ( void )
 	spn.stall_retry = 1;
 	spn.stall_msec = 0;		/* force to min. delay. */
 	SYS$GETTIM ( &spn.stall_delta );
-    }
+    } else set_stall_time ( spn.stall_msec );
     /*
      * Establish exit handler to force any open streams to closed state on
      * program exit to help prevent hangs.
@@ -190,37 +679,59 @@ static int set_spn_self ( void )
     }
     return status;
 }
-static void acquire_lock ( volatile struct commbuf *buf )
+/*
+ * Spin lock primitives used by acquire_lock():
+ *    try_lock()		Make up to retry attempts to set lock.
+ *    yield_processor()		Give up CPU until next scheduler tick.
+ *    park_lock()		Stall until lock obtained.
+ *    uniprocessor_lock()	Hibernate until holder releases lock.
+ */
+static int try_lock ( volatile struct commbuf *buf, int retry )
+{
+    return __LOCK_LONG_RETRY ( &buf->lock.state.flag, retry );
+}
+
+static void yield_processor ( void )
+{
+    long long now;
+    int status;
+
+    SYS$GETTIM ( &now );		/* pre-expired wakeup time */
+    status = SYS$SCHDWK ( &spn.self, 0, &now, 0 );
+    if ( status&1 ) SYS$HIBER();
+}
+
+static void park_lock ( volatile struct commbuf *buf )
+{
+    int status;
+
+    do {
+	spn.spinlock_fails++;
+	status = SYS$SCHDWK ( &spn.self, 0, &spn.stall_delta, 0 );
+	if ( status&1 ) SYS$HIBER();
+    } while ( !try_lock ( buf, spn.stall_retry ) );
+}
+
+static void uniprocessor_lock ( volatile struct commbuf *buf )
 {
     union lock_state new, old;
-    if ( spn.cpu_count == 1 ) {		/* uniprocessor */
-	new.state.flag = 1;
-	new.state.owner = spn.self;	/* take ownership */
-	while ( 1 ) {
-	    old.state_qw = __ATOMIC_EXCH_QUAD ( &buf->lock, new.state_qw );
-	    if ( old.state.flag ) {		/* previously locked */
-		spn.spinlock_fails++;
-	        SYS$HIBER();
-	    } else break;
-	};
-    } else {				/* multi-processor */
-	int spin_result, status;
-	for (spin_result=__LOCK_LONG_RETRY(&buf->lock.state.flag, spn.initial_retry);
-	     spin_result == 0;
-	     spin_result=__LOCK_LONG_RETRY(&buf->lock.state.flag,spn.stall_retry)) {
-	     spn.spinlock_fails++;
-	     status=SYS$SCHDWK( &spn.self, 0, &spn.stall_delta, 0 );
-	     if ( status&1 ) status = SYS$HIBER();
-	     if ( status&1 ) return;	/* 0 */
-	}
-	buf->lock.state.owner = spn.self;
-    }
+
+    new.state.flag = 1;
+    new.state.owner = spn.self;	/* take ownership */
+    while ( 1 ) {
+	old.state_qw = __ATOMIC_EXCH_QUAD ( &buf->lock, new.state_qw );
+	if ( old.state.flag ) {		/* previously locked */
+	    spn.spinlock_fails++;
+	    SYS$HIBER();
+	} else break;
+    };
 }
-static int release_lock ( volatile struct commbuf *buf )
+static int release_lock ( memstream stream, volatile struct commbuf *buf )
 {
     union lock_state new, old;
     int status;
 
+    note_lock_release ( stream );
     if ( spn.cpu_count == 1 ) {		/* uniprocessor */
 	new.state.flag = 0;
 	new.state.owner = 0;		/* make unowned */
@@ -240,442 +751,3007 @@ static int release_lock ( volatile struct commbuf *buf )
     }
     return 1;
 }
-/***********************************************************************/
-/* Primitives for copying data into and out of buffer as atomic operation
- * using spin lock.
- *
- * Return value:
- *        READY          Success, all bytes transferred.
- *        BLOCKED        Buffer full(write) or empty(empty), partial transfer.
- *        CLOSED         Pipe is closed, partial transfer.
- *        ABORT          Error, indeterminate transfer.
- *
- * Actions taken by caller depend on both status and previous buffer state:
- *     status    prev_state  xferred
- *    READY     idle                    continue
- *    READY     full(read)     >0       continue
- *    READY     full(read)     0        wake writer (state now idle).
- *    READY     empty(write)   *        wake reader.(state now idle).
- *    BLOCKED       *                   sleep
- *    CLOSED        *          >0       continue.
- *    CLOSED        *           0       discontinue I/O attempts.
+/*
+ * Obtain lock for exit handler, which may have interrupted our own
+ * holding of it.
  */
-static int put_to_commbuf ( const void *bytes_vp, int count, 
-	volatile struct commbuf *buf, struct commbuf_report *report )
+static void seize_lock ( memstream stream )
 {
-    int spin_result, available, segsize, kick_reader, status;
-    volatile char *dest;
-    const char *bytes;
-
-    bytes = bytes_vp;
-    /*
-     * Obtain mutex (spin lock).
-     */
-    acquire_lock ( buf );
-    report->enter_state = buf->state;
-    report->flags.mask = 0;
-    /*
-     * Determine amount of caller's buffer to write (segsize), smaller of
-     * amount to be written, seg_limit, or space left in buffer.
-     */
-    if ( count > spn.seg_limit ) count = spn.seg_limit;
-    available = buf->data_limit - buf->write_pos;
-    segsize = (count > available) ? available : count;
-    /*
-     * Examine state of buffer to determine how to handle transfer, segment
-     * size is updated.  buf->state can only be examine
-     */
-    dest = &buf->data[buf->write_pos];
-    status = COMMBUF_COMPLETED;		/* Assume success */
-    switch ( buf->state ) {
-      case MEMSTREAM_STATE_IDLE:
-	/* Nobody reading at momemt, append data if we can */
-	if ( segsize == 0 ) {
-	    buf->state = MEMSTREAM_STATE_FULL;
-	    status = COMMBUF_BLOCKED;
-	}
-	break;
+    volatile struct commbuf *buf;
 
-      case MEMSTREAM_STATE_EMPTY:
-	/* Same as idle, caller will kick reader though */
-	if ( segsize == 0 ) {
-	    buf->state = MEMSTREAM_STATE_FULL;
-	    status = COMMBUF_BLOCKED;
+    buf = stream->buf;
+    if ( __LOCK_LONG_RETRY(&buf->lock.state.flag, 1) == 0 ) {
+	/* Lock failed, see if we already own it before long wait */
+	if ( buf->lock.state.owner != spn.self ) {
+	    __LOCK_LONG(&buf->lock.state.flag);
+	    buf->lock.state.owner = spn.self;
 	}
-	else buf->state = MEMSTREAM_STATE_IDLE;
-	break;
-
-      case MEMSTREAM_STATE_FULL:
-	/*
-	 * Should never happen, but spurious wakes can occur so force
-         * another block.
-         */
-	segsize = 0;
-	status = COMMBUF_BLOCKED;
-	break;
-
-      case MEMSTREAM_STATE_WRITER_DONE:
-      case MEMSTREAM_STATE_READER_DONE:
-	segsize = 0;
-	status = COMMBUF_DISCARDED;		/* attempt to write to closed stream */
-	break;
-
-      case MEMSTREAM_STATE_CLOSED:
-	segsize = 0;
-	status = COMMBUF_ABORT;		/* attempt to write to closed stream */
-	break;
+    }
+}
+/***************************************************************************/
+/*
+ * Wait handles for foreign event loops, see memstream_wait_fd().  The
+ * handle is a temporary mailbox the peer writes a byte to whenever it
+ * wakes us, identified to the peer by its unit number.  The caller gets
+ * a file descriptor opened on the mailbox, we drain it through our own
+ * channel.
+ */
+static int notify_create ( memstream stream )
+{
+    int status, code, unit;
+    char name[32];
 
-      default:
-	segsize = 0;
-	status = COMMBUF_ABORT;
-	break;
+    status = SYS$CREMBX ( 0, &stream->notify.chan, 4, 64, 0, 0, 0, 0, 0 );
+    if ( (status&1) == 0 ) {
+	errno = EVMSERR;
+	vaxc$errno = status;
+	return -1;
     }
-    /*
-     * Copy data and update write position.
-     */
-    if ( segsize > 0 ) {
-	__MEMCPY ( (void *) dest, bytes, segsize );
-	buf->write_pos += segsize;
+    code = DVI$_UNIT;
+    status = LIB$GETDVI ( &code, &stream->notify.chan, 0, &unit, 0, 0 );
+    if ( (status&1) == 1 ) {
+	sprintf ( name, "_MBA%d:", unit );
+	stream->notify.fd = open ( name, O_RDONLY, 0 );
+	if ( stream->notify.fd >= 0 ) {
+	    stream->notify.id = unit;
+	    return stream->notify.fd;
+	}
+    } else {
+	errno = EVMSERR;
+	vaxc$errno = status;
     }
-    /*
-     * Save result and release mutex.
-     */
-    report->exit_state = buf->state;
-    report->transferred = segsize;
-    release_lock ( buf );
+    SYS$DASSGN ( stream->notify.chan );
+    return -1;
+}
+/*
+ * Post a byte to the handle of the waiter in process target.  Full
+ * mailbox means the waiter has a notification pending anyway.
+ */
+static void notify_signal ( memstream stream, pid_t target, int id )
+{
+    int status;
+    unsigned short chan;
+    char name[32], token;
+    struct dsc$descriptor_s name_dx;
+    struct { unsigned short status, count; long pid; } iosb;
 
-    return status;
+    if ( id == stream->notify.id ) chan = stream->notify.chan;
+    else if ( id != stream->notify.peer_id ) {
+	/* Peer has a new handle (or block was migrated), reassign */
+	if ( stream->notify.peer_id ) SYS$DASSGN ( stream->notify.peer_chan );
+	stream->notify.peer_id = 0;
+	sprintf ( name, "_MBA%d:", id );
+	name_dx.dsc$w_length = strlen ( name );
+	name_dx.dsc$b_dtype = DSC$K_DTYPE_T;
+	name_dx.dsc$b_class = DSC$K_CLASS_S;
+	name_dx.dsc$a_pointer = name;
+	status = SYS$ASSIGN ( &name_dx, &stream->notify.peer_chan, 0, 0, 0 );
+	if ( (status&1) == 0 ) return;
+	stream->notify.peer_id = id;
+	chan = stream->notify.peer_chan;
+    } else chan = stream->notify.peer_chan;
+    token = 1;
+    SYS$QIOW ( EFN$C_ENF, chan, 
+	IO$_WRITEVBLK|IO$M_NOW|IO$M_NORSWAIT, &iosb, 0, 0,
+	&token, 1, 0, 0, 0, 0 );
 }
+static void notify_drain ( memstream stream )
+{
+    int status;
+    char token[16];
+    struct { unsigned short status, count; long pid; } iosb;
 
-static int get_from_commbuf ( volatile struct commbuf *buf,
-	void *bytes_vp, int limit, struct commbuf_report *report )
+    do {
+	status = SYS$QIOW ( EFN$C_ENF, stream->notify.chan, 
+	    IO$_READVBLK|IO$M_NOW, &iosb, 0, 0, token, sizeof(token), 
+	    0, 0, 0, 0 );
+    } while ( (status&1) && (iosb.status&1) );
+}
+static void notify_delete ( memstream stream )
 {
-    int spin_result, available, segment, kick_reader, status;
-    volatile char *src;
-    char *bytes;
+    if ( stream->notify.peer_id ) SYS$DASSGN ( stream->notify.peer_chan );
+    stream->notify.peer_id = 0;
+    if ( !stream->notify.id ) return;
+    close ( stream->notify.fd );
+    SYS$DASSGN ( stream->notify.chan );
+    stream->notify.id = 0;
+}
+/***************************************************************************/
+/*
+ * Process block/unblock primitives, this implementation use $HIBER/$WAKE.
+ * Wake_process returns 0 if target no longer exists, word is unused.
+ */
+static int wake_process ( memstream stream, pid_t target,
+	volatile commbuf_atomic *word )
+{
+    int status;
 
-    bytes = bytes_vp;
-    /*
-     * Obtain mutex (spin lock).
-     */
-    acquire_lock ( buf );
-    report->enter_state = buf->state;
-    report->flags.mask = 0;
-    /*
-     * Determine amount of caller's buffer to fill (segment), smaller of
-     * amount to be copied, seg_limit, or data available.
-     */
-    if ( limit > spn.seg_limit ) limit = spn.seg_limit;
-    available = buf->write_pos - buf->read_pos;
-    segment = (limit > available) ? available : limit;
-    /*
-     * Examine state of buffer to determine how to handle transfer, segment
-     * size is updated.
-     */
-    src = &buf->data[buf->read_pos];
-    status = COMMBUF_COMPLETED;
-    switch ( buf->state ) {
-      case MEMSTREAM_STATE_IDLE:
-	/* Nobody reading at momemt, block if no data */
-	if ( segment == 0 ) {
-	    buf->state = MEMSTREAM_STATE_EMPTY;
-	    status = COMMBUF_BLOCKED;
-	}
-	break;
+    if ( stream->stats ) stream->stats->signals++;
+    status = SYS$WAKE ( &target, 0 );
+    if ( status == SS$_NONEXPR ) return 0;
+    return COMMBUF_COMPLETED;
+}
+static int wake_peer ( memstream stream )
+{
+    pid_t target;
+    int id;
 
-      case MEMSTREAM_STATE_EMPTY:
-	/* Should never happen since caller should have waited last time */
-	status = COMMBUF_BLOCKED;
-	if ( buf->writer_pid == 0 ) {
-	     status = COMMBUF_DISCARDED;
-	} else {
-	     /* Pass along expedite bit status if writer set it */
-	     report->flags.bit.expedite = buf->flags.bit.expedite;
-	     buf->flags.bit.expedite = 0;
-	}
-	break;
+    if ( WAKES_SLOTS(stream) ) return wake_slots ( stream );
+    target = stream->is_writer ? 
+	stream->buf->reader_pid : stream->buf->writer_pid;
+    *WAKE_STAMP ( stream->buf, !stream->is_writer ) = clock_usec();
 
-      case MEMSTREAM_STATE_FULL:
-	/* Copy rest of data, reset state to IDLE if we consumed all pending */
-	if ( (buf->read_pos+segment) >= buf->write_pos ) {
-	     buf->state = MEMSTREAM_STATE_IDLE;
-	     report->flags.bit.expedite = buf->flags.bit.expedite;
-	     buf->flags.bit.expedite = 0;
-	}
-	break;
+    if ( !wake_process ( stream, target, 0 ) ) {
+	/*
+	 * Target went away.  Don't trust spinlock state.
+	 */
+	stream->buf->state = MEMSTREAM_STATE_CLOSED;
+	return 0;
+    }
+    id = *NOTIFY_ID ( stream->buf, !stream->is_writer );
+    if ( id ) notify_signal ( stream, target, id );
+    return COMMBUF_COMPLETED;
+}
+/*
+ * Current time in milliseconds, for timing out waits.
+ */
+static long long clock_msec ( void )
+{
+    long long now;
 
-      case MEMSTREAM_STATE_WRITER_DONE:
-	/* Peer closed pipe, flush data until empty */
-	if ( segment == 0 ) status = COMMBUF_DISCARDED;
-	break;
+    SYS$GETTIM ( &now );
+    return now / 10000;
+}
+static long long clock_usec ( void )
+{
+    long long now;
 
-      case MEMSTREAM_STATE_READER_DONE:
-	segment = 0;
-	status = COMMBUF_ABORT;		/* Attempt to read from closed stream */
-	break;
+    SYS$GETTIM ( &now );
+    return now / 10;
+}
+/*
+ * Deadline timer AST.  A timer request of our own is used rather than
+ * $SCHDWK, whose $CANWAK would cancel wakeups the application scheduled.
+ */
+static void deadline_ast ( void *stream )
+{
+    SYS$WAKE ( 0, 0 );
+}
+static int hibernate ( memstream stream )
+{
+    long long delta, start;
+    int status, timer;
 
-      case MEMSTREAM_STATE_CLOSED:
-	segment = 0;
-	status = COMMBUF_ABORT;		/* attempt to write to closed stream */
-	break;
+    if ( stream->stats ) stream->stats->waits++;
+    start = stream->stats ? clock_usec() : 0;
+    if ( wait_deadline ( stream ) ) {
+	/*
+	 * Tee writer dropping lagging readers, writer waiting for reader
+	 * to leave old block, or reader of batching writer, wait no later
+	 * than deadline.
+	 */
+	delta = wait_deadline ( stream ) - clock_msec();
+	if ( delta < 1 ) delta = 1;
+	delta = delta * -10000;
+	timer = SYS$SETIMR ( EFN$C_ENF, &delta, deadline_ast, stream, 0 );
+	status = SYS$HIBER();
+	if ( timer&1 ) SYS$CANTIM ( stream, 0 );
+    } else status = SYS$HIBER();
+    if ( stream->stats ) note_wait ( stream, start );
+    return status;
+}
 
-      default:
-	segment = 0;
-	status = COMMBUF_ABORT;
-	break;
+#else
+/****************************************************************************/
+/* POSIX platform layer.  Process wait and wake use a pair of futex words
+ * in the commbuf, one per side, so waits are keyed to the stream rather
+ * than the process.  Each word emulates the VMS wake pending flag:
+ * wake_peer() sets it and hibernate() consumes it.
+ */
+#define WAKE_WORD(buf,is_writer) (&(buf)->wake_pending[(is_writer)?0:1])
+
+static void memstream_exit ( void )
+{
+    memstream_rundown ( &rundown.status, &rundown.open_streams );
+}
+
+static void set_stall_time ( int stall_msec )
+{
+    spn.stall_delta = stall_msec;		/* nanoseconds */
+    spn.stall_delta = spn.stall_delta * 1000000;
+}
+
+static int set_spn_self ( void )
+{
+    long cpu_count;
+
+    spn.self = getpid();
+    cpu_count = sysconf ( _SC_NPROCESSORS_ONLN );
+    spn.cpu_count = (cpu_count > 0) ? cpu_count : 1;
+    set_stall_time ( spn.stall_msec );
+
+    if ( spn.cpu_count == 1 ) {
+	/*
+	 * Spin locks don't make progress when only 1 CPU, minimize the
+	 * spin and just yield the processor when lock is busy.
+	 */
+	spn.initial_retry = 2;
+	spn.stall_retry = 1;
+	spn.stall_msec = 0;
+	spn.stall_delta = 0;
     }
     /*
-     * Copy data and update read position.  Reset if we've read all data.
+     * Force any open streams to closed state on program exit.
      */
-    if ( segment > 0 ) {
-	__MEMCPY ( bytes, (void *) src, segment );
-	buf->read_pos += segment;
-	if ( buf->read_pos == buf->write_pos ) {
-	    buf->read_pos = 0;
-	    buf->write_pos = 0;
-	    if ( !buf->writer_pid ) {
-		/* Writer went away, force close if he didn't do so */
-		buf->state = MEMSTREAM_STATE_WRITER_DONE;
-	    }
+    if ( exit_handler_desc.handler == 0 ) {
+	rundown.open_streams = 0;
+	rundown.status = 1;
+	exit_handler_desc.handler = memstream_rundown;
+	if ( atexit ( memstream_exit ) != 0 ) 
+	    printf ( "Bugcheck, atexit failed\n" );
+    }
+    return 1;
+}
+
+/*
+ * Lock flag is 0 when free, 1 when held, and 2 when held with a parked
+ * waiter that release_lock() must wake via futex.
+ */
+static int try_lock ( volatile struct commbuf *buf, int retry )
+{
+    int expected;
+
+    for ( ; retry > 0; --retry ) {
+	expected = 0;
+	if ( (atomic_load_explicit ( &buf->lock.state.flag, 
+		memory_order_relaxed ) == 0) && 
+		atomic_compare_exchange_strong_explicit ( 
+		&buf->lock.state.flag, &expected, 1, 
+		memory_order_acquire, memory_order_relaxed ) ) {
+	    return 1;
 	}
     }
-    /*
-     * Save final result and release mutex.
-     */
-    report->exit_state = buf->state;
-    report->transferred = segment;
-    release_lock ( buf );
+    return 0;
+}
 
-    return status;
+static void yield_processor ( void )
+{
+    sched_yield();
+}
+
+static void park_lock ( volatile struct commbuf *buf )
+{
+    struct timespec stall, *timeout;
+
+    timeout = 0;
+    if ( spn.stall_delta > 0 ) {
+	/* Bound each park by stall time, as VMS does */
+	stall.tv_sec = spn.stall_delta / 1000000000;
+	stall.tv_nsec = spn.stall_delta % 1000000000;
+	timeout = &stall;
+    }
+    while ( atomic_exchange_explicit ( &buf->lock.state.flag, 2,
+		memory_order_acquire ) != 0 ) {
+	spn.spinlock_fails++;
+	syscall ( SYS_futex, &buf->lock.state.flag, FUTEX_WAIT, 2, 
+		timeout, 0, 0 );
+    }
+}
+
+static int release_lock ( memstream stream, volatile struct commbuf *buf )
+{
+    note_lock_release ( stream );
+    buf->lock.state.owner = 0;
+    if ( atomic_exchange_explicit ( &buf->lock.state.flag, 0, 
+		memory_order_release ) == 2 ) {
+	syscall ( SYS_futex, &buf->lock.state.flag, FUTEX_WAKE, 1, 0, 0, 0 );
+    }
+    return 1;
 }
+
+static void acquire_lock ( memstream stream );
+
+static void seize_lock ( memstream stream )
+{
+    volatile struct commbuf *buf;
+
+    buf = stream->buf;
+    if ( try_lock ( buf, 1 ) ) buf->lock.state.owner = spn.self;
+    else if ( buf->lock.state.owner != spn.self ) acquire_lock ( stream );
+}
+
 /*
- * Closedown commbuf.
+ * Wait handles for foreign event loops, see memstream_wait_fd().  An
+ * eventfd can only be signalled by processes that share it, so the handle
+ * is a datagram socket bound to an abstract name built from the waiter's
+ * pid and the handle id.  The peer sends a byte to it whenever it wakes
+ * us, a full queue means a notification is pending anyway.
  */
-static int close_commbuf ( volatile struct commbuf *buf, int close_state )
+static int notify_sender = -1;		/* shared by all streams */
+
+static void notify_address ( struct sockaddr_un *addr, socklen_t *len,
+	pid_t pid, int id )
 {
-    int prev_state;
+    __MEMSET ( addr, 0, sizeof(struct sockaddr_un) );
+    addr->sun_family = AF_UNIX;
+    *len = offsetof(struct sockaddr_un,sun_path) + 1 + 
+	sprintf ( &addr->sun_path[1], "memstream-notify-%d-%d", 
+	(int) pid, id );
+}
 
-    acquire_lock ( buf );
-    /*
-     * Upgrade close state to full if partner also closed.
-     */
-    prev_state = buf->state;
-    if ( close_state == MEMSTREAM_STATE_WRITER_DONE ) {
-	if ( buf->state == MEMSTREAM_STATE_READER_DONE )
-	    close_state = MEMSTREAM_STATE_CLOSED;
-    } else if ( close_state == MEMSTREAM_STATE_READER_DONE ) {
-	if ( buf->state == MEMSTREAM_STATE_WRITER_DONE )
-	    close_state = MEMSTREAM_STATE_CLOSED;
+static int notify_create ( memstream stream )
+{
+    static int last_id;
+    struct sockaddr_un addr;
+    socklen_t len;
+    int fd;
+
+    fd = socket ( AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+    if ( fd < 0 ) return -1;
+    last_id++;
+    notify_address ( &addr, &len, spn.self, last_id );
+    if ( bind ( fd, (struct sockaddr *) &addr, len ) < 0 ) {
+	close ( fd );
+	return -1;
     }
-    buf->state = close_state;
-    release_lock ( buf );
-    return prev_state;
+    stream->notify.fd = fd;
+    stream->notify.id = last_id;
+    return fd;
 }
 
-/*
-* Check to see if peer has finished using its side of the stream.
-*/
-int is_commbuf_peer_done(volatile struct commbuf *buf, int is_writer)
+static void notify_signal ( memstream stream, pid_t target, int id )
 {
-int ret_val = 0;
+    struct sockaddr_un addr;
+    socklen_t len;
+    char token;
 
-acquire_lock ( buf );
-if (is_writer)
-   ret_val = (buf->state == MEMSTREAM_STATE_READER_DONE);
-else
-   ret_val = (buf->state == MEMSTREAM_STATE_WRITER_DONE);
-release_lock ( buf );
+    if ( notify_sender < 0 ) {
+	notify_sender = socket ( AF_UNIX, 
+		SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+	if ( notify_sender < 0 ) return;
+    }
+    notify_address ( &addr, &len, target, id );
+    token = 1;
+    sendto ( notify_sender, &token, 1, MSG_DONTWAIT, 
+	(struct sockaddr *) &addr, len );
+}
 
-return ret_val;
+static void notify_drain ( memstream stream )
+{
+    char token[16];
+
+    while ( recv ( stream->notify.fd, token, sizeof(token), 
+	MSG_DONTWAIT ) > 0 );
+}
+
+static void notify_delete ( memstream stream )
+{
+    if ( !stream->notify.id ) return;
+    close ( stream->notify.fd );
+    stream->notify.id = 0;
 }
 
-/***************************************************************************/
 /*
- * Process block/unblock primitives, this implementation use $HIBER/$WAKE.
+ * Wake_process sets target's wake word and returns 0 if target no
+ * longer exists.
  */
+static int wake_process ( memstream stream, pid_t target,
+	volatile commbuf_atomic *word )
+{
+    long woken;
+
+    if ( stream->stats ) stream->stats->signals++;
+    atomic_store_explicit ( word, 1, memory_order_release );
+    woken = syscall ( SYS_futex, word, FUTEX_WAKE, 1, 0, 0, 0 );
+    if ( (woken == 0) && target && (kill ( target, 0 ) < 0) && 
+		(errno == ESRCH) ) return 0;
+    return COMMBUF_COMPLETED;
+}
+
 static int wake_peer ( memstream stream )
 {
-    int status;
     pid_t target;
+    int id;
+
+    if ( WAKES_SLOTS(stream) ) return wake_slots ( stream );
     target = stream->is_writer ? 
 	stream->buf->reader_pid : stream->buf->writer_pid;
+    *WAKE_STAMP ( stream->buf, !stream->is_writer ) = clock_usec();
 
-    if ( stream->stats ) stream->stats->signals++;
-    status = SYS$WAKE ( &target, 0 );
-    if ( status == SS$_NONEXPR ) {
+    if ( !wake_process ( stream, target, 
+		WAKE_WORD ( stream->buf, !stream->is_writer ) ) ) {
 	/*
 	 * Target went away.  Don't trust spinlock state.
 	 */
 	stream->buf->state = MEMSTREAM_STATE_CLOSED;
 	return 0;
     }
+    id = *NOTIFY_ID ( stream->buf, !stream->is_writer );
+    if ( id ) notify_signal ( stream, target, id );
     return COMMBUF_COMPLETED;
 }
+
+/*
+ * Current time in milliseconds, for timing out waits.
+ */
+static long long clock_msec ( void )
+{
+    struct timespec now;
+
+    clock_gettime ( CLOCK_MONOTONIC, &now );
+    return (now.tv_sec * 1000LL) + (now.tv_nsec / 1000000);
+}
+
+static long long clock_usec ( void )
+{
+    struct timespec now;
+
+    clock_gettime ( CLOCK_MONOTONIC, &now );
+    return (now.tv_sec * 1000000LL) + (now.tv_nsec / 1000);
+}
+
 static int hibernate ( memstream stream )
 {
-    int status;
+    volatile commbuf_atomic *word;
+    struct timespec wait, *timeout;
+    long long delta, start;
 
     if ( stream->stats ) stream->stats->waits++;
-    status = SYS$HIBER();
-    return status;
+    start = stream->stats ? clock_usec() : 0;
+    /* MPSC writers and tee readers each wait on their own slot */
+    if ( stream->fanin.slot ) word = &stream->fanin.slot->wake;
+    else if ( stream->tee.reader ) word = &stream->tee.reader->slot.wake;
+    else word = WAKE_WORD ( stream->buf, stream->is_writer );
+    timeout = 0;
+    if ( wait_deadline ( stream ) ) {
+	/*
+	 * Tee writer dropping lagging readers, writer waiting for reader
+	 * to leave old block, or reader of batching writer, wait no later
+	 * than deadline.
+	 */
+	delta = wait_deadline ( stream ) - clock_msec();
+	if ( delta < 1 ) delta = 1;
+	wait.tv_sec = delta / 1000;
+	wait.tv_nsec = (delta % 1000) * 1000000;
+	timeout = &wait;
+    }
+    while ( atomic_exchange ( word, 0 ) == 0 ) {
+	if ( (syscall ( SYS_futex, word, FUTEX_WAIT, 0, timeout, 0, 0 ) < 0)
+		&& (errno == ETIMEDOUT) ) break;
+    }
+    if ( stream->stats ) note_wait ( stream, start );
+    return 1;
+}
+#endif
+/***********************************************************************/
+/* Adaptive spin lock acquisition.  A contended lock is first spun on for
+ * up to the stream's spin budget, which tracks the attempts recent
+ * acquisitions needed.  If that fails, back off with exponentially more
+ * yields between retries, then park until the lock is released.  The
+ * phases reached are counted in the stream's statistics.
+ */
+#define MEMSTREAM_SPIN_MIN 16		/* floor of learned spin budget */
+#define MEMSTREAM_BACKOFF_ROUNDS 6	/* yield rounds before parking */
+
+static void learn_spin_budget ( memstream stream, int spins )
+{
+    stream->spin.average += (spins - stream->spin.average) / 8;
+    stream->spin.budget = (stream->spin.average*2) + MEMSTREAM_SPIN_MIN;
+    if ( stream->spin.budget > spn.initial_retry ) 
+	stream->spin.budget = spn.initial_retry;
 }
 
-static int memstream_rundown ( int *exit_status, memstream *open_streams )
+static void spin_for_lock ( memstream stream )
 {
-    memstream stream;
-    int partial_close;
-    struct commbuf *buf;
-    /*
-     * Traverse list of open streams and force all commbufs to closed state.
-     */
-    for ( stream = *open_streams; stream; stream = stream->next ) {
+    volatile struct commbuf *buf;
+    int spins, round, yields;
 
-	*open_streams = stream->next;	/* remove from list */
-	buf = stream->buf;
-	if ( !buf ) continue;		/* Nothing shared, skip it */
+    buf = stream->buf;
+#ifdef __VMS
+    if ( (spn.cpu_count == 1) && (buf->fmt_version != MEMSTREAM_FMT_MPSC) &&
+	(buf->fmt_version != MEMSTREAM_FMT_TEE) ) {
 	/*
-	 * Make effort to lock commbuf so we can change state.
+	 * Spinning is pointless, wait for holder to wake us.  Lock only
+	 * records one waiter, so MPSC and tee commbufs back off and park
+	 * below.
 	 */
-	if ( __LOCK_LONG_RETRY(&buf->lock.state.flag, 1) == 0 ) {
-	    /* Lock failed, see if we already own it before long wait */
-	    if ( stream->buf->lock.state.owner != spn.self ) {
-		__LOCK_LONG(&buf->lock.state.flag);
-		buf->lock.state.owner = spn.self;
-	    }
-	}
+	if ( stream->stats && buf->lock.state.flag ) stream->stats->lock_parks++;
+	uniprocessor_lock ( buf );
+	return;
+    }
+#endif
+    if ( try_lock ( buf, 1 ) == 0 ) {
 	/*
-	 * Force state to closed, giving kick to peer if it is waiting.
+	 * Lock busy, spin.
 	 */
-	if ( stream->is_writer ) {
-	    partial_close = MEMSTREAM_STATE_WRITER_DONE;
-	    buf->writer_pid = 0;
-	} else {
-	    partial_close = MEMSTREAM_STATE_READER_DONE;
-	    buf->reader_pid = 0;
+	if ( stream->stats ) stream->stats->lock_spins++;
+	for ( spins = 1; spins < stream->spin.budget; spins++ ) {
+	    if ( try_lock ( buf, 1 ) ) break;
 	}
-	switch ( stream->buf->state ) {
-	  case MEMSTREAM_STATE_IDLE:
-	    stream->buf->state = partial_close;
-	    break;
+	learn_spin_budget ( stream, spins );
 
-	  case MEMSTREAM_STATE_EMPTY:
-	    stream->buf->state = partial_close;
-	    if ( stream->is_writer ) wake_peer ( stream );
-	    break;
+	if ( spins >= stream->spin.budget ) {
+	    /*
+	     * Spin budget exhausted, back off.
+	     */
+	    if ( stream->stats ) stream->stats->lock_yields++;
+	    for ( round = 0; round < MEMSTREAM_BACKOFF_ROUNDS; round++ ) {
+		for ( yields = 1<<round; yields > 0; --yields ) 
+		    yield_processor();
+		if ( try_lock ( buf, spn.stall_retry ) ) break;
+	    }
+	    if ( round >= MEMSTREAM_BACKOFF_ROUNDS ) {
+		if ( stream->stats ) stream->stats->lock_parks++;
+		park_lock ( buf );
+	    }
+	}
+    }
+    buf->lock.state.owner = spn.self;
+}
 
-	  case MEMSTREAM_STATE_FULL:
-	    stream->buf->state = partial_close;
-	    if ( !stream->is_writer ) wake_peer ( stream );
-	    break;
+static void acquire_lock ( memstream stream )
+{
+    unsigned long long start;
 
-	  case MEMSTREAM_STATE_WRITER_DONE:
-	  case MEMSTREAM_STATE_READER_DONE:
-	    if ( stream->buf->state != partial_close )
-		stream->buf->state = MEMSTREAM_STATE_CLOSED;
-	    break;
+    if ( !stream->stats ) {
+	spin_for_lock ( stream );
+	return;
+    }
+    start = read_cycle_counter();
+    spin_for_lock ( stream );
+    note_lock_acquired ( stream, start );
+}
+/***********************************************************************/
+/* Commbuf accounting, caller must hold spin lock.
+ *    commbuf_pending()		Bytes written but not yet read.
+ *    commbuf_space()		Bytes that may be written before buffer full.
+ *    commbuf_resume_level()	Reader wakes a blocked (FULL) writer when
+ *				pending drops to this level or below.
+ */
+/*
+ * Bytes the slowest tee reader has yet to read, dropped readers excluded.
+ */
+static int tee_lag ( volatile struct commbuf *buf )
+{
+    volatile struct tee_reader *reader;
+    int head, lag, max_lag, i;
 
-	  case MEMSTREAM_STATE_CLOSED:
-	  default:
-	    break;
-	}
-	release_lock ( stream->buf );
+    head = load_acquire ( &TEE_LAYOUT(buf)->head.pos );
+    max_lag = 0;
+    for ( i = 0; i < TEE_MAX_READERS; i++ ) {
+	reader = &TEE_LAYOUT(buf)->reader[i];
+	if ( !reader->slot.pid || reader->dropped ) continue;
+	lag = head - load_acquire ( &reader->tail );
+	if ( lag < 0 ) lag += buf->data_limit;
+	if ( lag > max_lag ) max_lag = lag;
     }
-    return 1;
+    return max_lag;
 }
+static int commbuf_pending ( volatile struct commbuf *buf )
+{
+    int pending;
 
-/************************************************************************/
-/* Exported functions:
+    if ( buf->fmt_version == MEMSTREAM_FMT_SPSC ) {
+	pending = load_acquire ( &SPSC_LAYOUT(buf)->head.pos ) -
+		load_acquire ( &SPSC_LAYOUT(buf)->tail.pos );
+    } else if ( buf->fmt_version == MEMSTREAM_FMT_MPSC ) {
+	/* includes claimed records not yet committed */
+	pending = load_acquire ( &MPSC_LAYOUT(buf)->claim.pos ) -
+		load_acquire ( &MPSC_LAYOUT(buf)->tail.pos );
+    } else if ( buf->fmt_version == MEMSTREAM_FMT_TEE ) {
+	pending = tee_lag ( buf );		/* slowest reader */
+    } else {
+	pending = buf->write_pos - buf->read_pos;
+    }
+    if ( pending < 0 ) pending += buf->data_limit;	/* ring wrapped */
+    return pending;
+}
+/*
+ * MPSC room for a record (header included) at the claim cursor and, after
+ * padding to the end of the data area, at its start.  Claim may never
+ * catch up to tail, that would look empty.
  */
-int memstream_set_spinlock ( 
-	int initial_retry,	/* retry limit to acquire spinlock */
-	int stall_retry,	/* retry limit after stall */
-	int stall_msec, 	/* Stall time if initial failure */
-	int xfer_segment )	/* limit of data that can be moved while
-				   holding spinlock */
+static void mpsc_extent ( volatile struct commbuf *buf, int *at_claim,
+	int *at_start )
+{
+    int claim, tail;
+
+    claim = MPSC_LAYOUT(buf)->claim.pos;
+    tail = load_acquire ( &MPSC_LAYOUT(buf)->tail.pos );
+    if ( claim < tail ) {
+	*at_claim = tail - claim - MPSC_HDR_SIZE;
+	*at_start = 0;
+    } else {
+	*at_claim = buf->data_limit - claim;
+	if ( tail == 0 ) *at_claim -= MPSC_HDR_SIZE;
+	*at_start = tail - MPSC_HDR_SIZE;
+    }
+}
+/*
+ * Largest single MPSC record, writes up to this size reach the reader
+ * whole.  Any claim this size fits once the reader drains to the resume
+ * level.
+ */
+static int mpsc_record_limit ( volatile struct commbuf *buf )
+{
+    return (buf->data_limit / 8) & ~(MPSC_HDR_SIZE-1);
+}
+
+static int commbuf_space ( volatile struct commbuf *buf )
+{
+    int at_claim, at_start;
+
+    if ( buf->fmt_version == MEMSTREAM_FMT_MPSC ) {
+	mpsc_extent ( buf, &at_claim, &at_start );
+	if ( at_start > at_claim ) at_claim = at_start;
+	at_claim -= MPSC_HDR_SIZE;
+	if ( at_claim > mpsc_record_limit ( buf ) ) 
+	    at_claim = mpsc_record_limit ( buf );
+	return (at_claim > 0) ? at_claim : 0;
+    }
+    if ( buf->fmt_version != MEMSTREAM_FMT_VERSION )
+	return buf->data_limit - 1 - commbuf_pending ( buf );
+
+    return buf->data_limit - buf->write_pos;
+}
+static int commbuf_resume_level ( volatile struct commbuf *buf )
 {
-    int status;
-    /*
-     * Fill in PID and adjust defaults if not initialized yet.
-     */
-    if ( !spn.self ) status = set_spn_self ( );
-    /*
-     * Overwrite spn structure with caller's arguments
-     */
-    spn.initial_retry = initial_retry;
-    spn.stall_retry = stall_retry;
-    spn.stall_msec = stall_msec;
-    spn.seg_limit = xfer_segment;
-    spn.stall_delta = stall_msec;	/* VMS delta time */
     /*
-     * Compute VMS delta time for stall and fetch current process's PID.
+     * Linear buffer has no space until it is completely drained, a ring
+     * lets the writer resume once half the buffer is free again.
      */
-    if ( spn.stall_delta > 0 ) {
-	spn.stall_delta = spn.stall_delta * -10000;
-    } else {
-	SYS$GETTIM ( &spn.stall_delta );
+    if ( buf->fmt_version != MEMSTREAM_FMT_VERSION ) 
+	return buf->data_limit / 2;
+    return 0;
+}
+/*
+ * Writer that added data while reader waits (state EMPTY) calls this with
+ * the lock held.  If writer is batching and the reader waits with a
+ * deadline, it is left asleep until low water mark reached, otherwise
+ * state goes to IDLE.  Returns EMPTY if caller should wake reader.
+ */
+static int release_waiting_reader ( memstream stream, 
+	volatile struct commbuf *buf )
+{
+    if ( buf->flags.bit.timed_wait && !buf->flags.bit.expedite &&
+	(commbuf_pending ( buf ) < stream->batch.low_water) )
+	return MEMSTREAM_STATE_IDLE;	/* reader's deadline wakes it */
+    buf->state = MEMSTREAM_STATE_IDLE;
+    return MEMSTREAM_STATE_EMPTY;
+}
+static volatile char *commbuf_data ( volatile struct commbuf *buf )
+{
+    if ( buf->fmt_version == MEMSTREAM_FMT_SPSC ) return SPSC_LAYOUT(buf)->data;
+    if ( buf->fmt_version == MEMSTREAM_FMT_MPSC ) return MPSC_LAYOUT(buf)->data;
+    if ( buf->fmt_version == MEMSTREAM_FMT_TEE ) return TEE_LAYOUT(buf)->data;
+    return buf->data;
+}
+/*
+ * Return position count bytes past pos, wrapping for ring formats.
+ */
+static int commbuf_advance ( volatile struct commbuf *buf, int pos, int count )
+{
+    pos += count;
+    if ( (pos >= buf->data_limit) && 
+	(buf->fmt_version != MEMSTREAM_FMT_VERSION) ) pos -= buf->data_limit;
+    return pos;
+}
+/***********************************************************************/
+/* Copy kernels.  Data moves between callers' buffers and the data area
+ * through copy_bytes, which picks a kernel by size.  The C library's
+ * memcpy, already vectorized, handles small and medium copies.  Where
+ * the processor has SSE2, copies of at least spn.stream_copy bytes use
+ * non-temporal stores, which skip the cache so a large transfer doesn't
+ * evict data its process still needs for bytes the peer reads much
+ * later.  The threshold is picked by calibrate_copy the first time a
+ * copy is big enough to need it, or taken from DMPIPE_MEMSTREAM_NT_COPY
+ * (0 for never).  Only fan-in records and zero-copy regions filled or
+ * drained by readv/writev are copied in pieces that large.
+ */
+#if defined(__SSE2__) && !defined(__VMS)
+#define MEMSTREAM_STREAM_COPY_NEVER 0x7fffffff
+#define MEMSTREAM_CALIBRATE_MIN 0x10000	/* smallest size tried */
+#define MEMSTREAM_CALIBRATE_MAX 0x100000	/* largest size tried */
+
+static void stream_copy ( void *dst_vp, const void *src_vp, size_t count )
+{
+    char *dst;
+    const char *src;
+    size_t lead;
+    __m128i a, b, c, d;
+
+    dst = dst_vp;
+    src = src_vp;
+    lead = (0 - (size_t) dst) & 15;	/* align destination */
+    if ( lead > count ) lead = count;
+    memcpy ( dst, src, lead );
+    dst += lead;
+    src += lead;
+    count -= lead;
+    for ( ; count >= 64; count -= 64 ) {
+	a = _mm_loadu_si128 ( (const __m128i *) src );
+	b = _mm_loadu_si128 ( (const __m128i *) (src+16) );
+	c = _mm_loadu_si128 ( (const __m128i *) (src+32) );
+	d = _mm_loadu_si128 ( (const __m128i *) (src+48) );
+	_mm_stream_si128 ( (__m128i *) dst, a );
+	_mm_stream_si128 ( (__m128i *) (dst+16), b );
+	_mm_stream_si128 ( (__m128i *) (dst+32), c );
+	_mm_stream_si128 ( (__m128i *) (dst+48), d );
+	src += 64;
+	dst += 64;
+    }
+    _mm_sfence();		/* order before caller publishes cursor */
+    memcpy ( dst, src, count );
+}
+/*
+ * Time passing size bytes through dst repeatedly with each kernel, best
+ * of 2: copy in as a writer would, then out as the reader does.  Return
+ * true if non-temporal stores are at least 10% faster.
+ */
+static int stream_copy_wins ( char *dst, char *src, size_t size )
+{
+    unsigned long long start, ticks[2], best[2];
+    int trial, kernel, rep;
+
+    best[0] = best[1] = ~0ULL;
+    for ( trial = 0; trial < 2; trial++ ) {
+	for ( kernel = 0; kernel < 2; kernel++ ) {
+	    start = read_cycle_counter();
+	    for ( rep = MEMSTREAM_CALIBRATE_MAX/size; rep > 0; --rep ) {
+		if ( kernel ) stream_copy ( dst, src, size );
+		else memcpy ( dst, src, size );
+		memcpy ( src, dst, size );
+	    }
+	    ticks[kernel] = read_cycle_counter() - start;
+	    if ( ticks[kernel] < best[kernel] ) best[kernel] = ticks[kernel];
+	}
     }
+    return (best[1]*10) < (best[0]*9);
+}
 
-    return status;
+static void calibrate_copy ( void )
+{
+    char *env, *src, *dst;
+    size_t size;
+
+    spn.stream_copy = MEMSTREAM_STREAM_COPY_NEVER;
+    env = getenv ( "DMPIPE_MEMSTREAM_NT_COPY" );
+    if ( env ) {
+	if ( atoi ( env ) > 0 ) spn.stream_copy = atoi ( env );
+	return;
+    }
+    src = malloc ( MEMSTREAM_CALIBRATE_MAX*2 );
+    if ( !src ) return;
+    dst = src + MEMSTREAM_CALIBRATE_MAX;
+    __MEMSET ( src, 1, MEMSTREAM_CALIBRATE_MAX*2 );
+    for ( size = MEMSTREAM_CALIBRATE_MIN; size <= MEMSTREAM_CALIBRATE_MAX;
+	    size *= 4 ) {
+	if ( stream_copy_wins ( dst, src, size ) ) {
+	    spn.stream_copy = size;
+	    break;
+	}
+    }
+    free ( src );
+}
+
+static void copy_bytes ( void *dst_vp, const void *src_vp, int count )
+{
+    char *dst;
+    const char *src;
+
+    dst = dst_vp;
+    src = src_vp;
+    if ( count >= MEMSTREAM_CALIBRATE_MIN ) {
+	if ( !spn.stream_copy ) calibrate_copy();
+	if ( count >= spn.stream_copy ) {
+	    stream_copy ( dst, src, count );
+	    return;
+	}
+	/*
+	 * Keep memcpy under the size at which the C library switches to
+	 * non-temporal stores on its own, calibration made that choice.
+	 */
+	for ( ; count > MEMSTREAM_CALIBRATE_MIN; 
+		count -= MEMSTREAM_CALIBRATE_MIN ) {
+	    __MEMCPY ( dst, src, MEMSTREAM_CALIBRATE_MIN );
+	    dst += MEMSTREAM_CALIBRATE_MIN;
+	    src += MEMSTREAM_CALIBRATE_MIN;
+	}
+    }
+    __MEMCPY ( dst, src, count );
 }
+#else
+#define copy_bytes(dst,src,count) __MEMCPY(dst,src,count)
+#endif
 /*
- * create a new memstream and assign.
+ * Most data linear and ring formats move while holding the spin lock:
+ * seg_limit, but no more than half the buffer so the peer can work on the
+ * other half meanwhile.
  */
-memstream memstream_create ( void *shared_blk, int blk_size, int is_writer )
+static int lock_segment_limit ( volatile struct commbuf *buf )
 {
-    memstream ctx;
-    struct commbuf *buf;
+    if ( (spn.seg_limit*2) > buf->data_limit ) return buf->data_limit / 2;
+    return spn.seg_limit;
+}
+/*
+ * Lock-free formats copy without the lock, but still publish in pieces so
+ * the peer can start on the first while the rest is copied and the data
+ * is still in cache when it does.
+ */
+#define MEMSTREAM_LOCKFREE_SEGMENT 0x4000
+/*
+ * Copy between caller's buffer and commbuf data area starting at offset
+ * pos, splitting the copy if it runs past data_limit (ring format only).
+ * Return updated position.
+ */
+static int copy_to_data ( volatile struct commbuf *buf, int pos, 
+	const char *bytes, int count )
+{
+    int seg;
+    volatile char *data;
+
+    data = commbuf_data ( buf );
+    seg = buf->data_limit - pos;
+    if ( seg > count ) seg = count;
+    copy_bytes ( (void *) &data[pos], bytes, seg );
+    if ( seg < count ) copy_bytes ( (void *) data, &bytes[seg], count-seg );
+
+    return commbuf_advance ( buf, pos, count );
+}
+static int copy_from_data ( volatile struct commbuf *buf, int pos, 
+	char *bytes, int count )
+{
+    int seg;
+    volatile char *data;
+
+    data = commbuf_data ( buf );
+    seg = buf->data_limit - pos;
+    if ( seg > count ) seg = count;
+    copy_bytes ( bytes, (void *) &data[pos], seg );
+    if ( seg < count ) copy_bytes ( &bytes[seg], (void *) data, count-seg );
+
+    return commbuf_advance ( buf, pos, count );
+}
+/*
+ * Move count bytes between a contiguous region of the data area and the
+ * caller's iovec array, cursor (element and offset) tracks where in the
+ * array the previous call left off.  Then, if set, is where to go after
+ * the first element, letting a record's length prefix precede the array.
+ */
+struct iov_cursor {
+    const struct iovec *iov;	/* current element */
+    size_t offset;		/* bytes of current element already moved */
+    const struct iovec *then;	/* element following current one */
+};
+
+static void next_iov ( struct iov_cursor *cur )
+{
+    cur->offset = 0;
+    if ( cur->then ) {
+	cur->iov = cur->then;
+	cur->then = 0;
+    } else cur->iov++;
+}
+static void gather_iov ( volatile char *region, int count,
+	struct iov_cursor *cur )
+{
+    size_t seg;
+
+    while ( count > 0 ) {
+	seg = cur->iov->iov_len - cur->offset;
+	if ( seg > (size_t) count ) seg = count;
+	copy_bytes ( (void *) region, (char *) cur->iov->iov_base + 
+		cur->offset, seg );
+	region += seg;
+	count -= seg;
+	cur->offset += seg;
+	if ( cur->offset >= cur->iov->iov_len ) next_iov ( cur );
+    }
+}
+static void scatter_iov ( volatile char *region, int count,
+	struct iov_cursor *cur )
+{
+    size_t seg;
+
+    while ( count > 0 ) {
+	seg = cur->iov->iov_len - cur->offset;
+	if ( seg > (size_t) count ) seg = count;
+	copy_bytes ( (char *) cur->iov->iov_base + cur->offset, 
+		(void *) region, seg );
+	region += seg;
+	count -= seg;
+	cur->offset += seg;
+	if ( cur->offset >= cur->iov->iov_len ) next_iov ( cur );
+    }
+}
+/*
+ * Sum iovec lengths, returning -1 if array is invalid or total will
+ * not fit an int.
+ */
+static int iov_total ( const struct iovec *iov, int iovcnt )
+{
+    int i;
+    size_t total;
+
+    if ( (iovcnt < 0) || (!iov && (iovcnt > 0)) ) return -1;
+    for ( total = 0, i = 0; i < iovcnt; i++ ) {
+	if ( iov[i].iov_len > (size_t) 0x7fffffff - total ) return -1;
+	total += iov[i].iov_len;
+    }
+    return (int) total;
+}
+/***********************************************************************/
+/* Lock-free transfer primitives for SPSC format commbufs.  Return values
+ * and report contents match put_to_commbuf and get_from_commbuf below.
+ *
+ * Only the writer moves head and only the reader moves tail, so data
+ * is copied without holding the spin lock.  The lock serializes state
+ * changes; each side arms EMPTY or FULL under the lock, issues a memory
+ * barrier, and rechecks the peer's cursor, while the peer stores its
+ * cursor, issues a barrier, and then checks the state.  Either the arming
+ * side sees the new cursor or the peer sees the armed state and wakes it.
+ * A transfer of 0 bytes with status COMMBUF_COMPLETED means a state race
+ * was resolved and the caller should simply retry.  A null bytes argument
+ * reserves space or peeks at data in place, see commit_to_commbuf and
+ * consume_from_commbuf.
+ */
+static int put_to_spsc ( const char *bytes, int count, 
+	memstream stream, struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+    volatile struct spsc_layout *ring;
+    int head, available, segsize, status;
+
+    buf = stream->buf;
+    ring = SPSC_LAYOUT(buf);
+    report->enter_state = buf->state;
+    report->flags.mask = 0;
+    report->transferred = 0;
+    switch ( report->enter_state ) {
+      case MEMSTREAM_STATE_IDLE:
+      case MEMSTREAM_STATE_EMPTY:
+	break;
+      case MEMSTREAM_STATE_FULL:
+	/* Spurious wake, only reader moves buffer out of FULL state */
+	report->exit_state = report->enter_state;
+	return COMMBUF_BLOCKED;
+      case MEMSTREAM_STATE_WRITER_DONE:
+      case MEMSTREAM_STATE_READER_DONE:
+	report->exit_state = report->enter_state;
+	return COMMBUF_DISCARDED;
+      default:
+	report->exit_state = report->enter_state;
+	return COMMBUF_ABORT;
+    }
     /*
-     * Initialize buffer or verify it is supported type.
+     * Compute space from our own head and reader's tail.  Reservations
+     * must be contiguous.
      */
-    if ( blk_size <= (sizeof(struct commbuf)+MEMSTREAM_MIN_BLK_SIZE) ) {
-	return 0;		/* block too small */
+    head = ring->head.pos;
+    report->position = head;
+    available = commbuf_space ( buf );
+    if ( bytes ) {
+	if ( count > MEMSTREAM_LOCKFREE_SEGMENT ) 
+	    count = MEMSTREAM_LOCKFREE_SEGMENT;
+    } else if ( available > (buf->data_limit - head) ) {
+	available = buf->data_limit - head;
     }
-    buf = shared_blk;
-    if ( buf->fmt_version == 0 ) {
-	spn.sequence++;
-	buf->fmt_version = MEMSTREAM_FMT_VERSION;
-	buf->ipc_version = MEMSTREAM_IPC_VERSION;
-	buf->sequence = spn.sequence;
-	buf->lock.state_qw = 0;
-	buf->data_limit = blk_size - sizeof(struct commbuf);
-	if ( (spn.seg_limit*2) > buf->data_limit ) {
-	    spn.seg_limit = buf->data_limit > 2;
-        }
-	buf->state = MEMSTREAM_STATE_IDLE;
-	buf->write_pos = 0;
-	buf->read_pos = 0;
+    segsize = (count > available) ? available : count;
 
-    } else if ( buf->fmt_version != MEMSTREAM_FMT_VERSION ) {
+    if ( segsize > 0 ) {
+	report->transferred = segsize;
+	if ( !bytes ) {
+	    report->exit_state = report->enter_state;
+	    return COMMBUF_COMPLETED;		/* space reserved */
+	}
+	head = copy_to_data ( buf, head, bytes, segsize );
+	store_release ( &ring->head.pos, head );
 	/*
-	 * Unknown version.
+	 * Publish before examining state, reader may have armed EMPTY
+	 * state without seeing our data.  Caller wakes reader when it
+	 * sees enter_state of EMPTY.
 	 */
-	return 0;
+	full_barrier();
+	report->enter_state = buf->state;
+	if ( report->enter_state == MEMSTREAM_STATE_EMPTY ) {
+	    acquire_lock ( stream );
+	    report->enter_state = buf->state;
+	    if ( buf->state == MEMSTREAM_STATE_EMPTY ) 
+		report->enter_state = release_waiting_reader ( stream, buf );
+	    report->exit_state = buf->state;
+	    release_lock ( stream, buf );
+	} else report->exit_state = report->enter_state;
+	return COMMBUF_COMPLETED;
     }
     /*
-     * Fill in PID for IPC signalling.
+     * No space, arm FULL state and recheck in case reader freed space
+     * before it could see the new state.
      */
-    if ( !spn.self ) set_spn_self( );
-    if ( is_writer ) buf->writer_pid = spn.self; 
-    else buf->reader_pid = spn.self;
+    acquire_lock ( stream );
+    report->enter_state = buf->state;
+    switch ( buf->state ) {
+      case MEMSTREAM_STATE_IDLE:
+      case MEMSTREAM_STATE_EMPTY:
+	buf->state = MEMSTREAM_STATE_FULL;
+	full_barrier();
+	if ( commbuf_space ( buf ) > 0 ) {
+	    buf->state = MEMSTREAM_STATE_IDLE;
+	    status = COMMBUF_COMPLETED;
+	} else status = COMMBUF_BLOCKED;
+	break;
+
+      case MEMSTREAM_STATE_FULL:
+	status = COMMBUF_BLOCKED;
+	break;
+
+      case MEMSTREAM_STATE_WRITER_DONE:
+      case MEMSTREAM_STATE_READER_DONE:
+	status = COMMBUF_DISCARDED;
+	break;
+
+      default:
+	status = COMMBUF_ABORT;
+	break;
+    }
+    report->exit_state = buf->state;
+    release_lock ( stream, buf );
+
+    return status;
+}
+
+static int get_from_spsc ( memstream stream,
+	char *bytes, int limit, struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+    volatile struct spsc_layout *ring;
+    int tail, available, segment, status;
+
+    buf = stream->buf;
+    ring = SPSC_LAYOUT(buf);
+    report->enter_state = buf->state;
+    report->flags.mask = 0;
+    report->transferred = 0;
+    if ( (report->enter_state != MEMSTREAM_STATE_IDLE) &&
+	 (report->enter_state != MEMSTREAM_STATE_EMPTY) &&
+	 (report->enter_state != MEMSTREAM_STATE_FULL) &&
+	 (report->enter_state != MEMSTREAM_STATE_WRITER_DONE) ) {
+	report->exit_state = report->enter_state;
+	return COMMBUF_ABORT;		/* Attempt to read from closed stream */
+    }
     /*
-     * Allocate context structure for tracking stream.
+     * Compute pending data from writer's head and our own tail.  Peeked
+     * data must be contiguous.
      */
-    ctx = malloc ( sizeof(struct memstream_context) );
-    if ( !ctx ) return ctx;
+    tail = ring->tail.pos;
+    report->position = tail;
+    available = commbuf_pending ( buf );
+    if ( bytes ) {
+	if ( limit > MEMSTREAM_LOCKFREE_SEGMENT ) 
+	    limit = MEMSTREAM_LOCKFREE_SEGMENT;
+	segment = (limit > available) ? available : limit;
+    } else {
+	segment = buf->data_limit - tail;
+	if ( segment > available ) segment = available;
+	if ( segment > limit ) segment = limit;
+    }
 
-    __MEMSET ( ctx, 0, sizeof(struct memstream_context) );
-    ctx->is_writer = is_writer;
-    ctx->buf = buf;
+    if ( segment > 0 ) {
+	report->transferred = segment;
+	if ( !bytes ) {
+	    report->exit_state = report->enter_state;
+	    return COMMBUF_COMPLETED;		/* data left in place */
+	}
+	tail = copy_from_data ( buf, tail, bytes, segment );
+	store_release ( &ring->tail.pos, tail );
+	/*
+	 * Publish freed space, then see if writer is blocked waiting for it.
+	 */
+	full_barrier();
+	report->enter_state = buf->state;
+	if ( (report->enter_state == MEMSTREAM_STATE_FULL) &&
+		(commbuf_pending ( buf ) <= commbuf_resume_level ( buf )) ) {
+	    acquire_lock ( stream );
+	    report->enter_state = buf->state;
+	    if ( buf->state == MEMSTREAM_STATE_FULL ) {
+		buf->state = MEMSTREAM_STATE_IDLE;
+		report->flags.bit.expedite = buf->flags.bit.expedite;
+		buf->flags.bit.expedite = 0;
+	    }
+	    report->exit_state = buf->state;
+	    release_lock ( stream, buf );
+	} else report->exit_state = report->enter_state;
+	return COMMBUF_COMPLETED;
+    }
     /*
-     * Link into open streams list for exit handler.
+     * Nothing to read, arm EMPTY state and recheck in case writer added
+     * data before it could see the new state.
      */
-    ctx->next = rundown.open_streams;
-    rundown.open_streams = ctx;
+    acquire_lock ( stream );
+    report->enter_state = buf->state;
+    available = commbuf_pending ( buf );
+    status = COMMBUF_COMPLETED;
+    switch ( buf->state ) {
+      case MEMSTREAM_STATE_IDLE:
+	if ( available > 0 ) break;
+	buf->state = MEMSTREAM_STATE_EMPTY;
+	buf->flags.bit.timed_wait = stream->batch.timed;
+	full_barrier();
+	if ( commbuf_pending ( buf ) > 0 ) buf->state = MEMSTREAM_STATE_IDLE;
+	else status = COMMBUF_BLOCKED;
+	break;
 
-    return ctx;
+      case MEMSTREAM_STATE_EMPTY:
+	if ( available > 0 ) {
+	    /* Batching writer left us waiting */
+	    buf->state = MEMSTREAM_STATE_IDLE;
+	    break;
+	}
+	buf->flags.bit.timed_wait = stream->batch.timed;
+	status = COMMBUF_BLOCKED;
+	if ( buf->writer_pid == 0 ) {
+	     status = COMMBUF_DISCARDED;
+	} else {
+	     /* Pass along expedite bit status if writer set it */
+	     report->flags.bit.expedite = buf->flags.bit.expedite;
+	     buf->flags.bit.expedite = 0;
+	}
+	break;
+
+      case MEMSTREAM_STATE_FULL:
+	/* Writer waiting for space we already freed */
+	buf->state = MEMSTREAM_STATE_IDLE;
+	report->flags.bit.expedite = buf->flags.bit.expedite;
+	buf->flags.bit.expedite = 0;
+	break;
+
+      case MEMSTREAM_STATE_WRITER_DONE:
+	/* Peer closed pipe, flush data until empty */
+	if ( available == 0 ) status = COMMBUF_DISCARDED;
+	break;
+
+      default:
+	status = COMMBUF_ABORT;
+	break;
+    }
+    report->exit_state = buf->state;
+    release_lock ( stream, buf );
+
+    return status;
 }
+/***********************************************************************/
+/* Transfer primitives for MPSC format commbufs.  Return values and report
+ * contents match put_to_commbuf and get_from_commbuf below.
+ *
+ * A put claims a whole record under the spin lock, so it moves at most
+ * mpsc_record_limit bytes and moves nothing if the record doesn't fit.
+ * Filling and committing the record are done without the lock.  The
+ * reader copies from the record at tail and retires it once all its bytes
+ * are read.  EMPTY arming follows the SPSC handshake.  A writer short of
+ * space instead flags its slot and the shared waiting word; when the
+ * reader retires a record and finds the word set with pending data at or
+ * below the resume level, it clears the word and reports enter_state FULL
+ * and exit_state IDLE so the caller wakes the waiting writers.
+ */
+static int claim_mpsc_record ( volatile struct commbuf *buf, int size )
+{
+    volatile struct mpsc_record *rec;
+    int at_claim, at_start, pos, next;
 
-int memstream_control ( memstream stream, int *new_attributes,
+    mpsc_extent ( buf, &at_claim, &at_start );
+    pos = MPSC_LAYOUT(buf)->claim.pos;
+    if ( size > at_claim ) {
+	if ( size > at_start ) return -1;
+	/*
+	 * Pad rest of data area with an empty record and wrap.
+	 */
+	rec = MPSC_RECORD(buf,pos);
+	rec->size = buf->data_limit - pos;
+	store_release ( &rec->length, 1 );
+	pos = 0;
+    }
+    /*
+     * Header must read as uncommitted before reader can see the claim.
+     */
+    rec = MPSC_RECORD(buf,pos);
+    rec->size = size;
+    store_release ( &rec->length, 0 );
+    next = pos + size;
+    if ( next >= buf->data_limit ) next = 0;
+    store_release ( &MPSC_LAYOUT(buf)->claim.pos, next );
+    return pos;
+}
+/*
+ * Flag writer as waiting for the reader, caller holds lock and must
+ * recheck afterward since the reader frees space without the lock.
+ */
+static void arm_mpsc_wait ( memstream stream )
+{
+    stream->fanin.slot->waiting = 1;
+    store_release ( &MPSC_CONTROL(stream->buf)->waiting, 1 );
+    full_barrier();
+}
+/*
+ * Publish a claimed record holding count bytes.  A count of 0 releases
+ * an abandoned reservation, the reader skips it.
+ */
+static int commit_to_mpsc ( memstream stream, int pos, int count,
+	struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+
+    buf = stream->buf;
+    report->flags.mask = 0;
+    report->transferred = count;
+    report->position = pos;
+    store_release ( &MPSC_RECORD(buf,pos-MPSC_HDR_SIZE)->length, count+1 );
+    /*
+     * Publish before examining state, reader may have armed EMPTY
+     * state without seeing our record.
+     */
+    full_barrier();
+    report->enter_state = buf->state;
+    if ( report->enter_state == MEMSTREAM_STATE_EMPTY ) {
+	acquire_lock ( stream );
+	report->enter_state = buf->state;
+	if ( buf->state == MEMSTREAM_STATE_EMPTY ) 
+	    buf->state = MEMSTREAM_STATE_IDLE;
+	report->exit_state = buf->state;
+	release_lock ( stream, buf );
+    } else report->exit_state = report->enter_state;
+
+    if ( report->enter_state >= MEMSTREAM_STATE_READER_DONE ) {
+	report->transferred = 0;
+	return (report->enter_state == MEMSTREAM_STATE_CLOSED) ?
+		COMMBUF_ABORT : COMMBUF_DISCARDED;
+    }
+    return COMMBUF_COMPLETED;
+}
+
+static int put_to_mpsc ( const char *bytes, int count, 
+	memstream stream, struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+    int size, pos, status;
+
+    buf = stream->buf;
+    report->flags.mask = 0;
+    report->transferred = 0;
+    if ( count > mpsc_record_limit ( buf ) ) count = mpsc_record_limit ( buf );
+    size = MPSC_HDR_SIZE + ((count+MPSC_HDR_SIZE-1) & ~(MPSC_HDR_SIZE-1));
+
+    acquire_lock ( stream );
+    report->enter_state = buf->state;
+    pos = -1;
+    switch ( buf->state ) {
+      case MEMSTREAM_STATE_IDLE:
+      case MEMSTREAM_STATE_EMPTY:
+	pos = claim_mpsc_record ( buf, size );
+	if ( pos < 0 ) {
+	    /* No room, wait unless reader freed some meanwhile */
+	    arm_mpsc_wait ( stream );
+	    pos = claim_mpsc_record ( buf, size );
+	    if ( pos >= 0 ) stream->fanin.slot->waiting = 0;
+	}
+	status = (pos < 0) ? COMMBUF_BLOCKED : COMMBUF_COMPLETED;
+	break;
+
+      case MEMSTREAM_STATE_WRITER_DONE:
+      case MEMSTREAM_STATE_READER_DONE:
+	status = COMMBUF_DISCARDED;
+	break;
+
+      default:
+	status = COMMBUF_ABORT;
+	break;
+    }
+    report->exit_state = buf->state;
+    release_lock ( stream, buf );
+    if ( pos < 0 ) return status;
+
+    report->position = pos + MPSC_HDR_SIZE;
+    report->transferred = count;
+    if ( !bytes ) return COMMBUF_COMPLETED;	/* record reserved */
+
+    copy_bytes ( (void *) &MPSC_LAYOUT(buf)->data[report->position], bytes,
+	count );
+    return commit_to_mpsc ( stream, report->position, count, report );
+}
+/*
+ * Return true if record at tail is committed.
+ */
+static int mpsc_ready ( volatile struct commbuf *buf )
+{
+    int tail;
+
+    tail = MPSC_LAYOUT(buf)->tail.pos;
+    if ( tail == load_acquire ( &MPSC_LAYOUT(buf)->claim.pos ) ) return 0;
+    return load_acquire ( &MPSC_RECORD(buf,tail)->length ) != 0;
+}
+/*
+ * Give record at tail back to the writers.
+ */
+static void retire_mpsc_record ( memstream stream, 
+	struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+    volatile struct mpsc_control *ctl;
+    int tail;
+
+    buf = stream->buf;
+    ctl = MPSC_CONTROL(buf);
+    tail = MPSC_LAYOUT(buf)->tail.pos;
+    tail += MPSC_RECORD(buf,tail)->size;
+    if ( tail >= buf->data_limit ) tail = 0;
+    stream->fanin.offset = 0;
+    store_release ( &MPSC_LAYOUT(buf)->tail.pos, tail );
+    /*
+     * Publish freed space, then see if writers are blocked waiting for it.
+     */
+    full_barrier();
+    if ( load_acquire ( &ctl->waiting ) &&
+	(commbuf_pending ( buf ) <= commbuf_resume_level ( buf )) ) {
+	acquire_lock ( stream );
+	if ( ctl->waiting ) {
+	    ctl->waiting = 0;
+	    report->enter_state = MEMSTREAM_STATE_FULL;
+	    report->exit_state = MEMSTREAM_STATE_IDLE;
+	    report->flags.bit.expedite = buf->flags.bit.expedite;
+	    buf->flags.bit.expedite = 0;
+	}
+	release_lock ( stream, buf );
+    }
+}
+
+static int get_from_mpsc ( memstream stream,
+	char *bytes, int limit, struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+    int tail, available, segment, status;
+
+    buf = stream->buf;
+    report->enter_state = buf->state;
+    report->exit_state = report->enter_state;
+    report->flags.mask = 0;
+    report->transferred = 0;
+    if ( (report->enter_state != MEMSTREAM_STATE_IDLE) &&
+	 (report->enter_state != MEMSTREAM_STATE_EMPTY) &&
+	 (report->enter_state != MEMSTREAM_STATE_WRITER_DONE) ) {
+	return COMMBUF_ABORT;		/* Attempt to read from closed stream */
+    }
+    /*
+     * Copy from or peek at first committed record with unread data,
+     * retiring empty ones on the way.
+     */
+    while ( mpsc_ready ( buf ) ) {
+	tail = MPSC_LAYOUT(buf)->tail.pos;
+	available = load_acquire ( &MPSC_RECORD(buf,tail)->length ) - 1 - 
+		stream->fanin.offset;
+	if ( available > 0 ) {
+	    segment = (limit > available) ? available : limit;
+	    report->position = tail + MPSC_HDR_SIZE + stream->fanin.offset;
+	    report->transferred = segment;
+	    if ( !bytes ) return COMMBUF_COMPLETED;	/* data left in place */
+
+	    copy_bytes ( bytes, 
+		(void *) &MPSC_LAYOUT(buf)->data[report->position], segment );
+	    stream->fanin.offset += segment;
+	    if ( segment == available ) retire_mpsc_record ( stream, report );
+	    return COMMBUF_COMPLETED;
+	}
+	retire_mpsc_record ( stream, report );
+	if ( report->enter_state == MEMSTREAM_STATE_FULL ) 
+	    return COMMBUF_COMPLETED;	/* caller wakes writers and retries */
+    }
+    /*
+     * Nothing to read, arm EMPTY state and recheck in case a writer
+     * committed before it could see the new state.
+     */
+    acquire_lock ( stream );
+    report->enter_state = buf->state;
+    status = COMMBUF_COMPLETED;
+    switch ( buf->state ) {
+      case MEMSTREAM_STATE_IDLE:
+	buf->state = MEMSTREAM_STATE_EMPTY;
+	full_barrier();
+	if ( mpsc_ready ( buf ) ) buf->state = MEMSTREAM_STATE_IDLE;
+	else status = COMMBUF_BLOCKED;
+	break;
+
+      case MEMSTREAM_STATE_EMPTY:
+	if ( mpsc_ready ( buf ) ) {
+	    buf->state = MEMSTREAM_STATE_IDLE;
+	    break;
+	}
+	status = COMMBUF_BLOCKED;
+	/* Pass along expedite bit status if a writer set it */
+	report->flags.bit.expedite = buf->flags.bit.expedite;
+	buf->flags.bit.expedite = 0;
+	break;
+
+      case MEMSTREAM_STATE_WRITER_DONE:
+	/* Last writer closed, flush records until none left */
+	if ( !mpsc_ready ( buf ) ) status = COMMBUF_DISCARDED;
+	break;
+
+      default:
+	status = COMMBUF_ABORT;
+	break;
+    }
+    report->exit_state = buf->state;
+    release_lock ( stream, buf );
+
+    return status;
+}
+/*
+ * Release count bytes of the record at tail that get_from_mpsc peeked at.
+ */
+static int consume_from_mpsc ( memstream stream, int count,
+	struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+
+    buf = stream->buf;
+    report->enter_state = buf->state;
+    report->exit_state = report->enter_state;
+    stream->fanin.offset += count;
+    if ( stream->fanin.offset >= load_acquire ( &MPSC_RECORD(buf,
+		MPSC_LAYOUT(buf)->tail.pos)->length ) - 1 )
+	retire_mpsc_record ( stream, report );
+    return COMMBUF_COMPLETED;
+}
+/*
+ * Writer slot management.  Attach claims a free slot for a new writer,
+ * failing if the table is full or the stream already closed.  Detach,
+ * called with lock held, frees a slot and closes the stream for writing
+ * when the last writer leaves, it returns the previous state or IDLE if
+ * other writers remain.
+ */
+static volatile struct peer_slot *attach_mpsc_writer ( memstream stream )
+{
+    volatile struct commbuf *buf;
+    volatile struct mpsc_control *ctl;
+    volatile struct peer_slot *slot;
+    int i;
+
+    buf = stream->buf;
+    ctl = MPSC_CONTROL(buf);
+    slot = 0;
+    acquire_lock ( stream );
+    if ( (buf->state == MEMSTREAM_STATE_IDLE) || 
+	(buf->state == MEMSTREAM_STATE_EMPTY) ) {
+	for ( i = 0; i < MPSC_MAX_WRITERS; i++ ) if ( !ctl->slot[i].pid ) {
+	    slot = &ctl->slot[i];
+	    slot->pid = spn.self;
+	    slot->waiting = 0;
+	    store_release ( &slot->wake, 0 );
+	    ctl->writers++;
+	    buf->writer_pid = spn.self;
+	    break;
+	}
+    }
+    release_lock ( stream, buf );
+    return slot;
+}
+
+static int detach_mpsc_writer ( volatile struct commbuf *buf,
+	volatile struct peer_slot *slot )
+{
+    volatile struct mpsc_control *ctl;
+    int prev_state;
+
+    ctl = MPSC_CONTROL(buf);
+    slot->pid = 0;
+    slot->waiting = 0;
+    ctl->writers--;
+    if ( ctl->writers > 0 ) return MEMSTREAM_STATE_IDLE;
+
+    prev_state = buf->state;
+    buf->writer_pid = 0;
+    if ( buf->state == MEMSTREAM_STATE_READER_DONE ) 
+	buf->state = MEMSTREAM_STATE_CLOSED;
+    else if ( buf->state != MEMSTREAM_STATE_CLOSED )
+	buf->state = MEMSTREAM_STATE_WRITER_DONE;
+    return prev_state;
+}
+/***********************************************************************/
+/* Transfer primitives for tee format commbufs.  Return values and report
+ * contents match put_to_commbuf and get_from_commbuf below.
+ *
+ * The writer side is put_to_spsc with the slowest reader's lag standing in
+ * for pending data.  Each reader copies from its own tail and, when it
+ * catches up, flags its slot and the shared waiting word instead of arming
+ * EMPTY.  The writer checks the word after publishing head and, if set,
+ * reports enter_state EMPTY so the caller wakes the waiting readers.  A
+ * reader that frees space while the writer is FULL moves it back to IDLE
+ * as an SPSC reader would.  A reader dropped for lagging gets ABORT.  A
+ * writer dropping lagging readers hibernates no later than its drop time
+ * and then drops readers still holding the space.
+ */
+/*
+ * Mark readers more than the resume level behind as dropped so the writer
+ * can reuse their space, caller holds lock.  Returns number dropped.
+ */
+static int drop_lagging_readers ( volatile struct commbuf *buf )
+{
+    volatile struct tee_reader *reader;
+    int head, lag, dropped, i;
+
+    head = TEE_LAYOUT(buf)->head.pos;
+    dropped = 0;
+    for ( i = 0; i < TEE_MAX_READERS; i++ ) {
+	reader = &TEE_LAYOUT(buf)->reader[i];
+	if ( !reader->slot.pid || reader->dropped ) continue;
+	lag = head - load_acquire ( &reader->tail );
+	if ( lag < 0 ) lag += buf->data_limit;
+	if ( lag > commbuf_resume_level ( buf ) ) {
+	    reader->dropped = 1;
+	    dropped++;
+	}
+    }
+    /* Reader checks dropped after copying, make it visible first */
+    if ( dropped ) full_barrier();
+    return dropped;
+}
+
+static int put_to_tee ( const char *bytes, int count, 
+	memstream stream, struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+    volatile struct tee_layout *tee;
+    int head, available, segsize, status;
+
+    buf = stream->buf;
+    tee = TEE_LAYOUT(buf);
+    report->enter_state = buf->state;
+    report->flags.mask = 0;
+    report->transferred = 0;
+    switch ( report->enter_state ) {
+      case MEMSTREAM_STATE_IDLE:
+	break;
+      case MEMSTREAM_STATE_FULL:
+	/* Spurious wake unless drop time came, readers move us out of FULL */
+	if ( stream->tee.drop_at ) break;
+	report->exit_state = report->enter_state;
+	return COMMBUF_BLOCKED;
+      case MEMSTREAM_STATE_WRITER_DONE:
+      case MEMSTREAM_STATE_READER_DONE:
+	report->exit_state = report->enter_state;
+	return COMMBUF_DISCARDED;
+      default:
+	report->exit_state = report->enter_state;
+	return COMMBUF_ABORT;
+    }
+    head = tee->head.pos;
+    report->position = head;
+    available = commbuf_space ( buf );
+    if ( bytes ) {
+	if ( count > MEMSTREAM_LOCKFREE_SEGMENT ) 
+	    count = MEMSTREAM_LOCKFREE_SEGMENT;
+    } else if ( available > (buf->data_limit - head) ) {
+	available = buf->data_limit - head;
+    }
+    segsize = (count > available) ? available : count;
+
+    if ( segsize > 0 ) {
+	if ( report->enter_state == MEMSTREAM_STATE_IDLE ) 
+	    stream->tee.drop_at = 0;
+	report->transferred = segsize;
+	report->exit_state = report->enter_state;
+	if ( !bytes ) return COMMBUF_COMPLETED;		/* space reserved */
+
+	head = copy_to_data ( buf, head, bytes, segsize );
+	store_release ( &tee->head.pos, head );
+	/*
+	 * Publish before examining waiting word, a reader may have flagged
+	 * its slot without seeing our data.
+	 */
+	full_barrier();
+	if ( load_acquire ( &TEE_CONTROL(buf)->waiting ) ) {
+	    report->enter_state = MEMSTREAM_STATE_EMPTY;
+	    report->exit_state = MEMSTREAM_STATE_IDLE;
+	}
+	return COMMBUF_COMPLETED;
+    }
+    /*
+     * No space, arm FULL state and recheck in case readers freed space
+     * before they could see the new state.  When dropping lagging readers,
+     * give them until drop time to free it.
+     */
+    acquire_lock ( stream );
+    report->enter_state = buf->state;
+    switch ( buf->state ) {
+      case MEMSTREAM_STATE_IDLE:
+      case MEMSTREAM_STATE_FULL:
+	status = COMMBUF_BLOCKED;
+	if ( stream->tee.drop_at && (clock_msec() >= stream->tee.drop_at) ) {
+	    drop_lagging_readers ( buf );
+	    stream->tee.drop_at = 0;
+	    buf->state = MEMSTREAM_STATE_IDLE;
+	    status = COMMBUF_COMPLETED;
+	    break;
+	}
+	if ( buf->state == MEMSTREAM_STATE_FULL ) break;
+	buf->state = MEMSTREAM_STATE_FULL;
+	full_barrier();
+	if ( commbuf_space ( buf ) > 0 ) {
+	    buf->state = MEMSTREAM_STATE_IDLE;
+	    status = COMMBUF_COMPLETED;
+	} else if ( (stream->attributes&MEMSTREAM_ATTR_DROP) && 
+		!stream->tee.drop_at ) {
+	    stream->tee.drop_at = clock_msec() + TEE_DROP_MSEC;
+	}
+	break;
+
+      case MEMSTREAM_STATE_WRITER_DONE:
+      case MEMSTREAM_STATE_READER_DONE:
+	status = COMMBUF_DISCARDED;
+	break;
+
+      default:
+	status = COMMBUF_ABORT;
+	break;
+    }
+    report->exit_state = buf->state;
+    release_lock ( stream, buf );
+
+    return status;
+}
+/*
+ * Publish count bytes reserved at pos by put_to_tee.
+ */
+static int commit_to_tee ( memstream stream, int pos, int count,
+	struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+
+    buf = stream->buf;
+    store_release ( &TEE_LAYOUT(buf)->head.pos, 
+	commbuf_advance ( buf, pos, count ) );
+    full_barrier();
+    report->enter_state = buf->state;
+    report->exit_state = report->enter_state;
+    if ( report->enter_state >= MEMSTREAM_STATE_WRITER_DONE ) {
+	report->transferred = 0;
+	return (report->enter_state == MEMSTREAM_STATE_CLOSED) ?
+		COMMBUF_ABORT : COMMBUF_DISCARDED;
+    }
+    if ( load_acquire ( &TEE_CONTROL(buf)->waiting ) ) {
+	report->enter_state = MEMSTREAM_STATE_EMPTY;
+	report->exit_state = MEMSTREAM_STATE_IDLE;
+    }
+    return COMMBUF_COMPLETED;
+}
+/*
+ * Bytes written that this reader has yet to read.
+ */
+static int tee_pending ( memstream stream )
+{
+    int pending;
+
+    pending = load_acquire ( &TEE_LAYOUT(stream->buf)->head.pos ) -
+	stream->tee.reader->tail;
+    if ( pending < 0 ) pending += stream->buf->data_limit;
+    return pending;
+}
+/*
+ * Move reader's tail to pos, then see if the writer is blocked waiting
+ * for the space.
+ */
+static void release_tee_space ( memstream stream, int pos, 
+	struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+
+    buf = stream->buf;
+    store_release ( &stream->tee.reader->tail, pos );
+    full_barrier();
+    report->enter_state = buf->state;
+    if ( (report->enter_state == MEMSTREAM_STATE_FULL) &&
+	    (commbuf_pending ( buf ) <= commbuf_resume_level ( buf )) ) {
+	acquire_lock ( stream );
+	report->enter_state = buf->state;
+	if ( buf->state == MEMSTREAM_STATE_FULL ) {
+	    buf->state = MEMSTREAM_STATE_IDLE;
+	    report->flags.bit.expedite = buf->flags.bit.expedite;
+	    buf->flags.bit.expedite = 0;
+	}
+	report->exit_state = buf->state;
+	release_lock ( stream, buf );
+    } else report->exit_state = report->enter_state;
+}
+
+static int get_from_tee ( memstream stream,
+	char *bytes, int limit, struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+    volatile struct tee_reader *reader;
+    int tail, available, segment, status;
+
+    buf = stream->buf;
+    reader = stream->tee.reader;
+    report->enter_state = buf->state;
+    report->exit_state = report->enter_state;
+    report->flags.mask = 0;
+    report->transferred = 0;
+    if ( reader->dropped || ((report->enter_state != MEMSTREAM_STATE_IDLE) &&
+	 (report->enter_state != MEMSTREAM_STATE_FULL) &&
+	 (report->enter_state != MEMSTREAM_STATE_WRITER_DONE)) ) {
+	return COMMBUF_ABORT;		/* dropped or stream closed */
+    }
+    tail = reader->tail;
+    report->position = tail;
+    available = tee_pending ( stream );
+    if ( bytes ) {
+	if ( limit > MEMSTREAM_LOCKFREE_SEGMENT ) 
+	    limit = MEMSTREAM_LOCKFREE_SEGMENT;
+	segment = (limit > available) ? available : limit;
+    } else {
+	segment = buf->data_limit - tail;
+	if ( segment > available ) segment = available;
+	if ( segment > limit ) segment = limit;
+    }
+
+    if ( segment > 0 ) {
+	report->transferred = segment;
+	if ( !bytes ) return COMMBUF_COMPLETED;		/* data left in place */
+
+	tail = copy_from_data ( buf, tail, bytes, segment );
+	/*
+	 * Writer marks us dropped before overwriting our data, so check
+	 * after the copy.
+	 */
+	full_barrier();
+	if ( reader->dropped ) {
+	    report->transferred = 0;
+	    return COMMBUF_ABORT;
+	}
+	release_tee_space ( stream, tail, report );
+	return COMMBUF_COMPLETED;
+    }
+    /*
+     * Nothing to read, flag our slot and recheck in case writer published
+     * data before it could see the flag.
+     */
+    acquire_lock ( stream );
+    report->enter_state = buf->state;
+    status = COMMBUF_COMPLETED;
+    switch ( buf->state ) {
+      case MEMSTREAM_STATE_FULL:
+	/* Writer waiting for space we already freed */
+	if ( commbuf_pending ( buf ) <= commbuf_resume_level ( buf ) ) {
+	    buf->state = MEMSTREAM_STATE_IDLE;
+	    report->flags.bit.expedite = buf->flags.bit.expedite;
+	    buf->flags.bit.expedite = 0;
+	    break;
+	}
+	/* fall through, other readers hold the space */
+      case MEMSTREAM_STATE_IDLE:
+	reader->slot.waiting = 1;
+	store_release ( &TEE_CONTROL(buf)->waiting, 1 );
+	full_barrier();
+	if ( tee_pending ( stream ) > 0 ) reader->slot.waiting = 0;
+	else {
+	    status = COMMBUF_BLOCKED;
+	    /* Pass along expedite bit status if writer set it */
+	    report->flags.bit.expedite = buf->flags.bit.expedite;
+	}
+	break;
+
+      case MEMSTREAM_STATE_WRITER_DONE:
+	/* Writer closed, flush data until empty */
+	if ( tee_pending ( stream ) == 0 ) status = COMMBUF_DISCARDED;
+	break;
+
+      default:
+	status = COMMBUF_ABORT;
+	break;
+    }
+    report->exit_state = buf->state;
+    release_lock ( stream, buf );
+
+    return status;
+}
+/*
+ * Release count bytes at pos that get_from_tee peeked at.
+ */
+static int consume_from_tee ( memstream stream, int pos, int count,
+	struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+
+    buf = stream->buf;
+    full_barrier();
+    if ( stream->tee.reader->dropped ) {
+	report->enter_state = buf->state;
+	report->exit_state = report->enter_state;
+	return COMMBUF_ABORT;
+    }
+    release_tee_space ( stream, commbuf_advance ( buf, pos, count ), report );
+    return COMMBUF_COMPLETED;
+}
+/*
+ * Reader slot management.  Attach claims a free slot for a new reader,
+ * positioned at the current head, failing if the table is full or the
+ * writer has closed.  Detach, called with lock held, frees a slot.  The
+ * stream stays open for writing with no readers attached, so readers
+ * may come and go; detach returns the previous state so the caller can
+ * wake a writer waiting for space the reader held.
+ */
+static volatile struct tee_reader *attach_tee_reader ( memstream stream )
+{
+    volatile struct commbuf *buf;
+    volatile struct tee_reader *reader;
+    int i;
+
+    buf = stream->buf;
+    reader = 0;
+    acquire_lock ( stream );
+    if ( (buf->state == MEMSTREAM_STATE_IDLE) || 
+	(buf->state == MEMSTREAM_STATE_FULL) ) {
+	for ( i = 0; i < TEE_MAX_READERS; i++ ) 
+		if ( !TEE_LAYOUT(buf)->reader[i].slot.pid ) {
+	    reader = &TEE_LAYOUT(buf)->reader[i];
+	    reader->tail = TEE_LAYOUT(buf)->head.pos;
+	    reader->dropped = 0;
+	    reader->slot.waiting = 0;
+	    store_release ( &reader->slot.wake, 0 );
+	    reader->slot.pid = spn.self;
+	    TEE_CONTROL(buf)->readers++;
+	    buf->reader_pid = spn.self;
+	    break;
+	}
+    }
+    release_lock ( stream, buf );
+    return reader;
+}
+
+static int detach_tee_reader ( volatile struct commbuf *buf,
+	volatile struct tee_reader *reader )
+{
+    int prev_state;
+
+    reader->slot.pid = 0;
+    reader->slot.waiting = 0;
+    reader->dropped = 0;
+    TEE_CONTROL(buf)->readers--;
+    if ( TEE_CONTROL(buf)->readers == 0 ) buf->reader_pid = 0;
+
+    prev_state = buf->state;
+    if ( buf->state == MEMSTREAM_STATE_FULL ) {
+	/* Our lag may have been holding the writer */
+	buf->state = MEMSTREAM_STATE_IDLE;
+    } else if ( (buf->state == MEMSTREAM_STATE_WRITER_DONE) &&
+	(TEE_CONTROL(buf)->readers == 0) ) {
+	buf->state = MEMSTREAM_STATE_CLOSED;
+    }
+    return prev_state;
+}
+/*
+ * Wake_peer for MPSC readers and tee writers, wake every peer whose slot
+ * is flagged as waiting.  A peer that no longer exists is detached so
+ * the stream isn't held open (MPSC) or held FULL (tee) by it.
+ */
+static int wake_slots ( memstream stream )
+{
+    volatile struct commbuf *buf;
+    volatile commbuf_atomic *waiting;
+    volatile struct peer_slot *slot[MPSC_MAX_WRITERS];
+    pid_t target[MPSC_MAX_WRITERS];
+    int i, count;
+
+    buf = stream->buf;
+    if ( buf->fmt_version == MEMSTREAM_FMT_MPSC ) {
+	waiting = &MPSC_CONTROL(buf)->waiting;
+	count = MPSC_MAX_WRITERS;
+	for ( i = 0; i < count; i++ ) slot[i] = &MPSC_CONTROL(buf)->slot[i];
+    } else {
+	waiting = &TEE_CONTROL(buf)->waiting;
+	count = TEE_MAX_READERS;
+	for ( i = 0; i < count; i++ ) slot[i] = &TEE_LAYOUT(buf)->reader[i].slot;
+    }
+    acquire_lock ( stream );
+    *waiting = 0;
+    for ( i = 0; i < count; i++ ) {
+	target[i] = 0;
+	if ( slot[i]->pid && slot[i]->waiting ) {
+	    slot[i]->waiting = 0;
+	    target[i] = slot[i]->pid;
+	}
+    }
+    release_lock ( stream, buf );
+
+    for ( i = 0; i < count; i++ ) {
+	if ( !target[i] ) continue;
+	if ( wake_process ( stream, target[i], &slot[i]->wake ) ) continue;
+	acquire_lock ( stream );
+	if ( slot[i]->pid == target[i] ) {
+	    if ( buf->fmt_version == MEMSTREAM_FMT_MPSC )
+		detach_mpsc_writer ( buf, slot[i] );
+	    else detach_tee_reader ( buf, &TEE_LAYOUT(buf)->reader[i] );
+	}
+	release_lock ( stream, buf );
+    }
+    return COMMBUF_COMPLETED;
+}
+/***********************************************************************/
+/* Primitives for copying data into and out of buffer as atomic operation
+ * using spin lock.
+ *
+ * Return value:
+ *        READY          Success, all bytes transferred.
+ *        BLOCKED        Buffer full(write) or empty(empty), partial transfer.
+ *        CLOSED         Pipe is closed, partial transfer.
+ *        ABORT          Error, indeterminate transfer.
+ *
+ * Actions taken by caller depend on both status and previous buffer state:
+ *     status    prev_state  xferred
+ *    READY     idle                    continue
+ *    READY     full(read)     >0       continue
+ *    READY     full(read)     0        wake writer (state now idle).
+ *    READY     empty(write)   *        wake reader.(state now idle).
+ *    BLOCKED       *                   sleep
+ *    CLOSED        *          >0       continue.
+ *    CLOSED        *           0       discontinue I/O attempts.
+ */
+static int put_to_buffer ( const void *bytes_vp, int count, 
+	memstream stream, struct commbuf_report *report )
+{
+    int spin_result, available, segsize, kick_reader, status;
+    volatile struct commbuf *buf;
+    const char *bytes;
+
+    bytes = bytes_vp;
+    buf = stream->buf;
+    if ( buf->fmt_version == MEMSTREAM_FMT_SPSC )
+	return put_to_spsc ( bytes, count, stream, report );
+    if ( buf->fmt_version == MEMSTREAM_FMT_MPSC )
+	return put_to_mpsc ( bytes, count, stream, report );
+    if ( buf->fmt_version == MEMSTREAM_FMT_TEE )
+	return put_to_tee ( bytes, count, stream, report );
+    /*
+     * Obtain mutex (spin lock).
+     */
+    acquire_lock ( stream );
+    report->enter_state = buf->state;
+    report->flags.mask = 0;
+    /*
+     * Determine amount of caller's buffer to write (segsize), smaller of
+     * amount to be written, seg_limit, or space left in buffer.
+     */
+    report->position = buf->write_pos;
+    available = commbuf_space ( buf );
+    if ( bytes ) {
+	if ( count > lock_segment_limit ( buf ) ) 
+	    count = lock_segment_limit ( buf );
+    } else if ( available > (buf->data_limit - buf->write_pos) ) {
+	available = buf->data_limit - buf->write_pos;	/* contiguous */
+    }
+    segsize = (count > available) ? available : count;
+    /*
+     * Examine state of buffer to determine how to handle transfer, segment
+     * size is updated.  buf->state can only be examine
+     */
+    status = COMMBUF_COMPLETED;		/* Assume success */
+    switch ( buf->state ) {
+      case MEMSTREAM_STATE_IDLE:
+	/* Nobody reading at momemt, append data if we can */
+	if ( segsize == 0 ) {
+	    buf->state = MEMSTREAM_STATE_FULL;
+	    status = COMMBUF_BLOCKED;
+	}
+	break;
+
+      case MEMSTREAM_STATE_EMPTY:
+	/* Same as idle, caller will kick reader though */
+	if ( segsize == 0 ) {
+	    buf->state = MEMSTREAM_STATE_FULL;
+	    status = COMMBUF_BLOCKED;
+	}
+	break;
+
+      case MEMSTREAM_STATE_FULL:
+	/*
+	 * Should never happen, but spurious wakes can occur so force
+         * another block.
+         */
+	segsize = 0;
+	status = COMMBUF_BLOCKED;
+	break;
+
+      case MEMSTREAM_STATE_WRITER_DONE:
+      case MEMSTREAM_STATE_READER_DONE:
+	segsize = 0;
+	status = COMMBUF_DISCARDED;		/* attempt to write to closed stream */
+	break;
+
+      case MEMSTREAM_STATE_CLOSED:
+	segsize = 0;
+	status = COMMBUF_ABORT;		/* attempt to write to closed stream */
+	break;
+
+      default:
+	segsize = 0;
+	status = COMMBUF_ABORT;
+	break;
+    }
+    /*
+     * Copy data and update write position.
+     */
+    if ( (segsize > 0) && bytes ) {
+	buf->write_pos = copy_to_data ( buf, buf->write_pos, bytes, segsize );
+	if ( buf->state == MEMSTREAM_STATE_EMPTY )
+	    report->enter_state = release_waiting_reader ( stream, buf );
+    }
+    /*
+     * Save result and release mutex.
+     */
+    report->exit_state = buf->state;
+    report->transferred = segsize;
+    release_lock ( stream, buf );
+
+    return status;
+}
+
+static int get_from_buffer ( memstream stream,
+	void *bytes_vp, int limit, struct commbuf_report *report )
+{
+    int spin_result, available, segment, kick_reader, status;
+    volatile struct commbuf *buf;
+    char *bytes;
+
+    bytes = bytes_vp;
+    buf = stream->buf;
+    if ( buf->fmt_version == MEMSTREAM_FMT_SPSC )
+	return get_from_spsc ( stream, bytes, limit, report );
+    if ( buf->fmt_version == MEMSTREAM_FMT_MPSC )
+	return get_from_mpsc ( stream, bytes, limit, report );
+    if ( buf->fmt_version == MEMSTREAM_FMT_TEE )
+	return get_from_tee ( stream, bytes, limit, report );
+    /*
+     * Obtain mutex (spin lock).
+     */
+    acquire_lock ( stream );
+    report->enter_state = buf->state;
+    report->flags.mask = 0;
+    /*
+     * Determine amount of caller's buffer to fill (segment), smaller of
+     * amount to be copied, seg_limit, or data available.
+     */
+    report->position = buf->read_pos;
+    available = commbuf_pending ( buf );
+    if ( bytes ) {
+	if ( limit > lock_segment_limit ( buf ) ) 
+	    limit = lock_segment_limit ( buf );
+	segment = (limit > available) ? available : limit;
+    } else {
+	segment = buf->data_limit - buf->read_pos;	/* contiguous */
+	if ( segment > available ) segment = available;
+	if ( segment > limit ) segment = limit;
+    }
+    /*
+     * Examine state of buffer to determine how to handle transfer, segment
+     * size is updated.
+     */
+    status = COMMBUF_COMPLETED;
+    switch ( buf->state ) {
+      case MEMSTREAM_STATE_IDLE:
+	/* Nobody reading at momemt, block if no data */
+	if ( segment == 0 ) {
+	    buf->state = MEMSTREAM_STATE_EMPTY;
+	    buf->flags.bit.timed_wait = stream->batch.timed;
+	    status = COMMBUF_BLOCKED;
+	}
+	break;
+
+      case MEMSTREAM_STATE_EMPTY:
+	if ( available > 0 ) {
+	    /* Batching writer left us waiting */
+	    buf->state = MEMSTREAM_STATE_IDLE;
+	    break;
+	}
+	buf->flags.bit.timed_wait = stream->batch.timed;
+	status = COMMBUF_BLOCKED;
+	if ( buf->writer_pid == 0 ) {
+	     status = COMMBUF_DISCARDED;
+	} else {
+	     /* Pass along expedite bit status if writer set it */
+	     report->flags.bit.expedite = buf->flags.bit.expedite;
+	     buf->flags.bit.expedite = 0;
+	}
+	break;
+
+      case MEMSTREAM_STATE_FULL:
+	/* Copy rest of data, reset state to IDLE if enough space freed */
+	if ( bytes && ((available-segment) <= commbuf_resume_level ( buf )) ) {
+	     buf->state = MEMSTREAM_STATE_IDLE;
+	     report->flags.bit.expedite = buf->flags.bit.expedite;
+	     buf->flags.bit.expedite = 0;
+	}
+	break;
+
+      case MEMSTREAM_STATE_WRITER_DONE:
+	/* Peer closed pipe, flush data until empty */
+	if ( segment == 0 ) status = COMMBUF_DISCARDED;
+	break;
+
+      case MEMSTREAM_STATE_READER_DONE:
+	segment = 0;
+	status = COMMBUF_ABORT;		/* Attempt to read from closed stream */
+	break;
+
+      case MEMSTREAM_STATE_CLOSED:
+	segment = 0;
+	status = COMMBUF_ABORT;		/* attempt to write to closed stream */
+	break;
+
+      default:
+	segment = 0;
+	status = COMMBUF_ABORT;
+	break;
+    }
+    /*
+     * Copy data and update read position.  Reset if we've read all data.
+     */
+    if ( (segment > 0) && bytes ) {
+	buf->read_pos = copy_from_data ( buf, buf->read_pos, bytes, segment );
+	if ( buf->read_pos == buf->write_pos ) {
+	    buf->read_pos = 0;
+	    buf->write_pos = 0;
+	    if ( !buf->writer_pid ) {
+		/* Writer went away, force close if he didn't do so */
+		buf->state = MEMSTREAM_STATE_WRITER_DONE;
+	    }
+	}
+    }
+    /*
+     * Save final result and release mutex.
+     */
+    report->exit_state = buf->state;
+    report->transferred = segment;
+    release_lock ( stream, buf );
+
+    return status;
+}
+/*
+ * Complete a zero-copy write by publishing count bytes the caller placed
+ * in space reserved at offset pos by put_to_commbuf.  Return value and
+ * report match put_to_commbuf.
+ */
+static int commit_to_commbuf ( memstream stream, int pos, int count,
+	struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+    volatile char *data;
+    int status;
+
+    buf = stream->buf;
+    if ( buf->fmt_version == MEMSTREAM_FMT_MPSC )
+	return commit_to_mpsc ( stream, pos, count, report );
+    report->flags.mask = 0;
+    report->transferred = count;
+    report->position = pos;
+    if ( buf->fmt_version == MEMSTREAM_FMT_TEE )
+	return commit_to_tee ( stream, pos, count, report );
+    status = COMMBUF_COMPLETED;
+    if ( buf->fmt_version == MEMSTREAM_FMT_SPSC ) {
+	/*
+	 * Publish new head, then see if reader armed EMPTY state.
+	 */
+	store_release ( &SPSC_LAYOUT(buf)->head.pos, 
+		commbuf_advance ( buf, pos, count ) );
+	full_barrier();
+	report->enter_state = buf->state;
+	if ( report->enter_state == MEMSTREAM_STATE_EMPTY ) {
+	    acquire_lock ( stream );
+	    report->enter_state = buf->state;
+	    if ( buf->state == MEMSTREAM_STATE_EMPTY ) 
+		report->enter_state = release_waiting_reader ( stream, buf );
+	    report->exit_state = buf->state;
+	    release_lock ( stream, buf );
+	} else report->exit_state = report->enter_state;
+
+	if ( report->enter_state >= MEMSTREAM_STATE_WRITER_DONE ) {
+	    report->transferred = 0;
+	    status = (report->enter_state == MEMSTREAM_STATE_CLOSED) ?
+		COMMBUF_ABORT : COMMBUF_DISCARDED;
+	}
+	return status;
+    }
+
+    acquire_lock ( stream );
+    report->enter_state = buf->state;
+    switch ( buf->state ) {
+      case MEMSTREAM_STATE_IDLE:
+      case MEMSTREAM_STATE_FULL:
+	break;
+
+      case MEMSTREAM_STATE_EMPTY:
+	/* Caller will kick reader, once data is in */
+	break;
+
+      case MEMSTREAM_STATE_WRITER_DONE:
+      case MEMSTREAM_STATE_READER_DONE:
+	status = COMMBUF_DISCARDED;
+	break;
+
+      default:
+	status = COMMBUF_ABORT;
+	break;
+    }
+    if ( status == COMMBUF_COMPLETED ) {
+	/*
+	 * Reader resets positions when it drains the buffer, so the
+	 * reserved region may no longer be at write_pos.
+	 */
+	if ( buf->write_pos != pos ) {
+	    data = commbuf_data ( buf );
+	    memmove ( (void *) &data[buf->write_pos], (void *) &data[pos], 
+		count );
+	}
+	buf->write_pos = commbuf_advance ( buf, buf->write_pos, count );
+	if ( buf->state == MEMSTREAM_STATE_EMPTY )
+	    report->enter_state = release_waiting_reader ( stream, buf );
+    } else report->transferred = 0;
+    report->exit_state = buf->state;
+    release_lock ( stream, buf );
+
+    return status;
+}
+/*
+ * Complete a zero-copy read by releasing count bytes at offset pos that
+ * get_from_commbuf left in place.  Return value and report match 
+ * get_from_commbuf.
+ */
+static int consume_from_commbuf ( memstream stream, int pos, int count,
+	struct commbuf_report *report )
+{
+    volatile struct commbuf *buf;
+
+    buf = stream->buf;
+    report->flags.mask = 0;
+    report->transferred = count;
+    report->position = pos;
+    if ( buf->fmt_version == MEMSTREAM_FMT_MPSC )
+	return consume_from_mpsc ( stream, count, report );
+    if ( buf->fmt_version == MEMSTREAM_FMT_TEE )
+	return consume_from_tee ( stream, pos, count, report );
+    if ( buf->fmt_version == MEMSTREAM_FMT_SPSC ) {
+	/*
+	 * Publish freed space, then see if writer is blocked waiting for it.
+	 */
+	store_release ( &SPSC_LAYOUT(buf)->tail.pos, 
+		commbuf_advance ( buf, pos, count ) );
+	full_barrier();
+	report->enter_state = buf->state;
+	if ( (report->enter_state == MEMSTREAM_STATE_FULL) &&
+		(commbuf_pending ( buf ) <= commbuf_resume_level ( buf )) ) {
+	    acquire_lock ( stream );
+	    report->enter_state = buf->state;
+	    if ( buf->state == MEMSTREAM_STATE_FULL ) {
+		buf->state = MEMSTREAM_STATE_IDLE;
+		report->flags.bit.expedite = buf->flags.bit.expedite;
+		buf->flags.bit.expedite = 0;
+	    }
+	    report->exit_state = buf->state;
+	    release_lock ( stream, buf );
+	} else report->exit_state = report->enter_state;
+	return COMMBUF_COMPLETED;
+    }
+
+    acquire_lock ( stream );
+    report->enter_state = buf->state;
+    buf->read_pos = commbuf_advance ( buf, buf->read_pos, count );
+    if ( (buf->state == MEMSTREAM_STATE_FULL) &&
+	    (commbuf_pending ( buf ) <= commbuf_resume_level ( buf )) ) {
+	buf->state = MEMSTREAM_STATE_IDLE;
+	report->flags.bit.expedite = buf->flags.bit.expedite;
+	buf->flags.bit.expedite = 0;
+    }
+    if ( buf->read_pos == buf->write_pos ) {
+	buf->read_pos = 0;
+	buf->write_pos = 0;
+	if ( !buf->writer_pid ) {
+	    /* Writer went away, force close if he didn't do so */
+	    buf->state = MEMSTREAM_STATE_WRITER_DONE;
+	}
+    }
+    report->exit_state = buf->state;
+    release_lock ( stream, buf );
+
+    return COMMBUF_COMPLETED;
+}
+/*
+ * Closedown commbuf.
+ */
+static int close_commbuf ( memstream stream, int close_state )
+{
+    volatile struct commbuf *buf;
+    int prev_state;
+
+    buf = stream->buf;
+    acquire_lock ( stream );
+    if ( stream->fanin.slot ) {
+	/* MPSC writer, stream stays open until all writers close */
+	prev_state = detach_mpsc_writer ( buf, stream->fanin.slot );
+	stream->fanin.slot = 0;
+	release_lock ( stream, buf );
+	return prev_state;
+    }
+    if ( stream->tee.reader ) {
+	/* Tee reader, stream stays open for the writer and other readers */
+	prev_state = detach_tee_reader ( buf, stream->tee.reader );
+	stream->tee.reader = 0;
+	release_lock ( stream, buf );
+	return prev_state;
+    }
+    /*
+     * Upgrade close state to full if partner also closed.
+     */
+    prev_state = buf->state;
+    if ( close_state == MEMSTREAM_STATE_WRITER_DONE ) {
+	if ( buf->state == MEMSTREAM_STATE_READER_DONE )
+	    close_state = MEMSTREAM_STATE_CLOSED;
+    } else if ( close_state == MEMSTREAM_STATE_READER_DONE ) {
+	if ( buf->state == MEMSTREAM_STATE_WRITER_DONE )
+	    close_state = MEMSTREAM_STATE_CLOSED;
+    }
+    buf->state = close_state;
+    release_lock ( stream, buf );
+    return prev_state;
+}
+
+/*
+* Check to see if peer has finished using its side of the stream.
+*/
+static int is_commbuf_peer_done(memstream stream, int is_writer)
+{
+int ret_val = 0;
+volatile struct commbuf *buf = stream->buf;
+
+acquire_lock ( stream );
+if (is_writer)
+   ret_val = (buf->state == MEMSTREAM_STATE_READER_DONE);
+else
+   ret_val = (buf->state == MEMSTREAM_STATE_WRITER_DONE) &&
+	!buf->flags.bit.migrated;	/* writer carries on in next block */
+release_lock ( stream, buf );
+
+return ret_val;
+}
+
+/***********************************************************************/
+/* Block migration.  A single writer stream (linear, ring or SPSC format)
+ * can move to a new shared block, of another size, that the remap
+ * callback supplies.  The writer initializes the new block, marks the
+ * old one migrated (recording log2 of the new size) and closes it.  The
+ * reader drains the old block and at its end maps the new one through
+ * its own callback, then closes the old block to let the writer know it
+ * has left.  Only one migration is outstanding at a time, and a writer
+ * that migrated waits at close for the reader to arrive since a block
+ * nobody maps is lost.
+ */
+#define MEMSTREAM_GROW_BLOCKS 8		/* blocked writes before growing */
+#define MEMSTREAM_MIGRATE_POLL_MSEC 100	/* recheck for reader at close */
+
+static int init_commbuf ( struct commbuf *buf, int blk_size, int fmt_version )
+{
+    if ( blk_size <= (sizeof(struct commbuf)+MEMSTREAM_MIN_BLK_SIZE) ) {
+	return 0;		/* block too small */
+    }
+    if ( (fmt_version == MEMSTREAM_FMT_SPSC) && 
+		(blk_size <= (SPSC_DATA_OFFSET+MEMSTREAM_MIN_BLK_SIZE)) ) {
+	return 0;		/* block too small */
+    }
+    if ( (fmt_version == MEMSTREAM_FMT_MPSC) && 
+		(blk_size <= (MPSC_DATA_OFFSET+MEMSTREAM_MIN_BLK_SIZE)) ) {
+	return 0;		/* block too small */
+    }
+    if ( (fmt_version == MEMSTREAM_FMT_TEE) && 
+		(blk_size <= (TEE_DATA_OFFSET+MEMSTREAM_MIN_BLK_SIZE)) ) {
+	return 0;		/* block too small */
+    }
+    spn.sequence++;
+    buf->fmt_version = fmt_version;
+    buf->ipc_version = MEMSTREAM_IPC_VERSION;
+    buf->sequence = spn.sequence;
+    buf->lock.state_qw = 0;
+    buf->data_limit = blk_size - sizeof(struct commbuf);
+    if ( buf->fmt_version == MEMSTREAM_FMT_SPSC ) {
+	buf->data_limit = blk_size - SPSC_DATA_OFFSET;
+	SPSC_LAYOUT(buf)->head.pos = 0;
+	SPSC_LAYOUT(buf)->tail.pos = 0;
+    }
+    if ( buf->fmt_version == MEMSTREAM_FMT_MPSC ) {
+	/* Records are aligned to header size */
+	buf->data_limit = (blk_size - MPSC_DATA_OFFSET) & 
+	    ~(MPSC_HDR_SIZE-1);
+	MPSC_LAYOUT(buf)->claim.pos = 0;
+	MPSC_LAYOUT(buf)->tail.pos = 0;
+	__MEMSET ( (void *) MPSC_CONTROL(buf), 0, 
+	    sizeof(struct mpsc_control) );
+    }
+    if ( buf->fmt_version == MEMSTREAM_FMT_TEE ) {
+	buf->data_limit = blk_size - TEE_DATA_OFFSET;
+	TEE_LAYOUT(buf)->head.pos = 0;
+	__MEMSET ( (void *) TEE_CONTROL(buf), 0, 
+	    sizeof(struct tee_control) );
+	__MEMSET ( (void *) TEE_LAYOUT(buf)->reader, 0, 
+	    sizeof(struct tee_reader)*TEE_MAX_READERS );
+    }
+    buf->state = MEMSTREAM_STATE_IDLE;
+    buf->flags.mask = 0;
+    buf->write_pos = 0;
+    buf->read_pos = 0;
+    buf->notify[0] = buf->notify[1] = 0;
+    return 1;
+}
+
+static int size_shift ( int blk_size )
+{
+    int shift;
+
+    for ( shift = 0; (shift < 31) && ((1<<shift) < blk_size); shift++ );
+    return shift;
+}
+/*
+ * Give previous block back to the writer's callback once reader has closed
+ * it (or gone away).  Return 0 if still in use.
+ */
+static int release_prev_block ( memstream stream )
+{
+    volatile struct commbuf *prev;
+
+    prev = stream->growth.prev;
+    if ( !prev ) return 1;
+    if ( (prev->state != MEMSTREAM_STATE_CLOSED) &&
+	 (prev->state != MEMSTREAM_STATE_READER_DONE) ) return 0;
+    stream->growth.prev = 0;
+    stream->growth.remap ( stream->growth.arg, (void *) prev, 0, 1 );
+    return 1;
+}
+/*
+ * Writer side, move stream to new block of blk_size bytes.  Returns size
+ * of new block or -1 with errno set.
+ */
+static int migrate_commbuf ( memstream stream, int blk_size )
+{
+    struct commbuf *old, *buf;
+
+    old = stream->buf;
+    if ( !stream->is_writer || !stream->growth.remap || stream->duplex ||
+	(old->fmt_version == MEMSTREAM_FMT_MPSC) ||
+	(old->fmt_version == MEMSTREAM_FMT_TEE) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    if ( (stream->region.size > 0) || !release_prev_block ( stream ) ) {
+	errno = EBUSY;		/* reserved region or previous migration */
+	return -1;
+    }
+    if ( (old->state == MEMSTREAM_STATE_READER_DONE) ||
+	(old->state == MEMSTREAM_STATE_CLOSED) ) {
+	errno = EPIPE;
+	return -1;
+    }
+    buf = stream->growth.remap ( stream->growth.arg, old, &blk_size, 1 );
+    if ( !buf ) {
+	errno = ENOMEM;
+	return -1;
+    }
+    if ( !init_commbuf ( buf, blk_size, old->fmt_version ) ) {
+	stream->growth.remap ( stream->growth.arg, buf, 0, 1 );
+	errno = EINVAL;
+	return -1;
+    }
+    buf->flags.bit.framed = old->flags.bit.framed;
+    buf->flags.bit.wake_msec = old->flags.bit.wake_msec;
+    buf->writer_pid = spn.self;
+    buf->reader_pid = old->reader_pid;
+    /*
+     * Point reader at the new block and close the old one.  Reader may
+     * be waiting for data, so always wake it.
+     */
+    acquire_lock ( stream );
+    old->flags.bit.next_shift = size_shift ( blk_size );
+    old->flags.bit.migrated = 1;
+    if ( old->state == MEMSTREAM_STATE_READER_DONE )
+	old->state = MEMSTREAM_STATE_CLOSED;
+    else old->state = MEMSTREAM_STATE_WRITER_DONE;
+    release_lock ( stream, old );
+    wake_peer ( stream );
+
+    stream->growth.prev = old;
+    stream->buf = buf;
+    stream->growth.blk_size = blk_size;
+    stream->growth.blocked = 0;
+    return blk_size;
+}
+/*
+ * Reader side, move to next block if writer migrated and current one is
+ * drained.  Return 1 if stream now uses the new block.
+ */
+static int follow_migration ( memstream stream )
+{
+    struct commbuf *old, *buf;
+    int drained, blk_size;
+
+    old = stream->buf;
+    acquire_lock ( stream );
+    drained = old->flags.bit.migrated && 
+	(old->state == MEMSTREAM_STATE_WRITER_DONE) &&
+	(commbuf_pending ( old ) == 0);
+    release_lock ( stream, old );
+    if ( !drained || !stream->growth.remap ) return 0;
+
+    blk_size = 1 << old->flags.bit.next_shift;
+    buf = stream->growth.remap ( stream->growth.arg, old, &blk_size, 0 );
+    if ( !buf ) return 0;
+    if ( buf->fmt_version != old->fmt_version ) {
+	stream->growth.remap ( stream->growth.arg, buf, 0, 0 );
+	return 0;
+    }
+    buf->reader_pid = spn.self;
+    close_commbuf ( stream, MEMSTREAM_STATE_READER_DONE );
+    stream->buf = buf;
+    stream->growth.blk_size = blk_size;
+    stream->growth.remap ( stream->growth.arg, old, 0, 0 );
+    /* Writer may be at close, waiting for us to leave old block */
+    wake_peer ( stream );
+    return 1;
+}
+/*
+ * Writer side, wait at close for reader to leave the previous block.
+ */
+static void await_reader_migration ( memstream stream )
+{
+    while ( !release_prev_block ( stream ) ) {
+	if ( !wake_peer ( stream ) ) break;	/* reader went away */
+	stream->growth.poll_at = clock_msec() + MEMSTREAM_MIGRATE_POLL_MSEC;
+	hibernate ( stream );
+	stream->growth.poll_at = 0;
+    }
+}
+/*
+ * Put_to_commbuf and get_from_commbuf perform the transfer on the current
+ * block.  When a writer with automatic growth keeps blocking on a full
+ * buffer without the reader catching up, it moves to a block twice the
+ * size and returns COMPLETED with nothing transferred so caller retries.
+ * A reader reaching the end of a migrated block carries on in the next.
+ */
+static int put_to_commbuf ( const void *bytes_vp, int count, 
+	memstream stream, struct commbuf_report *report )
+{
+    int status, saved_errno;
+
+    status = put_to_buffer ( bytes_vp, count, stream, report );
+    if ( (status == COMMBUF_BLOCKED) && 
+	(report->enter_state == MEMSTREAM_STATE_EMPTY) ) {
+	/* Batching left reader waiting but buffer is now full */
+	wake_peer ( stream );
+    }
+    if ( !stream->growth.limit ) return status;
+
+    if ( status != COMMBUF_BLOCKED ) {
+	if ( report->enter_state == MEMSTREAM_STATE_EMPTY )
+	    stream->growth.blocked = 0;		/* reader keeping up */
+	return status;
+    }
+    if ( ++stream->growth.blocked < MEMSTREAM_GROW_BLOCKS ) return status;
+    if ( stream->growth.blk_size > (stream->growth.limit/2) ) {
+	stream->growth.limit = 0;		/* can't grow any more */
+	return status;
+    }
+    saved_errno = errno;
+    if ( migrate_commbuf ( stream, stream->growth.blk_size*2 ) < 0 ) {
+	if ( errno != EBUSY ) stream->growth.limit = 0;
+	errno = saved_errno;
+	return status;
+    }
+    report->enter_state = MEMSTREAM_STATE_IDLE;
+    report->exit_state = MEMSTREAM_STATE_IDLE;
+    report->flags.mask = 0;
+    report->transferred = 0;
+    return COMMBUF_COMPLETED;
+}
+
+/*
+ * Busy-poll mode (MEMSTREAM_ATTR_BUSY_POLL).  Before a read arms EMPTY and
+ * waits, watch the writer's position for up to poll_usec so data arriving
+ * shortly is taken without the wake and reschedule.  Clock is only read
+ * every MEMSTREAM_POLL_CLOCK_INTERVAL polls.  Pointless on a uniprocessor,
+ * the writer can't run while we spin.
+ */
+#define MEMSTREAM_BUSY_POLL_USEC 50	/* default budget */
+#define MEMSTREAM_POLL_CLOCK_INTERVAL 64
+
+static int stream_ready ( memstream stream )
+{
+    volatile struct commbuf *buf;
+
+    buf = stream->buf;
+    if ( buf->fmt_version == MEMSTREAM_FMT_MPSC ) return mpsc_ready ( buf );
+    if ( buf->fmt_version == MEMSTREAM_FMT_TEE ) 
+	return tee_pending ( stream ) > 0;
+    return commbuf_pending ( buf ) > 0;
+}
+
+static void busy_poll ( memstream stream )
+{
+    volatile struct commbuf *buf;
+    long long deadline;
+    int polls;
+
+    if ( spn.cpu_count == 1 ) return;
+    buf = stream->buf;
+    deadline = 0;
+    for ( polls = 0; !stream_ready ( stream ); polls++ ) {
+	if ( buf->flags.bit.migrated ) break;
+	if ( (buf->state != MEMSTREAM_STATE_IDLE) && 
+	    (buf->state != MEMSTREAM_STATE_EMPTY) ) break;	/* closing */
+	if ( (polls % MEMSTREAM_POLL_CLOCK_INTERVAL) == 0 ) {
+	    if ( !deadline ) deadline = clock_usec() + stream->poll_usec;
+	    else if ( clock_usec() >= deadline ) break;
+	}
+    }
+}
+
+static int get_from_commbuf ( memstream stream,
+	void *bytes_vp, int limit, struct commbuf_report *report )
+{
+    int status;
+
+    if ( (stream->attributes & (MEMSTREAM_ATTR_BUSY_POLL|
+	MEMSTREAM_ATTR_NONBLOCK)) == MEMSTREAM_ATTR_BUSY_POLL ) 
+	busy_poll ( stream );
+    /*
+     * If writer is batching, wait for it with a deadline unless the last
+     * such wait brought nothing.  Writer then only wakes us for enough data.
+     */
+    stream->batch.wake_at = 0;
+    stream->batch.timed = stream->buf->flags.bit.wake_msec && 
+	!stream->batch.idle;
+
+    status = get_from_buffer ( stream, bytes_vp, limit, report );
+    while ( (status == COMMBUF_DISCARDED) && 
+	stream->buf->flags.bit.migrated ) {
+	if ( !follow_migration ( stream ) ) return COMMBUF_ABORT;
+	status = get_from_buffer ( stream, bytes_vp, limit, report );
+    }
+    if ( status == COMMBUF_BLOCKED ) {
+	if ( stream->batch.timed ) {
+	    stream->batch.wake_at = clock_msec() + 
+		stream->buf->flags.bit.wake_msec;
+	    stream->batch.idle = 1;
+	}
+    } else if ( report->transferred > 0 ) stream->batch.idle = 0;
+    return status;
+}
+
+/*
+ * If DMPIPE_MEMSTREAM_STATS names a file ("-" for stderr), append stream's
+ * statistics to it when the stream is closed or run down at exit.
+ */
+static void print_histogram ( FILE *fp, const char *label, 
+	unsigned int *histogram )
+{
+    int bucket;
+
+    for ( bucket = 0; bucket < MEMSTREAM_HIST_BUCKETS; bucket++ ) {
+	if ( histogram[bucket] ) break;
+    }
+    if ( bucket >= MEMSTREAM_HIST_BUCKETS ) return;
+    fprintf ( fp, "    %s:", label );
+    for ( ; bucket < MEMSTREAM_HIST_BUCKETS; bucket++ ) {
+	if ( histogram[bucket] ) 
+	    fprintf ( fp, " 2^%d=%u", bucket, histogram[bucket] );
+    }
+    fprintf ( fp, "\n" );
+}
+
+static void report_statistics ( memstream stream )
+{
+    static int checked;
+    static char *fname;
+    struct memstream_stats *stats;
+    FILE *fp;
+
+    stats = stream->stats;
+    if ( !stats ) return;
+    if ( !checked ) {
+	checked = 1;
+	fname = getenv ( "DMPIPE_MEMSTREAM_STATS" );
+    }
+    if ( !fname || !*fname ) return;
+    fp = strcmp ( fname, "-" ) ? fopen ( fname, "a" ) : stderr;
+    if ( !fp ) return;
+
+    fprintf ( fp, "memstream %x/%ld %s, format %d: ops=%lld, bytes=%lld, "
+	"segments=%lld, errors=%lld\n", spn.self, (long) stream->buf->sequence,
+	stream->is_writer ? "writer" : "reader", stream->buf->fmt_version,
+	stats->operations, stats->bytes, stats->segments, stats->errors );
+    fprintf ( fp, "    waits=%lld (%lld usec), signals=%lld, "
+	"resumes=%lld (%lld usec)\n", stats->waits, stats->wait_usec,
+	stats->signals, stats->resumes, stats->resume_usec );
+    fprintf ( fp, "    lock acquires=%lld (%llu ticks), held %llu ticks, "
+	"spin=%lld, yield=%lld, park=%lld\n", stats->lock_acquires,
+	stats->lock_acquire_ticks, stats->lock_hold_ticks,
+	stats->lock_spins, stats->lock_yields, stats->lock_parks );
+    print_histogram ( fp, "wait usec", stats->wait_histogram );
+    print_histogram ( fp, "resume usec", stats->resume_histogram );
+    print_histogram ( fp, "lock acquire ticks", stats->acquire_histogram );
+    print_histogram ( fp, "lock hold ticks", stats->hold_histogram );
+    if ( fp != stderr ) fclose ( fp );
+}
+
+static int memstream_rundown ( int *exit_status, memstream *open_streams )
+{
+    memstream stream;
+    int partial_close;
+    struct commbuf *buf;
+    /*
+     * Traverse list of open streams and force all commbufs to closed state.
+     */
+    for ( stream = *open_streams; stream; stream = stream->next ) {
+
+	*open_streams = stream->next;	/* remove from list */
+	buf = stream->buf;
+	if ( !buf ) continue;		/* Nothing shared, skip it */
+	if ( stream->growth.prev ) await_reader_migration ( stream );
+	report_statistics ( stream );
+	/*
+	 * Make effort to lock commbuf so we can change state.
+	 */
+	seize_lock ( stream );
+	if ( stream->fanin.slot ) {
+	    /*
+	     * MPSC writer, give up slot and kick reader if we were last.
+	     */
+	    if ( detach_mpsc_writer ( buf, stream->fanin.slot ) == 
+		MEMSTREAM_STATE_EMPTY ) wake_peer ( stream );
+	    release_lock ( stream, buf );
+	    continue;
+	}
+	if ( stream->tee.reader ) {
+	    /*
+	     * Tee reader, give up slot and kick writer if it was waiting.
+	     */
+	    if ( detach_tee_reader ( buf, stream->tee.reader ) == 
+		MEMSTREAM_STATE_FULL ) wake_peer ( stream );
+	    release_lock ( stream, buf );
+	    continue;
+	}
+	/*
+	 * Force state to closed, giving kick to peer if it is waiting.
+	 */
+	if ( stream->is_writer ) {
+	    partial_close = MEMSTREAM_STATE_WRITER_DONE;
+	    buf->writer_pid = 0;
+	} else {
+	    partial_close = MEMSTREAM_STATE_READER_DONE;
+	    buf->reader_pid = 0;
+	}
+	switch ( stream->buf->state ) {
+	  case MEMSTREAM_STATE_IDLE:
+	    stream->buf->state = partial_close;
+	    break;
+
+	  case MEMSTREAM_STATE_EMPTY:
+	    stream->buf->state = partial_close;
+	    if ( stream->is_writer ) wake_peer ( stream );
+	    break;
+
+	  case MEMSTREAM_STATE_FULL:
+	    stream->buf->state = partial_close;
+	    if ( !stream->is_writer ) wake_peer ( stream );
+	    break;
+
+	  case MEMSTREAM_STATE_WRITER_DONE:
+	  case MEMSTREAM_STATE_READER_DONE:
+	    if ( stream->buf->state != partial_close )
+		stream->buf->state = MEMSTREAM_STATE_CLOSED;
+	    break;
+
+	  case MEMSTREAM_STATE_CLOSED:
+	  default:
+	    break;
+	}
+	release_lock ( stream, stream->buf );
+	/* MPSC writers and tee readers wait on their slots */
+	if ( WAKES_SLOTS(stream) ) wake_peer ( stream );
+    }
+    return 1;
+}
+
+/************************************************************************/
+/* Exported functions:
+ */
+int memstream_set_spinlock ( 
+	int initial_retry,	/* retry limit to acquire spinlock */
+	int stall_retry,	/* retry limit after stall */
+	int stall_msec, 	/* Stall time if initial failure */
+	int xfer_segment )	/* limit of data that can be moved while
+				   holding spinlock */
+{
+    int status;
+    /*
+     * Fill in PID and adjust defaults if not initialized yet.
+     */
+    if ( !spn.self ) status = set_spn_self ( );
+    /*
+     * Overwrite spn structure with caller's arguments
+     */
+    spn.initial_retry = initial_retry;
+    spn.stall_retry = stall_retry;
+    spn.stall_msec = stall_msec;
+    spn.seg_limit = xfer_segment;
+    set_stall_time ( stall_msec );
+
+    return status;
+}
+/*
+ * Set format version memstream_create will use when initializing a new
+ * commbuf.  Streams attach to existing commbufs in whatever format the
+ * creator chose.  Return value is previous setting or -1 if unsupported.
+ */
+int memstream_set_format ( int fmt_version )
+{
+    int prev_version;
+
+    if ( (fmt_version != MEMSTREAM_FORMAT_LINEAR) &&
+	(fmt_version != MEMSTREAM_FORMAT_RING) &&
+	(fmt_version != MEMSTREAM_FORMAT_SPSC) &&
+	(fmt_version != MEMSTREAM_FORMAT_MPSC) &&
+	(fmt_version != MEMSTREAM_FORMAT_TEE) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    prev_version = spn.fmt_version;
+    spn.fmt_version = fmt_version;
+    return prev_version;
+}
+/*
+ * Attach to shared block as one end of a stream, initializing the block
+ * in format fmt_version if it is new.
+ */
+static memstream attach_stream ( void *shared_blk, int blk_size, 
+	int is_writer, int fmt_version )
+{
+    memstream ctx;
+    struct commbuf *buf;
+    /*
+     * Initialize buffer or verify it is supported type.
+     */
+    if ( blk_size <= (sizeof(struct commbuf)+MEMSTREAM_MIN_BLK_SIZE) ) {
+	return 0;		/* block too small */
+    }
+    buf = shared_blk;
+    if ( buf->fmt_version == 0 ) {
+	if ( !init_commbuf ( buf, blk_size, fmt_version ) ) return 0;
+
+    } else if ( buf->ipc_version != MEMSTREAM_IPC_VERSION ) {
+	/*
+	 * Peer's library lays out the header differently.
+	 */
+	return 0;
+
+    } else if ( (buf->fmt_version != MEMSTREAM_FMT_VERSION) &&
+		(buf->fmt_version != MEMSTREAM_FMT_RING) &&
+		(buf->fmt_version != MEMSTREAM_FMT_SPSC) &&
+		(buf->fmt_version != MEMSTREAM_FMT_MPSC) &&
+		(buf->fmt_version != MEMSTREAM_FMT_TEE) ) {
+	/*
+	 * Unknown version.
+	 */
+	return 0;
+    }
+    /*
+     * Fill in PID for IPC signalling.
+     */
+    if ( !spn.self ) {
+	OPEN_STREAMS_LOCK();
+	if ( !spn.self ) set_spn_self( );
+	OPEN_STREAMS_UNLOCK();
+    }
+    if ( is_writer ) buf->writer_pid = spn.self; 
+    else buf->reader_pid = spn.self;
+    /*
+     * Allocate context structure for tracking stream.
+     */
+    ctx = malloc ( sizeof(struct memstream_context) );
+    if ( !ctx ) return ctx;
+
+    __MEMSET ( ctx, 0, sizeof(struct memstream_context) );
+    ctx->is_writer = is_writer;
+    ctx->buf = buf;
+    ctx->growth.blk_size = blk_size;
+    ctx->spin.budget = MEMSTREAM_SPIN_MIN;
+    ctx->poll_usec = MEMSTREAM_BUSY_POLL_USEC;
+    if ( ctx->spin.budget > spn.initial_retry ) 
+	ctx->spin.budget = spn.initial_retry;
+    if ( is_writer && (buf->fmt_version == MEMSTREAM_FMT_MPSC) ) {
+	/*
+	 * Each fan-in writer needs a slot to wait on.
+	 */
+	ctx->fanin.slot = attach_mpsc_writer ( ctx );
+	if ( !ctx->fanin.slot ) {
+	    free ( ctx );
+	    return 0;
+	}
+    }
+    if ( !is_writer && (buf->fmt_version == MEMSTREAM_FMT_TEE) ) {
+	/*
+	 * Each tee reader needs its own cursor.
+	 */
+	ctx->tee.reader = attach_tee_reader ( ctx );
+	if ( !ctx->tee.reader ) {
+	    free ( ctx );
+	    return 0;
+	}
+    }
+    /*
+     * Link into open streams list for exit handler.
+     */
+    OPEN_STREAMS_LOCK();
+    ctx->next = rundown.open_streams;
+    rundown.open_streams = ctx;
+    OPEN_STREAMS_UNLOCK();
+
+    return ctx;
+}
+/*
+ * create a new memstream and assign.
+ */
+memstream memstream_create ( void *shared_blk, int blk_size, int is_writer )
+{
+    return attach_stream ( shared_blk, blk_size, is_writer, spn.fmt_version );
+}
+/*
+ * Create both directions of a request/response pair on one shared block.
+ * Each half of the block is a commbuf whose header starts on its own
+ * cache line, the initiator writes the first half and reads the second.
+ * Fan-in and tee formats don't apply to a pair, a ring is used instead.
+ * Pair[0] is the stream to read and pair[1] the stream to write.
+ */
+int memstream_create_duplex ( void *shared_blk, int blk_size, 
+	int is_initiator, memstream pair[2] )
+{
+    struct commbuf *half[2];
+    int half_size, fmt_version, i;
+
+    half_size = (blk_size / 2) & ~(MEMSTREAM_CACHE_LINE-1);
+    half[0] = shared_blk;
+    half[1] = (struct commbuf *) ((char *) shared_blk + half_size);
+    for ( i = 0; i < 2; i++ ) {
+	if ( (half[i]->fmt_version == MEMSTREAM_FMT_MPSC) ||
+		(half[i]->fmt_version == MEMSTREAM_FMT_TEE) ) {
+	    errno = EINVAL;		/* not a duplex block */
+	    return -1;
+	}
+    }
+    fmt_version = spn.fmt_version;
+    if ( (fmt_version == MEMSTREAM_FMT_MPSC) || 
+	(fmt_version == MEMSTREAM_FMT_TEE) ) fmt_version = MEMSTREAM_FMT_RING;
+
+    pair[1] = attach_stream ( half[is_initiator ? 0 : 1], half_size, 1,
+	fmt_version );
+    if ( !pair[1] ) {
+	errno = EINVAL;
+	return -1;
+    }
+    pair[0] = attach_stream ( half[is_initiator ? 1 : 0], half_size, 0,
+	fmt_version );
+    if ( !pair[0] ) {
+	memstream_close ( pair[1] );
+	memstream_destroy ( pair[1] );
+	errno = EINVAL;
+	return -1;
+    }
+    pair[0]->duplex = 1;
+    pair[1]->duplex = 1;
+    return 0;
+}
+
+int memstream_control ( memstream stream, int *new_attributes,
 	int *old_attributes )
 {
     int attributes;
@@ -685,25 +3761,468 @@ int memstream_control ( memstream stream, int *new_attributes,
 	/*
 	 * Return error if new_attributes mask sets undefined bits.
 	 */
-	if ( (*new_attributes) & ~(MEMSTREAM_ATTR_NONBLOCK) ) {
+	if ( (*new_attributes) & 
+		~(MEMSTREAM_ATTR_NONBLOCK|MEMSTREAM_ATTR_RECORD|
+		MEMSTREAM_ATTR_DROP|MEMSTREAM_ATTR_BUSY_POLL) ) {
 	    errno = EINVAL;
 	    return -1;
 	}
-	stream->attributes = (*new_attributes);
+	stream->attributes = (*new_attributes);
+    }
+    return 0;
+}
+/*
+ * Set how long a busy-polling reader watches an empty stream.
+ */
+int memstream_set_busy_poll ( memstream stream, int usec )
+{
+    if ( usec < 0 ) {
+	errno = EINVAL;
+	return -1;
+    }
+    stream->poll_usec = usec;
+    return 0;
+}
+/*
+ * Register callback that maps the block a stream migrates to.  Size_limit
+ * greater than the current size lets a writer grow automatically.
+ */
+int memstream_set_growth ( memstream stream, 
+	memstream_remap_callback *remap, void *arg, int size_limit )
+{
+    if ( (!remap && size_limit) || (remap && stream->duplex) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    stream->growth.remap = remap;
+    stream->growth.arg = arg;
+    stream->growth.limit = stream->is_writer ? size_limit : 0;
+    stream->growth.blocked = 0;
+    return 0;
+}
+/*
+ * Set writer's wake policy: a waiting reader is left asleep until
+ * low_water bytes are pending, the writer flushes or the reader's
+ * max_latency_msec deadline passes.  Data reaching high_water wakes the
+ * reader without waiting for the write to finish.  Zeros turn both off.
+ */
+int memstream_set_wake_marks ( memstream stream, int low_water,
+	int high_water, int max_latency_msec )
+{
+    volatile struct commbuf *buf;
+
+    buf = stream->buf;
+    if ( !stream->is_writer || (low_water < 0) || (high_water < 0) ||
+	(max_latency_msec < 0) || (max_latency_msec > MEMSTREAM_MAX_WAKE_MSEC) ||
+	(low_water && !max_latency_msec) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    if ( low_water && ((buf->fmt_version == MEMSTREAM_FMT_MPSC) || 
+	(buf->fmt_version == MEMSTREAM_FMT_TEE)) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    stream->batch.low_water = low_water;
+    stream->batch.high_water = high_water;
+
+    acquire_lock ( stream );
+    buf->flags.bit.wake_msec = low_water ? max_latency_msec : 0;
+    release_lock ( stream, buf );
+    return 0;
+}
+/*
+ * Move writer's stream to a new block of blk_size bytes now.  Data already
+ * written stays in the old block until the reader drains it.
+ */
+int memstream_resize ( memstream stream, int blk_size )
+{
+    if ( blk_size == stream->growth.blk_size ) return blk_size;
+    return migrate_commbuf ( stream, blk_size );
+}
+/*
+ * Link caller-supplied statistics block to memstream context.  Block is
+ * zeroed.
+ */
+int memstream_assign_statistics ( memstream stream,
+         struct memstream_stats *stats )
+{
+    __MEMSET ( stats, 0, sizeof(struct memstream_stats) );
+    stream->stats = stats;
+    return 1;
+}
+/***********************************************************************/
+/*
+ * Issue a deferred wake early once the pending data reaches the high
+ * water mark, so a long write doesn't keep the reader idle until its end.
+ */
+static void high_water_wake ( memstream stream, int *deferred_wake )
+{
+    if ( *deferred_wake && stream->batch.high_water &&
+	(commbuf_pending ( stream->buf ) >= stream->batch.high_water) ) {
+	*deferred_wake = 0;
+	wake_peer ( stream );
+    }
+}
+/*
+ * Non-blocking operation is returning EWOULDBLOCK with the stream armed,
+ * so the peer's next read or write will wake us and post our wait handle.
+ * Publish the handle in the current block (it may have migrated), drain
+ * stale notifications, then post it ourselves if the peer acted between
+ * our arming and the publish, as that wake would have gone unposted.
+ */
+static void notify_blocked ( memstream stream )
+{
+    int *id;
+
+    if ( !stream->notify.id ) return;
+    id = NOTIFY_ID ( stream->buf, stream->is_writer );
+    if ( *id != stream->notify.id ) *id = stream->notify.id;
+    full_barrier();
+    notify_drain ( stream );
+    full_barrier();
+    if ( !memstream_armed ( stream ) ) 
+	notify_signal ( stream, spn.self, stream->notify.id );
+}
+
+/* Internal transfer loops shared by the public read and write functions.
+ * Callers count the operation in the statistics.
+ *
+ * Writev_stream moves total bytes from the caller's buffers described by
+ * cursor.  It reserves contiguous space and gathers into it, so a vector
+ * that fits normally reaches the reader in a single commit.  Reader wake
+ * is left to caller via *deferred_wake.  On a framed stream, a record
+ * that has been started is always finished, even if non-blocking.
+ */
+static int writev_stream ( memstream stream, struct iov_cursor *cur,
+	int total, int *deferred_wake )
+{
+    int status, count;
+    struct commbuf_report report;
+
+    count = 0;
+    while ( count < total ) {
+	status = put_to_commbuf ( 0, total-count, stream, &report );
+	if ( (status == COMMBUF_COMPLETED) && (report.transferred > 0) ) {
+	    gather_iov ( &commbuf_data ( stream->buf )[report.position],
+		report.transferred, cur );
+	    status = commit_to_commbuf ( stream, report.position,
+		report.transferred, &report );
+	    if ( status == COMMBUF_COMPLETED ) {
+		count += report.transferred;
+		count_segment ( stream, report.transferred );
+		if ( report.enter_state == MEMSTREAM_STATE_EMPTY )
+		    *deferred_wake = 1;
+		high_water_wake ( stream, deferred_wake );
+	    }
+	}
+	if ( status == COMMBUF_BLOCKED ) {
+	    /*
+	     * No space, make sure reader is draining before we sleep.
+	     */
+	    if ( *deferred_wake ) {
+		*deferred_wake = 0;
+		wake_peer ( stream );
+	    }
+	    if ( (stream->attributes&MEMSTREAM_ATTR_NONBLOCK) &&
+		 ((count == 0) || (stream->record.mode < 0)) ) {
+		if ( count > 0 ) break;
+		notify_blocked ( stream );
+		errno = EWOULDBLOCK;
+		return -1;
+	    }
+	    hibernate ( stream );
+
+	} else if ( status == COMMBUF_DISCARDED ) {
+	    errno = EPIPE;
+	    return -1;
+
+	} else if ( status == COMMBUF_ABORT ) {
+	    if ( stream->stats ) stream->stats->errors++;
+	    errno = EIO;
+	    return -1;
+	}
+    }
+    return count;
+}
+/*
+ * Read_stream is the memstream_read loop, copying up to bufsize bytes.
+ * Returns number of bytes read, which is less than min_bytes when:
+ *    -1    Condition saved in errno: EWOULDBLOCK, EIO, EPIPE
+ *     0
+ */
+static int read_stream ( memstream stream, void *buffer_vp, int bufsize,
+	int min_bytes, int *expedite_flag )
+{
+    int status, remaining, seg, count, defer_wake;
+    struct commbuf_report report;
+    char *buffer;
+
+    count = 0;
+    buffer = buffer_vp;
+    *expedite_flag = 0;
+    /*
+     * Transfer bytes from shared buffer to caller's buffer in chunks until
+     * bufsize moved or stream closed.
+     */
+    do {
+	status = get_from_commbuf(stream, buffer, bufsize-count, &report);
+	seg = report.transferred;
+	if ( seg > 0 ) {
+	    count += seg;
+	    buffer += seg;
+	    count_segment ( stream, seg );
+	}
+	if ( status == COMMBUF_COMPLETED ) {
+	    if ( report.enter_state == MEMSTREAM_STATE_FULL ) {
+		/*
+		 * Writer filled buffer and is waiting for us to flush
+		 * it, which may take multiple gets.  Defer wake until
+		 * commbuf_get returned all data and flips state to IDLE.
+		 */
+		if ( report.exit_state == MEMSTREAM_STATE_IDLE ) {
+		    wake_peer ( stream );
+		    /* If we have read something, return now to let it
+		       be processed rather than wait on writer */
+		    /* check for expedite */
+		    if ( report.flags.bit.expedite ) {
+			*expedite_flag = 1;
+			break;
+		    }
+		    if ( count > 0 ) break;
+		}
+	    }
+	} else if ( status == COMMBUF_BLOCKED ) {
+	    /* No data, wait and retry. */
+	    if ( report.flags.bit.expedite ) {
+		/* writer is performing a flush */
+		*expedite_flag = 1;
+	    }
+	    if ( stream->attributes&MEMSTREAM_ATTR_NONBLOCK ) {
+		/* Return bytes read or EWOULDBLOCK error */
+		if ( count == 0 ) {
+		    notify_blocked ( stream );
+		    errno = EWOULDBLOCK;
+		    return -1;
+		}
+		break;
+	    }
+	    hibernate ( stream );
+	} else if ( status == COMMBUF_DISCARDED ) {
+	    if ( count == 0 ) errno = EPIPE;
+	    return (count > 0) ? count : -1;
+	} else if ( status == COMMBUF_ABORT ) {
+	    if ( stream->stats ) stream->stats->errors++;
+	    errno = EIO;
+	    return -1;
+	}
+    } while ( count < min_bytes );
+
+/* TRACE */
+    if ((count == 0) && TRACE_AVAILABLE)
+       {
+/*       dmpipe_trace = 1; */
+       dmpipe_trace_output("memstream_read returning 0 when:\r\nreturned status = %d\r\nreport.enter_state = %d\r\n"
+                           "report.flags = %d\r\nreport.exit_state = %d\r\n report.transferred = %d\r\n",
+                           status, report.enter_state, report.flags.mask, report.exit_state, report.transferred);
+       }
+/* END TRACE */
+    return count;
+}
+/*
+ * Readv_stream peeks at contiguous data and copies it out to as many of
+ * the caller's buffers as it fills, then consumes it.  Returns as
+ * read_stream, but a writer waiting for space is woken only once, as
+ * the call returns.
+ */
+static int readv_stream ( memstream stream, struct iov_cursor *cur,
+	int total, int min_bytes, int *expedite_flag )
+{
+    int status, count, deferred_wake;
+    struct commbuf_report report;
+
+    *expedite_flag = 0;
+    if ( total == 0 ) return 0;
+    if ( min_bytes > total ) min_bytes = total;
+    count = 0;
+    deferred_wake = 0;
+
+    do {
+	status = get_from_commbuf ( stream, 0, total-count, &report );
+	if ( status == COMMBUF_COMPLETED ) {
+	    if ( report.transferred > 0 ) {
+		scatter_iov ( &commbuf_data ( stream->buf )[report.position],
+			report.transferred, cur );
+		if ( consume_from_commbuf ( stream, report.position,
+			report.transferred, &report ) == COMMBUF_ABORT ) {
+		    /* Tee reader dropped, data may be overwritten */
+		    if ( stream->stats ) stream->stats->errors++;
+		    errno = EIO;
+		    return -1;
+		}
+		count += report.transferred;
+		count_segment ( stream, report.transferred );
+	    }
+	    if ( (report.enter_state == MEMSTREAM_STATE_FULL) &&
+		 (report.exit_state == MEMSTREAM_STATE_IDLE) ) {
+		deferred_wake = 1;
+		if ( report.flags.bit.expedite ) {
+		    *expedite_flag = 1;
+		    break;
+		}
+		if ( count > 0 ) break;
+	    }
+	} else if ( status == COMMBUF_BLOCKED ) {
+	    if ( report.flags.bit.expedite ) *expedite_flag = 1;
+	    if ( deferred_wake ) {
+		deferred_wake = 0;
+		wake_peer ( stream );
+	    }
+	    if ( stream->attributes&MEMSTREAM_ATTR_NONBLOCK ) {
+		if ( count == 0 ) {
+		    notify_blocked ( stream );
+		    errno = EWOULDBLOCK;
+		    return -1;
+		}
+		break;
+	    }
+	    hibernate ( stream );
+	} else if ( status == COMMBUF_DISCARDED ) {
+	    if ( count == 0 ) errno = EPIPE;
+	    return (count > 0) ? count : -1;
+	} else if ( status == COMMBUF_ABORT ) {
+	    if ( stream->stats ) stream->stats->errors++;
+	    errno = EIO;
+	    return -1;
+	}
+    } while ( count < min_bytes );
+
+    if ( deferred_wake ) wake_peer ( stream );
+    return count;
+}
+/***********************************************************************/
+/* Record (framed) mode.  If the writer has MEMSTREAM_ATTR_RECORD set when
+ * it first writes, it marks the commbuf framed and each write call after
+ * that sends one record: a length prefix (int) followed by the data.
+ * The reader learns the mode from the commbuf flags when data first
+ * arrives.  Reads on a framed stream never return bytes from more than
+ * one record and memstream_read_record returns a whole record, in place
+ * when possible.  The mode is fixed for the life of the stream.
+ */
+static int decide_framing ( memstream stream, int *expedite_flag )
+{
+    const void *view;
+    volatile struct commbuf *buf;
+
+    buf = stream->buf;
+    if ( stream->is_writer ) {
+	stream->record.mode = -1;
+	if ( stream->attributes&MEMSTREAM_ATTR_RECORD ) {
+	    acquire_lock ( stream );
+	    buf->flags.bit.framed = 1;
+	    release_lock ( stream, buf );
+	    stream->record.mode = 1;
+	}
+	return 0;
+    }
+    /*
+     * Writer has made its choice by the time any data shows up.
+     */
+    if ( memstream_read_peek ( stream, &view, 1, expedite_flag ) < 0 )
+	return -1;
+    memstream_read_consume ( stream, 0 );
+    stream->record.mode = buf->flags.bit.framed ? 1 : -1;
+    return 0;
+}
+/*
+ * Give back record that memstream_read_record returned in place.
+ */
+static void release_record_view ( memstream stream )
+{
+    stream->record.view = 0;
+    memstream_read_consume ( stream, stream->region.size );
+}
+/*
+ * Set stream->record.remaining from length prefix of next record.  The
+ * prefix may arrive in pieces, so partial prefix is kept across calls.
+ * Return 1 on success, otherwise result of read_stream.
+ */
+static int read_record_header ( memstream stream, int *expedite_flag )
+{
+    int count, needed;
+
+    do {
+	needed = sizeof(stream->record.hdr) - stream->record.hdr_len;
+	count = read_stream ( stream,
+		&stream->record.hdr.b[stream->record.hdr_len], needed, needed,
+		expedite_flag );
+	if ( count <= 0 ) return count;
+	stream->record.hdr_len += count;
+	if ( (count < needed) &&
+		(stream->attributes&MEMSTREAM_ATTR_NONBLOCK) ) {
+	    notify_blocked ( stream );
+	    errno = EWOULDBLOCK;
+	    return -1;
+	}
+    } while ( count < needed );
+
+    stream->record.hdr_len = 0;
+    stream->record.remaining = stream->record.hdr.length;
+    return 1;
+}
+/*
+ * Send caller's buffers as one record.
+ */
+static int write_framed ( memstream stream, const struct iovec *iov,
+	int iovcnt, int total )
+{
+    struct iovec prefix;
+    struct iov_cursor cur;
+    int length, count, deferred_wake;
+
+    if ( (stream->buf->fmt_version == MEMSTREAM_FMT_MPSC) && (total >
+		mpsc_record_limit ( stream->buf ) - (int) sizeof(length)) ) {
+	errno = EMSGSIZE;	/* would be split among other writers' data */
+	return -1;
     }
-    return 0;
+    length = total;
+    prefix.iov_base = (void *) &length;
+    prefix.iov_len = sizeof(length);
+    cur.iov = &prefix;
+    cur.offset = 0;
+    cur.then = iov;
+    deferred_wake = 0;
+    count = writev_stream ( stream, &cur, total+sizeof(length),
+	&deferred_wake );
+    if ( deferred_wake ) wake_peer ( stream );
+
+    return (count < 0) ? count : count - sizeof(length);
 }
 /*
- * Link caller-supplied statistics block to memstream context.  Block is
- * zeroed.
+ * Read from current record, starting next one if needed.  Empty records
+ * are skipped.  Data goes to buffer, or to caller's buffers described
+ * by cursor if not null.
  */
-int memstream_assign_statistics ( memstream stream,
-         struct memstream_stats *stats )
+static int read_framed ( memstream stream, void *buffer,
+	struct iov_cursor *cur, int total, int min_bytes, int *expedite_flag )
 {
-    __MEMSET ( stats, 0, sizeof(struct memstream_stats) );
-    stream->stats = stats;
-    return 1;
+    int count, status;
+
+    while ( stream->record.remaining == 0 ) {
+	status = read_record_header ( stream, expedite_flag );
+	if ( status <= 0 ) return status;
+    }
+    if ( total > stream->record.remaining ) total = stream->record.remaining;
+    if ( min_bytes > total ) min_bytes = total;
+    if ( cur ) {
+	count = readv_stream ( stream, cur, total, min_bytes, expedite_flag );
+    } else {
+	count = read_stream ( stream, buffer, total, min_bytes, expedite_flag );
+    }
+    if ( count > 0 ) stream->record.remaining -= count;
+    return count;
 }
+/***********************************************************************/
 /*
  * write block of data to stream.
  */
@@ -712,20 +4231,30 @@ int memstream_write ( memstream stream, const void *buffer_vp, int bufsize )
     int status, remaining, deferred_wake, seg, count;
     struct commbuf_report report;
     const char *buffer;
+    struct iovec vec;
     /*
      * Prepare for main lopp.
      */
     if ( stream->stats ) stream->stats->operations++;
+    if ( stream->record.mode >= 0 ) {
+	if ( stream->record.mode == 0 ) decide_framing ( stream, 0 );
+	if ( stream->record.mode > 0 ) {
+	    vec.iov_base = (void *) buffer_vp;
+	    vec.iov_len = bufsize;
+	    return write_framed ( stream, &vec, 1, bufsize );
+	}
+    }
     count = 0;
     deferred_wake = 0;
     buffer = buffer_vp;
     /*
      * Call put_to_commbuf as many times as needed to transfer caller's buffer.
-     * Put_to_commbuf transfer at most spn.seg_limit bytes at a time.
+     * It transfers at most a segment at a time.
      */
     for ( remaining=bufsize; remaining > 0; remaining -= report.transferred ) {
-	status = put_to_commbuf ( buffer, remaining, stream->buf, &report );
-	if (stream->stats && (report.transferred>0)) stream->stats->segments++;
+	status = put_to_commbuf ( buffer, remaining, stream, &report );
+	if ( report.transferred > 0 ) 
+	    count_segment ( stream, report.transferred );
 	if ( status == COMMBUF_COMPLETED ) {
 	    /*
 	     * Skip over buffer we wrote and note if we should wake reader.
@@ -734,14 +4263,16 @@ int memstream_write ( memstream stream, const void *buffer_vp, int bufsize )
 	     */
 	    buffer += report.transferred;
 	    if (report.enter_state == MEMSTREAM_STATE_EMPTY) deferred_wake = 1;
+	    high_water_wake ( stream, &deferred_wake );
 
 	} else if ( status == COMMBUF_BLOCKED ) {
 	    /*
 	     * Ran out of space in commbuf, sleep and retry when awakened.
-             * Clear any pending wake to prevent deadlock in case where 
+             * Clear any pending wake to prevent deadlock in case where
              * reader was also blocked (i.e. bufsize > buf->data_limit).
 	     */
 	    if ( stream->attributes&MEMSTREAM_ATTR_NONBLOCK ) {
+		notify_blocked ( stream );
 		errno = EWOULDBLOCK;	/* rethink */
 		return -1;
 	    }
@@ -778,84 +4309,361 @@ int memstream_write ( memstream stream, const void *buffer_vp, int bufsize )
  * Read fuctino returns number of bytes read from memstream.  If count
  * returned is less than min_bytes:
  *    -1    Condition saved in errno: EWOULDBLOCK, EIO, EPIPE
- *     0    
+ *     0
  */
-int memstream_read ( memstream stream, void *buffer_vp, int bufsize, 
+int memstream_read ( memstream stream, void *buffer_vp, int bufsize,
 	int min_bytes, int *expedite_flag )
 {
-    int status, remaining, seg, count, defer_wake;
-    struct commbuf_report report;
-    char *buffer;
+    if ( stream->stats ) stream->stats->operations++;
+    if ( stream->record.view ) release_record_view ( stream );
+    if ( stream->record.mode <= 0 ) {
+	if ( (stream->record.mode == 0) &&
+		(decide_framing ( stream, expedite_flag ) < 0) ) return -1;
+	if ( stream->record.mode < 0 ) return read_stream ( stream,
+		buffer_vp, bufsize, min_bytes, expedite_flag );
+    }
+    return read_framed ( stream, buffer_vp, 0, bufsize, min_bytes, 
+	expedite_flag );
+}
+/*
+ * Wake-and-wait: send request on wstream and wait for the reply on
+ * rstream, usually the two halves of a duplex block.  The request is never
+ * held back by wake batching, the peer is woken as soon as it is
+ * published and we go straight to waiting for the reply.  Returns as
+ * memstream_read.
+ */
+int memstream_call ( memstream wstream, const void *request, int reqlen,
+	memstream rstream, void *reply, int replysize, int min_bytes,
+	int *expedite_flag )
+{
+    int low_water;
+
+    if ( !wstream->is_writer || rstream->is_writer ) {
+	errno = EINVAL;
+	return -1;
+    }
+    low_water = wstream->batch.low_water;
+    wstream->batch.low_water = 0;
+    if ( memstream_write ( wstream, request, reqlen ) < 0 ) {
+	wstream->batch.low_water = low_water;
+	return -1;
+    }
+    wstream->batch.low_water = low_water;
+
+    return memstream_read ( rstream, reply, replysize, min_bytes, 
+	expedite_flag );
+}
+/*
+ * Gather write, normally sent to the reader with a single commit.  Wake of
+ * reader is deferred as in memstream_write.
+ */
+int memstream_writev ( memstream stream, const struct iovec *iov,
+	int iovcnt )
+{
+    int total, count, deferred_wake;
+    struct iov_cursor cur;
 
+    total = iov_total ( iov, iovcnt );
+    if ( !stream->is_writer || (stream->region.size > 0) || (total < 0) ) {
+	errno = EINVAL;
+	return -1;
+    }
     if ( stream->stats ) stream->stats->operations++;
-    count = 0;
-    buffer = buffer_vp;
+    if ( stream->record.mode == 0 ) decide_framing ( stream, 0 );
+    if ( stream->record.mode > 0 )
+	return write_framed ( stream, iov, iovcnt, total );
+
+    cur.iov = iov;
+    cur.offset = 0;
+    cur.then = 0;
+    deferred_wake = 0;
+    count = writev_stream ( stream, &cur, total, &deferred_wake );
+    if ( deferred_wake ) wake_peer ( stream );
+    return count;
+}
+/*
+ * Scatter read, returns as memstream_read.
+ */
+int memstream_readv ( memstream stream, const struct iovec *iov,
+	int iovcnt, int min_bytes, int *expedite_flag )
+{
+    int total;
+    struct iov_cursor cur;
+
+    if ( stream->record.view ) release_record_view ( stream );
+    total = iov_total ( iov, iovcnt );
+    if ( stream->is_writer || (stream->region.size > 0) || (total < 0) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    if ( stream->stats ) stream->stats->operations++;
+    *expedite_flag = 0;
+    if ( total == 0 ) return 0;
+    if ( (stream->record.mode == 0) &&
+	(decide_framing ( stream, expedite_flag ) < 0) ) return -1;
+    cur.iov = iov;
+    cur.offset = 0;
+    cur.then = 0;
+    if ( stream->record.mode > 0 )
+	return read_framed ( stream, 0, &cur, total, min_bytes, expedite_flag );
+
+    return readv_stream ( stream, &cur, total, min_bytes, expedite_flag );
+}
+/*
+ * Return next record, which memstream_write or memstream_writev sent as
+ * one call.  If the record lies contiguous in the shared buffer, *record
+ * points to it in place and it stays valid until the next read call on
+ * the stream, otherwise it is copied to buffer and any excess beyond
+ * bufsize is discarded.  A stream that isn't framed returns the data
+ * available as in memstream_read.  Empty records return 0 with *record
+ * set, end of stream is reported as memstream_read does.
+ */
+int memstream_read_record ( memstream stream, void *buffer, int bufsize,
+	const void **record, int *expedite_flag )
+{
+    int count, length, status, attributes, flush;
+    const void *view;
+
+    *record = 0;
     *expedite_flag = 0;
+    if ( stream->is_writer ) {
+	errno = EINVAL;
+	return -1;
+    }
+    if ( stream->record.view ) release_record_view ( stream );
+    if ( (stream->record.mode == 0) &&
+	(decide_framing ( stream, expedite_flag ) < 0) ) return -1;
+    if ( stream->record.mode < 0 ) {
+	count = memstream_read ( stream, buffer, bufsize, 1, expedite_flag );
+	if ( count > 0 ) *record = buffer;
+	return count;
+    }
+    if ( stream->stats ) stream->stats->operations++;
+
+    if ( stream->record.remaining == 0 ) {
+	/*
+	 * Start of new record, try to return it in place.
+	 */
+	status = read_record_header ( stream, expedite_flag );
+	if ( status <= 0 ) return status;
+	length = stream->record.remaining;
+	if ( length == 0 ) {
+	    *record = (const void *) &stream->record.hdr;
+	    return 0;
+	}
+	count = memstream_read_peek ( stream, &view, length, &flush );
+	if ( count < 0 ) return -1;
+	if ( flush ) *expedite_flag = 1;
+	if ( count == length ) {
+	    stream->record.view = 1;
+	    stream->record.remaining = 0;
+	    *record = view;
+	    return length;
+	}
+	memstream_read_consume ( stream, 0 );
+    }
     /*
-     * Transfer bytes from shared buffer to caller's buffer in chunks until
-     * bufsize moved or stream closed.
+     * Copy record to caller's buffer.  Record has been started so finish
+     * it even if stream is non-blocking.
      */
-    do {
-	status = get_from_commbuf(stream->buf, buffer, bufsize-count, &report);
-	seg = report.transferred;
-	if ( seg > 0 ) {
-	    count += seg;
-	    buffer += seg;
-	    if ( stream->stats ) stream->stats->segments++;
+    attributes = stream->attributes;
+    stream->attributes &= ~MEMSTREAM_ATTR_NONBLOCK;
+    length = stream->record.remaining;
+    if ( !buffer || (bufsize < 0) ) bufsize = 0;
+    if ( length > bufsize ) length = bufsize;
+    for ( count = 0, status = 1; count < length; count += status ) {
+	status = read_stream ( stream, (char *) buffer + count, length-count,
+		length-count, &flush );
+	if ( flush ) *expedite_flag = 1;
+	if ( status < 0 ) break;
+    }
+    stream->record.remaining -= count;
+    while ( (status >= 0) && (stream->record.remaining > 0) ) {
+	/* Discard rest of record */
+	status = memstream_read_peek ( stream, &view,
+		stream->record.remaining, &flush );
+	if ( status > 0 ) {
+	    memstream_read_consume ( stream, status );
+	    stream->record.remaining -= status;
 	}
+    }
+    stream->attributes = attributes;
+
+    if ( status < 0 ) return -1;
+    if ( bufsize == 0 ) {
+	errno = EMSGSIZE;		/* no place to copy record */
+	return -1;
+    }
+    *record = buffer;
+    return count;
+}
+
+/*
+ * Zero-copy write.  memstream_write_reserve returns the size of, and sets
+ * *region to point to, contiguous space in the shared buffer for up to
+ * bufsize bytes, waiting (unless non-blocking) until some is available.
+ * Caller builds data in place and calls memstream_write_commit to pass
+ * the first count bytes of the region to the reader.  Only one region may
+ * be outstanding and memstream_write must not be used until committed.
+ */
+int memstream_write_reserve ( memstream stream, void **region, int bufsize )
+{
+    int status;
+    struct commbuf_report report;
+
+    if ( stream->is_writer && (stream->record.mode == 0) ) 
+	decide_framing ( stream, 0 );
+    if ( !stream->is_writer || (stream->region.size > 0) || (bufsize <= 0) ||
+	(stream->record.mode > 0) ) {
+	errno = EINVAL;		/* records can't be built in place */
+	return -1;
+    }
+    if ( stream->stats ) stream->stats->operations++;
+    for ( ; ; ) {
+	status = put_to_commbuf ( 0, bufsize, stream, &report );
 	if ( status == COMMBUF_COMPLETED ) {
-	    if ( report.enter_state == MEMSTREAM_STATE_FULL ) {
-		/*
-		 * Writer filled buffer and is waiting for us to flush
-		 * it, which may take multiple gets.  Defer wake until
-		 * commbuf_get returned all data and flips state to IDLE.
-		 */
-		if ( report.exit_state == MEMSTREAM_STATE_IDLE ) {
-		    wake_peer ( stream );
-		    /* If we have read something, return now to let it
-		       be processed rather than wait on writer */
-		    /* check for expedite */
-		    if ( report.flags.bit.expedite ) {
-			*expedite_flag = 1;
-			break;
-		    }
-		    if ( count > 0 ) break;
-		}
+	    if ( report.transferred > 0 ) break;
+
+	} else if ( status == COMMBUF_BLOCKED ) {
+	    /* No space, sleep and retry when reader wakes us */
+	    if ( stream->attributes&MEMSTREAM_ATTR_NONBLOCK ) {
+		notify_blocked ( stream );
+		errno = EWOULDBLOCK;
+		return -1;
+	    }
+	    hibernate ( stream );
+
+	} else if ( status == COMMBUF_DISCARDED ) {
+	    errno = EPIPE;
+	    return -1;
+
+	} else {
+	    if ( stream->stats ) stream->stats->errors++;
+	    errno = EIO;
+	    return -1;
+	}
+    }
+    stream->region.pos = report.position;
+    stream->region.size = report.transferred;
+    *region = (void *) &commbuf_data ( stream->buf )[report.position];
+    return report.transferred;
+}
+
+int memstream_write_commit ( memstream stream, int count )
+{
+    int status;
+    struct commbuf_report report;
+
+    if ( (count < 0) || (count > stream->region.size) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    if ( count == 0 ) {
+	/* reservation abandoned, an MPSC record must still be released */
+	if ( (stream->region.size == 0) || 
+	    (stream->buf->fmt_version != MEMSTREAM_FMT_MPSC) ) {
+	    stream->region.size = 0;
+	    return 0;
+	}
+    }
+    stream->region.size = 0;
+
+    status = commit_to_commbuf ( stream, stream->region.pos, count, &report );
+    if ( status == COMMBUF_COMPLETED ) {
+	count_segment ( stream, count );
+	if ( report.enter_state == MEMSTREAM_STATE_EMPTY ) wake_peer ( stream );
+	return count;
+    } else if ( status == COMMBUF_DISCARDED ) {
+	errno = EPIPE;
+	return -1;
+    }
+    if ( stream->stats ) stream->stats->errors++;
+    errno = EIO;
+    return -1;
+}
+/*
+ * Zero-copy read.  memstream_read_peek returns the size of, and sets
+ * *region to point to, contiguous data in the shared buffer (at most 
+ * bufsize bytes), waiting (unless non-blocking) until some arrives.
+ * Caller examines data in place and calls memstream_read_consume to
+ * release the first count bytes of the region back to the writer.
+ */
+int memstream_read_peek ( memstream stream, const void **region, 
+	int bufsize, int *expedite_flag )
+{
+    int status;
+    struct commbuf_report report;
+
+    if ( stream->record.view ) release_record_view ( stream );
+    if ( stream->is_writer || (stream->region.size > 0) || (bufsize <= 0) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    if ( stream->stats ) stream->stats->operations++;
+    *expedite_flag = stream->flags.bit.expedite;	/* from last consume */
+    stream->flags.mask = 0;
+    for ( ; ; ) {
+	status = get_from_commbuf ( stream, 0, bufsize, &report );
+	if ( status == COMMBUF_COMPLETED ) {
+	    if ( report.transferred > 0 ) break;
+	    if ( (report.enter_state == MEMSTREAM_STATE_FULL) &&
+		 (report.exit_state == MEMSTREAM_STATE_IDLE) ) {
+		/* Writer was waiting on space already freed */
+		wake_peer ( stream );
+		if ( report.flags.bit.expedite ) *expedite_flag = 1;
 	    }
+
 	} else if ( status == COMMBUF_BLOCKED ) {
 	    /* No data, wait and retry. */
-	    if ( report.flags.bit.expedite ) {
-		/* writer is performing a flush */
-		*expedite_flag = 1;
-	    }
+	    if ( report.flags.bit.expedite ) *expedite_flag = 1;
 	    if ( stream->attributes&MEMSTREAM_ATTR_NONBLOCK ) {
-		/* Return bytes read or EWOULDBLOCK error */
-		if ( count == 0 ) {
-		    errno = EWOULDBLOCK;
-		    return -1;
-		}
-		break;
+		notify_blocked ( stream );
+		errno = EWOULDBLOCK;
+		return -1;
 	    }
 	    hibernate ( stream );
+
 	} else if ( status == COMMBUF_DISCARDED ) {
-	    if ( count > 0 ) ; else errno = EPIPE;
-	    return (count > 0) ? count : -1;
-	} else if ( status == COMMBUF_ABORT ) {
+	    errno = EPIPE;
+	    return -1;
+
+	} else {
 	    if ( stream->stats ) stream->stats->errors++;
 	    errno = EIO;
 	    return -1;
 	}
-    } while ( count < min_bytes );
+    }
+    stream->region.pos = report.position;
+    stream->region.size = report.transferred;
+    *region = (const void *) &commbuf_data ( stream->buf )[report.position];
+    return report.transferred;
+}
 
-/* TRACE */
-    if (count == 0)
-       {
-/*       dmpipe_trace = 1; */
-       dmpipe_trace_output("memstream_read returning 0 when:\r\nreturned status = %d\r\nreport.enter_state = %d\r\n"
-                           "report.flags = %d\r\nreport.exit_state = %d\r\n report.transferred = %d\r\n",
-                           status, report.enter_state, report.flags.mask, report.exit_state, report.transferred);
-       }
-/* END TRACE */
+int memstream_read_consume ( memstream stream, int count )
+{
+    struct commbuf_report report;
+
+    if ( (count < 0) || (count > stream->region.size) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    stream->region.size = 0;
+    if ( count == 0 ) return 0;
+
+    if ( consume_from_commbuf ( stream, stream->region.pos, count, 
+		&report ) == COMMBUF_ABORT ) {
+	/* Tee reader dropped while examining region */
+	if ( stream->stats ) stream->stats->errors++;
+	errno = EIO;
+	return -1;
+    }
+    count_segment ( stream, count );
+    if ( (report.enter_state == MEMSTREAM_STATE_FULL) &&
+	 (report.exit_state == MEMSTREAM_STATE_IDLE) ) {
+	/* Writer is waiting for space, save expedite for next peek */
+	wake_peer ( stream );
+	stream->flags.mask |= report.flags.mask;
+    }
     return count;
 }
 
@@ -867,6 +4675,7 @@ int memstream_close ( memstream stream )
      * Remove from open streams list.
      */
     prev = 0;
+    OPEN_STREAMS_LOCK();
     for ( cur = rundown.open_streams; cur; cur = cur->next ) {
 	if ( cur == stream ) break;
 	prev = cur;
@@ -874,16 +4683,22 @@ int memstream_close ( memstream stream )
     if ( cur ) {
 	if ( prev ) prev->next = cur->next;
 	else rundown.open_streams = cur->next;
-    } else {
+    }
+    OPEN_STREAMS_UNLOCK();
+    if ( !cur ) {
 	/* Stream not found on list, abort */
 	errno = EINVAL;
 	return -1;
     }
-    if ( stream->stats ) stream->stats->errors = spn.spinlock_fails;
+    if ( stream->growth.prev ) await_reader_migration ( stream );
+    if ( stream->notify.id ) {
+	/* Withdraw wait handle so peer stops posting to it */
+	*NOTIFY_ID ( stream->buf, stream->is_writer ) = 0;
+    }
     /*
      * Mark closed.
      */
-    prev_state = close_commbuf ( stream->buf, stream->is_writer ? 
+    prev_state = close_commbuf ( stream, stream->is_writer ? 
 	MEMSTREAM_STATE_WRITER_DONE : MEMSTREAM_STATE_READER_DONE );
     if ( prev_state == MEMSTREAM_STATE_FULL ) {
 	/* Someone was blocked writing to pipe, wake if not us */
@@ -901,6 +4716,12 @@ int memstream_close ( memstream stream )
 	    if ( (status&1) == 0 ) { errno=EINTR; return -1; }
 	}
     }
+    if ( WAKES_SLOTS(stream) ) {
+	/* Peers may be blocked on their slots, wake them to see close */
+	wake_peer ( stream );
+    }
+    notify_delete ( stream );
+    report_statistics ( stream );
     stream->buf = 0;
     return 0;
 }
@@ -936,46 +4757,142 @@ int memstream_query ( memstream stream,
     struct commbuf *buf;
 
     if ( stream->stats ) stream->stats->operations++;
+    /*
+     * Reader at end of a migrated block looks at the next one.
+     */
+    if ( !stream->is_writer && stream->buf->flags.bit.migrated ) 
+	follow_migration ( stream );
     /*
      * Lock commbuf and extract header information.
      */
-    acquire_lock ( stream->buf );
+    acquire_lock ( stream );
     buf = stream->buf;
     enter_state = buf->state;
-    available = buf->data_limit - buf->write_pos;
-    pending = buf->write_pos - buf->read_pos;
+    available = commbuf_space ( buf );
+    pending = stream->tee.reader ? tee_pending ( stream ) : 
+	commbuf_pending ( buf );
     /*
      * perform arm notification.
      */
-    if ( (buf->state == MEMSTREAM_STATE_IDLE) && arm_notification ) {
-	if ( stream->is_writer && (available <= 0) ) {
+    if ( arm_notification && ((buf->state == MEMSTREAM_STATE_IDLE) ||
+	(stream->tee.reader && (buf->state == MEMSTREAM_STATE_FULL))) ) {
+	if ( (pending <= 0) && stream->tee.reader ) {
+	    /*
+	     * Tee readers wait on their own slot, state left alone.
+	     */
+	    stream->tee.reader->slot.waiting = 1;
+	    store_release ( &TEE_CONTROL(buf)->waiting, 1 );
+	    full_barrier();
+	    if ( tee_pending ( stream ) > 0 ) 
+		stream->tee.reader->slot.waiting = 0;
+
+	} else if ( stream->is_writer && (available <= 0) && 
+		stream->fanin.slot ) {
+	    /*
+	     * MPSC writers wait on their own slot, state stays IDLE.
+	     */
+	    arm_mpsc_wait ( stream );
+	    if ( commbuf_space ( buf ) > 0 ) stream->fanin.slot->waiting = 0;
+
+	} else if ( stream->is_writer && (available <= 0) ) {
 	    /*
-	     * Next write would change state to full, do it now.
+	     * Next write would change state to full, do it now.  Recheck
+	     * after barrier since SPSC reader frees space without lock.
 	     */
 	    buf->state = MEMSTREAM_STATE_FULL;
+	    full_barrier();
+	    if ( commbuf_space ( buf ) > 0 ) buf->state = MEMSTREAM_STATE_IDLE;
 
 	} else if ( !stream->is_writer && (pending <= 0) ) {
 	    /*
 	     * Next read would reset buffer and mark it empty, do it now.
+	     * SPSC and MPSC cursors are never reset.
 	     */
-	    if ( buf->read_pos > 0 ) {
+	    if ( (buf->read_pos > 0) && 
+		(buf->fmt_version != MEMSTREAM_FMT_SPSC) &&
+		(buf->fmt_version != MEMSTREAM_FMT_MPSC) ) {
 		buf->read_pos = 0;
 		buf->write_pos = 0;    /* give write maximun space */
 	    }
 	    buf->state = MEMSTREAM_STATE_EMPTY;
+	    buf->flags.bit.timed_wait = 0;	/* poller needs a wake */
+	    full_barrier();
+	    if ( commbuf_pending ( buf ) > 0 ) buf->state = MEMSTREAM_STATE_IDLE;
 	}
 	exit_state = buf->state;
     } else exit_state = enter_state;
     /*
      * Release lock or buffer and return data.  Translate state.
      */
-    release_lock ( buf );
+    release_lock ( stream, buf );
     *pending_bytes = pending;
     *available_space = available;
     *state = exit_state;
 
     return 0;
 }
+/*
+ * Test, without the lock, whether the notification memstream_query armed
+ * is still set.  Once the peer acts on the stream it clears the EMPTY/FULL
+ * state or slot flag before waking us, so a 0 return tells a poller this
+ * stream is worth querying again.  Also 0 if the writer has migrated.
+ */
+int memstream_armed ( memstream stream )
+{
+    volatile struct commbuf *buf;
+
+    buf = stream->buf;
+    if ( buf->flags.bit.migrated ) return 0;
+    if ( stream->tee.reader ) return stream->tee.reader->slot.waiting;
+    if ( stream->fanin.slot ) return stream->fanin.slot->waiting;
+    return buf->state == (stream->is_writer ? 
+	MEMSTREAM_STATE_FULL : MEMSTREAM_STATE_EMPTY);
+}
+/*
+ * Return the stream's wait handle, creating it on first call.  The handle
+ * starts out readable so the caller's first attempt arms the stream, from
+ * then on it stays readable until a non-blocking operation returns
+ * EWOULDBLOCK (see notify_blocked()).  MPSC writers and tee readers wait
+ * on slots the peer wakes in bulk, they can't have a handle.
+ */
+int memstream_wait_fd ( memstream stream )
+{
+    if ( !stream->buf || stream->fanin.slot || stream->tee.reader ) {
+	errno = EINVAL;
+	return -1;
+    }
+    if ( stream->notify.id ) return stream->notify.fd;
+    if ( notify_create ( stream ) < 0 ) return -1;
+    notify_signal ( stream, spn.self, stream->notify.id );
+    return stream->notify.fd;
+}
+/*
+ * Examine a commbuf another process may be using, without its lock, for
+ * monitors.  Fields are read separately so may not agree with each
+ * other.  Return 0 or -1 if blk doesn't hold a commbuf.
+ */
+int memstream_inspect ( void *blk, struct memstream_snapshot *snap )
+{
+    volatile struct commbuf *buf;
+
+    buf = blk;
+    if ( (buf->ipc_version != MEMSTREAM_IPC_VERSION) ||
+	(buf->fmt_version < MEMSTREAM_FMT_VERSION) ||
+	(buf->fmt_version > MEMSTREAM_FMT_TEE) || (buf->data_limit <= 0) ) {
+	errno = EINVAL;
+	return -1;
+    }
+    snap->format = buf->fmt_version;
+    snap->state = buf->state;
+    snap->data_limit = buf->data_limit;
+    snap->pending = commbuf_pending ( buf );
+    if ( (snap->pending < 0) || (snap->pending > snap->data_limit) ) 
+	snap->pending = 0;		/* caught positions changing */
+    snap->writer_pid = buf->writer_pid;
+    snap->reader_pid = buf->reader_pid;
+    snap->migrated = buf->flags.bit.migrated;
+    return 0;
+}
 /*
  * Flush function stalls until all written data read by peer.  Convert
  * a non-empty, idle, buffer to state FULL and wait for change to non-full state.
@@ -992,12 +4909,37 @@ int memstream_flush ( memstream stream )
     /*
      * Lock commbuf and extract header information.
      */
+#ifdef __VMS
 if ( !tty ) tty = fopen ( "DBG$OUTPUT", "w" );
-    acquire_lock ( stream->buf );
+#endif
+    acquire_lock ( stream );
     buf = stream->buf;
     enter_state = buf->state;
-    available = buf->data_limit - buf->write_pos;
-    pending = buf->write_pos - buf->read_pos;
+    available = commbuf_space ( buf );
+    pending = commbuf_pending ( buf );
+    /*
+     * MPSC writers can't use FULL state, wait on our slot until
+     * reader has retired every record (including other writers').
+     */
+    while ( (pending > 0) && stream->fanin.slot ) {
+	if ( (buf->state != MEMSTREAM_STATE_IDLE) &&
+	     (buf->state != MEMSTREAM_STATE_EMPTY) ) {
+	    status = EOF;		/* reader closed connection */
+	    break;
+	}
+	buf->flags.bit.expedite = 1;
+	arm_mpsc_wait ( stream );
+	pending = commbuf_pending ( buf );
+	if ( pending == 0 ) {
+	    stream->fanin.slot->waiting = 0;
+	    buf->flags.bit.expedite = 0;
+	    break;
+	}
+	release_lock ( stream, buf );
+	hibernate ( stream );
+	acquire_lock ( stream );
+	pending = commbuf_pending ( buf );
+    }
     /*
      * We only have something to do if bytes waiting to be read or
      * if peer is wait for data.
@@ -1018,10 +4960,17 @@ if ( !tty ) tty = fopen ( "DBG$OUTPUT", "w" );
 	    do {
 	        buf->state = MEMSTREAM_STATE_FULL;
 		buf->flags.bit.expedite = 1;
+		full_barrier();
+		if ( commbuf_pending ( buf ) == 0 ) {
+		    /* SPSC reader drained buffer without seeing FULL */
+		    buf->state = MEMSTREAM_STATE_IDLE;
+		    buf->flags.bit.expedite = 0;
+		    break;
+		}
 	        while ( buf->state == MEMSTREAM_STATE_FULL ) {
-		    release_lock ( buf );
+		    release_lock ( stream, buf );
 		    hibernate( stream );
-		    acquire_lock ( buf );
+		    acquire_lock ( stream );
 	        }
 	        if ( (buf->state != MEMSTREAM_STATE_IDLE) &&
 		     (buf->state != MEMSTREAM_STATE_EMPTY) ) {
@@ -1029,7 +4978,7 @@ if ( !tty ) tty = fopen ( "DBG$OUTPUT", "w" );
 		    status = EOF;
 		    break;
 	        }
-	    } while ( buf->read_pos < buf->write_pos );
+	    } while ( commbuf_pending ( buf ) > 0 );
 	    break;
 
 	  case MEMSTREAM_STATE_WRITER_DONE:
@@ -1050,11 +4999,11 @@ if ( !tty ) tty = fopen ( "DBG$OUTPUT", "w" );
 	    break;
 	}
     }
-    release_lock ( buf );
+    release_lock ( stream, buf );
     return status;
 }
 
 int is_memstream_peer_done(memstream stream, int is_writer)
 {
-return is_commbuf_peer_done(stream->buf, is_writer);
+return is_commbuf_peer_done(stream, is_writer);
 }
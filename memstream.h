@@ -5,36 +5,104 @@
  *
  *    typedef memstream;	Handle for stream context.
  *    memstream_create();       Create new memstream.
+ *    memstream_create_duplex(); Create request/response pair on one block.
  *    memstream_write();        Write data bytes to stream.
  *    memstream_read();         Read data bytes from stream.
+ *    memstream_writev();       Write data gathered from several buffers.
+ *    memstream_readv();        Read data scattered to several buffers.
+ *    memstream_read_record();  Read one record (record mode).
+ *    memstream_call();         Send request and wait for reply.
+ *    memstream_write_reserve(); Get shared space to build data in.
+ *    memstream_write_commit(); Send data built in reserved space.
+ *    memstream_read_peek();    Get data in shared space to read in place.
+ *    memstream_read_consume(); Release data read in place.
  *    memstream_close();        Shutdown stream.
  *    memstream_destroy();      Free memstream resources.
+ *    memstream_set_growth();   Set callback for moving to a new block.
+ *    memstream_resize();       Move writer to block of a different size.
+ *    memstream_set_wake_marks(); Batch wakes of a waiting reader.
+ *    memstream_set_busy_poll(); Set how long a reader polls before waiting.
+ *    memstream_inspect();      Examine a block without locking (monitors).
  *
  *    memstream_assign_statistics();
  *
  * Caller is responsible for creating a shared memory region between
  * the processes using the stream.
  */
+#include <sys/uio.h>		/* struct iovec */
+
 typedef struct memstream_context *memstream;
+/*
+ * Statistics for a stream, maintained if caller assigns a block.  Lock
+ * times are in ticks of the processor's cycle counter.  Histogram bucket
+ * n counts values from 2^n up to 2^(n+1)-1 (bucket 0 includes 0).
+ */
+#define MEMSTREAM_HIST_BUCKETS 32
 struct memstream_stats {
-    int operations;		/* writes or reads calls */
-    int errors;
-    int segments;
-    int waits;
-    int signals;
+    long long operations;		/* writes or reads calls */
+    long long errors;
+    long long segments;
+    long long waits;
+    long long signals;
+    long long lock_spins;		/* spin lock busy, spun for it */
+    long long lock_yields;		/* spin budget exhausted, backed off */
+    long long lock_parks;		/* backoff exhausted, parked */
+    long long bytes;			/* data moved */
+    long long wait_usec;		/* time spent waiting for peer */
+    long long resumes;			/* waits ended by peer's wake */
+    long long resume_usec;		/* time from peer's wake to resuming */
+    long long lock_acquires;
+    unsigned long long lock_acquire_ticks;	/* time getting lock */
+    unsigned long long lock_hold_ticks;	/* time lock was held */
+    unsigned int wait_histogram[MEMSTREAM_HIST_BUCKETS];	/* usec */
+    unsigned int resume_histogram[MEMSTREAM_HIST_BUCKETS];	/* usec */
+    unsigned int acquire_histogram[MEMSTREAM_HIST_BUCKETS];	/* ticks */
+    unsigned int hold_histogram[MEMSTREAM_HIST_BUCKETS];	/* ticks */
 };
 /*
- * Allow tuning of parameters for spinlock.  Glocal setting.
+ * Allow tuning of parameters for spinlock.  Glocal setting.  Each stream
+ * learns its own spin budget (capped by initial_retry) from recent lock
+ * acquisitions, then backs off yielding the CPU and finally parks.
  */
 int memstream_set_spinlock ( 
 	int initial_retry,	/* retry limit to acquire spinlock */
-	int secondary_retry,	/* retry limit after stall */
-	int stall_msec, 	/* Stall time if initial failure */
+	int secondary_retry,	/* retry limit after each yield or stall */
+	int stall_msec, 	/* Stall time when parked */
 	int xfer_segment );	/* limit of data that can be moved while
-				   holding spinlock */
+				   holding spinlock (linear and ring) */
+/*
+ * Select commbuf format memstream_create uses when it initializes a new
+ * shared block, return value is previous setting.  Global setting.
+ */
+int memstream_set_format ( int fmt_version );
+#define MEMSTREAM_FORMAT_LINEAR 2	/* buffer reused only after drained */
+#define MEMSTREAM_FORMAT_RING 3		/* wrap-around ring buffer */
+#define MEMSTREAM_FORMAT_SPSC 4		/* ring with lock-free positions */
+#define MEMSTREAM_FORMAT_MPSC 5		/* fan-in, many writers one reader */
+#define MEMSTREAM_FORMAT_TEE 6		/* broadcast, one writer many readers */
 
+/*
+ * Create stream on shared block.  With MPSC format, every writer process
+ * calls memstream_create on the same block (up to 16) and the reader sees
+ * end of stream after the last one closes.  Each write of up to 1/8 of
+ * the buffer reaches the reader whole, never interleaved with another
+ * writer's data.  With tee format, every reader process (up to 16) calls
+ * memstream_create and reads all data written after it attached; the
+ * writer waits for the slowest reader.  Readers may attach and leave at
+ * any time, so on a record mode tee they must attach before the first
+ * write.  Returns 0 if the block is unusable or has no MPSC writer or tee
+ * reader slot free.
+ */
 memstream memstream_create ( void *shared_blk, int blk_size, int is_writer );
 #define MEMSTREAM_MIN_BLK_SIZE 512
+/*
+ * Create both streams of a request/response pair on one shared block,
+ * each half of the block carrying one direction.  The initiator and its
+ * peer both call it, pair[0] receives the stream to read and pair[1] the
+ * stream to write.  The streams can't migrate.  Returns 0 or -1.
+ */
+int memstream_create_duplex ( void *shared_blk, int blk_size, 
+	int is_initiator, memstream pair[2] );
 
 int memstream_assign_statistics ( memstream stream,
 	 struct memstream_stats *stats );
@@ -43,10 +111,86 @@ int memstream_write ( memstream stream, const void *buffer, int bufsize );
 
 int memstream_read(memstream stream, void *buffer, int bufsize, 
 	int min_bytes, int *expedite_flag );
+/*
+ * Write request to wstream, waking the reader at once, and wait for at
+ * least min_bytes of reply from rstream.  Returns as memstream_read.
+ */
+int memstream_call ( memstream wstream, const void *request, int reqlen,
+	memstream rstream, void *reply, int replysize, int min_bytes,
+	int *expedite_flag );
+/*
+ * Vector transfers move all iovcnt buffers with at most one wake of the
+ * peer per call (plus one each time call must block).  Return value is
+ * the same as the single buffer versions.
+ */
+int memstream_writev ( memstream stream, const struct iovec *iov, 
+	int iovcnt );
+int memstream_readv ( memstream stream, const struct iovec *iov, 
+	int iovcnt, int min_bytes, int *expedite_flag );
+/*
+ * Zero-copy transfers, caller works directly in shared memory region.
+ * Reserve/peek return size of region (-1 on error), commit/consume pass 
+ * the first count bytes of it to the peer.
+ */
+int memstream_write_reserve ( memstream stream, void **region, int bufsize );
+int memstream_write_commit ( memstream stream, int count );
+
+int memstream_read_peek ( memstream stream, const void **region,
+	int bufsize, int *expedite_flag );
+int memstream_read_consume ( memstream stream, int count );
+/*
+ * Record mode.  When writer sets MEMSTREAM_ATTR_RECORD before its first
+ * write, each write call sends a record and reads never cross a record
+ * boundary.  Read_record returns length of next record and sets *record
+ * to point to it, in the shared memory until next read if possible,
+ * otherwise in buffer (truncated to bufsize).  Writer can't use
+ * memstream_write_reserve on a record mode stream.
+ */
+int memstream_read_record ( memstream stream, void *buffer, int bufsize,
+	const void **record, int *expedite_flag );
+
+/*
+ * Block migration (linear, ring and SPSC formats).  The remap callback is
+ * called with *blk_size set to the size wanted (a writer) or to the
+ * power of 2 at least as big as the writer's block (a reader).  It
+ * returns a zeroed (writer) or the peer's (reader) shared block and
+ * updates *blk_size, or returns 0 if it can't.  With blk_size null it
+ * releases old_blk, which the stream no longer uses.  Both ends of a
+ * stream need the callback.  A writer with size_limit non-zero moves to
+ * a block twice the size when it keeps blocking on a full buffer, up to
+ * size_limit bytes.  Memstream_resize returns the new size or -1.
+ */
+typedef void *memstream_remap_callback ( void *arg, void *old_blk, 
+	int *blk_size, int is_writer );
+int memstream_set_growth ( memstream stream, 
+	memstream_remap_callback *remap, void *arg, int size_limit );
+int memstream_resize ( memstream stream, int blk_size );
+
+/*
+ * Wake batching (linear, ring and SPSC formats), set by the writer.  A
+ * reader waiting on an empty stream is woken only once low_water bytes
+ * are pending, on memstream_flush, or when max_latency_msec passes.
+ * High_water wakes the reader part way through a long write.
+ */
+int memstream_set_wake_marks ( memstream stream, int low_water,
+	int high_water, int max_latency_msec );
+#define MEMSTREAM_MAX_WAKE_MSEC 1023
 
 int memstream_control ( memstream stream, int *new_attributes, 
 	int *old_attribtes );
 #define MEMSTREAM_ATTR_NONBLOCK 1
+#define MEMSTREAM_ATTR_RECORD 2		/* writer frames each write */
+#define MEMSTREAM_ATTR_DROP 4		/* tee writer drops lagging readers,
+					   their reads then fail (EIO) */
+#define MEMSTREAM_ATTR_BUSY_POLL 8	/* reader polls before waiting */
+
+/*
+ * Busy-poll mode.  A reader with MEMSTREAM_ATTR_BUSY_POLL set that finds
+ * the stream empty spins watching for data for up to usec microseconds
+ * (default 50) before it arms notification and waits, trading CPU for
+ * wake latency.  Ignored for non-blocking reads and on uniprocessors.
+ */
+int memstream_set_busy_poll ( memstream stream, int usec );
 
 int memstream_query ( memstream stream, 
 	int *state, 		/* stream state */
@@ -54,6 +198,37 @@ int memstream_query ( memstream stream,
 	int *available_space,	/* bytes that can be written without blocking */
 	int arm_notification ); /* change state to empty/full if appropriate */
 
+/*
+ * True while the EMPTY/FULL notification armed by memstream_query is
+ * still pending, i.e. the peer hasn't touched the stream since.  Cheap,
+ * no lock taken.
+ */
+int memstream_armed ( memstream stream );
+
+/*
+ * Descriptor for foreign event loops (poll, select, epoll), readable when
+ * a non-blocking read or write on the stream may make progress.  It stays
+ * readable until an operation returns EWOULDBLOCK, which drains it, so
+ * callers only wait on it and must not read or close it.  Closed with the
+ * stream.  Not available to MPSC writers or tee readers.  Returns -1 with
+ * errno set on failure.
+ */
+int memstream_wait_fd ( memstream stream );
+
+/*
+ * Snapshot of a shared block for monitoring tools, taken without the
+ * spin lock.  State values are those memstream_query returns.
+ */
+struct memstream_snapshot {
+    int format;			/* commbuf format version */
+    int state;
+    int pending;		/* bytes written, not yet read */
+    int data_limit;		/* buffer capacity */
+    unsigned int writer_pid, reader_pid;
+    int migrated;		/* writer moved to another block */
+};
+int memstream_inspect ( void *blk, struct memstream_snapshot *snap );
+
 int memstream_close ( memstream stream );
 
 int memstream_destroy ( memstream stream );
@@ -6,25 +6,58 @@
  *
  *     If argv[1] is filename, file is sent to pipe.  If '=' then process
  *     is child.
+ *
+ * Environment variables:
+ *     TEST_MEMSTREAM_FORMAT	Commbuf format version for memstream_set_format,
+ *				compare throughput of formats by running
+ *				test with different values.  With 6 (tee)
+ *				master waits for the child's reader to
+ *				attach before sending.
+ *     TEST_MEMSTREAM_ALT_SELECT If non-zero, use pipe instead of memstream.
+ *     TEST_MEMSTREAM_ZERO_COPY	If non-zero, use reserve/commit and 
+ *				peek/consume functions.
+ *     TEST_MEMSTREAM_DIGEST	OpenSSL digest name to verify transfer.
+ *     TEST_MEMSTREAM_CHILD_TIMEOUT Seconds before child gives up.
+ *     TEST_MEMSTREAM_PINGPONG	Number of request/reply round trips to time
+ *				instead of sending file, child echoes each
+ *				request.
+ *     TEST_MEMSTREAM_DUPLEX	If non-zero, put both streams in a duplex
+ *				block and send requests with memstream_call.
+ *     TEST_MEMSTREAM_BUSY_POLL	Microseconds reads busy-poll an empty stream
+ *				before waiting (MEMSTREAM_ATTR_BUSY_POLL).
+ *     TEST_MEMSTREAM_WAIT_FD	If non-zero, read non-blocking and wait in
+ *				poll() on memstream_wait_fd's descriptor, as
+ *				a foreign event loop would (not with DUPLEX).
  */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <unixlib.h>
-#include <stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <poll.h>
+#ifdef VMS
+#include <unixlib.h>
+#include <stat.h>
+#include <starlet.h>
+#else
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#ifndef MAP_VARIABLE
+#define MAP_VARIABLE 0
+#endif
+#endif
 
 #include <openssl/evp.h>	/* for digest functions */
-#include <starlet.h>
 
 #include "memstream.h"
 
 static unsigned char digest_value[EVP_MAX_MD_SIZE];
 static unsigned int digest_vallen;
-static EVP_MD_CTX digest_state;
+static EVP_MD_CTX *digest_state;
 static char *digest_name;
 /*
  * Create a shared memory section.
@@ -34,18 +67,22 @@ void *shared_memory ( const char *name, size_t size )
     void *blk;
     int mem_obj;
     off_t eof;
+    struct stat info;
 
     mem_obj = shm_open ( name, O_CREAT | O_RDWR, 0660 );
     printf ( "mem_obj: %d\n", mem_obj );
     if ( mem_obj < 0 ) { perror ( "shm_open failed" ); return 0; }
 
     size = (size+8191) & (~8191);
-    eof = lseek ( mem_obj, size-4, SEEK_SET );
-    write ( mem_obj, "    ", 4 );
-    fsync ( mem_obj );
+    if ( (fstat ( mem_obj, &info ) < 0) || (info.st_size < size) ) {
+	/* Extend new object, peer may already be using existing one */
+	eof = lseek ( mem_obj, size-4, SEEK_SET );
+	write ( mem_obj, "    ", 4 );
+	fsync ( mem_obj );
+    }
     /* printf ( "Seek result: %x\n", eof ); */
 
-    blk = mmap ( 0, size, PROT_WRITE, 
+    blk = mmap ( 0, size, PROT_READ | PROT_WRITE, 
 	MAP_VARIABLE | MAP_SHARED, mem_obj, 0 );
     if ( blk == MAP_FAILED ) {
 	perror ( "mmap failed" );
@@ -57,6 +94,40 @@ void *shared_memory ( const char *name, size_t size )
 #ifdef VMS
 #include <lib$routines.h>
 #endif
+/*
+ * Elapsed time measurement for computing throughput.
+ */
+static struct timeval timer_start;
+
+static void init_timer ( void )
+{
+#ifdef VMS
+    LIB$INIT_TIMER();
+#endif
+    gettimeofday ( &timer_start, 0 );
+}
+
+static double elapsed_seconds ( void )
+{
+    struct timeval now;
+
+    gettimeofday ( &now, 0 );
+    return (double) (now.tv_sec - timer_start.tv_sec) +
+	(double) (now.tv_usec - timer_start.tv_usec) / 1000000.0;
+}
+
+static void show_timer ( const char *label, long long bytes )
+{
+    double elapsed;
+
+#ifdef VMS
+    LIB$SHOW_TIMER();
+#endif
+    elapsed = elapsed_seconds();
+    printf ( "%s throughput: %lld bytes in %.3f seconds, %.2f MB/sec\n",
+	label, bytes, elapsed, (elapsed > 0.0) ? 
+	((double) bytes / elapsed) / 1048576.0 : 0.0 );
+}
 /*
  * Allocate and return string describing device assigned to a file descriptor.
  */
@@ -79,7 +150,7 @@ static char *device_name ( int fd )
 	/* synthesize /dev/... name for device. */
 	name= malloc ( 40 );
 	sprintf ( name, "/dev/#%d/#%d", (int) major(info.st_dev),
-		(int) minor(into.st_dev) );
+		(int) minor(info.st_dev) );
 #endif
     }
     return name;
@@ -93,7 +164,7 @@ static char *finalize_digest ( void )
     if ( digest_name ) {
 	sprintf ( string, ", %s:", digest_name );
 	len = strlen ( string );
-        EVP_DigestFinal ( &digest_state, digest_value, &digest_vallen );
+        EVP_DigestFinal ( digest_state, digest_value, &digest_vallen );
         for (i=0; i<digest_vallen; i++) { 
 	    sprintf( &string[len], " %02x", digest_value[i] );
 	    len += strlen ( &string[len] );
@@ -106,42 +177,74 @@ static char *finalize_digest ( void )
  * Receive file sent over pipe and return byte count.
  */
 static int alt_is_pipe = 0;
-static alt_read ( int fd, memstream stream, void *buffer, size_t bufsize )
+static int zero_copy = 0;
+static int use_wait_fd = 0;
+static int alt_read ( int fd, memstream stream, void *buffer, size_t bufsize )
 {
-    int result;
+    int result, expedite;
+    const void *region;
+    struct pollfd pfd;
     if ( alt_is_pipe ) {
 	result = read ( fd, buffer, bufsize );
 	return result;
     }
-    return memstream_read ( stream, buffer, bufsize );
+    for ( ; ; ) {
+	if ( zero_copy ) {
+	    result = memstream_read_peek ( stream, &region, bufsize, 
+		&expedite );
+	    if ( result > 0 ) {
+		memcpy ( buffer, region, result );
+		memstream_read_consume ( stream, result );
+	    }
+	} else result = memstream_read ( stream, buffer, bufsize, 1, 
+		&expedite );
+	if ( (result >= 0) || !use_wait_fd || (errno != EWOULDBLOCK) ) break;
+	/*
+	 * Wait on the stream's wait handle like a foreign event loop.
+	 */
+	pfd.fd = memstream_wait_fd ( stream );
+	pfd.events = POLLIN;
+	if ( poll ( &pfd, 1, -1 ) < 0 ) break;
+    }
+    return result;
 }
 
-static alt_write ( int fd, memstream stream, void *buffer, size_t bufsize )
+static int alt_write ( int fd, memstream stream, void *buffer, size_t bufsize )
 {
-    int result;
+    int result, count;
+    void *region;
     if ( alt_is_pipe ) {
 	result = write ( fd, buffer, bufsize );
 	return result;
     }
+    if ( zero_copy ) {
+	for ( count = 0; count < bufsize; count += result ) {
+	    result = memstream_write_reserve ( stream, &region, bufsize-count );
+	    if ( result < 0 ) return result;
+	    memcpy ( region, (char *) buffer + count, result );
+	    if ( memstream_write_commit ( stream, result ) < 0 ) return -1;
+	}
+	return count;
+    }
     return memstream_write ( stream, buffer, bufsize );
 }
 
-static pipe_sink ( int pfd[2], memstream mpipe[2] )
+static void pipe_sink ( int pfd[2], memstream mpipe[2] )
 {
     int count, total_bytes, read_count, i;
     int ret_val;
     char buffer[22000];
 
-    LIB$INIT_TIMER();
+    init_timer();
     read_count = 0;
     for ( total_bytes = 0; 
 	(count=alt_read(pfd[0], mpipe[0], buffer, sizeof(buffer))) > 0;
 	total_bytes += count ) {
 	read_count++;
 	/* printf ( "child read completed: %d\n", count ); */
-	if ( digest_name ) EVP_DigestUpdate ( &digest_state, buffer, count );
+	if ( digest_name ) EVP_DigestUpdate ( digest_state, buffer, count );
     }
-    LIB$SHOW_TIMER();
+    show_timer ( "child", total_bytes );
     printf ( "\nchild bytes read: %d, reads: %d%s\n",
 	total_bytes, read_count, finalize_digest() );
 
@@ -158,19 +261,19 @@ static pipe_sink ( int pfd[2], memstream mpipe[2] )
 /*
  * Read file and send to source.
  */
-static pipe_source ( FILE *sf, int pfd[2], memstream mpipe[2] )
+static void pipe_source ( FILE *sf, int pfd[2], memstream mpipe[2] )
 {
     int count, total_bytes, i;
     char buffer[20480];
     unsigned char rem_digest[EVP_MAX_MD_SIZE];
 
-    LIB$INIT_TIMER();
+    init_timer();
     total_bytes = 0;
     while ( sf ) {
 	count = fread ( buffer, 1, sizeof(buffer), sf );
 	if ( count > 0 ) {
 	    if ( digest_name ) EVP_DigestUpdate ( 
-			&digest_state, buffer, count );
+			digest_state, buffer, count );
 	    total_bytes += count;
 	    count = alt_write (pfd[1], mpipe[1], buffer, count );
    		/*  printf ( "write count: %d\n", count ); */
@@ -182,8 +285,10 @@ static pipe_source ( FILE *sf, int pfd[2], memstream mpipe[2] )
 	} else break;
     }
     memstream_close ( mpipe[1] );
+#ifdef VMS
     decc$write_eof_to_mbx ( pfd[1] );
     decc$write_eof_to_mbx ( pfd[1] );
+#endif
     close ( pfd[1] );
     printf ( "file sent, bytes: %d%s\n", total_bytes, finalize_digest() );
 
@@ -197,11 +302,131 @@ static pipe_source ( FILE *sf, int pfd[2], memstream mpipe[2] )
     }
     close ( pfd[0] );
     memstream_close ( mpipe[0] );
-    LIB$SHOW_TIMER();
+    show_timer ( "master", total_bytes );
     printf ( "Sleeping...\n" );
     sleep ( 4 );
 }
 
+/*
+ * A tee reader starts at the head when it attaches, so wait for the child
+ * to attach to the block we write before the first write.  Return -1 if
+ * it hasn't after timeout seconds.
+ */
+static int tee_format = 0;
+
+static int wait_tee_reader ( void *blk, int timeout )
+{
+    struct memstream_snapshot snap;
+    int i;
+
+    for ( i = 0; i < timeout*100; i++ ) {
+	if ( (memstream_inspect ( blk, &snap ) == 0) && snap.reader_pid ) 
+	    return 0;
+	usleep ( 10000 );
+    }
+    return -1;
+}
+/*
+ * Round trip benchmark, master sends fixed size requests and child echoes
+ * each one back.
+ */
+static int ping_count = 0;
+static int duplex = 0;
+static int busy_poll = 0;
+
+static void set_busy_poll ( memstream stream )
+{
+    int attributes;
+
+    if ( busy_poll <= 0 ) return;
+    memstream_control ( stream, 0, &attributes );
+    attributes |= MEMSTREAM_ATTR_BUSY_POLL;
+    memstream_control ( stream, &attributes, 0 );
+    memstream_set_busy_poll ( stream, busy_poll );
+}
+
+static void set_wait_fd ( memstream stream )
+{
+    int attributes;
+
+    if ( !use_wait_fd || duplex ) return;
+    if ( memstream_wait_fd ( stream ) < 0 ) {
+	perror ( "memstream_wait_fd" );
+	use_wait_fd = 0;
+	return;
+    }
+    memstream_control ( stream, 0, &attributes );
+    attributes |= MEMSTREAM_ATTR_NONBLOCK;
+    memstream_control ( stream, &attributes, 0 );
+}
+
+static int read_reply ( int pfd[2], memstream mpipe[2], char *reply, 
+	int size )
+{
+    int count, seg;
+
+    for ( count = 0; count < size; count += seg ) {
+	seg = alt_read ( pfd[0], mpipe[0], &reply[count], size-count );
+	if ( seg <= 0 ) return count;
+    }
+    return count;
+}
+
+static void pingpong_server ( int pfd[2], memstream mpipe[2] )
+{
+    int count, requests;
+    char buffer[512];
+
+    for ( requests = 0; 
+	(count=alt_read(pfd[0], mpipe[0], buffer, sizeof(buffer))) > 0;
+	requests++ ) {
+	if ( alt_write ( pfd[1], mpipe[1], buffer, count ) != count ) break;
+    }
+    printf ( "child answered %d requests\n", requests );
+    memstream_close ( mpipe[0] );
+    memstream_close ( mpipe[1] );
+    close ( pfd[0] );
+    close ( pfd[1] );
+}
+
+static void pingpong_client ( int pfd[2], memstream mpipe[2] )
+{
+    int i, count, expedite;
+    char request[64], reply[64];
+    double elapsed;
+
+    memset ( request, 0, sizeof(request) );
+    init_timer();
+    for ( i = 0; i < ping_count; i++ ) {
+	sprintf ( request, "ping %d", i );
+	if ( duplex && !alt_is_pipe ) {
+	    count = memstream_call ( mpipe[1], request, sizeof(request),
+		mpipe[0], reply, sizeof(reply), sizeof(reply), &expedite );
+	} else {
+	    count = alt_write ( pfd[1], mpipe[1], request, sizeof(request) );
+	    if ( count == sizeof(request) ) 
+		count = read_reply ( pfd, mpipe, reply, sizeof(reply) );
+	}
+	if ( (count != sizeof(reply)) || strcmp ( reply, request ) ) {
+	    printf ( "Bad reply to request %d, length %d\n", i, count );
+	    break;
+	}
+    }
+    elapsed = elapsed_seconds();
+    printf ( "%s round trips: %d in %.3f seconds, %.2f usec each\n",
+	alt_is_pipe ? "pipe" : (duplex ? "duplex call" : "write/read"),
+	i, elapsed, (i > 0) ? (elapsed * 1000000.0) / i : 0.0 );
+
+    memstream_close ( mpipe[1] );
+#ifdef VMS
+    decc$write_eof_to_mbx ( pfd[1] );
+#endif
+    close ( pfd[1] );
+    close ( pfd[0] );
+    memstream_close ( mpipe[0] );
+}
+
+#ifdef VMS
 static void timeout_ast ( char *commbuf )
 {
     int status;
@@ -209,16 +434,29 @@ static void timeout_ast ( char *commbuf )
     status = SYS$FORCEX ( 0, 0, 44 );
     printf ( "forcex status: %d\n", status );
 }
+#else
+static void timeout_ast ( int sig )
+{
+    printf ( "Child timed out, killing\n" );
+    _exit ( 44 );
+}
+#endif
 
 static void dump_stats ( char *label, struct memstream_stats *rstats,
 	struct memstream_stats *wstats )
 {
-    printf ( "%s stats reader: ops=%d, err=%d, seg=%d, waits=%d, wak=%d\n",
-	label, rstats->operations, rstats->errors, rstats->segments, 
-	rstats->waits, rstats->signals );
-    printf ( "%s stats writer: ops=%d, err=%d, seg=%d, waits=%d, wak=%d\n",
-	label, wstats->operations, wstats->errors, wstats->segments, 
-	wstats->waits, wstats->signals );
+    printf ( "%s stats reader: ops=%lld, err=%lld, seg=%lld, waits=%lld, "
+	"wak=%lld\n", label, rstats->operations, rstats->errors, 
+	rstats->segments, rstats->waits, rstats->signals );
+    printf ( "%s stats writer: ops=%lld, err=%lld, seg=%lld, waits=%lld, "
+	"wak=%lld\n", label, wstats->operations, wstats->errors, 
+	wstats->segments, wstats->waits, wstats->signals );
+    printf ( "%s lock phases reader: spin=%lld, yield=%lld, park=%lld\n",
+	label, rstats->lock_spins, rstats->lock_yields, rstats->lock_parks );
+    printf ( "%s lock phases writer: spin=%lld, yield=%lld, park=%lld\n",
+	label, wstats->lock_spins, wstats->lock_yields, wstats->lock_parks );
+    printf ( "%s wait usec reader: %lld, writer: %lld, bytes=%lld\n", label,
+	rstats->wait_usec, wstats->wait_usec, wstats->bytes );
 }
 
 int main ( int argc, char **argv, char *env[] )
@@ -229,16 +467,33 @@ int main ( int argc, char **argv, char *env[] )
     const EVP_MD *cur_md;
     FILE *dummyf;
     char cmd_line[712];
-    char *alt_select, *child_timeout, *commbuf;
+    char *alt_select, *child_timeout, *commbuf, *format;
     memstream mpipe[2];
     struct memstream_stats rstats, wstats;
 
     blk_size = 0x8000;		/* 32K buffer */
     commbuf = shared_memory ( "MEMSTREAM_TEST", blk_size*2 );
-    printf ( "Shared memory address: %x\n", commbuf );
+    printf ( "Shared memory address: %p\n", commbuf );
     if ( !commbuf ) return 44;
     alt_select = getenv ( "TEST_MEMSTREAM_ALT_SELECT" );
     if ( alt_select ) alt_is_pipe = atoi ( alt_select );
+    alt_select = getenv ( "TEST_MEMSTREAM_ZERO_COPY" );
+    if ( alt_select ) zero_copy = atoi ( alt_select );
+    alt_select = getenv ( "TEST_MEMSTREAM_PINGPONG" );
+    if ( alt_select ) ping_count = atoi ( alt_select );
+    alt_select = getenv ( "TEST_MEMSTREAM_DUPLEX" );
+    if ( alt_select ) duplex = atoi ( alt_select );
+    alt_select = getenv ( "TEST_MEMSTREAM_BUSY_POLL" );
+    if ( alt_select ) busy_poll = atoi ( alt_select );
+    alt_select = getenv ( "TEST_MEMSTREAM_WAIT_FD" );
+    if ( alt_select ) use_wait_fd = atoi ( alt_select );
+    format = getenv ( "TEST_MEMSTREAM_FORMAT" );
+    if ( format ) {
+	if ( memstream_set_format ( atoi ( format ) ) < 0 ) 
+	    printf ( "Format %s not supported, ignored!\n", format );
+	else printf ( "Using commbuf format %s\n", format );
+	tee_format = (atoi ( format ) == MEMSTREAM_FORMAT_TEE);
+    }
 
     digest_vallen = 0;
     digest_name = getenv("TEST_MEMSTREAM_DIGEST");
@@ -247,7 +502,8 @@ int main ( int argc, char **argv, char *env[] )
 	cur_md = EVP_get_digestbyname ( digest_name );
 	if ( cur_md ) {
 	    printf ( "Using OpenSSL digest %s\n", digest_name );
-	    EVP_DigestInit ( &digest_state, cur_md );
+	    digest_state = EVP_MD_CTX_create();
+	    EVP_DigestInit ( digest_state, cur_md );
 	} else {
 	    printf ( "Digest %s unknown to OpenSSL, ignored!\n", digest_name );
 	    digest_name = 0;		/* disable used of digest */
@@ -264,17 +520,28 @@ int main ( int argc, char **argv, char *env[] )
 	p1fd = getenv ( "PIPEFD1" );
 	child_timeout = getenv ( "TEST_MEMSTREAM_CHILD_TIMEOUT" );
 	if ( child_timeout ) {
+#ifdef VMS
 	    long long delta = atoi ( child_timeout );  /* seconds */
 	    delta = delta * -10000000;   /* convert to 100-nsec ticks */
 	    SYS$SETIMR ( 3, &delta, timeout_ast, commbuf, 0 );
+#else
+	    signal ( SIGALRM, timeout_ast );
+	    alarm ( atoi ( child_timeout ) );
+#endif
 	}
 
 	printf ( "child process active...(%s, %s)\n", p0fd?p0fd:"<NULL>",
 		p1fd?p1fd:"<NULL>");
-        mpipe[0] = memstream_create ( &commbuf[blk_size], blk_size, 0 );
-	mpipe[1] = memstream_create ( &commbuf[0], blk_size, 1 );
+	if ( duplex ) {
+	    memstream_create_duplex ( commbuf, blk_size*2, 0, mpipe );
+	} else {
+	    mpipe[0] = memstream_create ( &commbuf[blk_size], blk_size, 0 );
+	    mpipe[1] = memstream_create ( &commbuf[0], blk_size, 1 );
+	}
 	memstream_assign_statistics ( mpipe[0], &rstats );
 	memstream_assign_statistics ( mpipe[1], &wstats );
+	set_busy_poll ( mpipe[0] );
+	set_wait_fd ( mpipe[0] );
 
 	pfd[0] = atoi ( p0fd );
 	pfd[1] = atoi ( p1fd );
@@ -283,7 +550,8 @@ int main ( int argc, char **argv, char *env[] )
 	/* child process, pipes named by argv[argc-2] and argv[argc-1] */
 	printf ( "child opens: %d/'%s' %d/'%s'\n", pfd[0], pname[0],
 		pfd[1],pname[1] );
-	pipe_sink ( pfd, mpipe );
+	if ( ping_count > 0 ) pingpong_server ( pfd, mpipe );
+	else pipe_sink ( pfd, mpipe );
 	dump_stats ( "child", &rstats, &wstats );
 	return 0;
     }
@@ -298,10 +566,19 @@ int main ( int argc, char **argv, char *env[] )
 
     memset ( commbuf, 0, 40 );
     memset ( &commbuf[blk_size], 0, 40 );
-    mpipe[0] = memstream_create ( &commbuf[0], blk_size, 0 );
-    mpipe[1] = memstream_create ( &commbuf[blk_size], blk_size, 1 );
+    if ( duplex ) {
+	if ( memstream_create_duplex ( commbuf, blk_size*2, 1, mpipe ) < 0 ) {
+	    perror ( "duplex create failed" );
+	    return 44;
+	}
+    } else {
+	mpipe[0] = memstream_create ( &commbuf[0], blk_size, 0 );
+	mpipe[1] = memstream_create ( &commbuf[blk_size], blk_size, 1 );
+    }
     memstream_assign_statistics ( mpipe[0], &rstats );
     memstream_assign_statistics ( mpipe[1], &wstats );
+    set_busy_poll ( mpipe[0] );
+    set_wait_fd ( mpipe[0] );
 
     if ( pipe ( pfd ) != 0 ) {
 	perror ( "Pipe() call" );
@@ -315,8 +592,8 @@ int main ( int argc, char **argv, char *env[] )
     pfd[1] = pfd[2];			/* make independant mailboxes */
     pname[0] = device_name(pfd[0]);
     pname[1] = device_name(pfd[1]);
-    printf ( "pfd[0] = %d '%s' %d\n", pfd[0], pname[0], strlen(pname[0]) );
-    printf ( "pfd[1] = %d '%s' %d\n", pfd[1], pname[1], strlen(pname[1]) );
+    printf ( "pfd[0] = %d '%s' %d\n", pfd[0], pname[0], (int) strlen(pname[0]) );
+    printf ( "pfd[1] = %d '%s' %d\n", pfd[1], pname[1], (int) strlen(pname[1]) );
 
     sprintf ( cmd_line, "mcr %s %s %s %s\n", argv[0], (argc > 1) ? argv[1] :
 	"", pname[0], pname[1] );
@@ -327,14 +604,16 @@ int main ( int argc, char **argv, char *env[] )
     if ( dummyf ) {
 	pid_t child;
 	int i;
-	char *child_arg[10], *child_env[20];
+	char *child_arg[10], **child_env;
 
 	child_arg[0] = "test_pipe";
 	child_arg[1] = "=";		/* flag to be sink */
 	child_arg[2] = pname[0];
 	child_arg[3] = pname[1];
 	child_arg[4] = 0;	/* end of list */
-	for ( i = 0; env[i] && (i < 17); i++ ) {
+	for ( i = 0; env[i]; i++ );
+	child_env = malloc ( (i+3) * sizeof(char *) );
+	for ( i = 0; env[i]; i++ ) {
 	    child_env[i] = env[i]; /* printf ( "env[%d] = '%s'\n",i,env[i]); */
 	}
 	child_env[i] = malloc ( 80 );
@@ -356,7 +635,13 @@ int main ( int argc, char **argv, char *env[] )
 	    printf ( "Process, created, sending file\n" );
 	    close ( pfd2[0] );
 	    close ( pfd2[1] );
-	    pipe_source ( dummyf, pfd, mpipe );
+	    if ( tee_format && !alt_is_pipe && !duplex && 
+		(wait_tee_reader ( &commbuf[blk_size], 30 ) < 0) ) {
+		printf ( "Child never attached tee reader\n" );
+		return 44;
+	    }
+	    if ( ping_count > 0 ) pingpong_client ( pfd, mpipe );
+	    else pipe_source ( dummyf, pfd, mpipe );
 
 	    dump_stats ( "master", &rstats, &wstats );
 	} else {
@@ -27,6 +27,12 @@
  *
  *    (child):  test_poll interval
  *
+ *    (bench):  test_poll bench [max_pipes [rounds]]
+ *
+ *    (contend): test_poll contend [max_threads [writes]]
+ *
+ *    (fair):   test_poll fair [pipes [max_ready]]
+ *
  * Arguments:
  *    poll_timeout	Timeout time parent uses for dm_poll() call, in
  *                       milliseconds.
@@ -37,6 +43,35 @@
  *
  *    child-n_interval	Interval argument to use for child n.
  *
+ *    max_pipes		Largest number of pipes benchmark polls (default
+ *			1024), starting at 1 and doubling.
+ *
+ *    rounds		Messages exchanged per measurement (default 2000).
+ *
+ *    max_threads	Most writer threads contend measures (default 8),
+ *			starting at 1 and doubling.
+ *
+ *    writes		Messages each writer thread writes (default 20000).
+ *
+ *    pipes		Pipes fair mode makes ready at once (default 32).
+ *
+ *    max_ready		Events fair mode takes per dm_epoll_wait (default 4).
+ *
+ * Bench mode compares the cost per wakeup of dm_poll(), dm_epoll_wait() and
+ * dm_aio_reap() as the number of idle pipes grows.  A single child writes to one pipe at
+ * a time and waits for the parent's reply before moving to another.
+ *
+ * Contend mode needs the thread-safe build (THREADS macro in descrip.mms).
+ * Threads in the parent write to the same pipe with dm_write() and the
+ * time per write is shown as the thread count grows, one thread measures
+ * the unlocked (biased) path.  The child reading the pipe counts messages
+ * that arrive mixed with another thread's.
+ *
+ * Fair mode checks dm_epoll_wait takes turns when more pipes are ready
+ * than it may report.  A child writes a message to every pipe, none are
+ * read, and each must be reported within twice the waits needed to
+ * report them all max_ready at a time.
+ *
  * Author: David Jones
  * Date:   27-MAR-2014
  */
@@ -54,6 +89,9 @@
 #ifdef ENABLE_BYPASS
 #include "dmpipe.h"
 #endif
+#ifdef DMPIPE_THREADS
+#include <pthread.h>
+#endif
 int decc$write_eof_to_mbx(), decc$fprintf(), decc$printf();
 #define decc$fprintf fprintf
 #define decc$printf printf
@@ -318,6 +356,422 @@ static void child_mode ( int arg_c, char **arg_v )
     fprintf(tty, "child %X sent eof_to_mbx: %d\n", self, count );
 #endif
 }
+/***************************************************************************/
+/*
+ * Scaling benchmark.  Child gets its pipes' write ends as consecutive fds
+ * starting at base and writes a message to one of them at a time, waiting
+ * for a 1 byte reply on ack_fd before the next.  It runs 3 times the
+ * rounds, the parent uses dm_poll(), dm_epoll_wait() and then dm_aio_reap()
+ * with a read in flight on every pipe.
+ */
+#define BENCH_MSG_SIZE 16
+
+static void bench_child ( char *arg )
+{
+    int ack_fd, base, count, rounds, i;
+    char msg[BENCH_MSG_SIZE], ack;
+
+    if ( sscanf ( arg, "%d,%d,%d,%d", &ack_fd, &base, &count, &rounds ) != 4 )
+	return;
+    for ( i = 0; i < rounds; i++ ) {
+	memset ( msg, 'a' + (i%26), sizeof(msg) );
+	if ( write ( base + ((i*7919)%count), msg, sizeof(msg) ) != 
+		sizeof(msg) ) {
+	    perror ( "bench child write" );
+	    break;
+	}
+	if ( read ( ack_fd, &ack, 1 ) != 1 ) break;
+    }
+    for ( i = 0; i < count; i++ ) close ( base + i );
+}
+
+static int bench_receive ( int fd, int ack_fd )
+{
+    char msg[BENCH_MSG_SIZE];
+    int count, segment;
+
+    for ( count = 0; count < sizeof(msg); count += segment ) {
+	segment = dm_read ( fd, &msg[count], sizeof(msg)-count );
+	if ( segment <= 0 ) return -1;
+    }
+    return (dm_write ( ack_fd, "k", 1 ) == 1) ? 0 : -1;
+}
+/*
+ * Receive rounds messages with a read submitted on every pipe, returning
+ * microseconds per message or -1.0.  A read completes with part of a
+ * message if that's all there is, it is resubmitted for the rest.
+ */
+static double bench_measure_aio ( int *rfd, int npipes, int rounds, 
+	int ack_fd )
+{
+    struct dm_aiocb *cb, **list, *done[16];
+    char *msg;
+    long long start, finish;
+    int i, j, received, active;
+
+    cb = calloc ( sizeof(struct dm_aiocb), npipes );
+    list = calloc ( sizeof(struct dm_aiocb *), npipes );
+    msg = malloc ( npipes * BENCH_MSG_SIZE );
+    for ( i = 0; i < npipes; i++ ) {
+	cb[i].fd = rfd[i];
+	cb[i].opcode = DM_AIO_READ;
+	cb[i].buffer = &msg[i*BENCH_MSG_SIZE];
+	cb[i].nbytes = BENCH_MSG_SIZE;
+	cb[i].user_arg = &msg[i*BENCH_MSG_SIZE];
+	list[i] = &cb[i];
+    }
+    if ( dm_aio_submit ( list, npipes ) != npipes ) {
+	perror ( "dm_aio_submit" );
+	return -1.0;
+    }
+    SYS$GETTIM ( &start );
+    for ( received = 0; received < rounds; ) {
+	active = dm_aio_reap ( done, 1, 16, -1 );
+	if ( active < 0 ) {
+	    perror ( "dm_aio_reap" );
+	    return -1.0;
+	}
+	for ( j = 0; j < active; j++ ) {
+	    if ( done[j]->result <= 0 ) return -1.0;
+	    done[j]->buffer = (char *) done[j]->buffer + done[j]->result;
+	    done[j]->nbytes -= done[j]->result;
+	    if ( done[j]->nbytes == 0 ) {
+		/* Whole message, reply and read the next one */
+		if ( dm_write ( ack_fd, "k", 1 ) != 1 ) return -1.0;
+		done[j]->buffer = done[j]->user_arg;
+		done[j]->nbytes = BENCH_MSG_SIZE;
+		received++;
+	    }
+	    dm_aio_submit ( &done[j], 1 );
+	}
+    }
+    SYS$GETTIM ( &finish );
+    for ( i = 0; i < npipes; i++ ) dm_aio_cancel ( &cb[i] );
+    free ( msg );
+    free ( list );
+    free ( cb );
+    return ((double) (finish - start)) / 10.0 / rounds;
+}
+/*
+ * Receive rounds messages from the npipes read ends in rfd, returning
+ * microseconds per message or -1.0.
+ */
+static double bench_measure ( int *rfd, int npipes, int rounds, int ack_fd,
+	int use_epoll )
+{
+    struct pollfd *pfd;
+    struct dm_epoll_event events[16];
+    dm_epoll ep;
+    long long start, finish;
+    int i, j, received, active;
+
+    pfd = 0;
+    ep = 0;
+    if ( use_epoll ) {
+	ep = dm_epoll_create ( npipes );
+	if ( !ep ) return -1.0;
+	for ( i = 0; i < npipes; i++ ) {
+	    events[0].events = POLLIN;
+	    events[0].data.u32 = i;
+	    if ( dm_epoll_ctl ( ep, DM_EPOLL_CTL_ADD, rfd[i], events ) < 0 ) {
+		perror ( "dm_epoll_ctl" );
+		return -1.0;
+	    }
+	}
+    } else {
+	pfd = calloc ( sizeof(struct pollfd), npipes );
+	for ( i = 0; i < npipes; i++ ) {
+	    pfd[i].fd = rfd[i];
+	    pfd[i].events = POLLIN;
+	}
+    }
+    SYS$GETTIM ( &start );
+    for ( received = 0; received < rounds; ) {
+	if ( use_epoll ) {
+	    active = dm_epoll_wait ( ep, events, 16, -1 );
+	    for ( j = 0; j < active; j++ ) {
+		if ( bench_receive ( rfd[events[j].data.u32], ack_fd ) < 0 ) 
+		    return -1.0;
+		received++;
+	    }
+	} else {
+	    active = dm_poll ( pfd, npipes, -1 );
+	    for ( j = 0; (active > 0) && (j < npipes); j++ ) {
+		if ( !(pfd[j].revents & POLLIN) ) continue;
+		if ( bench_receive ( rfd[j], ack_fd ) < 0 ) return -1.0;
+		received++;
+	    }
+	}
+	if ( active < 0 ) {
+	    perror ( use_epoll ? "dm_epoll_wait" : "dm_poll" );
+	    return -1.0;
+	}
+    }
+    SYS$GETTIM ( &finish );
+    if ( ep ) dm_epoll_close ( ep );
+    if ( pfd ) free ( pfd );
+    return ((double) (finish - start)) / 10.0 / rounds;
+}
+
+static void bench_parent ( char *image, int max_pipes, int rounds )
+{
+    int npipes, i, *rfd, wfd, fds[2], ack[2], base;
+    pid_t pid;
+    double poll_usec, epoll_usec, aio_usec;
+    char *child_argv[2], *child_envp[2], env_var[80];
+
+    rfd = calloc ( sizeof(int), max_pipes );
+    printf ( "%6s %14s %14s %14s\n", "pipes", "dm_poll usec", 
+	"dm_epoll usec", "dm_aio usec" );
+    for ( npipes = 1; npipes <= max_pipes; npipes *= 2 ) {
+	/*
+	 * Make the pipes, moving the write ends to consecutive fds for the
+	 * child, which writes until we reply on ack.
+	 */
+	if ( dm_pipe ( ack ) < 0 ) { perror ( "pipe() failed" ); break; }
+	base = ack[1] + 2*npipes + 1;
+	for ( i = 0; i < npipes; i++ ) {
+	    if ( dm_pipe ( fds ) < 0 ) break;
+	    rfd[i] = fds[0];
+	    wfd = dm_dup2 ( fds[1], base + i );
+	    dm_close ( fds[1] );
+	    if ( wfd < 0 ) break;
+	}
+	if ( i < npipes ) { perror ( "pipe() failed" ); break; }
+	sprintf ( env_var, "TEST_POLL_BENCH=%d,%d,%d,%d", ack[0], base, 
+		npipes, rounds*3 );
+	child_argv[0] = image;
+	child_argv[1] = 0;
+	child_envp[0] = env_var;
+	child_envp[1] = 0;
+	pid = vfork ( );
+	if ( pid == 0 ) {
+	    if ( 0 > execve ( image, child_argv, child_envp ) ) 
+		perror ( "execve failed" );
+	    exit ( 20 );
+	}
+	for ( i = 0; i < npipes; i++ ) dm_close ( base + i );
+	dm_close ( ack[0] );
+
+	poll_usec = bench_measure ( rfd, npipes, rounds, ack[1], 0 );
+	epoll_usec = bench_measure ( rfd, npipes, rounds, ack[1], 1 );
+	aio_usec = bench_measure_aio ( rfd, npipes, rounds, ack[1] );
+	printf ( "%6d %14.2f %14.2f %14.2f\n", npipes, poll_usec, epoll_usec,
+		aio_usec );
+
+	for ( i = 0; i < npipes; i++ ) dm_close ( rfd[i] );
+	dm_close ( ack[1] );
+	if ( (poll_usec < 0.0) || (epoll_usec < 0.0) || (aio_usec < 0.0) ) 
+	    break;
+    }
+    free ( rfd );
+}
+/***************************************************************************/
+/*
+ * Fairness check.  Child writes a message to each of count pipes whose
+ * write ends start at base, signals ready_fd and waits for the parent's
+ * ack before closing them.
+ */
+static void fair_child ( char *arg )
+{
+    int ack_fd, ready_fd, base, count, i;
+    char msg[BENCH_MSG_SIZE], ack;
+
+    if ( sscanf ( arg, "%d,%d,%d,%d", &ack_fd, &ready_fd, &base,
+	&count ) != 4 ) return;
+    memset ( msg, 'f', sizeof(msg) );
+    for ( i = 0; i < count; i++ ) {
+	if ( write ( base + i, msg, sizeof(msg) ) != sizeof(msg) ) {
+	    perror ( "fair child write" );
+	    break;
+	}
+    }
+    write ( ready_fd, "r", 1 );
+    read ( ack_fd, &ack, 1 );
+    for ( i = 0; i < count; i++ ) close ( base + i );
+}
+
+static int fair_parent ( char *image, int npipes, int max_ready )
+{
+    int i, j, *rfd, *seen, wfd, fds[2], ack[2], ready[2], base, active;
+    int waits, limit, missing;
+    struct dm_epoll_event *events, event;
+    dm_epoll ep;
+    pid_t pid;
+    char *child_argv[2], *child_envp[2], env_var[80], flag;
+
+    rfd = calloc ( sizeof(int), npipes );
+    seen = calloc ( sizeof(int), npipes );
+    events = calloc ( sizeof(struct dm_epoll_event), max_ready );
+    if ( (dm_pipe ( ack ) < 0) || (dm_pipe ( ready ) < 0) ) {
+	perror ( "pipe() failed" );
+	return 44;
+    }
+    base = ready[1] + 2*npipes + 1;
+    for ( i = 0; i < npipes; i++ ) {
+	if ( dm_pipe ( fds ) < 0 ) break;
+	rfd[i] = fds[0];
+	wfd = dm_dup2 ( fds[1], base + i );
+	dm_close ( fds[1] );
+	if ( wfd < 0 ) break;
+    }
+    if ( i < npipes ) { perror ( "pipe() failed" ); return 44; }
+    sprintf ( env_var, "TEST_POLL_FAIR=%d,%d,%d,%d", ack[0], ready[1],
+	base, npipes );
+    child_argv[0] = image;
+    child_argv[1] = 0;
+    child_envp[0] = env_var;
+    child_envp[1] = 0;
+    pid = vfork ( );
+    if ( pid == 0 ) {
+	if ( 0 > execve ( image, child_argv, child_envp ) ) 
+	    perror ( "execve failed" );
+	exit ( 20 );
+    }
+    for ( i = 0; i < npipes; i++ ) dm_close ( base + i );
+    dm_close ( ack[0] );
+    dm_close ( ready[1] );
+
+    ep = dm_epoll_create ( npipes );
+    for ( i = 0; ep && (i < npipes); i++ ) {
+	event.events = POLLIN;
+	event.data.u32 = i;
+	if ( dm_epoll_ctl ( ep, DM_EPOLL_CTL_ADD, rfd[i], &event ) < 0 ) break;
+    }
+    if ( !ep || (i < npipes) ) { perror ( "dm_epoll_ctl" ); return 44; }
+    /*
+     * Once every pipe holds a message, wait without reading so all stay
+     * ready, noting which are reported.
+     */
+    if ( dm_read ( ready[0], &flag, 1 ) != 1 ) {
+	perror ( "fair child ready" );
+	return 44;
+    }
+    limit = 2 * ((npipes + max_ready - 1) / max_ready);
+    missing = npipes;
+    for ( waits = 0; (waits < limit) && (missing > 0); waits++ ) {
+	active = dm_epoll_wait ( ep, events, max_ready, 5000 );
+	if ( active < 0 ) { perror ( "dm_epoll_wait" ); break; }
+	for ( j = 0; j < active; j++ ) {
+	    if ( !seen[events[j].data.u32]++ ) missing--;
+	}
+    }
+    if ( missing > 0 ) printf ( "fair: FAILED, %d of %d ready pipes never reported in %d waits of %d\n", missing, npipes, waits, max_ready );
+    else printf ( "fair: all %d ready pipes reported in %d waits of %d\n",
+	npipes, waits, max_ready );
+
+    dm_epoll_close ( ep );
+    dm_write ( ack[1], "k", 1 );
+    for ( i = 0; i < npipes; i++ ) dm_close ( rfd[i] );
+    dm_close ( ack[1] );
+    dm_close ( ready[0] );
+    free ( events );
+    free ( seen );
+    free ( rfd );
+    return (missing > 0) ? 44 : 1;
+}
+/***************************************************************************/
+/*
+ * Contended writer benchmark.  Child reads messages from rfd until EOF and
+ * sends the number it found torn (not all one fill character) on ack_fd.
+ */
+static void contend_child ( char *arg )
+{
+    int rfd, wfd, ack_fd, torn, count, i;
+    char msg[BENCH_MSG_SIZE];
+
+    if ( sscanf ( arg, "%d,%d,%d", &rfd, &wfd, &ack_fd ) != 3 ) return;
+    close ( wfd );			/* so parent's close gives EOF */
+    for ( torn = 0; (count = read ( rfd, msg, sizeof(msg) )) > 0; ) {
+	for ( i = 1; i < count; i++ ) if ( msg[i] != msg[0] ) break;
+	if ( (count != sizeof(msg)) || (i < count) ) torn++;
+    }
+    write ( ack_fd, &torn, sizeof(torn) );
+}
+
+#ifdef DMPIPE_THREADS
+struct contend_writer {
+    int fd;
+    int writes;
+    char fill;			/* message character, one per thread */
+    int status;
+};
+
+static void *contend_write ( void *arg )
+{
+    struct contend_writer *wr;
+    char msg[BENCH_MSG_SIZE];
+    int i;
+
+    wr = arg;
+    memset ( msg, wr->fill, sizeof(msg) );
+    for ( i = 0; i < wr->writes; i++ ) {
+	if ( dm_write ( wr->fd, msg, sizeof(msg) ) != sizeof(msg) ) {
+	    wr->status = -1;
+	    break;
+	}
+    }
+    return 0;
+}
+
+static void contend_parent ( char *image, int max_threads, int writes )
+{
+    int nthreads, i, fds[2], ack[2], torn;
+    pid_t pid;
+    pthread_t *tid;
+    struct contend_writer *wr;
+    long long start, finish;
+    char *child_argv[2], *child_envp[2], env_var[80];
+
+    tid = calloc ( sizeof(pthread_t), max_threads );
+    wr = calloc ( sizeof(struct contend_writer), max_threads );
+    printf ( "%7s %14s %6s\n", "threads", "dm_write usec", "torn" );
+    for ( nthreads = 1; nthreads <= max_threads; nthreads *= 2 ) {
+	if ( (dm_pipe ( fds ) < 0) || (dm_pipe ( ack ) < 0) ) {
+	    perror ( "pipe() failed" );
+	    break;
+	}
+	sprintf ( env_var, "TEST_POLL_CONTEND=%d,%d,%d", fds[0], fds[1],
+		ack[1] );
+	child_argv[0] = image;
+	child_argv[1] = 0;
+	child_envp[0] = env_var;
+	child_envp[1] = 0;
+	pid = vfork ( );
+	if ( pid == 0 ) {
+	    if ( 0 > execve ( image, child_argv, child_envp ) ) 
+		perror ( "execve failed" );
+	    exit ( 20 );
+	}
+	dm_close ( fds[0] );
+	dm_close ( ack[1] );
+	/*
+	 * All threads write the same fd, so after the first row the fd's
+	 * lock is shared.
+	 */
+	SYS$GETTIM ( &start );
+	for ( i = 0; i < nthreads; i++ ) {
+	    wr[i].fd = fds[1];
+	    wr[i].writes = writes;
+	    wr[i].fill = 'a' + (i%26);
+	    wr[i].status = 0;
+	    pthread_create ( &tid[i], 0, contend_write, &wr[i] );
+	}
+	for ( i = 0; i < nthreads; i++ ) pthread_join ( tid[i], 0 );
+	SYS$GETTIM ( &finish );
+
+	dm_close ( fds[1] );
+	if ( dm_read ( ack[0], &torn, sizeof(torn) ) != sizeof(torn) ) torn = -1;
+	dm_close ( ack[0] );
+	for ( i = 0; i < nthreads; i++ ) if ( wr[i].status < 0 ) torn = -1;
+	printf ( "%7d %14.3f %6d\n", nthreads, 
+		((double) (finish - start)) / 10.0 / (nthreads * writes), torn );
+	if ( torn != 0 ) break;
+    }
+    free ( wr );
+    free ( tid );
+}
+#endif
 /****************************************************************************/
 int main ( int argc, char **argv, char **envp )
 {
@@ -326,9 +780,34 @@ int main ( int argc, char **argv, char **envp )
     char child_command[800];
    /*
     * Determine if we are master process or child by counting command
-    * line arguments.
+    * line arguments.  Benchmark processes are checked for first.
     */
-    if ( argc > 2 ) {
+    if ( getenv ( "TEST_POLL_BENCH" ) ) {
+	bench_child ( getenv ( "TEST_POLL_BENCH" ) );
+
+    } else if ( getenv ( "TEST_POLL_CONTEND" ) ) {
+	contend_child ( getenv ( "TEST_POLL_CONTEND" ) );
+
+    } else if ( getenv ( "TEST_POLL_FAIR" ) ) {
+	fair_child ( getenv ( "TEST_POLL_FAIR" ) );
+
+    } else if ( (argc > 1) && (strcmp ( argv[1], "fair" ) == 0) ) {
+	return fair_parent ( argv[0], (argc > 2) ? atoi ( argv[2] ) : 32,
+		(argc > 3) ? atoi ( argv[3] ) : 4 );
+
+    } else if ( (argc > 1) && (strcmp ( argv[1], "bench" ) == 0) ) {
+	bench_parent ( argv[0], (argc > 2) ? atoi ( argv[2] ) : 1024,
+		(argc > 3) ? atoi ( argv[3] ) : 2000 );
+
+    } else if ( (argc > 1) && (strcmp ( argv[1], "contend" ) == 0) ) {
+#ifdef DMPIPE_THREADS
+	contend_parent ( argv[0], (argc > 2) ? atoi ( argv[2] ) : 8,
+		(argc > 3) ? atoi ( argv[3] ) : 20000 );
+#else
+	printf ( "contend needs the thread-safe build (DMPIPE_THREADS)\n" );
+#endif
+
+    } else if ( argc > 2 ) {
 	/*
 	 * We are parent, allocate array of child control blocks.
 	 */